@@ -29,6 +29,8 @@ extern "C" {
 
 #include <stdint.h>
 
+/* an sddc_t is configured, started, stopped and closed from one thread at
+   a time (never from its callbacks); everything else from any thread */
 typedef struct sddc sddc_t;
 
 struct sddc_device_info {
@@ -59,6 +61,15 @@ enum RFMode {
   VHF_MODE
 };
 
+enum SDDCSampleFormat {
+  SAMPLE_FORMAT_REAL_INT16,       /* raw ADC samples */
+  SAMPLE_FORMAT_COMPLEX_INT16,    /* interleaved I/Q */
+  SAMPLE_FORMAT_COMPLEX_FLOAT32,  /* interleaved I/Q */
+  SAMPLE_FORMAT_REAL_FLOAT32,
+  SAMPLE_FORMAT_REAL_INT8,
+  SAMPLE_FORMAT_REAL_PACKED12     /* two samples in three bytes */
+};
+
 enum LEDColors {
   LED_YELLOW = 0x01,
   LED_RED    = 0x02,
@@ -73,6 +84,15 @@ int sddc_get_device_info(struct sddc_device_info **sddc_device_infos);
 
 int sddc_free_device_info(struct sddc_device_info *sddc_device_infos);
 
+/* with imagefile "file://<path>" a capture file (raw 16 bit samples, or a
+   16 bit mono WAV/RF64/BW64) is opened instead of a device, and replayed
+   through the usual streaming path when streaming starts; with
+   "udp://<address>:<port>[@<interface>]" (a multicast group, or a local
+   address to bind to) or "tcp://<server>:<port>" the samples come from
+   sddc_server instead. A remote stream must be of raw real samples (int16,
+   int8 or packed12 - expanded back to 16 bits); its sample rate is the one
+   of the stream, and the radio settings are accepted and ignored. The same
+   goes for "shm://<name>", the frames of a local sddc_publisher_t */
 sddc_t *sddc_open(int index, const char* imagefile);
 
 void sddc_close(sddc_t *this);
@@ -141,6 +161,27 @@ int sddc_get_vhf_bias(sddc_t *this);
 
 int sddc_set_vhf_bias(sddc_t *this, int bias);
 
+/* control batches: the setters called between sddc_control_batch_begin()
+   and sddc_control_batch_commit() (tuner frequency and attenuations, HF
+   attenuation, bias, dither, LEDs, ...) do not wait for the device: their
+   requests are queued, with a later value for the same setting replacing
+   the one queued, and the commit sends them back to back and returns
+   right away. The callback is called from the thread handling the USB
+   events (the event thread or sddc_handle_events()) when the device has
+   acknowledged the last request; all the samples before sample_index (as
+   in the v2 frame info) were acquired before the change, and the samples
+   still buffered on the device and in the transfers in flight at that
+   point may follow it. Status is 0, or -1 if any request failed; an
+   empty batch calls the callback from sddc_control_batch_commit(). The
+   getters return the new values as soon as the setters return */
+typedef void (*sddc_control_cb_t)(int status, uint64_t sample_index,
+                                  void *context);
+
+int sddc_control_batch_begin(sddc_t *this);
+
+int sddc_control_batch_commit(sddc_t *this, sddc_control_cb_t callback,
+                              void *context);
+
 
 /* streaming functions */
 typedef void (*sddc_read_async_cb_t)(uint32_t data_size, uint8_t *data,
@@ -150,10 +191,314 @@ double sddc_get_sample_rate(sddc_t *this);
 
 int sddc_set_sample_rate(sddc_t *this, double sample_rate);
 
+/* frame_size and/or num_frames can be SDDC_ASYNC_AUTO: frames of about
+   1 ms at the sample rate set when streaming starts, and a queue depth
+   picked from the event loop latency measured during the first 250 ms of
+   streaming (between 16 ms and 120 ms of samples) */
+#define SDDC_ASYNC_AUTO 0xffffffff
+
 int sddc_set_async_params(sddc_t *this, uint32_t frame_size, 
                           uint32_t num_frames, sddc_read_async_cb_t callback,
                           void *callback_context);
 
+/* v2 callback - every frame comes with its position in the sample stream
+   and the time the transfer completed */
+#define SDDC_FRAME_FLAG_GAP 0x01        /* samples lost before this frame */
+
+struct sddc_frame_info {
+  uint64_t sample_index;        /* index of the first sample in the frame
+                                   (counted from sddc_start_streaming()) */
+  uint64_t monotonic_time_ns;   /* CLOCK_MONOTONIC at transfer completion */
+  uint64_t realtime_ns;         /* CLOCK_REALTIME at transfer completion */
+  uint32_t flags;
+  uint64_t lost_samples;        /* samples lost since the previous frame */
+};
+
+typedef void (*sddc_read_async_cb2_t)(uint32_t data_size, uint8_t *data,
+                                      const struct sddc_frame_info *info,
+                                      void *context);
+
+int sddc_set_async_params2(sddc_t *this, uint32_t frame_size,
+                           uint32_t num_frames, sddc_read_async_cb2_t callback,
+                           void *callback_context);
+
+/* memory for the frame buffers: BUFFER_STRATEGY_AUTO uses usbfs zero-copy
+   buffers, or huge pages when a NUMA node is given; when a strategy fails
+   the next one in the list is tried. numa_node < 0 leaves the placement
+   to the kernel. The buffers are allocated by sddc_start_streaming(), and
+   sddc_get_buffer_strategy() then returns the strategy in use */
+enum SDDCBufferStrategy {
+  BUFFER_STRATEGY_AUTO,
+  BUFFER_STRATEGY_USB_ZEROCOPY,
+  BUFFER_STRATEGY_HUGE_PAGES,
+  BUFFER_STRATEGY_ALIGNED
+};
+
+int sddc_set_buffer_strategy(sddc_t *this, enum SDDCBufferStrategy strategy,
+                             int numa_node);
+
+enum SDDCBufferStrategy sddc_get_buffer_strategy(sddc_t *this);
+
+/* frames allocated in addition to the num_frames queued on the USB bus */
+int sddc_set_spare_frames(sddc_t *this, uint32_t num_spare_frames);
+
+/* ring mode: completed frames are queued on a lock-free ring and the
+   callback is run by a dedicated consumer thread, while the transfers are
+   resubmitted right away with one of the spare frames; frames are dropped
+   (and counted) when no spare frame is available */
+int sddc_set_async_ring(sddc_t *this, int enable);
+
+int sddc_get_async_ring_status(sddc_t *this, uint32_t *depth,
+                               uint32_t *high_water_mark,
+                               uint64_t *dropped_frames);
+
+/* zero-copy buffer lending: called from the callback with the data
+   pointer it was passed, sddc_buffer_retain() keeps that buffer valid
+   after the callback returns, until the handle is passed to
+   sddc_buffer_release() (from any thread). The transfer is resubmitted
+   with one of the spare frames (sddc_set_spare_frames()), so it returns 0
+   when none is available; it also returns 0 for data that is not a raw
+   USB frame (i.e. DDC output). A buffer can be retained more than once and
+   needs one release per retain; all the buffers must be released before
+   sddc_stop_streaming() */
+typedef struct sddc_buffer sddc_buffer_t;
+
+sddc_buffer_t *sddc_buffer_retain(sddc_t *this, const uint8_t *data);
+
+int sddc_buffer_release(sddc_t *this, sddc_buffer_t *buffer);
+
+/* library managed event thread: when enabled sddc_start_streaming() starts
+   a thread that handles the USB events (and runs the callback when not in
+   ring mode), and sddc_stop_streaming() stops it; while it is running
+   sddc_handle_events() just waits a little and returns. When handling the
+   events fails the thread ends: sddc_handle_events() then returns -1, and
+   sddc_read_sync() stops waiting, until the device is stopped */
+struct sddc_event_thread_params {
+  int enable;
+  uint64_t cpu_affinity_mask;   /* bit n = CPU n; 0 = no affinity */
+  int realtime_priority;        /* SCHED_FIFO priority; 0 = no change */
+  int lock_memory;              /* mlockall() the whole process */
+};
+
+int sddc_set_event_thread_params(sddc_t *this,
+                                 const struct sddc_event_thread_params *params);
+
+/* digital downconverter: the samples are mixed down by center_frequency
+   and decimated (power of two, 1 = just mix) before being passed to the
+   callback, which then gets complex samples in the given format at
+   sample_rate / decimation; the v2 callback sample_index and lost_samples
+   are counted at the output rate too. The DDC runs in the thread that
+   runs the callback; a decimation of 0 turns it off */
+int sddc_set_ddc(sddc_t *this, double center_frequency, uint32_t decimation,
+                 enum SDDCSampleFormat format);
+
+/* output format of the real ADC samples passed to the callback (without
+   a DDC): SAMPLE_FORMAT_REAL_FLOAT32 is sample * scale (0 = 1/32768, i.e.
+   full scale is +/-1.0); SAMPLE_FORMAT_REAL_INT8 is sample >> shift (0 =
+   8) with saturation, rounded or with uniform dither of one output LSB;
+   SAMPLE_FORMAT_REAL_PACKED12 keeps the 12 most significant bits, with
+   each pair of samples in three bytes (little endian, the first sample
+   in the low 12 bits). The conversion is done in the same pass over the
+   data as the ADC de-randomization, into a buffer of the output size; the
+   converted data cannot be retained with sddc_buffer_retain(). Must be
+   set before streaming starts; SAMPLE_FORMAT_REAL_INT16 (default) passes
+   the raw frames */
+struct sddc_output_format {
+  enum SDDCSampleFormat format;
+  float scale;
+  uint32_t shift;
+  int dither;
+};
+
+int sddc_set_output_format(sddc_t *this,
+                           const struct sddc_output_format *output_format);
+
+/* channelizer: extracts up to SDDC_MAX_CHANNELS narrowband channels from
+   the real ADC samples with one FFT of fft_size samples per block (75%
+   of fft_size new samples each) plus a small inverse FFT per channel.
+   It must be enabled (after sddc_set_sample_rate()) before streaming
+   starts; channels can then be added and removed at any time, from one
+   control thread. Each channel gets interleaved complex float32 samples
+   at sample_rate / decimation (a power of two <= fft_size / 4) through
+   its own callback; its center frequency is rounded to a multiple of
+   sample_rate / fft_size in the FFT and the rest is corrected by a
+   per-channel NCO. After sddc_remove_channel() returns its callback will
+   not be called again */
+#define SDDC_MAX_CHANNELS 64
+
+typedef void (*sddc_channel_cb_t)(int channel, uint32_t data_size,
+                                  uint8_t *data, void *context);
+
+int sddc_set_channelizer(sddc_t *this, uint32_t fft_size);
+
+int sddc_add_channel(sddc_t *this, double center_frequency,
+                     uint32_t decimation, sddc_channel_cb_t callback,
+                     void *callback_context);
+
+int sddc_remove_channel(sddc_t *this, int channel);
+
+/* frequency sweep (VHF/UHF tuner): the callback gets the power spectrum
+   (dBFS) at each hop. Set before streaming starts, async, no DDC; 0 = off */
+struct sddc_sweep_spectrum {
+  uint32_t hop;                 /* index in the list of frequencies */
+  uint32_t sweep;               /* number of full sweeps before this one */
+  double frequency;             /* tuner frequency */
+  double first_bin_frequency;
+  double bin_width;
+  uint32_t num_bins;
+  const float *power;           /* dBFS, in ascending frequency order */
+  uint64_t sample_index;        /* first sample measured */
+};
+
+typedef void (*sddc_sweep_cb_t)(const struct sddc_sweep_spectrum *spectrum,
+                                void *context);
+
+struct sddc_sweep_params {
+  const double *frequencies;
+  uint32_t num_frequencies;
+  double if_frequency;          /* of the tuner output in the ADC samples */
+  double span;                  /* around if_frequency */
+  uint32_t fft_size;            /* 0 = 1024 */
+  uint32_t averages;
+  double settling_time;         /* s, after the retune is acknowledged */
+  int invert;                   /* the tuner output is spectrally inverted */
+  int loop;                     /* start over at the end of the list */
+  sddc_sweep_cb_t callback;
+  void *callback_context;
+};
+
+int sddc_set_sweep(sddc_t *this, const struct sddc_sweep_params *params);
+
+/* spectrum monitor: the callback gets rows of averaged power spectra from
+   a thread of its own. Set before streaming starts, async mode; 0 = off */
+enum SDDCPSDFormat {
+  SDDC_PSD_FLOAT32_DB,
+  SDDC_PSD_UINT8_DB
+};
+
+struct sddc_psd_row {
+  uint64_t row;                 /* rows since streaming started */
+  uint64_t sample_index;        /* first sample measured */
+  uint32_t averages;            /* FFTs in this row */
+  double bin_width;
+  uint32_t num_bins;
+  enum SDDCPSDFormat format;
+  const void *data;             /* num_bins floats or bytes */
+};
+
+typedef void (*sddc_psd_cb_t)(const struct sddc_psd_row *row, void *context);
+
+struct sddc_psd_params {
+  uint32_t fft_size;            /* 0 = 4096 */
+  float overlap;                /* 0 to 0.9 */
+  uint32_t averages;            /* FFTs per row; 0 = all that fit */
+  double row_rate;              /* rows per second; 0 = 10 */
+  enum SDDCPSDFormat format;
+  float min_db;                 /* uint8 0; default -130 */
+  float max_db;                 /* uint8 255; default 0 */
+  sddc_psd_cb_t callback;
+  void *callback_context;
+};
+
+int sddc_set_psd(sddc_t *this, const struct sddc_psd_params *params);
+
+struct sddc_psd_stats {
+  uint64_t rows;
+  uint64_t ffts;
+  uint64_t skipped_frames;      /* the spectrum thread was not keeping up */
+};
+
+int sddc_get_psd_stats(sddc_t *this, struct sddc_psd_stats *stats);
+
+/* automatic gain control of the HF attenuator or the VHF tuner gain; the
+   callback gets every change the device acknowledges. Set before streaming
+   starts; 0 = off */
+struct sddc_agc_change {
+  double attenuation;           /* dB, now in effect */
+  double previous_attenuation;
+  uint64_t sample_index;
+  double peak_db;               /* of the window that caused the change */
+  uint64_t clipped_samples;     /* in that window */
+  int status;                   /* -1 if the control request failed */
+};
+
+typedef void (*sddc_agc_cb_t)(const struct sddc_agc_change *change,
+                              void *context);
+
+struct sddc_agc_params {
+  double high_threshold_db;     /* dBFS peak; 0 = -1 */
+  double low_threshold_db;      /* 0 = -12 */
+  double attack_step_db;        /* 0 = 3 */
+  double decay_step_db;         /* 0 = 1 */
+  double update_time;           /* s; 0 = 0.05 */
+  double hold_time;             /* s; 0 = 1 */
+  double settling_time;         /* s, after a change is acknowledged */
+  sddc_agc_cb_t callback;
+  void *callback_context;
+};
+
+int sddc_set_agc(sddc_t *this, const struct sddc_agc_params *params);
+
+struct sddc_agc_stats {
+  uint32_t changes;
+  uint64_t clipped_samples;     /* since streaming started */
+  double peak_db;               /* of the last window measured */
+  double rms_db;
+  double attenuation;           /* dB */
+};
+
+int sddc_get_agc_stats(sddc_t *this, struct sddc_agc_stats *stats);
+
+/* DSP worker threads for the DDC and the channelizer, with the same output
+   as a single thread. Set before streaming starts; 0 threads = off */
+#define SDDC_MAX_WORKER_THREADS 32
+
+int sddc_set_worker_threads(sddc_t *this, uint32_t num_threads,
+                            const uint64_t *cpu_affinity_masks);
+
+/* streaming statistics; the counters are updated without locks and are
+   read one by one, so they are not an atomic snapshot */
+#define SDDC_STATS_LATENCY_BUCKETS 20
+
+struct sddc_stream_stats {
+  uint64_t completed_transfers;  /* transfers with data delivered */
+  uint64_t bytes;
+  uint64_t short_transfers;      /* fewer bytes than frame_size */
+  uint64_t errors;               /* transfers completed by status */
+  uint64_t timeouts;
+  uint64_t cancelled;
+  uint64_t stalls;
+  uint64_t no_device;
+  uint64_t overflows;
+  uint64_t dropped_frames;       /* ring mode - no spare frame available */
+  uint64_t max_callback_duration_ns;
+  /* time from transfer completion to callback return: bucket n counts the
+     latencies between 2^n and 2^(n+1) us (the first bucket starts at 0,
+     the last one is open ended) */
+  uint64_t callback_latency_histogram[SDDC_STATS_LATENCY_BUCKETS];
+  int in_flight_transfers;
+};
+
+int sddc_get_stream_stats(sddc_t *this, struct sddc_stream_stats *stats);
+
+/* tracing (ENABLE_TRACING builds only - otherwise both return -1): the
+   transfer submits, completions, resubmits and cancels, the callback
+   enters and exits, the ring drops and the control requests of all the
+   devices are logged in a ring of the last 65536 events, which
+   sddc_trace_dump() writes to a file (0 = stderr) as text. The same
+   tracepoints are also USDT probes (provider sddc). SDDC_TRACE=1 in the
+   environment enables tracing at load time, and SDDC_TRACE=<file> also
+   dumps the ring to that file at exit */
+int sddc_trace_enable(int enable);
+
+int sddc_trace_dump(const char *path);
+
+/* streaming can be stopped and started again (for instance to change the
+   sample rate, the RF mode or the DDC in between) without calling
+   sddc_set_async_params() again: the frame buffers and USB transfers
+   allocated by the first start are reused, so only the ADC, the tuner
+   and the FX3 producer are set up again. The frame size and queue depth
+   picked automatically on the first start are kept */
 int sddc_start_streaming(sddc_t *this);
 
 int sddc_handle_events(sddc_t *this);
@@ -162,8 +507,295 @@ int sddc_stop_streaming(sddc_t *this);
 
 int sddc_reset_status(sddc_t *this);
 
+/* sync mode (no sddc_set_async_params()): sddc_start_streaming() queues
+   the USB transfers internally, with SDDC_ASYNC_AUTO frames and queue
+   depth, and an event thread (the one of sddc_set_event_thread_params(),
+   enabled or not) copies the frames - after the DDC or the output
+   format conversion, as for a callback - into a buffer of buffer_size
+   bytes (0 = 32MB, ~250 ms at 64Msps) that sddc_read_sync() reads from.
+   sddc_read_sync() waits (up to 5 s) until length bytes are there, and
+   returns -1 with the bytes it got in transferred if they are not; when
+   the application does not read fast enough the frames that do not fit
+   are dropped and counted in dropped_bytes. length must not be larger
+   than the buffer. In a session the devices in sync mode are served by
+   the session event thread */
+int sddc_set_sync_params(sddc_t *this, uint32_t buffer_size);
+
 int sddc_read_sync(sddc_t *this, uint8_t *data, int length, int *transferred);
 
+struct sddc_sync_stats {
+  uint64_t bytes_read;          /* since sddc_start_streaming() */
+  uint64_t dropped_bytes;
+  uint32_t depth;               /* bytes not read yet */
+  uint32_t high_water_mark;
+};
+
+int sddc_get_sync_stats(sddc_t *this, struct sddc_sync_stats *stats);
+
+
+/* recorder: writes the data passed to sddc_recorder_write() (usually from
+   the stream callback, which only copies it into a free buffer) to disk
+   from its own writer thread, with io_uring when available and pwrite()
+   otherwise. A new file is started when max_file_size or max_file_time
+   would be exceeded; the file name is path passed through strftime() (UTC)
+   with a .NNNN sequence number appended when rotation is enabled. Data
+   that finds no free buffer is dropped and counted. sddc_recorder_write()
+   must always be called from the same thread */
+typedef struct sddc_recorder sddc_recorder_t;
+
+struct sddc_recorder_params {
+  const char *path;
+  uint64_t max_file_size;       /* bytes; 0 = no limit */
+  uint32_t max_file_time;       /* seconds; 0 = no limit */
+  uint32_t buffer_size;         /* bytes (multiple of 4096); 0 = 4MB */
+  uint32_t num_buffers;         /* 0 = 64 */
+  int direct_io;                /* O_DIRECT, if the file system allows it */
+};
+
+struct sddc_recorder_stats {
+  uint64_t bytes_written;
+  uint64_t dropped_bytes;
+  uint32_t files;
+  uint32_t max_queued_buffers;  /* high water mark of the write queue */
+  uint32_t io_errors;
+  int uses_io_uring;
+};
+
+sddc_recorder_t *sddc_recorder_open(const struct sddc_recorder_params *params);
+
+void sddc_recorder_close(sddc_recorder_t *this);
+
+int sddc_recorder_write(sddc_recorder_t *this, const uint8_t *data,
+                        uint32_t size);
+
+int sddc_recorder_get_stats(sddc_recorder_t *this,
+                            struct sddc_recorder_stats *stats);
+
+/* trigger capture: keeps the last history_time seconds (default 4) of the
+   raw samples passed to sddc_trigger_write() (the frames of the v2 stream
+   callback, whose sample_index places them; missing samples are zeros) in
+   a preallocated ring in memory, on huge pages when available. A capture
+   is triggered by a frame whose mean power exceeds threshold_db (dBFS,
+   relative to a full scale DC level; 0 = no energy trigger), or by
+   sddc_trigger_fire() from any thread (at the next frame). The
+   pre_trigger_time seconds before the trigger frame and post_trigger_time
+   seconds after its start are then written to the recorder (opened by
+   the application, and not written to by anything else) by a thread of
+   the trigger capture, while the stream goes on; a capture that the
+   recorder does not take fast enough loses the oldest samples (counted in
+   lost_samples). Triggers during a capture are ignored and counted. The
+   callback (optional) is called from that thread once a capture has been
+   handed to the recorder. sddc_trigger_write() never blocks, and must
+   always be called from the same thread */
+typedef struct sddc_trigger sddc_trigger_t;
+
+struct sddc_trigger_capture {
+  uint32_t capture;             /* captures before this one */
+  int external;                 /* sddc_trigger_fire() */
+  double power_db;              /* of the trigger frame */
+  uint64_t trigger_sample_index;
+  uint64_t first_sample_index;
+  uint64_t num_samples;         /* written to the recorder */
+  uint64_t lost_samples;
+};
+
+typedef void (*sddc_trigger_cb_t)(const struct sddc_trigger_capture *capture,
+                                  void *context);
+
+struct sddc_trigger_params {
+  double sample_rate;
+  double history_time;          /* s */
+  double pre_trigger_time;      /* s; <= history_time */
+  double post_trigger_time;     /* s */
+  double threshold_db;
+  sddc_recorder_t *recorder;
+  sddc_trigger_cb_t callback;
+  void *callback_context;
+};
+
+struct sddc_trigger_stats {
+  uint32_t captures;
+  uint32_t ignored_triggers;    /* during a capture */
+  uint64_t captured_samples;
+  uint64_t lost_samples;
+  double max_power_db;          /* of the frames since the last call */
+  int huge_pages;               /* the history is on huge pages */
+};
+
+sddc_trigger_t *sddc_trigger_open(const struct sddc_trigger_params *params);
+
+/* a capture in progress is cut short at the samples already in the
+   history */
+void sddc_trigger_close(sddc_trigger_t *this);
+
+int sddc_trigger_write(sddc_trigger_t *this, const uint8_t *data,
+                       uint32_t size, const struct sddc_frame_info *info);
+
+void sddc_trigger_fire(sddc_trigger_t *this);
+
+int sddc_trigger_get_stats(sddc_trigger_t *this,
+                           struct sddc_trigger_stats *stats);
+
+/* compressed capture: like the recorder, but the samples are compressed
+   losslessly (fixed linear predictor + Rice coding) in independent blocks
+   before being written. The blocks of each batch are compressed in
+   parallel on num_threads worker threads, and an index of the blocks is
+   written at the end of the file (it is rebuilt by scanning the blocks if
+   the file was not closed). The reader decodes the file back to the
+   16 bit samples the stream callback was given, and can seek to any
+   sample. The samples dropped by the writer are left out of the file as
+   gaps, and read back as zeros */
+typedef struct sddc_compressed_writer sddc_compressed_writer_t;
+typedef struct sddc_compressed_reader sddc_compressed_reader_t;
+
+struct sddc_compressed_writer_params {
+  const char *path;
+  double sample_rate;           /* stored in the file header */
+  uint32_t block_samples;       /* multiple of 4096; 0 = 65536 */
+  uint32_t num_threads;         /* 0 = compress on the writer thread only */
+  uint32_t num_batches;         /* input batches buffered; 0 = 16 */
+};
+
+struct sddc_compressed_writer_stats {
+  uint64_t input_bytes;         /* compressed and written */
+  uint64_t output_bytes;
+  uint64_t dropped_bytes;
+  uint32_t gaps;                /* runs of dropped samples */
+  uint32_t blocks;
+  uint32_t max_queued_batches;  /* high water mark of the compression queue */
+  uint32_t io_errors;
+};
+
+sddc_compressed_writer_t *sddc_compressed_writer_open(
+                         const struct sddc_compressed_writer_params *params);
+
+void sddc_compressed_writer_close(sddc_compressed_writer_t *this);
+
+int sddc_compressed_writer_write(sddc_compressed_writer_t *this,
+                                 const uint8_t *data, uint32_t size);
+
+int sddc_compressed_writer_get_stats(sddc_compressed_writer_t *this,
+                                 struct sddc_compressed_writer_stats *stats);
+
+sddc_compressed_reader_t *sddc_compressed_reader_open(const char *path);
+
+void sddc_compressed_reader_close(sddc_compressed_reader_t *this);
+
+double sddc_compressed_reader_get_sample_rate(sddc_compressed_reader_t *this);
+
+uint64_t sddc_compressed_reader_get_num_samples(sddc_compressed_reader_t *this);
+
+int sddc_compressed_reader_seek(sddc_compressed_reader_t *this,
+                                uint64_t sample);
+
+/* returns the number of bytes read (0 at the end of the file) */
+int sddc_compressed_reader_read(sddc_compressed_reader_t *this,
+                                uint8_t *data, uint32_t size);
+
+/* file:// replay: realtime paces the frames at the sample rate (the one of
+   the WAV file by default), otherwise they are delivered as fast as the
+   callback takes them; at the end of the file the replay either starts
+   over (loop) or stops with finished set */
+struct sddc_replay_params {
+  int realtime;                 /* default 1 */
+  int loop;                     /* default 0 */
+};
+
+int sddc_set_replay_params(sddc_t *this,
+                           const struct sddc_replay_params *params);
+
+int sddc_get_replay_position(sddc_t *this, uint64_t *samples, int *finished);
+
+/* udp:// and tcp:// streams: the samples missing from the stream (lost
+   packets, or frames the server did not send) are replaced by zeros, so
+   that the sample index stays the one of the server; gaps of more than a
+   second are skipped instead (resyncs) */
+struct sddc_net_stats {
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t lost_samples;        /* replaced by zeros */
+  uint64_t dropped_packets;     /* late, duplicate or invalid */
+  uint64_t resyncs;
+  int connected;                /* 0 once the TCP server has gone away */
+};
+
+int sddc_get_net_stats(sddc_t *this, struct sddc_net_stats *stats);
+
+/* shared memory publisher: the frames passed to sddc_publisher_write()
+   (raw 16 bit samples, usually from the v2 stream callback) go into a
+   ring of slots in the POSIX shared memory object "/sddc-<name>", which
+   any number of local processes open with sddc_open() and "shm://<name>"
+   as the image file. A frame larger than a slot takes several. Writing
+   never waits for the readers: one that falls behind by more than the
+   ring skips ahead, and its missing samples are replaced by zeros (as for
+   the network streams) and counted in its sddc_get_shm_stats(). The
+   readers write their cursor into the object too, so mode must give them
+   read and write access */
+typedef struct sddc_publisher sddc_publisher_t;
+
+struct sddc_publisher_params {
+  const char *name;
+  double sample_rate;
+  uint32_t slot_size;           /* bytes (even); 0 = 64KB - 64 */
+  uint32_t num_slots;           /* 0 = 2048 */
+  uint32_t mode;                /* of the shared memory object, less the
+                                   umask; 0 = 0600 (this user only) */
+};
+
+struct sddc_publisher_stats {
+  uint64_t slots_written;
+  uint32_t readers;
+  uint64_t max_reader_lag;      /* slots behind, of the slowest reader */
+  uint64_t reader_dropped_slots;
+};
+
+sddc_publisher_t *sddc_publisher_open(const struct sddc_publisher_params *params);
+
+void sddc_publisher_close(sddc_publisher_t *this);
+
+int sddc_publisher_write(sddc_publisher_t *this, const uint8_t *data,
+                         uint32_t size, const struct sddc_frame_info *info);
+
+int sddc_publisher_get_stats(sddc_publisher_t *this,
+                             struct sddc_publisher_stats *stats);
+
+struct sddc_shm_stats {
+  uint64_t slots;
+  uint64_t lost_samples;        /* replaced by zeros */
+  uint64_t dropped_slots;       /* overwritten before they were read */
+  uint64_t resyncs;
+  int connected;                /* 0 once the publisher has gone away */
+};
+
+int sddc_get_shm_stats(sddc_t *this, struct sddc_shm_stats *stats);
+
+/* multi-device sessions: the devices opened in a session share one libusb
+   context, so one event loop (sddc_session_handle_events() or the session
+   event thread) services all of their transfers. Each device is configured
+   as usual; sddc_session_start_streaming() then starts them all and sends
+   STARTFX3 to every device at once, so that their first samples are as
+   close together as the USB bus allows (the v2 callback timestamps tell
+   how close). sddc_session_close() also closes the devices still open */
+#define SDDC_MAX_SESSION_DEVICES 16
+
+typedef struct sddc_session sddc_session_t;
+
+sddc_session_t *sddc_session_open();
+
+void sddc_session_close(sddc_session_t *this);
+
+sddc_t *sddc_session_open_device(sddc_session_t *this, int index,
+                                 const char* imagefile);
+
+int sddc_session_set_event_thread_params(sddc_session_t *this,
+                                 const struct sddc_event_thread_params *params);
+
+int sddc_session_start_streaming(sddc_session_t *this);
+
+int sddc_session_handle_events(sddc_session_t *this);
+
+int sddc_session_stop_streaming(sddc_session_t *this);
+
 
 /* Misc functions */
 double sddc_get_frequency_correction(sddc_t *this);
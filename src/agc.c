@@ -0,0 +1,373 @@
+/*
+ * agc.c - automatic gain control from the stream statistics
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* Every update_time of raw samples the peak, the number of clipped
+ * samples and the mean square are measured (in a single pass the
+ * compiler vectorizes) and compared with the two thresholds. A change of
+ * attenuation is sent as an asynchronous control request; as for the
+ * sweep retunes, the samples still in the device FIFO and in the
+ * transfer being filled when the device acknowledges it may have been
+ * acquired before the change, so the measurement starts again one frame
+ * (the largest seen so far) plus the settling time after the sample
+ * index of the acknowledgement. Only one change is in flight at a time.
+ *
+ * A window with clipped samples or a peak above high_threshold_db raises
+ * the attenuation by at least attack_step_db; once the peak has stayed
+ * below low_threshold_db for hold_time it is lowered by at least
+ * decay_step_db. The gap between the two thresholds and the hold time are
+ * the hysteresis. The attenuator is the DAT-31 in HF mode and the R82xx
+ * LNA/mixer gain in VHF mode, where the attenuation is in dB below the
+ * highest gain; the initial attenuation is the one set when streaming
+ * starts.
+ */
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "agc.h"
+
+
+typedef struct agc agc_t;
+
+#define MAX_ATTENUATIONS (64)
+
+static const double DEFAULT_HIGH_THRESHOLD = -1;  /* dBFS */
+static const double DEFAULT_LOW_THRESHOLD = -12;  /* dBFS */
+static const double DEFAULT_ATTACK_STEP = 3;      /* dB */
+static const double DEFAULT_DECAY_STEP = 1;       /* dB */
+static const double DEFAULT_UPDATE_TIME = 0.05;   /* s */
+static const double DEFAULT_HOLD_TIME = 1;        /* s */
+static const int32_t CLIP_LEVEL = 32767;
+static const double FULL_SCALE = 32768.0;
+
+enum AGCState {
+  AGC_IDLE,
+  AGC_RUNNING
+};
+
+typedef struct agc {
+  int32_t high_level;           /* peak */
+  int32_t low_level;
+  double attack_step;
+  double decay_step;
+  uint64_t window_samples;
+  uint32_t hold_windows;
+  uint64_t settling_samples;
+  sddc_agc_cb_t callback;
+  void *callback_context;
+  agc_set_attenuation_fn_t set_attenuation;
+  void *set_attenuation_context;
+  double attenuations[MAX_ATTENUATIONS];
+  uint32_t num_attenuations;
+  atomic_int state;
+  /* first sample to measure; UINT64_MAX while a change is in flight */
+  atomic_ullong settle_from;
+  atomic_uint max_frame_samples;
+  atomic_uint index;            /* in effect */
+  /* the change in flight - set before the request is sent */
+  uint32_t new_index;
+  int32_t change_peak;
+  uint64_t change_clipped;
+  /* the current window */
+  uint64_t count;
+  int32_t peak;
+  uint64_t clipped;
+  uint64_t sum_squares;
+  uint32_t quiet_windows;
+  /* stats */
+  atomic_uint changes;
+  atomic_ullong clipped_samples;
+  atomic_int last_peak;
+  atomic_ullong last_mean_square;
+} agc_t;
+
+
+/* internal functions */
+static void agc_finish_window(agc_t *this, uint64_t sample_index);
+static void agc_change(agc_t *this, uint32_t new_index, uint64_t sample_index);
+static double agc_db(double level);
+
+
+agc_t *agc_open(const struct sddc_agc_params *params, double sample_rate,
+                agc_set_attenuation_fn_t set_attenuation,
+                void *set_attenuation_context)
+{
+  agc_t *ret_val = 0;
+
+  double high_threshold = params->high_threshold_db != 0 ?
+                          params->high_threshold_db : DEFAULT_HIGH_THRESHOLD;
+  double low_threshold = params->low_threshold_db != 0 ?
+                         params->low_threshold_db : DEFAULT_LOW_THRESHOLD;
+  if (high_threshold > 0 || low_threshold >= high_threshold) {
+    fprintf(stderr, "ERROR - agc_open() failed - the thresholds must be low < high <= 0 dBFS: %f, %f\n",
+            low_threshold, high_threshold);
+    return ret_val;
+  }
+  if (params->attack_step_db < 0 || params->decay_step_db < 0 ||
+      params->update_time < 0 || params->hold_time < 0 ||
+      params->settling_time < 0) {
+    fprintf(stderr, "ERROR - agc_open() failed - negative step or time\n");
+    return ret_val;
+  }
+  double update_time = params->update_time > 0 ? params->update_time :
+                                                 DEFAULT_UPDATE_TIME;
+  double hold_time = params->hold_time > 0 ? params->hold_time :
+                                             DEFAULT_HOLD_TIME;
+
+  agc_t *this = (agc_t *) calloc(1, sizeof(agc_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  this->high_level = (int32_t) (FULL_SCALE * pow(10, high_threshold / 20));
+  this->low_level = (int32_t) (FULL_SCALE * pow(10, low_threshold / 20));
+  this->attack_step = params->attack_step_db > 0 ? params->attack_step_db :
+                                                   DEFAULT_ATTACK_STEP;
+  this->decay_step = params->decay_step_db > 0 ? params->decay_step_db :
+                                                 DEFAULT_DECAY_STEP;
+  this->window_samples = (uint64_t) (update_time * sample_rate);
+  this->window_samples = this->window_samples > 0 ? this->window_samples : 1;
+  this->hold_windows = (uint32_t) ceil(hold_time / update_time);
+  this->settling_samples = (uint64_t) (params->settling_time * sample_rate);
+  this->callback = params->callback;
+  this->callback_context = params->callback_context;
+  this->set_attenuation = set_attenuation;
+  this->set_attenuation_context = set_attenuation_context;
+  this->num_attenuations = 0;
+  atomic_init(&this->state, AGC_IDLE);
+  atomic_init(&this->settle_from, UINT64_MAX);
+  atomic_init(&this->max_frame_samples, 0);
+  atomic_init(&this->index, 0);
+  atomic_init(&this->changes, 0);
+  atomic_init(&this->clipped_samples, 0);
+  atomic_init(&this->last_peak, 0);
+  atomic_init(&this->last_mean_square, 0);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void agc_close(agc_t *this)
+{
+  free(this);
+  return;
+}
+
+
+int agc_start(agc_t *this, const double *attenuations,
+              uint32_t num_attenuations, uint32_t index)
+{
+  if (num_attenuations == 0 || num_attenuations > MAX_ATTENUATIONS ||
+      index >= num_attenuations) {
+    fprintf(stderr, "ERROR - agc_start() failed - invalid attenuator steps\n");
+    return -1;
+  }
+  memcpy(this->attenuations, attenuations, num_attenuations * sizeof(double));
+  this->num_attenuations = num_attenuations;
+  this->count = 0;
+  this->peak = 0;
+  this->clipped = 0;
+  this->sum_squares = 0;
+  this->quiet_windows = 0;
+  atomic_store(&this->index, index);
+  atomic_store(&this->changes, 0);
+  atomic_store(&this->clipped_samples, 0);
+  atomic_store(&this->last_peak, 0);
+  atomic_store(&this->last_mean_square, 0);
+  atomic_store(&this->max_frame_samples, 0);
+  atomic_store(&this->settle_from, this->settling_samples);
+  atomic_store(&this->state, AGC_RUNNING);
+  return 0;
+}
+
+
+void agc_stop(agc_t *this)
+{
+  atomic_store(&this->state, AGC_IDLE);
+  return;
+}
+
+
+int agc_is_running(agc_t *this)
+{
+  return atomic_load(&this->state) == AGC_RUNNING;
+}
+
+
+void agc_applied(agc_t *this, uint64_t sample_index, int status)
+{
+  if (atomic_load(&this->state) != AGC_RUNNING) {
+    return;
+  }
+  uint32_t previous_index = atomic_load(&this->index);
+  if (status < 0) {
+    fprintf(stderr, "ERROR - AGC attenuation change failed\n");
+  } else {
+    atomic_store(&this->index, this->new_index);
+    atomic_fetch_add(&this->changes, 1);
+  }
+  if (this->callback) {
+    struct sddc_agc_change change = {
+      .attenuation = this->attenuations[atomic_load(&this->index)],
+      .previous_attenuation = this->attenuations[previous_index],
+      .sample_index = sample_index,
+      .peak_db = agc_db(this->change_peak),
+      .clipped_samples = this->change_clipped,
+      .status = status < 0 ? -1 : 0
+    };
+    this->callback(&change, this->callback_context);
+  }
+  atomic_store(&this->settle_from, sample_index +
+               atomic_load(&this->max_frame_samples) + this->settling_samples);
+  return;
+}
+
+
+void agc_process(agc_t *this, const int16_t *input, uint32_t num_samples,
+                 uint64_t sample_index)
+{
+  if (num_samples > atomic_load_explicit(&this->max_frame_samples, memory_order_relaxed)) {
+    atomic_store_explicit(&this->max_frame_samples, num_samples, memory_order_relaxed);
+  }
+  if (atomic_load(&this->state) != AGC_RUNNING) {
+    return;
+  }
+  uint64_t settle_from = atomic_load(&this->settle_from);
+  if (settle_from == UINT64_MAX || sample_index + num_samples <= settle_from) {
+    return;
+  }
+
+  uint32_t i = sample_index < settle_from ? (uint32_t) (settle_from - sample_index) : 0;
+  while (i < num_samples) {
+    uint64_t n = this->window_samples - this->count;
+    n = n < num_samples - i ? n : num_samples - i;
+    const int16_t *block = input + i;
+    int32_t peak = this->peak;
+    uint32_t clipped = 0;
+    uint64_t sum_squares = 0;
+    for (uint32_t k = 0; k < (uint32_t) n; ++k) {
+      int32_t x = block[k];
+      int32_t a = x < 0 ? -x : x;
+      peak = a > peak ? a : peak;
+      clipped += a >= CLIP_LEVEL;
+      sum_squares += (uint32_t) (x * x);
+    }
+    this->peak = peak;
+    this->clipped += clipped;
+    this->sum_squares += sum_squares;
+    this->count += n;
+    i += (uint32_t) n;
+    if (this->count < this->window_samples) {
+      break;
+    }
+    agc_finish_window(this, sample_index + i);
+    if (atomic_load_explicit(&this->settle_from, memory_order_relaxed) == UINT64_MAX) {
+      /* the rest of the frame is at the old attenuation */
+      return;
+    }
+  }
+  return;
+}
+
+
+void agc_get_stats(agc_t *this, struct sddc_agc_stats *stats)
+{
+  stats->changes = atomic_load(&this->changes);
+  stats->clipped_samples = atomic_load(&this->clipped_samples);
+  stats->peak_db = agc_db(atomic_load(&this->last_peak));
+  uint64_t mean_square = atomic_load(&this->last_mean_square);
+  stats->rms_db = agc_db(sqrt((double) mean_square));
+  stats->attenuation = this->num_attenuations > 0 ?
+                       this->attenuations[atomic_load(&this->index)] : 0;
+  return;
+}
+
+
+/* internal functions */
+static void agc_finish_window(agc_t *this, uint64_t sample_index)
+{
+  int32_t peak = this->peak;
+  uint64_t clipped = this->clipped;
+  atomic_fetch_add_explicit(&this->clipped_samples, clipped, memory_order_relaxed);
+  atomic_store_explicit(&this->last_peak, peak, memory_order_relaxed);
+  atomic_store_explicit(&this->last_mean_square, this->sum_squares / this->count,
+                        memory_order_relaxed);
+  this->count = 0;
+  this->peak = 0;
+  this->clipped = 0;
+  this->sum_squares = 0;
+
+  uint32_t index = atomic_load(&this->index);
+  double attenuation = this->attenuations[index];
+  if (clipped > 0 || peak > this->high_level) {
+    this->quiet_windows = 0;
+    if (index + 1 == this->num_attenuations) {
+      return;
+    }
+    /* the first step at least attack_step above, or the last one */
+    uint32_t new_index = index + 1;
+    while (new_index + 1 < this->num_attenuations &&
+           this->attenuations[new_index] < attenuation + this->attack_step) {
+      new_index++;
+    }
+    this->change_peak = peak;
+    this->change_clipped = clipped;
+    agc_change(this, new_index, sample_index);
+  } else if (peak < this->low_level) {
+    if (++this->quiet_windows < this->hold_windows || index == 0) {
+      return;
+    }
+    this->quiet_windows = 0;
+    /* the last step at least decay_step below, or the first one */
+    uint32_t new_index = index - 1;
+    while (new_index > 0 &&
+           this->attenuations[new_index] > attenuation - this->decay_step) {
+      new_index--;
+    }
+    this->change_peak = peak;
+    this->change_clipped = clipped;
+    agc_change(this, new_index, sample_index);
+  } else {
+    this->quiet_windows = 0;
+  }
+  return;
+}
+
+static void agc_change(agc_t *this, uint32_t new_index, uint64_t sample_index)
+{
+  this->new_index = new_index;
+  atomic_store(&this->settle_from, UINT64_MAX);
+  if (this->set_attenuation(this->set_attenuation_context, new_index) < 0) {
+    fprintf(stderr, "ERROR - AGC attenuation change failed\n");
+    atomic_store(&this->settle_from, sample_index);
+  }
+  return;
+}
+
+static double agc_db(double level)
+{
+  return level > 0 ? 20 * log10(level / FULL_SCALE) : -INFINITY;
+}
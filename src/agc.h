@@ -0,0 +1,72 @@
+/*
+ * agc.h - automatic gain control from the stream statistics
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __AGC_H
+#define __AGC_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct agc agc_t;
+
+/* starts setting the attenuator to its step number 'index' and returns
+   right away; when the device has acknowledged it agc_applied() must be
+   called */
+typedef int (*agc_set_attenuation_fn_t)(void *context, uint32_t index);
+
+agc_t *agc_open(const struct sddc_agc_params *params, double sample_rate,
+                agc_set_attenuation_fn_t set_attenuation,
+                void *set_attenuation_context);
+
+void agc_close(agc_t *this);
+
+/* the attenuator steps (dB, ascending) and the one it is on; the samples
+   from sample index 0 are measured after the settling time */
+int agc_start(agc_t *this, const double *attenuations,
+              uint32_t num_attenuations, uint32_t index);
+
+/* after agc_stop() the changes still in flight are ignored */
+void agc_stop(agc_t *this);
+
+int agc_is_running(agc_t *this);
+
+/* called when the device acknowledged a change; sample_index is the index
+   of the next sample to come out of the stream at that point */
+void agc_applied(agc_t *this, uint64_t sample_index, int status);
+
+/* raw samples from the stream, in order; called from one thread */
+void agc_process(agc_t *this, const int16_t *input, uint32_t num_samples,
+                 uint64_t sample_index);
+
+void agc_get_stats(agc_t *this, struct sddc_agc_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __AGC_H */
@@ -0,0 +1,260 @@
+/*
+ * buffer_pool.c - allocation of the streaming frame buffers
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+
+
+typedef struct buffer_pool buffer_pool_t;
+
+typedef struct buffer_pool {
+  libusb_device_handle *dev_handle;
+  enum SDDCBufferStrategy strategy;
+  uint32_t num_buffers;
+  uint32_t buffer_size;
+  uint8_t **buffers;
+  /* huge pages and aligned memory: a single mapping for all the buffers */
+  void *arena;
+  size_t arena_size;
+} buffer_pool_t;
+
+
+static const size_t PAGE_SIZE_4K = 4096;
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static const int MPOL_BIND_POLICY = 2;      /* MPOL_BIND from numaif.h */
+
+
+/* internal functions */
+static int buffer_pool_alloc_usbfs(buffer_pool_t *this);
+static int buffer_pool_alloc_arena(buffer_pool_t *this, int huge_pages,
+                                   int numa_node);
+static void buffer_pool_bind_numa_node(void *addr, size_t length,
+                                       int numa_node);
+
+
+buffer_pool_t *buffer_pool_open(libusb_device_handle *dev_handle,
+                                uint32_t num_buffers, uint32_t buffer_size,
+                                enum SDDCBufferStrategy strategy,
+                                int numa_node)
+{
+  buffer_pool_t *ret_val = 0;
+
+  buffer_pool_t *this = (buffer_pool_t *) malloc(sizeof(buffer_pool_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->buffers = (uint8_t **) calloc(num_buffers ? num_buffers : 1,
+                                      sizeof(uint8_t *));
+  if (this->buffers == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL1;
+  }
+  this->dev_handle = dev_handle;
+  this->num_buffers = num_buffers;
+  this->buffer_size = buffer_size;
+  this->arena = 0;
+  this->arena_size = 0;
+
+  /* usbfs memory is allocated by the kernel driver wherever it likes, so
+     when a NUMA node is requested the automatic choice skips it (and so
+     it does for the file:// devices, that have no usbfs) */
+  if (strategy == BUFFER_STRATEGY_AUTO) {
+    strategy = numa_node < 0 && this->dev_handle ? BUFFER_STRATEGY_USB_ZEROCOPY :
+                               BUFFER_STRATEGY_HUGE_PAGES;
+  }
+  this->strategy = strategy;
+  if (this->strategy == BUFFER_STRATEGY_USB_ZEROCOPY) {
+    if (buffer_pool_alloc_usbfs(this) == 0) {
+      goto DONE;
+    }
+    fprintf(stderr, "WARNING - usbfs zero-copy buffers not available - trying huge pages\n");
+    this->strategy = BUFFER_STRATEGY_HUGE_PAGES;
+  }
+  if (this->strategy == BUFFER_STRATEGY_HUGE_PAGES) {
+    if (buffer_pool_alloc_arena(this, 1, numa_node) == 0) {
+      goto DONE;
+    }
+    fprintf(stderr, "WARNING - huge pages not available - using aligned memory\n");
+    this->strategy = BUFFER_STRATEGY_ALIGNED;
+  }
+  if (buffer_pool_alloc_arena(this, 0, numa_node) < 0) {
+    goto FAIL2;
+  }
+
+DONE:
+  fprintf(stderr, "buffer strategy = %s\n",
+          buffer_pool_strategy_name(this->strategy));
+  ret_val = this;
+  return ret_val;
+
+FAIL2:
+  free(this->buffers);
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void buffer_pool_close(buffer_pool_t *this)
+{
+  if (this->strategy == BUFFER_STRATEGY_USB_ZEROCOPY) {
+    for (uint32_t i = 0; i < this->num_buffers; ++i) {
+      libusb_dev_mem_free(this->dev_handle, this->buffers[i],
+                          this->buffer_size);
+    }
+  } else {
+    munmap(this->arena, this->arena_size);
+  }
+  free(this->buffers);
+  free(this);
+  return;
+}
+
+
+uint8_t *buffer_pool_get_buffer(buffer_pool_t *this, uint32_t index)
+{
+  return this->buffers[index];
+}
+
+
+enum SDDCBufferStrategy buffer_pool_get_strategy(buffer_pool_t *this)
+{
+  return this->strategy;
+}
+
+
+const char *buffer_pool_strategy_name(enum SDDCBufferStrategy strategy)
+{
+  switch (strategy) {
+    case BUFFER_STRATEGY_AUTO:
+      return "auto";
+    case BUFFER_STRATEGY_USB_ZEROCOPY:
+      return "usbfs zero-copy";
+    case BUFFER_STRATEGY_HUGE_PAGES:
+      return "huge pages";
+    case BUFFER_STRATEGY_ALIGNED:
+      return "aligned memory";
+  }
+  return "unknown";
+}
+
+
+/* internal functions */
+static int buffer_pool_alloc_usbfs(buffer_pool_t *this)
+{
+  /* no usbfs behind a file:// device */
+  if (this->dev_handle == 0) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < this->num_buffers; ++i) {
+    this->buffers[i] = libusb_dev_mem_alloc(this->dev_handle,
+                                            this->buffer_size);
+    if (this->buffers[i] == 0) {
+      for (uint32_t j = 0; j < i; j++) {
+        libusb_dev_mem_free(this->dev_handle, this->buffers[j],
+                            this->buffer_size);
+        this->buffers[j] = 0;
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+static int buffer_pool_alloc_arena(buffer_pool_t *this, int huge_pages,
+                                   int numa_node)
+{
+  /* every buffer starts on a page boundary */
+  size_t stride = (this->buffer_size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+  size_t size = stride * this->num_buffers;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (huge_pages) {
+#ifdef MAP_HUGETLB
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    flags |= MAP_HUGETLB;
+#else
+    return -1;
+#endif
+  }
+  void *arena = mmap(0, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (arena == MAP_FAILED) {
+    if (!huge_pages) {
+      fprintf(stderr, "ERROR - mmap() failed: %s\n", strerror(errno));
+    }
+    return -1;
+  }
+#ifdef MADV_HUGEPAGE
+  if (!huge_pages) {
+    /* transparent huge pages, if the kernel is willing */
+    madvise(arena, size, MADV_HUGEPAGE);
+  }
+#endif
+  buffer_pool_bind_numa_node(arena, size, numa_node);
+
+  /* fault the pages in now (on the right node), not in the first
+     transfers */
+  memset(arena, 0, size);
+
+  this->arena = arena;
+  this->arena_size = size;
+  for (uint32_t i = 0; i < this->num_buffers; ++i) {
+    this->buffers[i] = (uint8_t *) arena + i * stride;
+  }
+  return 0;
+}
+
+
+static void buffer_pool_bind_numa_node(void *addr, size_t length,
+                                       int numa_node)
+{
+  if (numa_node < 0) {
+    return;
+  }
+#ifdef SYS_mbind
+  /* no libnuma needed for a single node mask */
+  unsigned long nodemask[16];
+  const int node_bits = 8 * sizeof(unsigned long);
+  if (numa_node >= (int) (sizeof(nodemask) / sizeof(nodemask[0])) * node_bits) {
+    fprintf(stderr, "WARNING - invalid NUMA node %d\n", numa_node);
+    return;
+  }
+  memset(nodemask, 0, sizeof(nodemask));
+  nodemask[numa_node / node_bits] = 1UL << (numa_node % node_bits);
+  if (syscall(SYS_mbind, addr, length, MPOL_BIND_POLICY, nodemask,
+              sizeof(nodemask) * 8, 0) < 0) {
+    fprintf(stderr, "WARNING - mbind() to NUMA node %d failed: %s\n",
+            numa_node, strerror(errno));
+  }
+#else
+  fprintf(stderr, "WARNING - NUMA binding not supported\n");
+#endif
+  return;
+}
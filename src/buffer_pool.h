@@ -0,0 +1,58 @@
+/*
+ * buffer_pool.h - allocation of the streaming frame buffers
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __BUFFER_POOL_H
+#define __BUFFER_POOL_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct buffer_pool buffer_pool_t;
+
+/* allocate num_buffers buffers of buffer_size bytes with the requested
+   strategy, falling back to the next one (usbfs zero-copy, huge pages,
+   aligned memory) when it fails; numa_node < 0 means no NUMA binding */
+buffer_pool_t *buffer_pool_open(libusb_device_handle *dev_handle,
+                                uint32_t num_buffers, uint32_t buffer_size,
+                                enum SDDCBufferStrategy strategy,
+                                int numa_node);
+
+void buffer_pool_close(buffer_pool_t *this);
+
+uint8_t *buffer_pool_get_buffer(buffer_pool_t *this, uint32_t index);
+
+/* the strategy actually in use */
+enum SDDCBufferStrategy buffer_pool_get_strategy(buffer_pool_t *this);
+
+const char *buffer_pool_strategy_name(enum SDDCBufferStrategy strategy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BUFFER_POOL_H */
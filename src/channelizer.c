@@ -0,0 +1,485 @@
+/*
+ * channelizer.c - FFT overlap-save channelizer
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Fast convolution filter bank: the real input is cut into blocks of N
+ * samples overlapping by N/4 and each block goes through one real FFT.
+ * A channel with decimation D takes the M = N/D bins around its center
+ * frequency, multiplies them by the frequency response of its lowpass
+ * filter (N/4 + 1 taps, so the overlap-save output is free of circular
+ * aliasing) and runs an inverse FFT of size M; the last 3M/4 samples are
+ * the channel output at sample_rate / D.
+ *
+ * Shifting the spectrum by the center bin k0 leaves a phase rotation of
+ * exp(-j 2pi k0 b L / N) on block b (L = hop size), which is removed
+ * together with the residual frequency offset between the center
+ * frequency and the center bin.
+ */
+
+#include <math.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channelizer.h"
+#include "fft.h"
+
+
+typedef struct channelizer channelizer_t;
+
+#define CHANNEL_KAISER_BETA 8.0
+#define CHANNEL_STOPBAND_ATTENUATION 80.0  /* dB - for the Kaiser estimate */
+
+enum ChannelState {
+  CHANNEL_FREE,
+  CHANNEL_SETUP,
+  CHANNEL_ACTIVE,
+  CHANNEL_REMOVING
+};
+
+struct channel {
+  sddc_channel_cb_t callback;
+  void *callback_context;
+  uint32_t decimation;
+  uint32_t size;                /* M = N / D */
+  int center_bin;
+  double fine_phase;            /* cycles */
+  double fine_block_step;
+  double fine_sample_step;
+  float complex *response;      /* M bins in FFT order */
+  float complex *spectrum;
+  float complex *samples;
+  float *output;                /* interleaved I/Q */
+  fft_t *inverse;
+};
+
+/* the control thread sets state and then checks busy, the processing
+   thread sets busy and then checks state (both sequentially consistent),
+   so a channel is never freed while it is being processed */
+struct channel_slot {
+  atomic_int state;
+  atomic_int busy;
+  struct channel *channel;
+};
+
+typedef struct channelizer {
+  double sample_rate;
+  uint32_t fft_size;            /* N */
+  uint32_t overlap;             /* N / 4 */
+  uint32_t hop;                 /* L = N - overlap */
+  uint32_t block_offset;        /* b L mod N */
+  fft_t *forward;
+  float *input;
+  uint32_t fill;
+  float complex *spectrum;      /* N/2 + 1 bins */
+  struct channel_slot slots[SDDC_MAX_CHANNELS];
+  worker_pool_t *worker_pool;
+  int active_channels[SDDC_MAX_CHANNELS];
+} channelizer_t;
+
+
+/* internal functions */
+static void channelizer_process_block(channelizer_t *this);
+static void channel_process(channelizer_t *this, int id,
+                            struct channel *channel);
+static void channel_task(void *context, uint32_t index);
+static int channel_design(channelizer_t *this, struct channel *channel);
+static void channel_free(struct channel *channel);
+static double bessel_i0(double x);
+static inline float complex cmul(float complex a, float complex b);
+
+
+channelizer_t *channelizer_open(double sample_rate, uint32_t fft_size)
+{
+  channelizer_t *ret_val = 0;
+
+  if (fft_size < 64 || (fft_size & (fft_size - 1)) != 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed - FFT size must be a power of two >= 64: %u\n", fft_size);
+    return ret_val;
+  }
+
+  channelizer_t *this = (channelizer_t *) calloc(1, sizeof(channelizer_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL0;
+  }
+  this->sample_rate = sample_rate;
+  this->fft_size = fft_size;
+  this->overlap = fft_size / 4;
+  this->hop = fft_size - this->overlap;
+  this->block_offset = 0;
+  this->worker_pool = 0;
+  this->forward = fft_open_r2c(fft_size);
+  this->input = (float *) calloc(fft_size, sizeof(float));
+  this->spectrum = (float complex *) malloc((fft_size / 2 + 1) * sizeof(float complex));
+  if (this->forward == 0 || this->input == 0 || this->spectrum == 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed - out of memory\n");
+    goto FAIL1;
+  }
+  /* the first block starts with an overlap of zeros */
+  this->fill = this->overlap;
+  for (int i = 0; i < SDDC_MAX_CHANNELS; ++i) {
+    atomic_init(&this->slots[i].state, CHANNEL_FREE);
+    atomic_init(&this->slots[i].busy, 0);
+    this->slots[i].channel = 0;
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL1:
+  channelizer_close(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void channelizer_close(channelizer_t *this)
+{
+  for (int i = 0; i < SDDC_MAX_CHANNELS; ++i) {
+    if (this->slots[i].channel) {
+      channel_free(this->slots[i].channel);
+    }
+  }
+  if (this->forward) {
+    fft_close(this->forward);
+  }
+  free(this->input);
+  free(this->spectrum);
+  free(this);
+  return;
+}
+
+
+int channelizer_add_channel(channelizer_t *this, double center_frequency,
+                            uint32_t decimation, sddc_channel_cb_t callback,
+                            void *callback_context)
+{
+  if (fabs(center_frequency) > this->sample_rate / 2) {
+    fprintf(stderr, "ERROR - channelizer_add_channel() failed - center frequency out of range: %f\n",
+            center_frequency);
+    return -1;
+  }
+  if (decimation == 0 || decimation > this->overlap ||
+      (decimation & (decimation - 1)) != 0) {
+    fprintf(stderr, "ERROR - channelizer_add_channel() failed - decimation must be a power of two <= %u\n",
+            this->overlap);
+    return -1;
+  }
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - channelizer_add_channel() failed - no callback\n");
+    return -1;
+  }
+
+  /* grab a free slot */
+  int id;
+  for (id = 0; id < SDDC_MAX_CHANNELS; ++id) {
+    int expected = CHANNEL_FREE;
+    if (atomic_compare_exchange_strong(&this->slots[id].state, &expected,
+                                       CHANNEL_SETUP)) {
+      break;
+    }
+  }
+  if (id == SDDC_MAX_CHANNELS) {
+    fprintf(stderr, "ERROR - channelizer_add_channel() failed - no free channels\n");
+    return -1;
+  }
+
+  struct channel *channel = (struct channel *) calloc(1, sizeof(struct channel));
+  if (channel == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL0;
+  }
+  channel->callback = callback;
+  channel->callback_context = callback_context;
+  channel->decimation = decimation;
+  channel->size = this->fft_size / decimation;
+  double bin_width = this->sample_rate / this->fft_size;
+  channel->center_bin = (int) lround(center_frequency / bin_width);
+  double residual = center_frequency - channel->center_bin * bin_width;
+  channel->fine_phase = 0;
+  channel->fine_block_step = residual * this->hop / this->sample_rate;
+  channel->fine_sample_step = residual * decimation / this->sample_rate;
+  channel->response = (float complex *) malloc(channel->size * sizeof(float complex));
+  channel->spectrum = (float complex *) malloc(channel->size * sizeof(float complex));
+  channel->samples = (float complex *) malloc(channel->size * sizeof(float complex));
+  channel->output = (float *) malloc(2 * (this->hop / decimation) * sizeof(float));
+  channel->inverse = fft_open_c2c(channel->size, FFT_BACKWARD);
+  if (channel->response == 0 || channel->spectrum == 0 ||
+      channel->samples == 0 || channel->output == 0 ||
+      channel->inverse == 0) {
+    fprintf(stderr, "ERROR - channelizer_add_channel() failed - out of memory\n");
+    goto FAIL1;
+  }
+  if (channel_design(this, channel) < 0) {
+    goto FAIL1;
+  }
+
+  this->slots[id].channel = channel;
+  atomic_store(&this->slots[id].state, CHANNEL_ACTIVE);
+  return id;
+
+FAIL1:
+  channel_free(channel);
+FAIL0:
+  atomic_store(&this->slots[id].state, CHANNEL_FREE);
+  return -1;
+}
+
+
+int channelizer_remove_channel(channelizer_t *this, int channel)
+{
+  if (channel < 0 || channel >= SDDC_MAX_CHANNELS) {
+    fprintf(stderr, "ERROR - channelizer_remove_channel() failed - invalid channel: %d\n", channel);
+    return -1;
+  }
+  struct channel_slot *slot = &this->slots[channel];
+  int expected = CHANNEL_ACTIVE;
+  if (!atomic_compare_exchange_strong(&slot->state, &expected,
+                                      CHANNEL_REMOVING)) {
+    fprintf(stderr, "ERROR - channelizer_remove_channel() failed - channel %d not active\n", channel);
+    return -1;
+  }
+  /* wait for the processing thread to be done with it */
+  while (atomic_load(&slot->busy)) {
+    sched_yield();
+  }
+  channel_free(slot->channel);
+  slot->channel = 0;
+  atomic_store(&slot->state, CHANNEL_FREE);
+  return 0;
+}
+
+
+void channelizer_set_worker_pool(channelizer_t *this,
+                                 worker_pool_t *worker_pool)
+{
+  this->worker_pool = worker_pool;
+  return;
+}
+
+
+void channelizer_process(channelizer_t *this, const int16_t *input,
+                         uint32_t num_samples)
+{
+  const float scale = 1.0f / 32768.0f;
+  while (num_samples > 0) {
+    uint32_t n = this->fft_size - this->fill;
+    n = n < num_samples ? n : num_samples;
+    float *restrict x = this->input + this->fill;
+    for (uint32_t i = 0; i < n; ++i) {
+      x[i] = input[i] * scale;
+    }
+    this->fill += n;
+    input += n;
+    num_samples -= n;
+    if (this->fill == this->fft_size) {
+      channelizer_process_block(this);
+      memmove(this->input, this->input + this->hop,
+              this->overlap * sizeof(float));
+      this->fill = this->overlap;
+    }
+  }
+  return;
+}
+
+
+/* internal functions */
+static void channelizer_process_block(channelizer_t *this)
+{
+  fft_execute_r2c(this->forward, this->input, this->spectrum);
+
+  /* mark the active channels as busy */
+  uint32_t num_active = 0;
+  for (int i = 0; i < SDDC_MAX_CHANNELS; ++i) {
+    struct channel_slot *slot = &this->slots[i];
+    if (atomic_load_explicit(&slot->state, memory_order_relaxed) != CHANNEL_ACTIVE) {
+      continue;
+    }
+    atomic_store(&slot->busy, 1);
+    if (atomic_load(&slot->state) == CHANNEL_ACTIVE) {
+      this->active_channels[num_active++] = i;
+    } else {
+      atomic_store_explicit(&slot->busy, 0, memory_order_release);
+    }
+  }
+
+  if (this->worker_pool && num_active > 1) {
+    worker_pool_run(this->worker_pool, channel_task, this, num_active);
+  } else {
+    for (uint32_t i = 0; i < num_active; ++i) {
+      channel_task(this, i);
+    }
+  }
+
+  for (uint32_t i = 0; i < num_active; ++i) {
+    struct channel_slot *slot = &this->slots[this->active_channels[i]];
+    atomic_store_explicit(&slot->busy, 0, memory_order_release);
+  }
+  this->block_offset = (this->block_offset + this->hop) % this->fft_size;
+  return;
+}
+
+
+static void channel_task(void *context, uint32_t index)
+{
+  channelizer_t *this = (channelizer_t *) context;
+  int id = this->active_channels[index];
+  channel_process(this, id, this->slots[id].channel);
+  return;
+}
+
+
+static void channel_process(channelizer_t *this, int id,
+                            struct channel *channel)
+{
+  int n = this->fft_size;
+  int half = n / 2;
+  int m = channel->size;
+
+  /* bins around the center frequency (the spectrum of a real signal is
+     conjugate symmetric) */
+  for (int i = 0; i < m; ++i) {
+    int offset = i < m / 2 ? i : i - m;
+    int k = (channel->center_bin + offset) % n;
+    k = k < 0 ? k + n : k;
+    float complex bin = k <= half ? this->spectrum[k] : conjf(this->spectrum[n - k]);
+    channel->spectrum[i] = cmul(bin, channel->response[i]);
+  }
+  fft_execute_c2c(channel->inverse, channel->spectrum, channel->samples);
+
+  /* drop the overlap, remove the block rotation and the residual offset */
+  uint32_t first = this->overlap / channel->decimation;
+  uint32_t count = this->hop / channel->decimation;
+  uint32_t coarse = (uint32_t) (((uint64_t) ((int64_t) channel->center_bin + n) *
+                                 this->block_offset) % n);
+  double start = (double) coarse / n + channel->fine_phase;
+  double complex phasor = cexp(-2 * M_PI * I * start) / n;
+  double complex step = cexp(-2 * M_PI * I * channel->fine_sample_step);
+  float *restrict out = channel->output;
+  for (uint32_t i = 0; i < count; ++i) {
+    float complex s = channel->samples[first + i];
+    double re = creal(phasor);
+    double im = cimag(phasor);
+    out[2 * i] = crealf(s) * re - cimagf(s) * im;
+    out[2 * i + 1] = crealf(s) * im + cimagf(s) * re;
+    phasor = CMPLX(re * creal(step) - im * cimag(step),
+                   re * cimag(step) + im * creal(step));
+  }
+  channel->fine_phase += channel->fine_block_step;
+  channel->fine_phase -= floor(channel->fine_phase);
+
+  channel->callback(id, 2 * count * sizeof(float), (uint8_t *) out,
+                    channel->callback_context);
+  return;
+}
+
+
+static int channel_design(channelizer_t *this, struct channel *channel)
+{
+  /* Kaiser windowed sinc with overlap + 1 taps; the cutoff is pushed as
+     close to the output Nyquist frequency as the transition band allows */
+  uint32_t n = this->fft_size;
+  uint32_t taps = this->overlap + 1;
+  double center = this->overlap / 2.0;
+  double transition = (CHANNEL_STOPBAND_ATTENUATION - 8) /
+                      (2.285 * 2 * M_PI * this->overlap) * channel->decimation;
+  double cutoff = 0.5 - transition / 2;
+  cutoff = cutoff > 0.45 ? 0.45 : (cutoff < 0.25 ? 0.25 : cutoff);
+  cutoff /= channel->decimation;
+
+  int ret_val = -1;
+  float *h = (float *) calloc(n, sizeof(float));
+  float complex *response = (float complex *) malloc((n / 2 + 1) * sizeof(float complex));
+  fft_t *fft = fft_open_r2c(n);
+  if (h == 0 || response == 0 || fft == 0) {
+    fprintf(stderr, "ERROR - channel_design() failed - out of memory\n");
+    goto DONE;
+  }
+
+  double sum = 0;
+  double i0_beta = bessel_i0(CHANNEL_KAISER_BETA);
+  for (uint32_t i = 0; i < taps; ++i) {
+    double t = i - center;
+    double x = t / center;
+    double window = bessel_i0(CHANNEL_KAISER_BETA * sqrt(1 - x * x)) / i0_beta;
+    double sinc = t == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t);
+    h[i] = sinc * window;
+    sum += h[i];
+  }
+  for (uint32_t i = 0; i < taps; ++i) {
+    h[i] /= sum;
+  }
+  fft_execute_r2c(fft, h, response);
+
+  int m = channel->size;
+  for (int i = 0; i < m; ++i) {
+    int offset = i < m / 2 ? i : i - m;
+    channel->response[i] = offset >= 0 ? response[offset] : conjf(response[-offset]);
+  }
+  ret_val = 0;
+
+DONE:
+  if (fft) {
+    fft_close(fft);
+  }
+  free(response);
+  free(h);
+  return ret_val;
+}
+
+
+static void channel_free(struct channel *channel)
+{
+  if (channel->inverse) {
+    fft_close(channel->inverse);
+  }
+  free(channel->response);
+  free(channel->spectrum);
+  free(channel->samples);
+  free(channel->output);
+  free(channel);
+  return;
+}
+
+
+static double bessel_i0(double x)
+{
+  double sum = 1;
+  double term = 1;
+  for (int k = 1; k < 50; ++k) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < 1e-12 * sum) {
+      break;
+    }
+  }
+  return sum;
+}
+
+
+static inline float complex cmul(float complex a, float complex b)
+{
+  float re = crealf(a) * crealf(b) - cimagf(a) * cimagf(b);
+  float im = crealf(a) * cimagf(b) + cimagf(a) * crealf(b);
+  return CMPLXF(re, im);
+}
@@ -0,0 +1,64 @@
+/*
+ * channelizer.h - FFT overlap-save channelizer
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CHANNELIZER_H
+#define __CHANNELIZER_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+#include "worker_pool.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct channelizer channelizer_t;
+
+channelizer_t *channelizer_open(double sample_rate, uint32_t fft_size);
+
+void channelizer_close(channelizer_t *this);
+
+/* channels can be added and removed (by one control thread) while
+   another thread runs channelizer_process(); when
+   channelizer_remove_channel() returns the callback is not running and
+   will not be called again */
+int channelizer_add_channel(channelizer_t *this, double center_frequency,
+                            uint32_t decimation, sddc_channel_cb_t callback,
+                            void *callback_context);
+
+int channelizer_remove_channel(channelizer_t *this, int channel);
+
+/* run the channels of each block on the worker threads (0 = no pool):
+   the callbacks are then called from the worker threads, one block at a
+   time and never concurrently for the same channel */
+void channelizer_set_worker_pool(channelizer_t *this,
+                                 worker_pool_t *worker_pool);
+
+void channelizer_process(channelizer_t *this, const int16_t *input,
+                         uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CHANNELIZER_H */
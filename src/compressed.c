@@ -0,0 +1,1146 @@
+/*
+ * compressed.c - lossless compressed capture files
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * File layout (all little endian):
+ *   file header
+ *   block header + payload, for each block
+ *   index: one entry per block, followed by the index trailer
+ *
+ * Each block is compressed on its own, so that it can be decoded (and
+ * sought to) without the others. Block payloads are a sequence of
+ * partitions of PARTITION_SAMPLES samples (the last one may be shorter);
+ * each partition starts with two bytes:
+ *   - the order (0 to 3) of the fixed polynomial predictor used (as in
+ *     FLAC), or VERBATIM for uncompressed samples
+ *   - the Rice parameter k
+ * followed by the Rice codes of the zigzag encoded prediction residuals,
+ * MSB first and padded to a byte boundary. Residuals too large for a
+ * reasonable unary part are escaped and stored as 32 bits values.
+ * The predictor looks back across partitions, but not across blocks (the
+ * samples before the start of a block are taken to be 0).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMPRESSED_X86
+#endif
+
+#include "compressed.h"
+#include "convert.h"
+#include "spsc_ring.h"
+#include "worker_pool.h"
+
+
+struct file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_samples;
+  double sample_rate;
+  uint32_t partition_samples;
+  uint32_t reserved;
+};
+
+struct block_header {
+  char magic[4];
+  uint32_t payload_size;
+  uint32_t num_samples;
+  uint32_t reserved;
+  uint64_t first_sample;
+};
+
+struct index_entry {
+  uint64_t offset;        /* of the block header */
+  uint64_t first_sample;
+  uint32_t payload_size;
+  uint32_t num_samples;
+};
+
+struct index_trailer {
+  uint64_t index_offset;
+  uint64_t num_blocks;
+  char magic[8];
+};
+
+static const char FILE_MAGIC[8] = { 'S', 'D', 'D', 'C', 'Z', 'I', 'P', 0 };
+static const char BLOCK_MAGIC[4] = { 'S', 'Z', 'B', 'K' };
+static const char INDEX_MAGIC[8] = { 'S', 'Z', 'I', 'N', 'D', 'E', 'X', 0 };
+static const uint32_t FORMAT_VERSION = 1;
+
+#define PARTITION_SAMPLES 4096
+#define MAX_ORDER 3
+#define VERBATIM 0xff
+#define MAX_RICE_PARAMETER 20
+#define RICE_ESCAPE 24          /* unary part length that flags an escape */
+#define HISTORY_SAMPLES 16      /* zeros before each block (>= MAX_ORDER) */
+#define READ_PADDING 16         /* the bit reader reads ahead */
+
+static const uint32_t DEFAULT_BLOCK_SAMPLES = 65536;
+static const uint32_t DEFAULT_NUM_BATCHES = 16;
+
+
+/* prediction analysis kernels: the sums of the absolute values of the
+   residuals of the predictors of order 0 to MAX_ORDER over n samples; x
+   must have MAX_ORDER valid samples before it */
+typedef void (*analyze_kernel_t)(const int16_t *x, uint32_t n,
+                                 uint64_t sums[MAX_ORDER + 1]);
+
+static void analyze_scalar(const int16_t *x, uint32_t n,
+                           uint64_t sums[MAX_ORDER + 1])
+{
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (int32_t i = 0; i < (int32_t) n; ++i) {
+    int32_t e0 = x[i];
+    int32_t e1 = e0 - x[i-1];
+    int32_t e2 = e1 - (x[i-1] - x[i-2]);
+    int32_t e3 = e2 - (x[i-1] - 2 * x[i-2] + x[i-3]);
+    s0 += (uint32_t) abs(e0);
+    s1 += (uint32_t) abs(e1);
+    s2 += (uint32_t) abs(e2);
+    s3 += (uint32_t) abs(e3);
+  }
+  sums[0] = s0;
+  sums[1] = s1;
+  sums[2] = s2;
+  sums[3] = s3;
+}
+
+#ifdef COMPRESSED_X86
+static uint64_t hsum_epi32(__m256i v)
+    __attribute__((target("avx2")));
+
+static uint64_t hsum_epi32(__m256i v)
+{
+  uint32_t lanes[8];
+  _mm256_storeu_si256((__m256i *) lanes, v);
+  uint64_t sum = 0;
+  for (int i = 0; i < 8; ++i) {
+    sum += lanes[i];
+  }
+  return sum;
+}
+
+/* the 32 bit lane sums cannot overflow for n <= PARTITION_SAMPLES: the
+   residuals of order 3 are less than 2^18 */
+__attribute__((target("avx2")))
+static void analyze_avx2(const int16_t *x, uint32_t n,
+                         uint64_t sums[MAX_ORDER + 1])
+{
+  __m256i s0 = _mm256_setzero_si256();
+  __m256i s1 = _mm256_setzero_si256();
+  __m256i s2 = _mm256_setzero_si256();
+  __m256i s3 = _mm256_setzero_si256();
+  uint32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i x0 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (x + i)));
+    __m256i x1 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (x + i - 1)));
+    __m256i x2 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (x + i - 2)));
+    __m256i x3 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (x + i - 3)));
+    __m256i d1 = _mm256_sub_epi32(x0, x1);
+    __m256i d1p = _mm256_sub_epi32(x1, x2);
+    __m256i d2 = _mm256_sub_epi32(d1, d1p);
+    __m256i d2p = _mm256_sub_epi32(d1p, _mm256_sub_epi32(x2, x3));
+    __m256i d3 = _mm256_sub_epi32(d2, d2p);
+    s0 = _mm256_add_epi32(s0, _mm256_abs_epi32(x0));
+    s1 = _mm256_add_epi32(s1, _mm256_abs_epi32(d1));
+    s2 = _mm256_add_epi32(s2, _mm256_abs_epi32(d2));
+    s3 = _mm256_add_epi32(s3, _mm256_abs_epi32(d3));
+  }
+  uint64_t tail[MAX_ORDER + 1];
+  analyze_scalar(x + i, n - i, tail);
+  sums[0] = hsum_epi32(s0) + tail[0];
+  sums[1] = hsum_epi32(s1) + tail[1];
+  sums[2] = hsum_epi32(s2) + tail[2];
+  sums[3] = hsum_epi32(s3) + tail[3];
+}
+#endif /* COMPRESSED_X86 */
+
+/* follow the instruction set chosen for the conversions (SDDC_SIMD) */
+static analyze_kernel_t select_analyze_kernel(void)
+{
+#ifdef COMPRESSED_X86
+  const char *isa = convert_get_isa();
+  if (strcmp(isa, "avx2") == 0 || strcmp(isa, "avx512") == 0) {
+    return analyze_avx2;
+  }
+#endif
+  return analyze_scalar;
+}
+
+
+static inline int32_t predict(const int16_t *x, int order)
+{
+  switch (order) {
+  case 0:
+    return 0;
+  case 1:
+    return x[-1];
+  case 2:
+    return 2 * x[-1] - x[-2];
+  default:
+    return 3 * x[-1] - 3 * x[-2] + x[-3];
+  }
+}
+
+
+/* bit writer/reader - MSB first */
+struct bit_writer {
+  uint8_t *p;
+  uint64_t acc;
+  int bits;               /* bits in acc, < 8 between calls */
+};
+
+static inline void bit_writer_put(struct bit_writer *bw, uint32_t value,
+                                  int n)
+{
+  bw->acc = (bw->acc << n) | value;
+  bw->bits += n;
+  while (bw->bits >= 8) {
+    bw->bits -= 8;
+    *bw->p++ = (uint8_t) (bw->acc >> bw->bits);
+  }
+}
+
+static inline void bit_writer_flush(struct bit_writer *bw)
+{
+  if (bw->bits > 0) {
+    *bw->p++ = (uint8_t) (bw->acc << (8 - bw->bits));
+  }
+  bw->acc = 0;
+  bw->bits = 0;
+}
+
+struct bit_reader {
+  const uint8_t *p;
+  uint64_t acc;           /* left aligned */
+  int bits;
+};
+
+static inline void bit_reader_refill(struct bit_reader *br)
+{
+  while (br->bits <= 56) {
+    br->acc |= (uint64_t) *br->p++ << (56 - br->bits);
+    br->bits += 8;
+  }
+}
+
+static inline uint32_t bit_reader_get(struct bit_reader *br, int n)
+{
+  uint32_t value = (uint32_t) (br->acc >> (64 - n));
+  br->acc <<= n;
+  br->bits -= n;
+  return value;
+}
+
+/* the whole bytes consumed - the rest of the last byte is padding */
+static inline const uint8_t *bit_reader_align(struct bit_reader *br)
+{
+  return br->p - br->bits / 8;
+}
+
+
+/* encode n samples as one partition; returns the end of the output */
+static uint8_t *encode_partition(const int16_t *x, uint32_t n,
+                                 analyze_kernel_t analyze, uint8_t *out)
+{
+  uint64_t sums[MAX_ORDER + 1];
+  analyze(x, n, sums);
+  int order = 0;
+  for (int i = 1; i <= MAX_ORDER; ++i) {
+    if (sums[i] < sums[order]) {
+      order = i;
+    }
+  }
+  uint32_t mean = (uint32_t) (sums[order] / n);
+  int k = mean > 0 ? 31 - __builtin_clz(mean) : 0;
+  k = k < MAX_RICE_PARAMETER ? k : MAX_RICE_PARAMETER;
+
+  out[0] = (uint8_t) order;
+  out[1] = (uint8_t) k;
+  struct bit_writer bw = { out + 2, 0, 0 };
+  for (uint32_t i = 0; i < n; ++i) {
+    int32_t r = x[i] - predict(x + i, order);
+    uint32_t u = ((uint32_t) r << 1) ^ (uint32_t) (r >> 31);
+    uint32_t q = u >> k;
+    if (q < RICE_ESCAPE) {
+      bit_writer_put(&bw, 1, q + 1);
+      if (k > 0) {
+        bit_writer_put(&bw, u & ((1u << k) - 1), k);
+      }
+    } else {
+      bit_writer_put(&bw, 0, RICE_ESCAPE);
+      bit_writer_put(&bw, u >> 16, 16);
+      bit_writer_put(&bw, u & 0xffff, 16);
+    }
+  }
+  bit_writer_flush(&bw);
+
+  /* noise-like data - store it as it is */
+  if (bw.p - out > (ptrdiff_t) (1 + n * sizeof(int16_t))) {
+    out[0] = VERBATIM;
+    memcpy(out + 1, x, n * sizeof(int16_t));
+    return out + 1 + n * sizeof(int16_t);
+  }
+  return bw.p;
+}
+
+/* decode n samples of one partition; x must have MAX_ORDER valid samples
+   before it. Returns the end of the partition, or 0 if it is corrupted */
+static const uint8_t *decode_partition(const uint8_t *in, const uint8_t *end,
+                                       int16_t *x, uint32_t n)
+{
+  if (end - in < 1) {
+    return 0;
+  }
+  int order = in[0];
+  if (order == VERBATIM) {
+    if ((size_t) (end - in) < 1 + n * sizeof(int16_t)) {
+      return 0;
+    }
+    memcpy(x, in + 1, n * sizeof(int16_t));
+    return in + 1 + n * sizeof(int16_t);
+  }
+  if (end - in < 2 || order > MAX_ORDER || in[1] > MAX_RICE_PARAMETER) {
+    return 0;
+  }
+  int k = in[1];
+  struct bit_reader br = { in + 2, 0, 0 };
+  for (uint32_t i = 0; i < n; ++i) {
+    /* corrupted data could run past the READ_PADDING */
+    if (br.p > end + 8) {
+      return 0;
+    }
+    bit_reader_refill(&br);
+    uint32_t u;
+    int zeros = br.acc == 0 ? 64 : __builtin_clzll(br.acc);
+    if (zeros < RICE_ESCAPE) {
+      br.acc <<= zeros + 1;
+      br.bits -= zeros + 1;
+      u = (uint32_t) zeros << k;
+      if (k > 0) {
+        u |= bit_reader_get(&br, k);
+      }
+    } else {
+      br.acc <<= RICE_ESCAPE;
+      br.bits -= RICE_ESCAPE;
+      u = bit_reader_get(&br, 32);
+    }
+    int32_t r = (int32_t) (u >> 1) ^ -(int32_t) (u & 1);
+    x[i] = (int16_t) (r + predict(x + i, order));
+  }
+  const uint8_t *next = bit_reader_align(&br);
+  return next <= end ? next : 0;
+}
+
+static uint32_t max_payload_size(uint32_t num_samples)
+{
+  uint32_t num_partitions = (num_samples + PARTITION_SAMPLES - 1) / PARTITION_SAMPLES;
+  /* the partitions larger than verbatim are stored verbatim, but they
+     have to be encoded first */
+  return num_partitions * (2 + 8) +
+         num_samples * (RICE_ESCAPE + 32 + 7) / 8;
+}
+
+
+/******************************
+ * writer
+ ******************************/
+struct block {
+  int16_t *samples;       /* HISTORY_SAMPLES zeros before */
+  uint32_t num_samples;
+  uint64_t first_sample;
+  uint8_t *output;
+  uint32_t output_size;   /* block header included */
+};
+
+struct batch {
+  compressed_writer_t *writer;
+  struct block *blocks;
+  uint32_t num_blocks;    /* the ones filled */
+  uint32_t fill_bytes;    /* of the current block */
+};
+
+typedef struct sddc_compressed_writer {
+  int fd;
+  double sample_rate;
+  uint32_t block_samples;
+  uint32_t batch_blocks;
+  uint32_t num_batches;
+  analyze_kernel_t analyze;     /* used by the worker threads */
+  uint8_t *input_arena;
+  uint8_t *output_arena;
+  struct block *blocks;
+  struct batch *batches;
+  spsc_ring_t *filled_batches;  /* producer -> writer */
+  spsc_ring_t *free_batches;    /* writer -> producer */
+  sem_t filled_batches_sem;
+  pthread_t writer_thread;
+  atomic_int running;
+  worker_pool_t *worker_pool;
+  /* producer side */
+  struct batch *current;
+  uint64_t next_sample;          /* the dropped ones included */
+  int dropping;
+  atomic_ullong dropped_bytes;
+  atomic_uint gaps;
+  /* writer side */
+  uint64_t file_offset;
+  struct index_entry *index;
+  uint64_t num_blocks;
+  uint64_t index_capacity;
+  atomic_uint blocks_written;
+  atomic_ullong input_bytes;
+  atomic_ullong output_bytes;
+  atomic_uint io_errors;
+} compressed_writer_t;
+
+
+/* internal functions */
+static void *compressed_writer_thread(void *arg);
+static void compressed_encode_block(void *context, uint32_t index);
+static int compressed_write_batch(compressed_writer_t *this,
+                                  struct batch *batch);
+static int write_all(int fd, const void *data, size_t length);
+static int read_all(int fd, void *data, size_t length, uint64_t offset);
+
+
+compressed_writer_t *compressed_writer_open(const struct sddc_compressed_writer_params *params)
+{
+  compressed_writer_t *ret_val = 0;
+
+  uint32_t block_samples = params->block_samples ? params->block_samples : DEFAULT_BLOCK_SAMPLES;
+  if (block_samples % PARTITION_SAMPLES != 0) {
+    fprintf(stderr, "ERROR - compressed block size must be a multiple of %u samples\n",
+            (unsigned) PARTITION_SAMPLES);
+    return ret_val;
+  }
+  uint32_t num_batches = params->num_batches ? params->num_batches : DEFAULT_NUM_BATCHES;
+
+  compressed_writer_t *this = (compressed_writer_t *) malloc(sizeof(compressed_writer_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->sample_rate = params->sample_rate;
+  this->block_samples = block_samples;
+  this->num_batches = num_batches;
+  this->analyze = select_analyze_kernel();
+  this->input_arena = 0;
+  this->output_arena = 0;
+  this->blocks = 0;
+  this->batches = 0;
+  this->filled_batches = 0;
+  this->free_batches = 0;
+  this->current = 0;
+  this->next_sample = 0;
+  this->dropping = 0;
+  atomic_init(&this->dropped_bytes, 0);
+  atomic_init(&this->gaps, 0);
+  this->file_offset = 0;
+  this->index = 0;
+  this->num_blocks = 0;
+  this->index_capacity = 0;
+  atomic_init(&this->blocks_written, 0);
+  atomic_init(&this->input_bytes, 0);
+  atomic_init(&this->output_bytes, 0);
+  atomic_init(&this->io_errors, 0);
+
+  /* one block per thread in each batch */
+  this->worker_pool = 0;
+  if (params->num_threads > 0) {
+    this->worker_pool = worker_pool_open(params->num_threads, 0);
+    if (this->worker_pool == 0) {
+      fprintf(stderr, "ERROR - worker_pool_open() failed\n");
+      goto FAIL1;
+    }
+  }
+  this->batch_blocks = this->worker_pool ? worker_pool_get_concurrency(this->worker_pool) : 1;
+
+  uint32_t total_blocks = num_batches * this->batch_blocks;
+  size_t input_size = (size_t) (HISTORY_SAMPLES + block_samples) * sizeof(int16_t);
+  size_t output_size = sizeof(struct block_header) + max_payload_size(block_samples);
+  output_size = (output_size + 63) & ~(size_t) 63;
+  this->input_arena = (uint8_t *) calloc(total_blocks, input_size);
+  this->output_arena = (uint8_t *) malloc(total_blocks * output_size);
+  this->blocks = (struct block *) malloc(total_blocks * sizeof(struct block));
+  this->batches = (struct batch *) malloc(num_batches * sizeof(struct batch));
+  this->filled_batches = spsc_ring_open(num_batches);
+  this->free_batches = spsc_ring_open(num_batches);
+  if (this->input_arena == 0 || this->output_arena == 0 ||
+      this->blocks == 0 || this->batches == 0 ||
+      this->filled_batches == 0 || this->free_batches == 0) {
+    fprintf(stderr, "ERROR - compressed writer buffer allocation failed\n");
+    goto FAIL2;
+  }
+  for (uint32_t i = 0; i < total_blocks; ++i) {
+    struct block *block = &this->blocks[i];
+    block->samples = (int16_t *) (this->input_arena + i * input_size) + HISTORY_SAMPLES;
+    block->num_samples = 0;
+    block->first_sample = 0;
+    block->output = this->output_arena + i * output_size;
+    block->output_size = 0;
+  }
+  for (uint32_t i = 0; i < num_batches; ++i) {
+    this->batches[i].writer = this;
+    this->batches[i].blocks = &this->blocks[i * this->batch_blocks];
+    this->batches[i].num_blocks = 0;
+    this->batches[i].fill_bytes = 0;
+    spsc_ring_push(this->free_batches, &this->batches[i]);
+  }
+
+  this->fd = open(params->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (this->fd < 0) {
+    fprintf(stderr, "ERROR - open(%s) failed: %s\n", params->path,
+            strerror(errno));
+    goto FAIL2;
+  }
+  struct file_header file_header;
+  memset(&file_header, 0, sizeof(file_header));
+  memcpy(file_header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+  file_header.version = FORMAT_VERSION;
+  file_header.block_samples = block_samples;
+  file_header.sample_rate = params->sample_rate;
+  file_header.partition_samples = PARTITION_SAMPLES;
+  if (write_all(this->fd, &file_header, sizeof(file_header)) < 0) {
+    fprintf(stderr, "ERROR - write() failed: %s\n", strerror(errno));
+    goto FAIL3;
+  }
+  this->file_offset = sizeof(file_header);
+
+  int ret = sem_init(&this->filled_batches_sem, 0, 0);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - sem_init() failed: %s\n", strerror(errno));
+    goto FAIL3;
+  }
+  atomic_init(&this->running, 1);
+  ret = pthread_create(&this->writer_thread, 0, compressed_writer_thread, this);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+    goto FAIL4;
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL4:
+  sem_destroy(&this->filled_batches_sem);
+FAIL3:
+  close(this->fd);
+FAIL2:
+  if (this->free_batches) {
+    spsc_ring_close(this->free_batches);
+  }
+  if (this->filled_batches) {
+    spsc_ring_close(this->filled_batches);
+  }
+  free(this->batches);
+  free(this->blocks);
+  free(this->output_arena);
+  free(this->input_arena);
+  if (this->worker_pool) {
+    worker_pool_close(this->worker_pool);
+  }
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void compressed_writer_close(compressed_writer_t *this)
+{
+  /* the producer is done - queue the last partial batch */
+  struct batch *batch = this->current;
+  if (batch && (batch->num_blocks > 0 || batch->fill_bytes >= sizeof(int16_t))) {
+    if (batch->fill_bytes >= sizeof(int16_t)) {
+      struct block *block = &batch->blocks[batch->num_blocks++];
+      block->num_samples = batch->fill_bytes / sizeof(int16_t);
+      block->first_sample = this->next_sample;
+      this->next_sample += block->num_samples;
+    }
+    spsc_ring_push(this->filled_batches, batch);
+    sem_post(&this->filled_batches_sem);
+  }
+  this->current = 0;
+
+  /* let the writer thread drain the queue and exit */
+  atomic_store(&this->running, 0);
+  sem_post(&this->filled_batches_sem);
+  pthread_join(this->writer_thread, 0);
+  sem_destroy(&this->filled_batches_sem);
+
+  /* the index goes at the end */
+  struct index_trailer trailer;
+  trailer.index_offset = this->file_offset;
+  trailer.num_blocks = this->num_blocks;
+  memcpy(trailer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  if (write_all(this->fd, this->index, this->num_blocks * sizeof(struct index_entry)) < 0 ||
+      write_all(this->fd, &trailer, sizeof(trailer)) < 0) {
+    fprintf(stderr, "ERROR - writing the compressed block index failed: %s\n",
+            strerror(errno));
+  }
+  close(this->fd);
+
+  if (this->worker_pool) {
+    worker_pool_close(this->worker_pool);
+  }
+  spsc_ring_close(this->free_batches);
+  spsc_ring_close(this->filled_batches);
+  free(this->index);
+  free(this->batches);
+  free(this->blocks);
+  free(this->output_arena);
+  free(this->input_arena);
+  free(this);
+  return;
+}
+
+
+int compressed_writer_write(compressed_writer_t *this, const uint8_t *data,
+                            uint32_t length)
+{
+  uint32_t block_bytes = this->block_samples * sizeof(int16_t);
+  while (length > 0) {
+    if (this->current == 0) {
+      this->current = (struct batch *) spsc_ring_pop(this->free_batches);
+      if (this->current == 0) {
+        /* compression or the disk are not keeping up; the next block
+           starts after the dropped samples, so the reader sees the gap */
+        unsigned long long v = atomic_load_explicit(&this->dropped_bytes, memory_order_relaxed);
+        atomic_store_explicit(&this->dropped_bytes, v + length, memory_order_relaxed);
+        this->next_sample += length / sizeof(int16_t);
+        if (!this->dropping) {
+          unsigned int gaps = atomic_load_explicit(&this->gaps, memory_order_relaxed);
+          atomic_store_explicit(&this->gaps, gaps + 1, memory_order_relaxed);
+          this->dropping = 1;
+        }
+        return -1;
+      }
+      this->dropping = 0;
+      this->current->num_blocks = 0;
+      this->current->fill_bytes = 0;
+    }
+    struct batch *batch = this->current;
+    struct block *block = &batch->blocks[batch->num_blocks];
+    uint32_t n = block_bytes - batch->fill_bytes;
+    n = n < length ? n : length;
+    memcpy((uint8_t *) block->samples + batch->fill_bytes, data, n);
+    batch->fill_bytes += n;
+    data += n;
+    length -= n;
+    if (batch->fill_bytes == block_bytes) {
+      block->num_samples = this->block_samples;
+      block->first_sample = this->next_sample;
+      this->next_sample += this->block_samples;
+      batch->fill_bytes = 0;
+      if (++batch->num_blocks == this->batch_blocks) {
+        spsc_ring_push(this->filled_batches, batch);
+        sem_post(&this->filled_batches_sem);
+        this->current = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+
+int compressed_writer_get_stats(compressed_writer_t *this,
+                                struct sddc_compressed_writer_stats *stats)
+{
+  stats->input_bytes = atomic_load(&this->input_bytes);
+  stats->output_bytes = atomic_load(&this->output_bytes);
+  stats->dropped_bytes = atomic_load(&this->dropped_bytes);
+  stats->gaps = atomic_load(&this->gaps);
+  stats->blocks = atomic_load(&this->blocks_written);
+  stats->max_queued_batches = spsc_ring_high_water_mark(this->filled_batches);
+  stats->io_errors = atomic_load(&this->io_errors);
+  return 0;
+}
+
+
+/* internal functions */
+static void *compressed_writer_thread(void *arg)
+{
+  compressed_writer_t *this = (compressed_writer_t *) arg;
+  while (1) {
+    if (sem_wait(&this->filled_batches_sem) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR - sem_wait() failed: %s\n", strerror(errno));
+      break;
+    }
+    struct batch *batch = (struct batch *) spsc_ring_pop(this->filled_batches);
+    if (batch == 0) {
+      /* woken up with an empty queue - time to go */
+      if (!atomic_load(&this->running)) {
+        break;
+      }
+      continue;
+    }
+    if (this->worker_pool) {
+      worker_pool_run(this->worker_pool, compressed_encode_block, batch,
+                      batch->num_blocks);
+    } else {
+      for (uint32_t i = 0; i < batch->num_blocks; ++i) {
+        compressed_encode_block(batch, i);
+      }
+    }
+    compressed_write_batch(this, batch);
+    spsc_ring_push(this->free_batches, batch);
+  }
+  return 0;
+}
+
+/* runs on the worker threads */
+static void compressed_encode_block(void *context, uint32_t index)
+{
+  struct batch *batch = (struct batch *) context;
+  struct block *block = &batch->blocks[index];
+  analyze_kernel_t analyze = batch->writer->analyze;
+
+  uint8_t *p = block->output + sizeof(struct block_header);
+  for (uint32_t i = 0; i < block->num_samples; i += PARTITION_SAMPLES) {
+    uint32_t n = block->num_samples - i;
+    n = n < PARTITION_SAMPLES ? n : PARTITION_SAMPLES;
+    p = encode_partition(block->samples + i, n, analyze, p);
+  }
+
+  struct block_header block_header;
+  memcpy(block_header.magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC));
+  block_header.payload_size = (uint32_t) (p - block->output - sizeof(struct block_header));
+  block_header.num_samples = block->num_samples;
+  block_header.reserved = 0;
+  block_header.first_sample = block->first_sample;
+  memcpy(block->output, &block_header, sizeof(block_header));
+  block->output_size = (uint32_t) (p - block->output);
+}
+
+static int compressed_write_batch(compressed_writer_t *this,
+                                  struct batch *batch)
+{
+  if (this->num_blocks + batch->num_blocks > this->index_capacity) {
+    uint64_t capacity = this->index_capacity ? 2 * this->index_capacity : 1024;
+    struct index_entry *index = (struct index_entry *) realloc(this->index,
+                                    capacity * sizeof(struct index_entry));
+    if (index == 0) {
+      fprintf(stderr, "ERROR - realloc() failed\n");
+      atomic_fetch_add(&this->io_errors, 1);
+      return -1;
+    }
+    this->index = index;
+    this->index_capacity = capacity;
+  }
+  for (uint32_t i = 0; i < batch->num_blocks; ++i) {
+    struct block *block = &batch->blocks[i];
+    if (write_all(this->fd, block->output, block->output_size) < 0) {
+      fprintf(stderr, "ERROR - write() failed: %s\n", strerror(errno));
+      atomic_fetch_add(&this->io_errors, 1);
+      return -1;
+    }
+    struct index_entry *entry = &this->index[this->num_blocks++];
+    entry->offset = this->file_offset;
+    entry->first_sample = block->first_sample;
+    entry->payload_size = block->output_size - sizeof(struct block_header);
+    entry->num_samples = block->num_samples;
+    this->file_offset += block->output_size;
+    atomic_fetch_add(&this->input_bytes, block->num_samples * sizeof(int16_t));
+    atomic_fetch_add(&this->output_bytes, block->output_size);
+    atomic_fetch_add(&this->blocks_written, 1);
+  }
+  return 0;
+}
+
+static int write_all(int fd, const void *data, size_t length)
+{
+  const uint8_t *p = (const uint8_t *) data;
+  while (length > 0) {
+    ssize_t ret = write(fd, p, length);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += ret;
+    length -= ret;
+  }
+  return 0;
+}
+
+/* returns the bytes read (less than length at the end of the file) */
+static int read_all(int fd, void *data, size_t length, uint64_t offset)
+{
+  uint8_t *p = (uint8_t *) data;
+  size_t done = 0;
+  while (done < length) {
+    ssize_t ret = pread(fd, p + done, length - done, offset + done);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (ret == 0) {
+      break;
+    }
+    done += ret;
+  }
+  return (int) done;
+}
+
+
+/******************************
+ * reader
+ ******************************/
+typedef struct sddc_compressed_reader {
+  int fd;
+  double sample_rate;
+  uint32_t block_samples;
+  struct index_entry *index;
+  uint64_t num_blocks;
+  uint64_t num_samples;         /* the gaps included */
+  uint64_t num_gaps;
+  uint64_t gap_samples;
+  uint8_t *payload;             /* READ_PADDING zeros after */
+  int16_t *samples;             /* HISTORY_SAMPLES zeros before */
+  int64_t current_block;        /* decoded into samples; -1 = none */
+  uint64_t position;            /* next sample to read */
+} compressed_reader_t;
+
+
+static int compressed_reader_load_index(compressed_reader_t *this,
+                                        uint64_t file_size);
+static int compressed_reader_scan_blocks(compressed_reader_t *this,
+                                         uint64_t file_size);
+static int compressed_reader_decode_block(compressed_reader_t *this,
+                                          uint64_t block);
+
+
+compressed_reader_t *compressed_reader_open(const char *path)
+{
+  compressed_reader_t *ret_val = 0;
+
+  compressed_reader_t *this = (compressed_reader_t *) malloc(sizeof(compressed_reader_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->index = 0;
+  this->num_blocks = 0;
+  this->num_samples = 0;
+  this->num_gaps = 0;
+  this->gap_samples = 0;
+  this->payload = 0;
+  this->samples = 0;
+  this->current_block = -1;
+  this->position = 0;
+
+  this->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (this->fd < 0) {
+    fprintf(stderr, "ERROR - open(%s) failed: %s\n", path, strerror(errno));
+    goto FAIL1;
+  }
+
+  struct file_header file_header;
+  if (read_all(this->fd, &file_header, sizeof(file_header), 0) != sizeof(file_header) ||
+      memcmp(file_header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 ||
+      file_header.version != FORMAT_VERSION ||
+      file_header.partition_samples != PARTITION_SAMPLES ||
+      file_header.block_samples == 0 ||
+      file_header.block_samples % PARTITION_SAMPLES != 0) {
+    fprintf(stderr, "ERROR - %s is not a compressed capture file\n", path);
+    goto FAIL2;
+  }
+  this->sample_rate = file_header.sample_rate;
+  this->block_samples = file_header.block_samples;
+
+  this->payload = (uint8_t *) calloc(1, max_payload_size(this->block_samples) + READ_PADDING);
+  int16_t *samples = (int16_t *) calloc(HISTORY_SAMPLES + this->block_samples, sizeof(int16_t));
+  if (this->payload == 0 || samples == 0) {
+    fprintf(stderr, "ERROR - compressed reader buffer allocation failed\n");
+    free(samples);
+    goto FAIL3;
+  }
+  this->samples = samples + HISTORY_SAMPLES;
+
+  off_t file_size = lseek(this->fd, 0, SEEK_END);
+  if (file_size < 0) {
+    fprintf(stderr, "ERROR - lseek() failed: %s\n", strerror(errno));
+    goto FAIL4;
+  }
+  if (compressed_reader_load_index(this, file_size) < 0) {
+    /* not closed properly - find the blocks that made it to disk */
+    fprintf(stderr, "WARNING - no block index in %s - scanning the blocks\n", path);
+    if (compressed_reader_scan_blocks(this, file_size) < 0) {
+      goto FAIL4;
+    }
+  }
+  if (this->num_blocks > 0) {
+    struct index_entry *last = &this->index[this->num_blocks - 1];
+    this->num_samples = last->first_sample + last->num_samples;
+  }
+  uint64_t first_sample = 0;
+  for (uint64_t i = 0; i < this->num_blocks; ++i) {
+    if (this->index[i].first_sample > first_sample) {
+      this->num_gaps++;
+      this->gap_samples += this->index[i].first_sample - first_sample;
+    }
+    first_sample = this->index[i].first_sample + this->index[i].num_samples;
+  }
+  if (this->num_gaps > 0) {
+    fprintf(stderr, "WARNING - %s has %llu gaps (%llu samples dropped) - read as zeros\n",
+            path, (unsigned long long) this->num_gaps,
+            (unsigned long long) this->gap_samples);
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL4:
+  free(this->index);
+  free(this->samples - HISTORY_SAMPLES);
+FAIL3:
+  free(this->payload);
+FAIL2:
+  close(this->fd);
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void compressed_reader_close(compressed_reader_t *this)
+{
+  close(this->fd);
+  free(this->index);
+  free(this->samples - HISTORY_SAMPLES);
+  free(this->payload);
+  free(this);
+  return;
+}
+
+
+double compressed_reader_get_sample_rate(compressed_reader_t *this)
+{
+  return this->sample_rate;
+}
+
+
+uint64_t compressed_reader_get_num_samples(compressed_reader_t *this)
+{
+  return this->num_samples;
+}
+
+
+int compressed_reader_seek(compressed_reader_t *this, uint64_t sample)
+{
+  if (sample > this->num_samples) {
+    fprintf(stderr, "ERROR - seek beyond the end of the capture\n");
+    return -1;
+  }
+  this->position = sample;
+  return 0;
+}
+
+
+int compressed_reader_read(compressed_reader_t *this, uint8_t *data,
+                           uint32_t length)
+{
+  int16_t *out = (int16_t *) data;
+  uint32_t wanted = length / sizeof(int16_t);
+  uint32_t done = 0;
+  while (done < wanted && this->position < this->num_samples) {
+    /* find the block with the current position */
+    uint64_t lo = 0;
+    uint64_t hi = this->num_blocks;
+    if (this->current_block >= 0) {
+      struct index_entry *entry = &this->index[this->current_block];
+      if (this->position >= entry->first_sample &&
+          this->position < entry->first_sample + entry->num_samples) {
+        lo = this->current_block;
+        hi = lo + 1;
+      }
+    }
+    while (hi - lo > 1) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (this->index[mid].first_sample <= this->position) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    struct index_entry *entry = &this->index[lo];
+    if (this->position < entry->first_sample ||
+        this->position >= entry->first_sample + entry->num_samples) {
+      /* in a gap: zeros up to the next block */
+      uint64_t next = this->position < entry->first_sample ?
+                      entry->first_sample : this->index[lo + 1].first_sample;
+      uint64_t n = next - this->position;
+      n = n < wanted - done ? n : wanted - done;
+      memset(out + done, 0, n * sizeof(int16_t));
+      done += n;
+      this->position += n;
+      continue;
+    }
+    if ((int64_t) lo != this->current_block &&
+        compressed_reader_decode_block(this, lo) < 0) {
+      return -1;
+    }
+    uint32_t offset = (uint32_t) (this->position - entry->first_sample);
+    uint32_t n = entry->num_samples - offset;
+    n = n < wanted - done ? n : wanted - done;
+    memcpy(out + done, this->samples + offset, n * sizeof(int16_t));
+    done += n;
+    this->position += n;
+  }
+  return (int) (done * sizeof(int16_t));
+}
+
+
+/* internal functions */
+/* first_sample is where the previous block ended; the blocks after the
+   samples dropped by the writer start later */
+static int compressed_reader_check_entry(compressed_reader_t *this,
+                                         const struct index_entry *entry,
+                                         uint64_t first_sample,
+                                         uint64_t file_size)
+{
+  return entry->first_sample >= first_sample &&
+         entry->num_samples > 0 &&
+         entry->num_samples <= this->block_samples &&
+         entry->payload_size <= max_payload_size(entry->num_samples) &&
+         entry->offset + sizeof(struct block_header) + entry->payload_size <= file_size;
+}
+
+static int compressed_reader_load_index(compressed_reader_t *this,
+                                        uint64_t file_size)
+{
+  struct index_trailer trailer;
+  if (file_size < sizeof(struct file_header) + sizeof(trailer) ||
+      read_all(this->fd, &trailer, sizeof(trailer), file_size - sizeof(trailer)) != sizeof(trailer) ||
+      memcmp(trailer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+      trailer.index_offset + trailer.num_blocks * sizeof(struct index_entry) + sizeof(trailer) != file_size) {
+    return -1;
+  }
+  size_t index_size = trailer.num_blocks * sizeof(struct index_entry);
+  this->index = (struct index_entry *) malloc(index_size > 0 ? index_size : 1);
+  if (this->index == 0 ||
+      read_all(this->fd, this->index, index_size, trailer.index_offset) != (int) index_size) {
+    free(this->index);
+    this->index = 0;
+    return -1;
+  }
+  uint64_t first_sample = 0;
+  for (uint64_t i = 0; i < trailer.num_blocks; ++i) {
+    if (!compressed_reader_check_entry(this, &this->index[i], first_sample,
+                                       trailer.index_offset)) {
+      free(this->index);
+      this->index = 0;
+      return -1;
+    }
+    first_sample = this->index[i].first_sample + this->index[i].num_samples;
+  }
+  this->num_blocks = trailer.num_blocks;
+  return 0;
+}
+
+static int compressed_reader_scan_blocks(compressed_reader_t *this,
+                                         uint64_t file_size)
+{
+  uint64_t capacity = 0;
+  uint64_t offset = sizeof(struct file_header);
+  uint64_t first_sample = 0;
+  this->num_blocks = 0;
+  while (1) {
+    struct block_header block_header;
+    if (read_all(this->fd, &block_header, sizeof(block_header), offset) != sizeof(block_header) ||
+        memcmp(block_header.magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC)) != 0) {
+      break;
+    }
+    struct index_entry entry = {
+      offset,
+      block_header.first_sample,
+      block_header.payload_size,
+      block_header.num_samples
+    };
+    if (!compressed_reader_check_entry(this, &entry, first_sample, file_size)) {
+      /* a partially written block */
+      break;
+    }
+    if (this->num_blocks == capacity) {
+      capacity = capacity ? 2 * capacity : 1024;
+      struct index_entry *index = (struct index_entry *) realloc(this->index,
+                                      capacity * sizeof(struct index_entry));
+      if (index == 0) {
+        fprintf(stderr, "ERROR - realloc() failed\n");
+        return -1;
+      }
+      this->index = index;
+    }
+    this->index[this->num_blocks++] = entry;
+    offset += sizeof(block_header) + block_header.payload_size;
+    first_sample = block_header.first_sample + block_header.num_samples;
+  }
+  return 0;
+}
+
+static int compressed_reader_decode_block(compressed_reader_t *this,
+                                          uint64_t block)
+{
+  struct index_entry *entry = &this->index[block];
+  this->current_block = -1;
+  if (read_all(this->fd, this->payload, entry->payload_size,
+               entry->offset + sizeof(struct block_header)) != (int) entry->payload_size) {
+    fprintf(stderr, "ERROR - reading compressed block %llu failed\n",
+            (unsigned long long) block);
+    return -1;
+  }
+  memset(this->payload + entry->payload_size, 0, READ_PADDING);
+
+  const uint8_t *p = this->payload;
+  const uint8_t *end = this->payload + entry->payload_size;
+  for (uint32_t i = 0; i < entry->num_samples; i += PARTITION_SAMPLES) {
+    uint32_t n = entry->num_samples - i;
+    n = n < PARTITION_SAMPLES ? n : PARTITION_SAMPLES;
+    p = decode_partition(p, end, this->samples + i, n);
+    if (p == 0) {
+      fprintf(stderr, "ERROR - compressed block %llu is corrupted\n",
+              (unsigned long long) block);
+      return -1;
+    }
+  }
+  this->current_block = block;
+  return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * compressed.h - lossless compressed capture files
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __COMPRESSED_H
+#define __COMPRESSED_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sddc_compressed_writer compressed_writer_t;
+typedef struct sddc_compressed_reader compressed_reader_t;
+
+compressed_writer_t *compressed_writer_open(const struct sddc_compressed_writer_params *params);
+
+/* compresses and writes the data still buffered, and the block index */
+void compressed_writer_close(compressed_writer_t *this);
+
+/* producer side - never blocks on compression or disk I/O */
+int compressed_writer_write(compressed_writer_t *this, const uint8_t *data,
+                            uint32_t length);
+
+int compressed_writer_get_stats(compressed_writer_t *this,
+                                struct sddc_compressed_writer_stats *stats);
+
+compressed_reader_t *compressed_reader_open(const char *path);
+
+void compressed_reader_close(compressed_reader_t *this);
+
+double compressed_reader_get_sample_rate(compressed_reader_t *this);
+
+uint64_t compressed_reader_get_num_samples(compressed_reader_t *this);
+
+int compressed_reader_seek(compressed_reader_t *this, uint64_t sample);
+
+int compressed_reader_read(compressed_reader_t *this, uint8_t *data,
+                           uint32_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __COMPRESSED_H */
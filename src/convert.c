@@ -0,0 +1,647 @@
+/*
+ * convert.c - sample conversion kernels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* ADC randomization (LTC2208 RAND pin): when the LSB of a sample is set,
+ * all the other bits have been XORed with it, i.e.:
+ *     if (sample & 1) sample ^= 0xfffe
+ * The vectorized versions below compute the same thing branchless:
+ *  - build a mask with all the bits set in the odd samples
+ *  - XOR each sample with (mask & 0xfffe)
+ *
+ * The output format conversions fold the same step in (with the XOR bits
+ * set to 0 when the ADC randomization is off), so that the raw samples
+ * are read only once:
+ *  - float32: sample * scale
+ *  - int8: (sample + r) >> shift with saturation, where r is either half
+ *    an output LSB (rounding) or uniform dither in [0, 2^shift) from a
+ *    16 bit LCG per lane
+ *  - packed 12 bit: sample >> 4, two samples in three bytes (little
+ *    endian, the first sample in the low 12 bits)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONVERT_NEON
+#endif
+
+#include "convert.h"
+
+
+struct convert_kernels {
+  const char *isa;
+  void (*derandomize)(uint16_t *samples, size_t n);
+  void (*to_float32)(const uint16_t *in, float *out, size_t n,
+                     uint16_t xor_bits, float scale);
+  void (*to_int8)(const uint16_t *in, int8_t *out, size_t n,
+                  uint16_t xor_bits, unsigned int shift, uint16_t *dither);
+  void (*to_packed12)(const uint16_t *in, uint8_t *out, size_t n,
+                      uint16_t xor_bits);
+};
+
+#define DITHER_MULTIPLIER 25173
+#define DITHER_INCREMENT 13849
+#define DITHER_LANE_STEP 0x9e37         /* start of each lane's sequence */
+
+
+/* scalar versions */
+static inline int16_t sample_value(uint16_t x, uint16_t xor_bits)
+{
+  return (int16_t) (x ^ (uint16_t) (-(x & 1) & xor_bits));
+}
+
+static void derandomize_scalar(uint16_t *samples, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    samples[i] ^= (uint16_t) (-(samples[i] & 1) & 0xfffe);
+  }
+}
+
+static void to_float32_scalar(const uint16_t *in, float *out, size_t n,
+                              uint16_t xor_bits, float scale)
+{
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = sample_value(in[i], xor_bits) * scale;
+  }
+}
+
+static void to_int8_scalar(const uint16_t *in, int8_t *out, size_t n,
+                           uint16_t xor_bits, unsigned int shift,
+                           uint16_t *dither)
+{
+  int32_t r = shift > 0 ? 1 << (shift - 1) : 0;
+  uint16_t state = dither ? *dither : 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (dither && shift > 0) {
+      state = (uint16_t) (state * DITHER_MULTIPLIER + DITHER_INCREMENT);
+      r = state >> (16 - shift);
+    }
+    /* the vector versions add with 16 bit saturation */
+    int32_t y = sample_value(in[i], xor_bits) + r;
+    y = (y > INT16_MAX ? INT16_MAX : y) >> shift;
+    out[i] = (int8_t) (y > 127 ? 127 : y < -128 ? -128 : y);
+  }
+  if (dither) {
+    *dither = state;
+  }
+}
+
+static void to_packed12_scalar(const uint16_t *in, uint8_t *out, size_t n,
+                               uint16_t xor_bits)
+{
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    uint16_t s0 = (uint16_t) (sample_value(in[i], xor_bits) >> 4) & 0x0fff;
+    uint16_t s1 = (uint16_t) (sample_value(in[i + 1], xor_bits) >> 4) & 0x0fff;
+    out[0] = (uint8_t) s0;
+    out[1] = (uint8_t) ((s0 >> 8) | (s1 << 4));
+    out[2] = (uint8_t) (s1 >> 4);
+    out += 3;
+  }
+  if (i < n) {
+    uint16_t s0 = (uint16_t) (sample_value(in[i], xor_bits) >> 4) & 0x0fff;
+    out[0] = (uint8_t) s0;
+    out[1] = (uint8_t) (s0 >> 8);
+  }
+}
+
+static const struct convert_kernels scalar_kernels = {
+  "scalar",
+  derandomize_scalar,
+  to_float32_scalar,
+  to_int8_scalar,
+  to_packed12_scalar
+};
+
+
+#ifdef CONVERT_X86
+/* SSE2 versions */
+__attribute__((target("sse2")))
+static void derandomize_sse2(uint16_t *samples, size_t n)
+{
+  const __m128i xor_bits = _mm_set1_epi16((short) 0xfffe);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i *p = (__m128i *) (samples + i);
+    __m128i x0 = _mm_loadu_si128(p);
+    __m128i x1 = _mm_loadu_si128(p + 1);
+    __m128i m0 = _mm_srai_epi16(_mm_slli_epi16(x0, 15), 15);
+    __m128i m1 = _mm_srai_epi16(_mm_slli_epi16(x1, 15), 15);
+    _mm_storeu_si128(p, _mm_xor_si128(x0, _mm_and_si128(m0, xor_bits)));
+    _mm_storeu_si128(p + 1, _mm_xor_si128(x1, _mm_and_si128(m1, xor_bits)));
+  }
+  derandomize_scalar(samples + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sample_value_sse2(__m128i x, __m128i xor_bits)
+{
+  __m128i m = _mm_srai_epi16(_mm_slli_epi16(x, 15), 15);
+  return _mm_xor_si128(x, _mm_and_si128(m, xor_bits));
+}
+
+__attribute__((target("sse2")))
+static void to_float32_sse2(const uint16_t *in, float *out, size_t n,
+                            uint16_t xor_bits, float scale)
+{
+  const __m128i xb = _mm_set1_epi16((short) xor_bits);
+  const __m128 k = _mm_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = sample_value_sse2(_mm_loadu_si128((const __m128i *) (in + i)), xb);
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), k));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), k));
+  }
+  to_float32_scalar(in + i, out + i, n - i, xor_bits, scale);
+}
+
+__attribute__((target("sse2")))
+static void to_int8_sse2(const uint16_t *in, int8_t *out, size_t n,
+                         uint16_t xor_bits, unsigned int shift,
+                         uint16_t *dither)
+{
+  const __m128i xb = _mm_set1_epi16((short) xor_bits);
+  const __m128i count = _mm_cvtsi32_si128((int) shift);
+  const __m128i dither_count = _mm_cvtsi32_si128(16 - (int) shift);
+  const __m128i mul = _mm_set1_epi16((short) DITHER_MULTIPLIER);
+  const __m128i inc = _mm_set1_epi16((short) DITHER_INCREMENT);
+  int use_dither = dither && shift > 0;
+  __m128i r = _mm_set1_epi16((short) (shift > 0 ? 1 << (shift - 1) : 0));
+  __m128i s0 = _mm_setzero_si128();
+  __m128i s1 = _mm_setzero_si128();
+  if (use_dither) {
+    uint16_t state[16];
+    for (int k = 0; k < 16; ++k) {
+      state[k] = (uint16_t) (*dither + k * DITHER_LANE_STEP);
+    }
+    s0 = _mm_loadu_si128((const __m128i *) state);
+    s1 = _mm_loadu_si128((const __m128i *) (state + 8));
+  }
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x0 = sample_value_sse2(_mm_loadu_si128((const __m128i *) (in + i)), xb);
+    __m128i x1 = sample_value_sse2(_mm_loadu_si128((const __m128i *) (in + i + 8)), xb);
+    __m128i r0 = r;
+    __m128i r1 = r;
+    if (use_dither) {
+      s0 = _mm_add_epi16(_mm_mullo_epi16(s0, mul), inc);
+      s1 = _mm_add_epi16(_mm_mullo_epi16(s1, mul), inc);
+      r0 = _mm_srl_epi16(s0, dither_count);
+      r1 = _mm_srl_epi16(s1, dither_count);
+    }
+    x0 = _mm_sra_epi16(_mm_adds_epi16(x0, r0), count);
+    x1 = _mm_sra_epi16(_mm_adds_epi16(x1, r1), count);
+    _mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi16(x0, x1));
+  }
+  if (use_dither) {
+    *dither = (uint16_t) _mm_cvtsi128_si32(s0);
+  }
+  to_int8_scalar(in + i, out + i, n - i, xor_bits, shift, dither);
+}
+
+static const struct convert_kernels sse2_kernels = {
+  "sse2",
+  derandomize_sse2,
+  to_float32_sse2,
+  to_int8_sse2,
+  to_packed12_scalar    /* the byte shuffle needs SSSE3 */
+};
+
+
+/* AVX2 versions */
+__attribute__((target("avx2")))
+static void derandomize_avx2(uint16_t *samples, size_t n)
+{
+  const __m256i xor_bits = _mm256_set1_epi16((short) 0xfffe);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i *p = (__m256i *) (samples + i);
+    __m256i x0 = _mm256_loadu_si256(p);
+    __m256i x1 = _mm256_loadu_si256(p + 1);
+    __m256i m0 = _mm256_srai_epi16(_mm256_slli_epi16(x0, 15), 15);
+    __m256i m1 = _mm256_srai_epi16(_mm256_slli_epi16(x1, 15), 15);
+    _mm256_storeu_si256(p, _mm256_xor_si256(x0, _mm256_and_si256(m0, xor_bits)));
+    _mm256_storeu_si256(p + 1, _mm256_xor_si256(x1, _mm256_and_si256(m1, xor_bits)));
+  }
+  derandomize_scalar(samples + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i sample_value_avx2(__m256i x, __m256i xor_bits)
+{
+  __m256i m = _mm256_srai_epi16(_mm256_slli_epi16(x, 15), 15);
+  return _mm256_xor_si256(x, _mm256_and_si256(m, xor_bits));
+}
+
+__attribute__((target("avx2")))
+static void to_float32_avx2(const uint16_t *in, float *out, size_t n,
+                            uint16_t xor_bits, float scale)
+{
+  const __m256i xb = _mm256_set1_epi16((short) xor_bits);
+  const __m256 k = _mm256_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i x = sample_value_avx2(_mm256_loadu_si256((const __m256i *) (in + i)), xb);
+    __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+    __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), k));
+    _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), k));
+  }
+  to_float32_scalar(in + i, out + i, n - i, xor_bits, scale);
+}
+
+__attribute__((target("avx2")))
+static void to_int8_avx2(const uint16_t *in, int8_t *out, size_t n,
+                         uint16_t xor_bits, unsigned int shift,
+                         uint16_t *dither)
+{
+  const __m256i xb = _mm256_set1_epi16((short) xor_bits);
+  const __m128i count = _mm_cvtsi32_si128((int) shift);
+  const __m128i dither_count = _mm_cvtsi32_si128(16 - (int) shift);
+  const __m256i mul = _mm256_set1_epi16((short) DITHER_MULTIPLIER);
+  const __m256i inc = _mm256_set1_epi16((short) DITHER_INCREMENT);
+  int use_dither = dither && shift > 0;
+  __m256i r = _mm256_set1_epi16((short) (shift > 0 ? 1 << (shift - 1) : 0));
+  __m256i s0 = _mm256_setzero_si256();
+  __m256i s1 = _mm256_setzero_si256();
+  if (use_dither) {
+    uint16_t state[32];
+    for (int k = 0; k < 32; ++k) {
+      state[k] = (uint16_t) (*dither + k * DITHER_LANE_STEP);
+    }
+    s0 = _mm256_loadu_si256((const __m256i *) state);
+    s1 = _mm256_loadu_si256((const __m256i *) (state + 16));
+  }
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x0 = sample_value_avx2(_mm256_loadu_si256((const __m256i *) (in + i)), xb);
+    __m256i x1 = sample_value_avx2(_mm256_loadu_si256((const __m256i *) (in + i + 16)), xb);
+    __m256i r0 = r;
+    __m256i r1 = r;
+    if (use_dither) {
+      s0 = _mm256_add_epi16(_mm256_mullo_epi16(s0, mul), inc);
+      s1 = _mm256_add_epi16(_mm256_mullo_epi16(s1, mul), inc);
+      r0 = _mm256_srl_epi16(s0, dither_count);
+      r1 = _mm256_srl_epi16(s1, dither_count);
+    }
+    x0 = _mm256_sra_epi16(_mm256_adds_epi16(x0, r0), count);
+    x1 = _mm256_sra_epi16(_mm256_adds_epi16(x1, r1), count);
+    /* packs works within 128 bit lanes */
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(x0, x1), 0xd8);
+    _mm256_storeu_si256((__m256i *) (out + i), packed);
+  }
+  if (use_dither) {
+    *dither = (uint16_t) _mm256_extract_epi16(s0, 0);
+  }
+  to_int8_scalar(in + i, out + i, n - i, xor_bits, shift, dither);
+}
+
+/* each 128 bit lane packs 8 samples into 12 bytes; the 16 byte stores
+   overlap, and the 4 bytes past the last group are rewritten by the next
+   iteration or the scalar tail */
+__attribute__((target("avx2")))
+static void to_packed12_avx2(const uint16_t *in, uint8_t *out, size_t n,
+                             uint16_t xor_bits)
+{
+  const __m256i xb = _mm256_set1_epi16((short) xor_bits);
+  const __m256i mask12 = _mm256_set1_epi16(0x0fff);
+  const __m256i low = _mm256_set1_epi32(0x00000fff);
+  const __m256i high = _mm256_set1_epi32(0x00fff000);
+  const __m256i bytes = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 16) {
+    __m256i x = sample_value_avx2(_mm256_loadu_si256((const __m256i *) (in + i)), xb);
+    __m256i s = _mm256_and_si256(_mm256_srai_epi16(x, 4), mask12);
+    /* s0 | s1 << 12 in each 32 bit lane */
+    __m256i v = _mm256_or_si256(_mm256_and_si256(s, low),
+                                _mm256_and_si256(_mm256_srli_epi32(s, 4), high));
+    v = _mm256_shuffle_epi8(v, bytes);
+    _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *) (out + 12), _mm256_extracti128_si256(v, 1));
+    out += 24;
+  }
+  to_packed12_scalar(in + i, out, n - i, xor_bits);
+}
+
+static const struct convert_kernels avx2_kernels = {
+  "avx2",
+  derandomize_avx2,
+  to_float32_avx2,
+  to_int8_avx2,
+  to_packed12_avx2
+};
+
+
+/* AVX-512 versions (AVX512BW is needed for 16 bit lanes) */
+__attribute__((target("avx512f,avx512bw")))
+static void derandomize_avx512(uint16_t *samples, size_t n)
+{
+  const __m512i one = _mm512_set1_epi16(1);
+  const __m512i xor_bits = _mm512_set1_epi16((short) 0xfffe);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i *p = (__m512i *) (samples + i);
+    __m512i x0 = _mm512_loadu_si512(p);
+    __m512i x1 = _mm512_loadu_si512(p + 1);
+    __mmask32 m0 = _mm512_test_epi16_mask(x0, one);
+    __mmask32 m1 = _mm512_test_epi16_mask(x1, one);
+    _mm512_storeu_si512(p, _mm512_xor_si512(x0, _mm512_maskz_mov_epi16(m0, xor_bits)));
+    _mm512_storeu_si512(p + 1, _mm512_xor_si512(x1, _mm512_maskz_mov_epi16(m1, xor_bits)));
+  }
+  derandomize_scalar(samples + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i sample_value_avx512(__m512i x, __m512i xor_bits)
+{
+  __mmask32 m = _mm512_test_epi16_mask(x, _mm512_set1_epi16(1));
+  return _mm512_xor_si512(x, _mm512_maskz_mov_epi16(m, xor_bits));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void to_float32_avx512(const uint16_t *in, float *out, size_t n,
+                              uint16_t xor_bits, float scale)
+{
+  const __m512i xb = _mm512_set1_epi16((short) xor_bits);
+  const __m512 k = _mm512_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i x = sample_value_avx512(_mm512_loadu_si512(in + i), xb);
+    __m512i lo = _mm512_cvtepi16_epi32(_mm512_castsi512_si256(x));
+    __m512i hi = _mm512_cvtepi16_epi32(_mm512_extracti64x4_epi64(x, 1));
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(lo), k));
+    _mm512_storeu_ps(out + i + 16, _mm512_mul_ps(_mm512_cvtepi32_ps(hi), k));
+  }
+  to_float32_scalar(in + i, out + i, n - i, xor_bits, scale);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void to_int8_avx512(const uint16_t *in, int8_t *out, size_t n,
+                           uint16_t xor_bits, unsigned int shift,
+                           uint16_t *dither)
+{
+  const __m512i xb = _mm512_set1_epi16((short) xor_bits);
+  const __m128i count = _mm_cvtsi32_si128((int) shift);
+  const __m128i dither_count = _mm_cvtsi32_si128(16 - (int) shift);
+  const __m512i mul = _mm512_set1_epi16((short) DITHER_MULTIPLIER);
+  const __m512i inc = _mm512_set1_epi16((short) DITHER_INCREMENT);
+  int use_dither = dither && shift > 0;
+  __m512i r = _mm512_set1_epi16((short) (shift > 0 ? 1 << (shift - 1) : 0));
+  __m512i s0 = _mm512_setzero_si512();
+  if (use_dither) {
+    uint16_t state[32];
+    for (int k = 0; k < 32; ++k) {
+      state[k] = (uint16_t) (*dither + k * DITHER_LANE_STEP);
+    }
+    s0 = _mm512_loadu_si512(state);
+  }
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i x = sample_value_avx512(_mm512_loadu_si512(in + i), xb);
+    __m512i r0 = r;
+    if (use_dither) {
+      s0 = _mm512_add_epi16(_mm512_mullo_epi16(s0, mul), inc);
+      r0 = _mm512_srl_epi16(s0, dither_count);
+    }
+    x = _mm512_sra_epi16(_mm512_adds_epi16(x, r0), count);
+    _mm256_storeu_si256((__m256i *) (out + i), _mm512_cvtsepi16_epi8(x));
+  }
+  if (use_dither) {
+    *dither = (uint16_t) _mm_extract_epi16(_mm512_castsi512_si128(s0), 0);
+  }
+  to_int8_scalar(in + i, out + i, n - i, xor_bits, shift, dither);
+}
+
+/* AVX512BW implies AVX2, which does the byte shuffle just as well */
+static const struct convert_kernels avx512_kernels = {
+  "avx512",
+  derandomize_avx512,
+  to_float32_avx512,
+  to_int8_avx512,
+  to_packed12_avx2
+};
+#endif /* CONVERT_X86 */
+
+
+#ifdef CONVERT_NEON
+/* NEON versions */
+static void derandomize_neon(uint16_t *samples, size_t n)
+{
+  const uint16x8_t one = vdupq_n_u16(1);
+  const uint16x8_t xor_bits = vdupq_n_u16(0xfffe);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint16x8_t x0 = vld1q_u16(samples + i);
+    uint16x8_t x1 = vld1q_u16(samples + i + 8);
+    uint16x8_t m0 = vtstq_u16(x0, one);
+    uint16x8_t m1 = vtstq_u16(x1, one);
+    vst1q_u16(samples + i, veorq_u16(x0, vandq_u16(m0, xor_bits)));
+    vst1q_u16(samples + i + 8, veorq_u16(x1, vandq_u16(m1, xor_bits)));
+  }
+  derandomize_scalar(samples + i, n - i);
+}
+
+static inline int16x8_t sample_value_neon(uint16x8_t x, uint16x8_t xor_bits)
+{
+  uint16x8_t m = vtstq_u16(x, vdupq_n_u16(1));
+  return vreinterpretq_s16_u16(veorq_u16(x, vandq_u16(m, xor_bits)));
+}
+
+static void to_float32_neon(const uint16_t *in, float *out, size_t n,
+                            uint16_t xor_bits, float scale)
+{
+  const uint16x8_t xb = vdupq_n_u16(xor_bits);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t x = sample_value_neon(vld1q_u16(in + i), xb);
+    int32x4_t lo = vmovl_s16(vget_low_s16(x));
+    int32x4_t hi = vmovl_s16(vget_high_s16(x));
+    vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(lo), scale));
+    vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(hi), scale));
+  }
+  to_float32_scalar(in + i, out + i, n - i, xor_bits, scale);
+}
+
+static void to_int8_neon(const uint16_t *in, int8_t *out, size_t n,
+                         uint16_t xor_bits, unsigned int shift,
+                         uint16_t *dither)
+{
+  const uint16x8_t xb = vdupq_n_u16(xor_bits);
+  const int16x8_t count = vdupq_n_s16((int16_t) -shift);
+  const int16x8_t dither_count = vdupq_n_s16((int16_t) (shift - 16));
+  const uint16x8_t mul = vdupq_n_u16(DITHER_MULTIPLIER);
+  const uint16x8_t inc = vdupq_n_u16(DITHER_INCREMENT);
+  int use_dither = dither && shift > 0;
+  int16x8_t r = vdupq_n_s16((int16_t) (shift > 0 ? 1 << (shift - 1) : 0));
+  uint16x8_t s0 = vdupq_n_u16(0);
+  uint16x8_t s1 = vdupq_n_u16(0);
+  if (use_dither) {
+    uint16_t state[16];
+    for (int k = 0; k < 16; ++k) {
+      state[k] = (uint16_t) (*dither + k * DITHER_LANE_STEP);
+    }
+    s0 = vld1q_u16(state);
+    s1 = vld1q_u16(state + 8);
+  }
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    int16x8_t x0 = sample_value_neon(vld1q_u16(in + i), xb);
+    int16x8_t x1 = sample_value_neon(vld1q_u16(in + i + 8), xb);
+    int16x8_t r0 = r;
+    int16x8_t r1 = r;
+    if (use_dither) {
+      s0 = vmlaq_u16(inc, s0, mul);
+      s1 = vmlaq_u16(inc, s1, mul);
+      r0 = vreinterpretq_s16_u16(vshlq_u16(s0, dither_count));
+      r1 = vreinterpretq_s16_u16(vshlq_u16(s1, dither_count));
+    }
+    x0 = vshlq_s16(vqaddq_s16(x0, r0), count);
+    x1 = vshlq_s16(vqaddq_s16(x1, r1), count);
+    vst1q_s8(out + i, vcombine_s8(vqmovn_s16(x0), vqmovn_s16(x1)));
+  }
+  if (use_dither) {
+    *dither = vgetq_lane_u16(s0, 0);
+  }
+  to_int8_scalar(in + i, out + i, n - i, xor_bits, shift, dither);
+}
+
+static void to_packed12_neon(const uint16_t *in, uint8_t *out, size_t n,
+                             uint16_t xor_bits)
+{
+  const uint16x8_t xb = vdupq_n_u16(xor_bits);
+  const uint16x8_t mask12 = vdupq_n_u16(0x0fff);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint16x8x2_t x = vld2q_u16(in + i);
+    uint16x8_t s0 = vandq_u16(vreinterpretq_u16_s16(vshrq_n_s16(sample_value_neon(x.val[0], xb), 4)), mask12);
+    uint16x8_t s1 = vandq_u16(vreinterpretq_u16_s16(vshrq_n_s16(sample_value_neon(x.val[1], xb), 4)), mask12);
+    uint8x8x3_t b;
+    b.val[0] = vmovn_u16(s0);
+    b.val[1] = vmovn_u16(vorrq_u16(vshrq_n_u16(s0, 8), vshlq_n_u16(s1, 4)));
+    b.val[2] = vmovn_u16(vshrq_n_u16(s1, 4));
+    vst3_u8(out, b);
+    out += 24;
+  }
+  to_packed12_scalar(in + i, out, n - i, xor_bits);
+}
+
+static const struct convert_kernels neon_kernels = {
+  "neon",
+  derandomize_neon,
+  to_float32_neon,
+  to_int8_neon,
+  to_packed12_neon
+};
+#endif /* CONVERT_NEON */
+
+
+/* all the kernels that can run on this CPU, best first */
+static const struct convert_kernels *available_kernels(int index)
+{
+  int count = 0;
+#ifdef CONVERT_X86
+  if (__builtin_cpu_supports("avx512bw") && count++ == index) {
+    return &avx512_kernels;
+  }
+  if (__builtin_cpu_supports("avx2") && count++ == index) {
+    return &avx2_kernels;
+  }
+  if (__builtin_cpu_supports("sse2") && count++ == index) {
+    return &sse2_kernels;
+  }
+#endif
+#ifdef CONVERT_NEON
+  if (count++ == index) {
+    return &neon_kernels;
+  }
+#endif
+  if (count++ == index) {
+    return &scalar_kernels;
+  }
+  return 0;
+}
+
+static const struct convert_kernels *kernels = &scalar_kernels;
+
+__attribute__((constructor))
+static void convert_init(void)
+{
+#ifdef CONVERT_X86
+  __builtin_cpu_init();
+#endif
+  kernels = available_kernels(0);
+
+  const char *isa = getenv("SDDC_SIMD");
+  if (isa && convert_select_isa(isa) < 0) {
+    fprintf(stderr, "WARNING - SDDC_SIMD=%s not supported on this CPU - using %s\n",
+            isa, kernels->isa);
+  }
+}
+
+
+const char *convert_get_isa(void)
+{
+  return kernels->isa;
+}
+
+int convert_select_isa(const char *isa)
+{
+  const struct convert_kernels *k;
+  for (int i = 0; (k = available_kernels(i)) != 0; ++i) {
+    if (strcmp(k->isa, isa) == 0) {
+      kernels = k;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void convert_derandomize(uint16_t *samples, size_t n)
+{
+  kernels->derandomize(samples, n);
+}
+
+void convert_to_float32(const uint16_t *in, float *out, size_t n,
+                        int derandomize, float scale)
+{
+  kernels->to_float32(in, out, n, derandomize ? 0xfffe : 0, scale);
+}
+
+void convert_to_int8(const uint16_t *in, int8_t *out, size_t n,
+                     int derandomize, unsigned int shift, uint16_t *dither)
+{
+  kernels->to_int8(in, out, n, derandomize ? 0xfffe : 0, shift, dither);
+}
+
+void convert_to_packed12(const uint16_t *in, uint8_t *out, size_t n,
+                         int derandomize)
+{
+  kernels->to_packed12(in, out, n, derandomize ? 0xfffe : 0);
+}
@@ -0,0 +1,65 @@
+/*
+ * convert.h - sample conversion kernels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CONVERT_H
+#define __CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the kernels are selected at load time based on the CPU features; the
+   SDDC_SIMD environment variable (scalar, sse2, avx2, avx512, neon) can be
+   used to force a specific instruction set */
+const char *convert_get_isa(void);
+
+int convert_select_isa(const char *isa);
+
+/* remove ADC randomization in place */
+void convert_derandomize(uint16_t *samples, size_t n);
+
+/* output format conversions of raw ADC samples, with the ADC
+   randomization removed in the same pass when derandomize is set */
+void convert_to_float32(const uint16_t *in, float *out, size_t n,
+                        int derandomize, float scale);
+
+/* (sample + r) >> shift (0..15), saturated; r rounds to nearest, or is
+   uniform dither in [0, 2^shift) when dither points to the generator
+   state (kept between calls) */
+void convert_to_int8(const uint16_t *in, int8_t *out, size_t n,
+                     int derandomize, unsigned int shift, uint16_t *dither);
+
+/* the 12 most significant bits, two samples in three bytes; an odd last
+   sample takes two bytes */
+#define CONVERT_PACKED12_SIZE(n) (((n) * 3 + 1) / 2)
+
+void convert_to_packed12(const uint16_t *in, uint8_t *out, size_t n,
+                         int derandomize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CONVERT_H */
@@ -0,0 +1,471 @@
+/*
+ * ddc.c - digital downconverter (NCO + halfband decimators)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The real ADC samples are mixed down by the NCO and then decimated by a
+ * cascade of halfband filters, one per factor of two. The input is
+ * processed in chunks of CHUNK_SIZE samples, so the whole pipeline runs
+ * out of a scratch buffer that stays in cache.
+ *
+ * NCO: a 32 bit phase accumulator advances once every NCO_BLOCK samples.
+ * The phasor at the start of a block comes from two 1024 entry tables
+ * (cos(a + b) = cos(a)cos(b) - sin(a)sin(b)), i.e. 20 bits of phase; the
+ * phasors within a block come from a table of the first NCO_BLOCK
+ * multiples of the phase increment. This way the inner loop is just two
+ * complex multiplications per sample with no lookups, and the frequency
+ * is exact to fs/2^32 with no drift.
+ *
+ * Halfband filters: all the odd taps but the center one are zero, so the
+ * input is split into even and odd samples and each output sample takes
+ * HALFBAND_K+1 multiplications per I/Q channel.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ddc.h"
+
+
+typedef struct ddc ddc_t;
+
+#define NCO_BLOCK 64
+#define NCO_TABLE_BITS 10
+#define NCO_TABLE_SIZE (1 << NCO_TABLE_BITS)
+#define HALFBAND_K 12               /* 4 * HALFBAND_K + 3 = 51 taps */
+#define HALFBAND_KAISER_BETA 7.0
+#define CHUNK_SIZE 4096
+
+/* histories of the even and odd samples */
+#define EVEN_HISTORY (2 * HALFBAND_K + 1)
+#define ODD_HISTORY (HALFBAND_K + 1)
+
+struct halfband_stage {
+  float *even_i;
+  float *even_q;
+  float *odd_i;
+  float *odd_q;
+};
+
+typedef struct ddc {
+  enum SDDCSampleFormat format;
+  uint32_t decimation;
+  int num_stages;
+  uint32_t chunk_size;
+  /* NCO */
+  uint32_t phase;
+  uint32_t phase_increment;
+  float coarse_cos[NCO_TABLE_SIZE];
+  float coarse_sin[NCO_TABLE_SIZE];
+  float fine_cos[NCO_TABLE_SIZE];
+  float fine_sin[NCO_TABLE_SIZE];
+  float block_cos[NCO_BLOCK];
+  float block_sin[NCO_BLOCK];
+  /* halfband filters - non zero taps except the center one (0.5) */
+  float taps[HALFBAND_K + 1];
+  struct halfband_stage *stages;
+  float *scratch_i;
+  float *scratch_q;
+  /* input samples short of a whole output sample, for the next call */
+  int16_t *carry;
+  uint32_t carry_length;
+} ddc_t;
+
+
+/* internal functions */
+static void ddc_design_halfband(float *taps);
+static double bessel_i0(double x);
+static void ddc_run(ddc_t *this, const int16_t *input, uint32_t num_samples,
+                    uint8_t *out);
+static void ddc_mix(ddc_t *this, const int16_t *input, uint32_t n,
+                    float *restrict out_i, float *restrict out_q);
+static void ddc_decimate(ddc_t *this, struct halfband_stage *stage,
+                         float *data_i, float *data_q, uint32_t n);
+static void ddc_write_output(ddc_t *this, const float *restrict data_i,
+                             const float *restrict data_q, uint32_t n,
+                             void *output);
+
+
+ddc_t *ddc_open(double sample_rate, double center_frequency,
+                uint32_t decimation, enum SDDCSampleFormat format)
+{
+  ddc_t *ret_val = 0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - ddc_open() failed - invalid sample rate: %f\n", sample_rate);
+    return ret_val;
+  }
+  if (decimation == 0 || decimation > DDC_MAX_DECIMATION ||
+      (decimation & (decimation - 1)) != 0) {
+    fprintf(stderr, "ERROR - ddc_open() failed - decimation must be a power of two <= %d: %u\n",
+            DDC_MAX_DECIMATION, decimation);
+    return ret_val;
+  }
+  if (format != SAMPLE_FORMAT_COMPLEX_INT16 &&
+      format != SAMPLE_FORMAT_COMPLEX_FLOAT32) {
+    fprintf(stderr, "ERROR - ddc_open() failed - invalid output format: %d\n", format);
+    return ret_val;
+  }
+
+  ddc_t *this = (ddc_t *) malloc(sizeof(ddc_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->format = format;
+  this->decimation = decimation;
+  this->num_stages = 0;
+  while ((1U << this->num_stages) < decimation) {
+    this->num_stages++;
+  }
+  this->chunk_size = CHUNK_SIZE > decimation ? CHUNK_SIZE : decimation;
+
+  /* NCO tables */
+  this->phase = 0;
+  double increment = fmod(center_frequency / sample_rate, 1.0);
+  if (increment < 0) {
+    increment += 1.0;
+  }
+  this->phase_increment = (uint32_t) llround(increment * 4294967296.0);
+  for (int i = 0; i < NCO_TABLE_SIZE; ++i) {
+    double coarse = 2 * M_PI * i / NCO_TABLE_SIZE;
+    double fine = coarse / NCO_TABLE_SIZE;
+    this->coarse_cos[i] = cos(coarse);
+    this->coarse_sin[i] = sin(coarse);
+    this->fine_cos[i] = cos(fine);
+    this->fine_sin[i] = sin(fine);
+  }
+  for (int i = 0; i < NCO_BLOCK; ++i) {
+    uint32_t phase = this->phase_increment * (uint32_t) i;
+    double angle = 2 * M_PI * phase / 4294967296.0;
+    this->block_cos[i] = cos(angle);
+    this->block_sin[i] = sin(angle);
+  }
+
+  ddc_design_halfband(this->taps);
+
+  /* scratch buffers and filter histories */
+  this->scratch_i = (float *) malloc(this->chunk_size * sizeof(float));
+  this->scratch_q = (float *) malloc(this->chunk_size * sizeof(float));
+  this->carry = (int16_t *) malloc(decimation * sizeof(int16_t));
+  this->carry_length = 0;
+  this->stages = (struct halfband_stage *) calloc(this->num_stages ? this->num_stages : 1,
+                                                  sizeof(struct halfband_stage));
+  if (this->scratch_i == 0 || this->scratch_q == 0 || this->carry == 0 ||
+      this->stages == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL1;
+  }
+  for (int i = 0; i < this->num_stages; ++i) {
+    struct halfband_stage *stage = &this->stages[i];
+    uint32_t half = (this->chunk_size >> i) / 2;
+    stage->even_i = (float *) calloc(EVEN_HISTORY + half, sizeof(float));
+    stage->even_q = (float *) calloc(EVEN_HISTORY + half, sizeof(float));
+    stage->odd_i = (float *) calloc(ODD_HISTORY + half, sizeof(float));
+    stage->odd_q = (float *) calloc(ODD_HISTORY + half, sizeof(float));
+    if (stage->even_i == 0 || stage->even_q == 0 || stage->odd_i == 0 ||
+        stage->odd_q == 0) {
+      fprintf(stderr, "ERROR - calloc() failed\n");
+      goto FAIL1;
+    }
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL1:
+  ddc_close(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void ddc_close(ddc_t *this)
+{
+  if (this->stages) {
+    for (int i = 0; i < this->num_stages; ++i) {
+      free(this->stages[i].even_i);
+      free(this->stages[i].even_q);
+      free(this->stages[i].odd_i);
+      free(this->stages[i].odd_q);
+    }
+    free(this->stages);
+  }
+  free(this->scratch_i);
+  free(this->scratch_q);
+  free(this->carry);
+  free(this);
+  return;
+}
+
+
+uint32_t ddc_get_sample_size(enum SDDCSampleFormat format)
+{
+  switch (format) {
+    case SAMPLE_FORMAT_REAL_INT16:
+      return sizeof(int16_t);
+    case SAMPLE_FORMAT_COMPLEX_INT16:
+      return 2 * sizeof(int16_t);
+    case SAMPLE_FORMAT_COMPLEX_FLOAT32:
+      return 2 * sizeof(float);
+    case SAMPLE_FORMAT_REAL_FLOAT32:
+      return sizeof(float);
+    case SAMPLE_FORMAT_REAL_INT8:
+      return sizeof(int8_t);
+    case SAMPLE_FORMAT_REAL_PACKED12:
+      /* not a whole number of bytes */
+      return 0;
+  }
+  return 0;
+}
+
+
+void ddc_reset(ddc_t *this, uint64_t sample_index)
+{
+  this->phase = this->phase_increment * (uint32_t) sample_index;
+  for (int i = 0; i < this->num_stages; ++i) {
+    uint32_t half = (this->chunk_size >> i) / 2;
+    struct halfband_stage *stage = &this->stages[i];
+    memset(stage->even_i, 0, (EVEN_HISTORY + half) * sizeof(float));
+    memset(stage->even_q, 0, (EVEN_HISTORY + half) * sizeof(float));
+    memset(stage->odd_i, 0, (ODD_HISTORY + half) * sizeof(float));
+    memset(stage->odd_q, 0, (ODD_HISTORY + half) * sizeof(float));
+  }
+  this->carry_length = 0;
+  return;
+}
+
+
+uint32_t ddc_get_preroll(ddc_t *this)
+{
+  /* stage s remembers EVEN_HISTORY + ODD_HISTORY of its inputs, i.e.
+     that many times 2^s real samples; round up to the alignment */
+  uint32_t preroll = 0;
+  for (int i = 0; i < this->num_stages; ++i) {
+    preroll += (EVEN_HISTORY + ODD_HISTORY) * 2 << i;
+  }
+  uint32_t alignment = ddc_get_alignment(this);
+  return (preroll + alignment - 1) / alignment * alignment;
+}
+
+
+uint32_t ddc_get_alignment(ddc_t *this)
+{
+  /* whole NCO blocks and whole output samples */
+  return this->decimation > NCO_BLOCK ? this->decimation : NCO_BLOCK;
+}
+
+
+uint32_t ddc_process(ddc_t *this, const int16_t *input, uint32_t num_samples,
+                     void *output)
+{
+  uint8_t *out = (uint8_t *) output;
+  uint32_t num_outputs = 0;
+
+  /* complete the output sample left over by the previous call first */
+  if (this->carry_length > 0) {
+    uint32_t n = this->decimation - this->carry_length;
+    n = n < num_samples ? n : num_samples;
+    memcpy(this->carry + this->carry_length, input, n * sizeof(int16_t));
+    this->carry_length += n;
+    input += n;
+    num_samples -= n;
+    if (this->carry_length < this->decimation) {
+      return 0;
+    }
+    ddc_run(this, this->carry, this->decimation, out);
+    out += ddc_get_sample_size(this->format);
+    num_outputs = 1;
+    this->carry_length = 0;
+  }
+
+  uint32_t remainder = num_samples % this->decimation;
+  num_samples -= remainder;
+  ddc_run(this, input, num_samples, out);
+  memcpy(this->carry, input + num_samples, remainder * sizeof(int16_t));
+  this->carry_length = remainder;
+  return num_outputs + num_samples / this->decimation;
+}
+
+
+/* internal functions */
+static void ddc_run(ddc_t *this, const int16_t *input, uint32_t num_samples,
+                    uint8_t *out)
+{
+  /* num_samples is a multiple of the decimation */
+  uint32_t out_sample_size = ddc_get_sample_size(this->format);
+
+  for (uint32_t offset = 0; offset < num_samples; offset += this->chunk_size) {
+    uint32_t n = num_samples - offset;
+    n = n < this->chunk_size ? n : this->chunk_size;
+    ddc_mix(this, input + offset, n, this->scratch_i, this->scratch_q);
+    for (int i = 0; i < this->num_stages; ++i) {
+      ddc_decimate(this, &this->stages[i], this->scratch_i, this->scratch_q,
+                   n >> i);
+    }
+    n >>= this->num_stages;
+    ddc_write_output(this, this->scratch_i, this->scratch_q, n, out);
+    out += n * out_sample_size;
+  }
+  return;
+}
+
+
+static void ddc_design_halfband(float *taps)
+{
+  /* Kaiser windowed sinc; the taps at offsets +-(2k+1) are taps[k] */
+  const int half_length = 2 * HALFBAND_K + 1;
+  double sum = 0;
+  double h[HALFBAND_K + 1];
+  for (int k = 0; k <= HALFBAND_K; ++k) {
+    int n = 2 * k + 1;
+    double x = (double) n / (half_length + 1);
+    double window = bessel_i0(HALFBAND_KAISER_BETA * sqrt(1 - x * x)) /
+                    bessel_i0(HALFBAND_KAISER_BETA);
+    h[k] = sin(M_PI * n / 2) / (M_PI * n) * window;
+    sum += 2 * h[k];
+  }
+  /* unity gain at DC: center tap (0.5) + all the others = 1 */
+  for (int k = 0; k <= HALFBAND_K; ++k) {
+    taps[k] = h[k] * 0.5 / sum;
+  }
+  return;
+}
+
+
+static double bessel_i0(double x)
+{
+  double sum = 1;
+  double term = 1;
+  for (int k = 1; k < 50; ++k) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < 1e-12 * sum) {
+      break;
+    }
+  }
+  return sum;
+}
+
+
+static void ddc_mix(ddc_t *this, const int16_t *input, uint32_t n,
+                    float *restrict out_i, float *restrict out_q)
+{
+  const float scale = 1.0f / 32768.0f;
+  const float *restrict block_cos = this->block_cos;
+  const float *restrict block_sin = this->block_sin;
+
+  for (uint32_t offset = 0; offset < n; offset += NCO_BLOCK) {
+    uint32_t length = n - offset < NCO_BLOCK ? n - offset : NCO_BLOCK;
+    /* phasor at the start of the block */
+    uint32_t coarse = this->phase >> (32 - NCO_TABLE_BITS);
+    uint32_t fine = (this->phase >> (32 - 2 * NCO_TABLE_BITS)) & (NCO_TABLE_SIZE - 1);
+    float c = this->coarse_cos[coarse] * this->fine_cos[fine] -
+              this->coarse_sin[coarse] * this->fine_sin[fine];
+    float s = this->coarse_sin[coarse] * this->fine_cos[fine] +
+              this->coarse_cos[coarse] * this->fine_sin[fine];
+    c *= scale;
+    s *= scale;
+
+    /* multiply by exp(-j * phase) */
+    const int16_t *restrict x = input + offset;
+    float *restrict y_i = out_i + offset;
+    float *restrict y_q = out_q + offset;
+    for (uint32_t i = 0; i < length; ++i) {
+      float nco_cos = c * block_cos[i] - s * block_sin[i];
+      float nco_sin = s * block_cos[i] + c * block_sin[i];
+      y_i[i] = x[i] * nco_cos;
+      y_q[i] = -x[i] * nco_sin;
+    }
+    this->phase += this->phase_increment * length;
+  }
+  return;
+}
+
+
+static void ddc_decimate(ddc_t *this, struct halfband_stage *stage,
+                         float *data_i, float *data_q, uint32_t n)
+{
+  uint32_t m = n / 2;
+  float *restrict even_i = stage->even_i;
+  float *restrict even_q = stage->even_q;
+  float *restrict odd_i = stage->odd_i;
+  float *restrict odd_q = stage->odd_q;
+
+  /* split into even and odd samples after the histories */
+  for (uint32_t j = 0; j < m; ++j) {
+    even_i[EVEN_HISTORY + j] = data_i[2 * j];
+    even_q[EVEN_HISTORY + j] = data_q[2 * j];
+    odd_i[ODD_HISTORY + j] = data_i[2 * j + 1];
+    odd_q[ODD_HISTORY + j] = data_q[2 * j + 1];
+  }
+
+  /* the output overwrites the input (which has been copied above) */
+  float *restrict y_i = data_i;
+  float *restrict y_q = data_q;
+  for (uint32_t j = 0; j < m; ++j) {
+    y_i[j] = 0.5f * odd_i[j];
+    y_q[j] = 0.5f * odd_q[j];
+  }
+  for (int k = 0; k <= HALFBAND_K; ++k) {
+    const float h = this->taps[k];
+    const float *restrict early_i = even_i + HALFBAND_K - k;
+    const float *restrict early_q = even_q + HALFBAND_K - k;
+    const float *restrict late_i = even_i + HALFBAND_K + 1 + k;
+    const float *restrict late_q = even_q + HALFBAND_K + 1 + k;
+    for (uint32_t j = 0; j < m; ++j) {
+      y_i[j] += h * (early_i[j] + late_i[j]);
+      y_q[j] += h * (early_q[j] + late_q[j]);
+    }
+  }
+
+  /* keep the histories for the next chunk */
+  memmove(even_i, even_i + m, EVEN_HISTORY * sizeof(float));
+  memmove(even_q, even_q + m, EVEN_HISTORY * sizeof(float));
+  memmove(odd_i, odd_i + m, ODD_HISTORY * sizeof(float));
+  memmove(odd_q, odd_q + m, ODD_HISTORY * sizeof(float));
+  return;
+}
+
+
+static void ddc_write_output(ddc_t *this, const float *restrict data_i,
+                             const float *restrict data_q, uint32_t n,
+                             void *output)
+{
+  if (this->format == SAMPLE_FORMAT_COMPLEX_FLOAT32) {
+    float *restrict out = (float *) output;
+    for (uint32_t j = 0; j < n; ++j) {
+      out[2 * j] = data_i[j];
+      out[2 * j + 1] = data_q[j];
+    }
+  } else {
+    int16_t *restrict out = (int16_t *) output;
+    for (uint32_t j = 0; j < n; ++j) {
+      float i = data_i[j] * 32768.0f;
+      float q = data_q[j] * 32768.0f;
+      i = i > 32767.0f ? 32767.0f : (i < -32768.0f ? -32768.0f : i);
+      q = q > 32767.0f ? 32767.0f : (q < -32768.0f ? -32768.0f : q);
+      out[2 * j] = (int16_t) i;
+      out[2 * j + 1] = (int16_t) q;
+    }
+  }
+  return;
+}
@@ -0,0 +1,68 @@
+/*
+ * ddc.h - digital downconverter (NCO + halfband decimators)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DDC_H
+#define __DDC_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ddc ddc_t;
+
+/* decimation must be a power of two between 1 and DDC_MAX_DECIMATION */
+#define DDC_MAX_DECIMATION 4096
+
+ddc_t *ddc_open(double sample_rate, double center_frequency,
+                uint32_t decimation, enum SDDCSampleFormat format);
+
+void ddc_close(ddc_t *this);
+
+uint32_t ddc_get_sample_size(enum SDDCSampleFormat format);
+
+/* clear the filter histories and move the NCO to the phase it has at
+   sample_index (counted from the first sample processed after open);
+   sample_index must be a multiple of ddc_get_alignment() */
+void ddc_reset(ddc_t *this, uint64_t sample_index);
+
+/* the outputs depend only on the last ddc_get_preroll() input samples:
+   after a reset and that many samples, the filter state is bit for bit
+   the same as if all the samples since the start had been processed */
+uint32_t ddc_get_preroll(ddc_t *this);
+
+uint32_t ddc_get_alignment(ddc_t *this);
+
+/* process num_samples real samples; the samples short of a whole output
+   sample are kept for the next call (until ddc_reset()). Returns the
+   number of output samples, at most (num_samples / decimation + 1) */
+uint32_t ddc_process(ddc_t *this, const int16_t *input, uint32_t num_samples,
+                     void *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DDC_H */
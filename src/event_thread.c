@@ -0,0 +1,156 @@
+/*
+ * event_thread.c - event handling thread
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "event_thread.h"
+
+
+typedef struct event_thread event_thread_t;
+
+/* internal functions */
+static void *event_thread_run(void *arg);
+
+
+typedef struct event_thread {
+  struct sddc_event_thread_params params;
+  event_thread_handler_t handler;
+  void *context;
+  pthread_t thread;
+  atomic_int running;
+  atomic_int failed;            /* the handler failed, and the loop ended */
+} event_thread_t;
+
+
+event_thread_t *event_thread_start(const struct sddc_event_thread_params *params,
+                                   event_thread_handler_t handler,
+                                   void *context)
+{
+  event_thread_t *ret_val = 0;
+
+  if (params->lock_memory) {
+    /* lock the frames and the stacks in RAM to avoid page faults in the
+       completion path */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      fprintf(stderr, "WARNING - mlockall() failed: %s\n", strerror(errno));
+    }
+  }
+
+  event_thread_t *this = (event_thread_t *) malloc(sizeof(event_thread_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return ret_val;
+  }
+  this->params = *params;
+  this->handler = handler;
+  this->context = context;
+  atomic_init(&this->running, 1);
+  atomic_init(&this->failed, 0);
+
+  int ret = pthread_create(&this->thread, 0, event_thread_run, this);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+    free(this);
+    return ret_val;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void event_thread_stop(event_thread_t *this)
+{
+  atomic_store(&this->running, 0);
+  pthread_join(this->thread, 0);
+  free(this);
+  return;
+}
+
+
+int event_thread_failed(event_thread_t *this)
+{
+  return atomic_load(&this->failed);
+}
+
+
+int event_thread_set_scheduling(uint64_t cpu_affinity_mask,
+                                int realtime_priority)
+{
+  int ret_val = 0;
+
+  if (cpu_affinity_mask) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (int cpu = 0; cpu < 64; ++cpu) {
+      if (cpu_affinity_mask & ((uint64_t) 1 << cpu)) {
+        CPU_SET(cpu, &cpuset);
+      }
+    }
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (ret != 0) {
+      fprintf(stderr, "WARNING - pthread_setaffinity_np() failed: %s\n", strerror(ret));
+      ret_val = -1;
+    }
+  }
+
+  if (realtime_priority > 0) {
+    struct sched_param param = { .sched_priority = realtime_priority };
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0) {
+      /* usually EPERM - needs CAP_SYS_NICE or an rtprio limit */
+      fprintf(stderr, "WARNING - pthread_setschedparam(SCHED_FIFO, %d) failed: %s\n",
+              realtime_priority, strerror(ret));
+      ret_val = -1;
+    }
+  }
+
+  return ret_val;
+}
+
+
+/* internal functions */
+static void *event_thread_run(void *arg)
+{
+  event_thread_t *this = (event_thread_t *) arg;
+
+  event_thread_set_scheduling(this->params.cpu_affinity_mask,
+                              this->params.realtime_priority);
+
+  while (atomic_load_explicit(&this->running, memory_order_relaxed)) {
+    int ret = this->handler(this->context);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - event handler failed: %d - no more events are handled\n", ret);
+      atomic_store(&this->failed, 1);
+      break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * event_thread.h - event handling thread
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __EVENT_THREAD_H
+#define __EVENT_THREAD_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct event_thread event_thread_t;
+
+/* the handler is called in a loop until the thread is stopped; it should
+   not block for more than a fraction of a second */
+typedef int (*event_thread_handler_t)(void *context);
+
+event_thread_t *event_thread_start(const struct sddc_event_thread_params *params,
+                                   event_thread_handler_t handler,
+                                   void *context);
+
+void event_thread_stop(event_thread_t *this);
+
+/* the handler failed, and the thread no longer calls it */
+int event_thread_failed(event_thread_t *this);
+
+/* apply CPU affinity and SCHED_FIFO priority to the calling thread */
+int event_thread_set_scheduling(uint64_t cpu_affinity_mask,
+                                int realtime_priority);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __EVENT_THREAD_H */
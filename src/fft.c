@@ -0,0 +1,333 @@
+/*
+ * fft.c - single precision FFTs (built-in radix-2 or FFTW)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* When the library is built with FFTW (HAVE_FFTW3F) the plans are just
+ * wrappers around FFTW plans; otherwise a simple iterative radix-2 FFT is
+ * used, and the real FFT of size n is computed with a complex FFT of size
+ * n/2 on the even/odd samples followed by the usual split step.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_FFTW3F
+#include <fftw3.h>
+#include <pthread.h>
+#endif
+
+#include "fft.h"
+
+
+typedef struct fft fft_t;
+
+enum FFTType {
+  FFT_TYPE_R2C,
+  FFT_TYPE_C2C
+};
+
+typedef struct fft {
+  enum FFTType type;
+  uint32_t size;
+#ifdef HAVE_FFTW3F
+  fftwf_plan plan;
+#else
+  /* complex FFT of size n (c2c) or n/2 (r2c) */
+  uint32_t complex_size;
+  uint32_t *bit_reverse;
+  float complex *twiddles;
+  /* r2c only */
+  float complex *split_twiddles;
+  float complex *work;
+#endif
+} fft_t;
+
+#ifdef HAVE_FFTW3F
+/* only fftwf_execute*() is thread safe: the plans of all the channelizers,
+   spectra and sweeps in the process are made and destroyed one at a time */
+static pthread_mutex_t planner_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/* internal functions */
+static int is_power_of_two(uint32_t n);
+static inline float complex cmul(float complex a, float complex b);
+#ifndef HAVE_FFTW3F
+static int fft_init_complex(fft_t *this, uint32_t size,
+                            enum FFTDirection direction);
+static void fft_complex(fft_t *this, const float complex *in,
+                        float complex *out);
+#endif
+
+
+fft_t *fft_open_r2c(uint32_t size)
+{
+  fft_t *ret_val = 0;
+
+  if (size < 4 || !is_power_of_two(size)) {
+    fprintf(stderr, "ERROR - fft_open_r2c() failed - size must be a power of two: %u\n", size);
+    return ret_val;
+  }
+
+  fft_t *this = (fft_t *) calloc(1, sizeof(fft_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL0;
+  }
+  this->type = FFT_TYPE_R2C;
+  this->size = size;
+
+#ifdef HAVE_FFTW3F
+  float *in = fftwf_alloc_real(size);
+  fftwf_complex *out = fftwf_alloc_complex(size / 2 + 1);
+  if (in && out) {
+    pthread_mutex_lock(&planner_mutex);
+    this->plan = fftwf_plan_dft_r2c_1d(size, in, out,
+                                       FFTW_ESTIMATE | FFTW_UNALIGNED);
+    pthread_mutex_unlock(&planner_mutex);
+  }
+  fftwf_free(in);
+  fftwf_free(out);
+  if (this->plan == 0) {
+    fprintf(stderr, "ERROR - fftwf_plan_dft_r2c_1d() failed\n");
+    goto FAIL1;
+  }
+#else
+  if (fft_init_complex(this, size / 2, FFT_FORWARD) < 0) {
+    goto FAIL1;
+  }
+  this->split_twiddles = (float complex *) malloc((size / 2) * sizeof(float complex));
+  this->work = (float complex *) malloc((size / 2) * sizeof(float complex));
+  if (this->split_twiddles == 0 || this->work == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL1;
+  }
+  for (uint32_t k = 0; k < size / 2; ++k) {
+    this->split_twiddles[k] = cexp(-2 * M_PI * I * k / size);
+  }
+#endif
+
+  ret_val = this;
+  return ret_val;
+
+FAIL1:
+  fft_close(this);
+FAIL0:
+  return ret_val;
+}
+
+
+fft_t *fft_open_c2c(uint32_t size, enum FFTDirection direction)
+{
+  fft_t *ret_val = 0;
+
+  if (size < 2 || !is_power_of_two(size)) {
+    fprintf(stderr, "ERROR - fft_open_c2c() failed - size must be a power of two: %u\n", size);
+    return ret_val;
+  }
+
+  fft_t *this = (fft_t *) calloc(1, sizeof(fft_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL0;
+  }
+  this->type = FFT_TYPE_C2C;
+  this->size = size;
+
+#ifdef HAVE_FFTW3F
+  fftwf_complex *in = fftwf_alloc_complex(size);
+  fftwf_complex *out = fftwf_alloc_complex(size);
+  if (in && out) {
+    pthread_mutex_lock(&planner_mutex);
+    this->plan = fftwf_plan_dft_1d(size, in, out,
+                                   direction == FFT_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD,
+                                   FFTW_ESTIMATE | FFTW_UNALIGNED);
+    pthread_mutex_unlock(&planner_mutex);
+  }
+  fftwf_free(in);
+  fftwf_free(out);
+  if (this->plan == 0) {
+    fprintf(stderr, "ERROR - fftwf_plan_dft_1d() failed\n");
+    goto FAIL1;
+  }
+#else
+  if (fft_init_complex(this, size, direction) < 0) {
+    goto FAIL1;
+  }
+#endif
+
+  ret_val = this;
+  return ret_val;
+
+FAIL1:
+  fft_close(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void fft_close(fft_t *this)
+{
+#ifdef HAVE_FFTW3F
+  if (this->plan) {
+    pthread_mutex_lock(&planner_mutex);
+    fftwf_destroy_plan(this->plan);
+    pthread_mutex_unlock(&planner_mutex);
+  }
+#else
+  free(this->bit_reverse);
+  free(this->twiddles);
+  free(this->split_twiddles);
+  free(this->work);
+#endif
+  free(this);
+  return;
+}
+
+
+void fft_execute_r2c(fft_t *this, const float *in, float complex *out)
+{
+#ifdef HAVE_FFTW3F
+  fftwf_execute_dft_r2c(this->plan, (float *) in, (fftwf_complex *) out);
+#else
+  uint32_t n = this->complex_size;
+  /* z[k] = in[2k] + j in[2k+1] */
+  fft_complex(this, (const float complex *) in, this->work);
+  const float complex *z = this->work;
+  out[0] = crealf(z[0]) + cimagf(z[0]);
+  out[n] = crealf(z[0]) - cimagf(z[0]);
+  for (uint32_t k = 1; k < n; ++k) {
+    float complex a = z[k];
+    float complex b = conjf(z[n - k]);
+    float complex even = 0.5f * (a + b);
+    float complex odd = CMPLXF(0.5f * cimagf(a - b), -0.5f * crealf(a - b));
+    out[k] = even + cmul(this->split_twiddles[k], odd);
+  }
+#endif
+  return;
+}
+
+
+void fft_execute_c2c(fft_t *this, const float complex *in,
+                     float complex *out)
+{
+#ifdef HAVE_FFTW3F
+  fftwf_execute_dft(this->plan, (fftwf_complex *) in, (fftwf_complex *) out);
+#else
+  fft_complex(this, in, out);
+#endif
+  return;
+}
+
+
+const char *fft_get_backend(void)
+{
+#ifdef HAVE_FFTW3F
+  return "fftw3f";
+#else
+  return "builtin";
+#endif
+}
+
+
+/* internal functions */
+static int is_power_of_two(uint32_t n)
+{
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+
+/* plain complex multiplication (no C99 Annex G inf/nan handling) */
+static inline float complex cmul(float complex a, float complex b)
+{
+  float re = crealf(a) * crealf(b) - cimagf(a) * cimagf(b);
+  float im = crealf(a) * cimagf(b) + cimagf(a) * crealf(b);
+  return CMPLXF(re, im);
+}
+
+
+#ifndef HAVE_FFTW3F
+static int fft_init_complex(fft_t *this, uint32_t size,
+                            enum FFTDirection direction)
+{
+  this->complex_size = size;
+  this->bit_reverse = (uint32_t *) malloc(size * sizeof(uint32_t));
+  this->twiddles = (float complex *) malloc((size / 2 + 1) * sizeof(float complex));
+  if (this->bit_reverse == 0 || this->twiddles == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  int bits = 0;
+  while ((1U << bits) < size) {
+    bits++;
+  }
+  for (uint32_t i = 0; i < size; ++i) {
+    uint32_t r = 0;
+    for (int b = 0; b < bits; ++b) {
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    this->bit_reverse[i] = r;
+  }
+  for (uint32_t k = 0; k <= size / 2; ++k) {
+    this->twiddles[k] = cexp(direction * 2 * M_PI * I * k / size);
+  }
+  return 0;
+}
+
+
+static void fft_complex(fft_t *this, const float complex *in,
+                        float complex *out)
+{
+  uint32_t n = this->complex_size;
+
+  /* bit reversal permutation */
+  if (in == out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      uint32_t r = this->bit_reverse[i];
+      if (r > i) {
+        float complex t = out[i];
+        out[i] = out[r];
+        out[r] = t;
+      }
+    }
+  } else {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[this->bit_reverse[i]] = in[i];
+    }
+  }
+
+  /* butterflies */
+  for (uint32_t half = 1; half < n; half <<= 1) {
+    uint32_t stride = n / (2 * half);
+    for (uint32_t start = 0; start < n; start += 2 * half) {
+      for (uint32_t k = 0; k < half; ++k) {
+        float complex w = this->twiddles[k * stride];
+        float complex a = out[start + k];
+        float complex b = cmul(out[start + k + half], w);
+        out[start + k] = a + b;
+        out[start + k + half] = a - b;
+      }
+    }
+  }
+  return;
+}
+#endif
@@ -0,0 +1,61 @@
+/*
+ * fft.h - single precision FFTs (built-in radix-2 or FFTW)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FFT_H
+#define __FFT_H
+
+#include <complex.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fft fft_t;
+
+enum FFTDirection {
+  FFT_FORWARD = -1,     /* exp(-j...) */
+  FFT_BACKWARD = 1      /* exp(+j...) - not normalized */
+};
+
+/* the sizes must be powers of two; a plan must not be executed by more
+   than one thread at a time */
+fft_t *fft_open_r2c(uint32_t size);
+
+fft_t *fft_open_c2c(uint32_t size, enum FFTDirection direction);
+
+void fft_close(fft_t *this);
+
+/* size real samples in, size/2+1 complex bins out */
+void fft_execute_r2c(fft_t *this, const float *in, float complex *out);
+
+void fft_execute_c2c(fft_t *this, const float complex *in,
+                     float complex *out);
+
+/* "builtin" or "fftw3f" */
+const char *fft_get_backend(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FFT_H */
@@ -20,42 +20,126 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+/* Threading: an sddc_t (and an sddc_session_t) is opened, configured,
+ * started, stopped, and closed from one thread at a time - the functions
+ * that fail with "device is streaming" are configuration. Everything else
+ * can be called from any thread, also while streaming and while another
+ * thread is in sddc_handle_events():
+ * - sddc_get_status() is lock free: a device being started still reads
+ *   READY, and one being stopped still reads STREAMING; a second
+ *   sddc_start_streaming() or sddc_stop_streaming() racing with the first
+ *   one fails instead of running twice
+ * - the radio settings go to the device in the order they are called;
+ *   when two threads change the same register at the same time, the
+ *   device ends up with the value written last, which is also what the
+ *   getters read back
+ * - sddc_set_rf_mode() fails while the AGC or the sweep is running, since
+ *   they step the attenuator or the tuner of the mode they started in
+ * - a control batch belongs to the thread that began it; the settings
+ *   from the other threads are sent right away
+ * - the stats are counters updated with atomic operations
+ * The callbacks are called from the thread handling the events (or from
+ * the consumer thread in ring mode), and must not configure, start, stop,
+ * or close the device they are called for.
+ */
+
 #include <math.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "libsddc.h"
 #include "logging.h"
 #include "usb_device.h"
 #include "streaming.h"
+#include "ddc.h"
+#include "channelizer.h"
+#include "sweep.h"
+#include "agc.h"
+#include "psd.h"
+#include "trace.h"
+#include "worker_pool.h"
+#include "event_thread.h"
+#include "recorder.h"
+#include "trigger.h"
+#include "sync_buffer.h"
+#include "publisher.h"
+#include "compressed.h"
 
 typedef struct sddc sddc_t;
 
 
 /* internal functions */
+static sddc_t *sddc_open_usb_device(usb_device_t *usb_device);
 static int sddc_set_vhf_gpios(sddc_t *this);
+static int sddc_start_streaming_prepare(sddc_t *this);
+static int sddc_stop_streaming_transfers(sddc_t *this);
+static int sddc_stop_streaming_finish(sddc_t *this);
+static int sddc_event_thread_handler(void *context);
+static int sddc_session_event_thread_handler(void *context);
+static void sddc_control_batch_callback(int status, void *context);
+static int sddc_sweep_retune(void *context, double frequency);
+static int sddc_open_sync_streaming(sddc_t *this);
+static int sddc_is_streaming(sddc_t *this);
+static int sddc_set_status(sddc_t *this, int from, int to);
+static void sddc_sync_callback(uint32_t data_size, uint8_t *data,
+                               const struct sddc_frame_info *info,
+                               void *context);
+static void sddc_sweep_tuned(int status, void *context);
+static int sddc_agc_start(sddc_t *this);
+static int sddc_agc_set_attenuation(void *context, uint32_t index);
+static void sddc_agc_applied(int status, void *context);
 
 
 typedef struct sddc {
-  enum SDDCStatus status;
+  atomic_int status;            /* enum SDDCStatus, or STARTING/STOPPING */
   enum SDDCHWModel model;
   uint16_t firmware;
-  enum RFMode rf_mode;
+  _Atomic enum RFMode rf_mode;          /* also read by the AGC */
   usb_device_t *usb_device;
   streaming_t *streaming;
   int has_clock_source;
   int has_vhf_tuner;
   int hf_attenuator_levels;
-  double hf_attenuation;
+  _Atomic double hf_attenuation;        /* also set by the AGC */
   double sample_rate;
-  double tuner_frequency;
+  _Atomic double tuner_frequency;       /* also set by the sweep */
   double tuner_attenuation;
-  double tuner_clock;
-  double freq_corr_ppm;
+  _Atomic double tuner_clock;
+  _Atomic double freq_corr_ppm;
   double frequency_range[2];
+  uint32_t num_spare_frames;
+  int use_ring;
+  enum SDDCBufferStrategy buffer_strategy;
+  int numa_node;
+  double ddc_center_frequency;
+  uint32_t ddc_decimation;
+  enum SDDCSampleFormat ddc_format;
+  struct sddc_output_format output_format;
+  channelizer_t *channelizer;
+  sweep_t *sweep;
+  psd_t *psd;
+  agc_t *agc;
+  atomic_uint agc_pending_index;        /* the change in flight */
+  worker_pool_t *worker_pool;
+  /* sync mode: this->streaming is ours, and feeds the sync buffer */
+  uint32_t sync_buffer_size;
+  sync_buffer_t *sync_buffer;
+  struct sddc_event_thread_params event_thread_params;
+  event_thread_t *event_thread;
+  sddc_session_t *session;
 } sddc_t;
 
+typedef struct sddc_session {
+  libusb_context *context;
+  sddc_t *devices[SDDC_MAX_SESSION_DEVICES];
+  int num_devices;
+  struct sddc_event_thread_params event_thread_params;
+  event_thread_t *event_thread;
+} sddc_session_t;
+
 
 static const double DEFAULT_SAMPLE_RATE = 64e6;       /* 64Msps */
 static const double DEFAULT_TUNER_FREQUENCY = 999e3;  /* MW station in Turin */
@@ -65,6 +149,15 @@ static const double DEFAULT_TUNER_ATTENUATION = 0;    /* no gain */
 
 static const double TUNER_CLOCK = 32E6;               /* tuner expects 32MHz when running */
 
+/* while sddc_start_streaming() and sddc_stop_streaming() run; the other
+   threads see the status before that */
+static const int SDDC_STATUS_STARTING = 0x100;
+static const int SDDC_STATUS_STOPPING = 0x101;
+
+static const int EVENT_THREAD_TIMEOUT = 100;          /* ms - how quickly the event thread stops */
+static const uint32_t DEFAULT_SYNC_BUFFER_SIZE = 32 * 1024 * 1024;
+static const int SYNC_READ_TIMEOUT = 5000;            /* ms */
+
 
 /******************************
  * basic functions
@@ -126,15 +219,31 @@ sddc_t *sddc_open(int index, const char* imagefile)
     fprintf(stderr, "ERROR - usb_device_open() failed\n");
     goto FAIL0;
   }
+  ret_val = sddc_open_usb_device(usb_device);
+  if (ret_val == 0) {
+    goto FAIL1;
+  }
+  return ret_val;
+
+FAIL1:
+  usb_device_close(usb_device);
+FAIL0:
+  return ret_val;
+}
+
+static sddc_t *sddc_open_usb_device(usb_device_t *usb_device)
+{
+  sddc_t *ret_val = 0;
+
   uint8_t data[4];
   int ret = usb_device_control(usb_device, TESTFX3, 0, 0, data, sizeof(data));
   if (ret < 0) {
     fprintf(stderr, "ERROR - usb_device_control(TESTFX3) failed\n");
-    goto FAIL1;
+    return ret_val;
   }
 
   sddc_t *this = (sddc_t *) malloc(sizeof(sddc_t));
-  this->status = SDDC_STATUS_READY;
+  atomic_init(&this->status, SDDC_STATUS_READY);
   this->model = (enum SDDCHWModel) data[0];
   this->firmware = (data[1] << 8) | data[2];
   this->rf_mode = HF_MODE;
@@ -170,26 +279,100 @@ sddc_t *sddc_open(int index, const char* imagefile)
   this->tuner_attenuation = DEFAULT_TUNER_ATTENUATION; /* default gain */
   this->tuner_clock = 0;                               /* tuner off */
   this->freq_corr_ppm = DEFAULT_FREQ_CORR_PPM;         /* default frequency correction PPM */
+  this->num_spare_frames = 0;                          /* no spare frames */
+  this->use_ring = 0;                                  /* callback from the event loop */
+  this->buffer_strategy = BUFFER_STRATEGY_AUTO;
+  this->numa_node = -1;                                /* no NUMA binding */
+  this->ddc_center_frequency = 0;                      /* no DDC */
+  this->ddc_decimation = 0;
+  this->ddc_format = SAMPLE_FORMAT_REAL_INT16;
+  this->output_format.format = SAMPLE_FORMAT_REAL_INT16;  /* raw samples */
+  this->output_format.scale = 0;
+  this->output_format.shift = 0;
+  this->output_format.dither = 0;
+  this->channelizer = 0;                               /* no channelizer */
+  this->sweep = 0;                                     /* no sweep */
+  this->psd = 0;                                       /* no spectrum */
+  this->agc = 0;                                       /* no AGC */
+  atomic_init(&this->agc_pending_index, 0);
+  this->worker_pool = 0;                               /* no worker threads */
+  this->sync_buffer_size = DEFAULT_SYNC_BUFFER_SIZE;
+  this->sync_buffer = 0;                               /* not in sync mode yet */
+  this->event_thread_params.enable = 0;                /* no event thread */
+  this->event_thread_params.cpu_affinity_mask = 0;
+  this->event_thread_params.realtime_priority = 0;
+  this->event_thread_params.lock_memory = 0;
+  this->event_thread = 0;
+  this->session = 0;
+
+  /* a WAV capture says what it was recorded at */
+  replay_t *replay = usb_device_get_replay(usb_device);
+  if (replay && replay_get_file_sample_rate(replay) > 0) {
+    this->sample_rate = replay_get_file_sample_rate(replay);
+  }
+  /* and a network stream is at the rate of the server */
+  net_receiver_t *net_receiver = usb_device_get_net_receiver(usb_device);
+  if (net_receiver) {
+    this->sample_rate = net_receiver_get_sample_rate(net_receiver);
+  }
+  /* and a shared memory ring at the rate of its publisher */
+  shm_reader_t *shm_reader = usb_device_get_shm_reader(usb_device);
+  if (shm_reader) {
+    this->sample_rate = shm_reader_get_sample_rate(shm_reader);
+  }
 
   ret_val = this;
   return ret_val;
-
-FAIL1:
-  usb_device_close(usb_device);
-FAIL0:
-  return ret_val;
 }
 
 void sddc_close(sddc_t *this)
 {
+  if (this->session) {
+    sddc_session_t *session = this->session;
+    for (int i = 0; i < session->num_devices; ++i) {
+      if (session->devices[i] == this) {
+        session->devices[i] = session->devices[--session->num_devices];
+        break;
+      }
+    }
+  }
+  if (this->streaming) {
+    streaming_close(this->streaming);
+  }
+  if (this->sync_buffer) {
+    sync_buffer_close(this->sync_buffer);
+  }
+  if (this->channelizer) {
+    channelizer_close(this->channelizer);
+  }
+  if (this->psd) {
+    psd_close(this->psd);
+  }
+  if (this->worker_pool) {
+    worker_pool_close(this->worker_pool);
+  }
   usb_device_close(this->usb_device);
+  /* after the retunes and the attenuation changes in flight are done */
+  if (this->sweep) {
+    sweep_close(this->sweep);
+  }
+  if (this->agc) {
+    agc_close(this->agc);
+  }
   free(this);
   return;
 }
 
 enum SDDCStatus sddc_get_status(sddc_t *this)
 {
-  return this->status;
+  int status = atomic_load(&this->status);
+  if (status == SDDC_STATUS_STARTING) {
+    return SDDC_STATUS_READY;
+  }
+  if (status == SDDC_STATUS_STOPPING) {
+    return SDDC_STATUS_STREAMING;
+  }
+  return (enum SDDCStatus) status;
 }
 
 enum SDDCHWModel sddc_get_hw_model(sddc_t *this)
@@ -214,6 +397,13 @@ enum RFMode sddc_get_rf_mode(sddc_t *this)
 
 int sddc_set_rf_mode(sddc_t *this, enum RFMode rf_mode)
 {
+  /* the AGC and the sweep step the attenuator or the tuner of the mode
+     they were started in */
+  if ((this->agc && agc_is_running(this->agc)) ||
+      (this->sweep && sweep_is_running(this->sweep))) {
+    fprintf(stderr, "ERROR - sddc_set_rf_mode() failed - AGC or sweep running\n");
+    return -1;
+  }
   int ret;
   switch (rf_mode) {
     case HF_MODE:
@@ -410,6 +600,12 @@ int sddc_set_hf_attenuation(sddc_t *this, double attenuation)
   return -1;
 }
 
+/* the DAT-31 steps, for the AGC */
+static const double hf_attenuations_table[] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
+  20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+};
+
 int sddc_get_hf_bias(sddc_t *this)
 {
   return (usb_device_gpio_get(this->usb_device) & GPIO_BIAS_HF) != 0;
@@ -555,9 +751,64 @@ int sddc_set_vhf_bias(sddc_t *this, int bias)
 }
 
 
+/*******************
+ * control batches *
+ *******************/
+struct control_batch_completion {
+  sddc_t *sddc;
+  sddc_control_cb_t callback;
+  void *callback_context;
+};
+
+int sddc_control_batch_begin(sddc_t *this)
+{
+  return usb_device_control_batch_begin(this->usb_device);
+}
+
+int sddc_control_batch_commit(sddc_t *this, sddc_control_cb_t callback,
+                              void *context)
+{
+  struct control_batch_completion *completion = (struct control_batch_completion *) malloc(sizeof(struct control_batch_completion));
+  if (completion == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  completion->sddc = this;
+  completion->callback = callback;
+  completion->callback_context = context;
+  int ret = usb_device_control_batch_commit(this->usb_device,
+                                            sddc_control_batch_callback,
+                                            completion);
+  if (ret < 0) {
+    free(completion);
+    fprintf(stderr, "ERROR - usb_device_control_batch_commit() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* runs in the event loop, like the stream callback */
+static void sddc_control_batch_callback(int status, void *context)
+{
+  struct control_batch_completion *completion = (struct control_batch_completion *) context;
+  sddc_t *this = completion->sddc;
+  uint64_t sample_index = this->streaming ?
+                          streaming_get_sample_index(this->streaming) : 0;
+  if (completion->callback) {
+    completion->callback(status, sample_index, completion->callback_context);
+  }
+  free(completion);
+}
+
+
 /******************************
  * streaming related functions
  ******************************/
+double sddc_get_sample_rate(sddc_t *this)
+{
+  return this->sample_rate;
+}
+
 int sddc_set_sample_rate(sddc_t *this, double sample_rate)
 {
   /* no checks yet */
@@ -570,10 +821,17 @@ int sddc_set_async_params(sddc_t *this, uint32_t frame_size,
                            uint32_t num_frames, sddc_read_async_cb_t callback,
                            void *callback_context)
 {
-  if (this->streaming) {
-    fprintf(stderr, "ERROR - sddc_set_async_params() failed: streaming already configured\n");
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_async_params() failed: device is streaming\n");
     return -1;
   }
+  if (this->streaming) {
+    streaming_close(this->streaming);
+  }
+  if (this->sync_buffer) {
+    sync_buffer_close(this->sync_buffer);
+    this->sync_buffer = 0;
+  }
 
   this->streaming = streaming_open_async(this->usb_device, frame_size,
                                          num_frames, callback,
@@ -586,148 +844,1357 @@ int sddc_set_async_params(sddc_t *this, uint32_t frame_size,
   return 0;
 }
 
-int sddc_start_streaming(sddc_t *this)
+int sddc_set_async_params2(sddc_t *this, uint32_t frame_size,
+                           uint32_t num_frames, sddc_read_async_cb2_t callback,
+                           void *callback_context)
 {
-  if (this->status != SDDC_STATUS_READY) {
-    fprintf(stderr, "ERROR - sddc_start_streaming() called with SDR status not READY: %d\n", this->status);
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_async_params2() failed: device is streaming\n");
     return -1;
   }
+  if (this->streaming) {
+    streaming_close(this->streaming);
+  }
+  if (this->sync_buffer) {
+    sync_buffer_close(this->sync_buffer);
+    this->sync_buffer = 0;
+  }
 
-  /* ADC sampling frequency */
-  double correction = 1e-6 * this->freq_corr_ppm * this->sample_rate;
-  uint32_t data = (uint32_t) (this->sample_rate + correction);
+  this->streaming = streaming_open_async2(this->usb_device, frame_size,
+                                          num_frames, callback,
+                                          callback_context);
+  if (this->streaming == 0) {
+    fprintf(stderr, "ERROR - streaming_open_async2() failed\n");
+    return -1;
+  }
 
-  int ret = usb_device_control(this->usb_device, STARTADC, 0, 0,
-                               (uint8_t *) &data, sizeof(data));
-  if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(STARTADC) failed\n");
+  return 0;
+}
+
+int sddc_set_buffer_strategy(sddc_t *this, enum SDDCBufferStrategy strategy,
+                             int numa_node)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_buffer_strategy() failed - device is streaming\n");
     return -1;
   }
+  this->buffer_strategy = strategy;
+  this->numa_node = numa_node;
+  return 0;
+}
 
-  /* initialize tuner */
-  if (this->rf_mode == VHF_MODE) {
-    /* tuner reference frequency */
-    double correction = 1e-6 * this->freq_corr_ppm * TUNER_CLOCK;
-    uint32_t data = (uint32_t) (TUNER_CLOCK + correction);
+enum SDDCBufferStrategy sddc_get_buffer_strategy(sddc_t *this)
+{
+  if (this->streaming == 0) {
+    return BUFFER_STRATEGY_AUTO;
+  }
+  return streaming_get_buffer_strategy(this->streaming);
+}
 
-    int ret = usb_device_control(this->usb_device, R82XXINIT, 0, 0,
-                                 (uint8_t *) &data, sizeof(data));
-    if (ret < 0) {
-      fprintf(stderr, "ERROR - usb_device_control(R82XXINIT) failed\n");
-      return -1;
-    }
+int sddc_set_spare_frames(sddc_t *this, uint32_t num_spare_frames)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_spare_frames() failed - device is streaming\n");
+    return -1;
   }
+  this->num_spare_frames = num_spare_frames;
+  return 0;
+}
 
-  /* start async streaming */
-  if (this->streaming) {
-    streaming_set_sample_rate(this->streaming, (uint32_t) this->sample_rate);
-    int ret = streaming_start(this->streaming);
-    if (ret < 0) {
-      fprintf(stderr, "ERROR - streaming_start() failed\n");
+int sddc_set_async_ring(sddc_t *this, int enable)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_async_ring() failed - device is streaming\n");
+    return -1;
+  }
+  this->use_ring = enable != 0;
+  return 0;
+}
+
+int sddc_get_async_ring_status(sddc_t *this, uint32_t *depth,
+                               uint32_t *high_water_mark,
+                               uint64_t *dropped_frames)
+{
+  if (this->streaming == 0) {
+    fprintf(stderr, "ERROR - sddc_get_async_ring_status() failed - streaming not configured\n");
+    return -1;
+  }
+  return streaming_get_ring_status(this->streaming, depth, high_water_mark,
+                                   dropped_frames);
+}
+
+int sddc_set_ddc(sddc_t *this, double center_frequency, uint32_t decimation,
+                 enum SDDCSampleFormat format)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_ddc() failed - device is streaming\n");
+    return -1;
+  }
+  if (decimation > 0) {
+    if (decimation > DDC_MAX_DECIMATION || (decimation & (decimation - 1)) != 0) {
+      fprintf(stderr, "ERROR - sddc_set_ddc() failed - decimation must be a power of two <= %d\n",
+              DDC_MAX_DECIMATION);
+      return -1;
+    }
+    if (format != SAMPLE_FORMAT_COMPLEX_INT16 &&
+        format != SAMPLE_FORMAT_COMPLEX_FLOAT32) {
+      fprintf(stderr, "ERROR - sddc_set_ddc() failed - output format must be complex\n");
       return -1;
     }
   }
+  this->ddc_center_frequency = center_frequency;
+  this->ddc_decimation = decimation;
+  this->ddc_format = format;
+  return 0;
+}
 
-  /* start the producer */
-  ret = usb_device_control(this->usb_device, STARTFX3, 0, 0, 0, 0);
-  if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(STARTFX3) failed\n");
+int sddc_set_output_format(sddc_t *this,
+                           const struct sddc_output_format *output_format)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_output_format() failed - device is streaming\n");
+    return -1;
+  }
+  switch (output_format->format) {
+    case SAMPLE_FORMAT_REAL_INT16:
+    case SAMPLE_FORMAT_REAL_FLOAT32:
+    case SAMPLE_FORMAT_REAL_INT8:
+    case SAMPLE_FORMAT_REAL_PACKED12:
+      break;
+    default:
+      fprintf(stderr, "ERROR - sddc_set_output_format() failed - output format must be real\n");
+      return -1;
+  }
+  if (output_format->shift > 15) {
+    fprintf(stderr, "ERROR - sddc_set_output_format() failed - shift must be <= 15\n");
     return -1;
   }
+  this->output_format = *output_format;
+  return 0;
+}
 
-  /* all good */
-  this->status = SDDC_STATUS_STREAMING;
+int sddc_set_channelizer(sddc_t *this, uint32_t fft_size)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_channelizer() failed - device is streaming\n");
+    return -1;
+  }
+  if (this->channelizer) {
+    channelizer_close(this->channelizer);
+    this->channelizer = 0;
+  }
+  if (fft_size == 0) {
+    return 0;
+  }
+  this->channelizer = channelizer_open(this->sample_rate, fft_size);
+  if (this->channelizer == 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed\n");
+    return -1;
+  }
   return 0;
 }
 
-int sddc_handle_events(sddc_t *this)
+int sddc_set_sweep(sddc_t *this, const struct sddc_sweep_params *params)
 {
-  return usb_device_handle_events(this->usb_device);
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_sweep() failed - device is streaming\n");
+    return -1;
+  }
+  if (this->sweep) {
+    sweep_close(this->sweep);
+    this->sweep = 0;
+  }
+  if (params == 0) {
+    return 0;
+  }
+  if (!this->has_vhf_tuner && usb_device_get_replay(this->usb_device) == 0) {
+    fprintf(stderr, "ERROR - sddc_set_sweep() failed - no VHF/UHF tuner\n");
+    return -1;
+  }
+  if (this->ddc_decimation > 0) {
+    fprintf(stderr, "ERROR - sddc_set_sweep() failed - DDC enabled\n");
+    return -1;
+  }
+  this->sweep = sweep_open(params, this->sample_rate, sddc_sweep_retune, this);
+  if (this->sweep == 0) {
+    fprintf(stderr, "ERROR - sweep_open() failed\n");
+    return -1;
+  }
+  return 0;
 }
 
-int sddc_stop_streaming(sddc_t *this)
+int sddc_set_psd(sddc_t *this, const struct sddc_psd_params *params)
 {
-  if (this->status != SDDC_STATUS_STREAMING) {
-    fprintf(stderr, "ERROR - sddc_stop_streaming() called with SDR status not STREAMING: %d\n", this->status);
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_psd() failed - device is streaming\n");
+    return -1;
+  }
+  if (this->psd) {
+    psd_close(this->psd);
+    this->psd = 0;
+  }
+  if (params == 0) {
+    return 0;
+  }
+  this->psd = psd_open(params, this->sample_rate);
+  if (this->psd == 0) {
+    fprintf(stderr, "ERROR - psd_open() failed\n");
     return -1;
   }
+  return 0;
+}
 
-  /* stop the producer */
-  int ret = usb_device_control(this->usb_device, STOPFX3, 0, 0, 0, 0);
-  if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(STOPFX3) failed\n");
+int sddc_get_psd_stats(sddc_t *this, struct sddc_psd_stats *stats)
+{
+  if (this->psd == 0) {
+    fprintf(stderr, "ERROR - sddc_get_psd_stats() failed - spectrum not enabled\n");
     return -1;
   }
+  psd_get_stats(this->psd, stats);
+  return 0;
+}
 
-  /* stop async streaming */
-  if (this->streaming) {
-    int ret = streaming_stop(this->streaming);
-    if (ret < 0) {
-      fprintf(stderr, "ERROR - streaming_stop() failed\n");
-      return -1;
-    }
+int sddc_set_agc(sddc_t *this, const struct sddc_agc_params *params)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_agc() failed - device is streaming\n");
+    return -1;
+  }
+  if (this->agc) {
+    /* a start that failed may have left a change in flight */
+    usb_device_wait_batches(this->usb_device);
+    agc_close(this->agc);
+    this->agc = 0;
+  }
+  if (params == 0) {
+    return 0;
+  }
+  this->agc = agc_open(params, this->sample_rate, sddc_agc_set_attenuation,
+                       this);
+  if (this->agc == 0) {
+    fprintf(stderr, "ERROR - agc_open() failed\n");
+    return -1;
+  }
+  return 0;
+}
 
-    streaming_close(this->streaming);
+int sddc_get_agc_stats(sddc_t *this, struct sddc_agc_stats *stats)
+{
+  if (this->agc == 0) {
+    fprintf(stderr, "ERROR - sddc_get_agc_stats() failed - AGC not enabled\n");
+    return -1;
   }
+  agc_get_stats(this->agc, stats);
+  return 0;
+}
 
-  /* stop tuner */
+/* the attenuator of the current RF mode, from where it is now; in VHF
+   mode the register selects the R82xx LNA/mixer gain, so the AGC steps
+   are the gains the other way round, as dB below the highest one */
+static int sddc_agc_start(sddc_t *this)
+{
   if (this->rf_mode == VHF_MODE) {
-    int ret = usb_device_control(this->usb_device, R82XXSTDBY, 0, 0, 0, 0);
-    if (ret < 0) {
-      fprintf(stderr, "ERROR - usb_device_control(R82XXSTDBY) failed\n");
-      return -1;
+    const uint32_t num_gains = sizeof(tuner_rf_attenuations_table) / sizeof(tuner_rf_attenuations_table[0]);
+    double attenuations[sizeof(tuner_rf_attenuations_table) / sizeof(tuner_rf_attenuations_table[0])];
+    for (uint32_t i = 0; i < num_gains; ++i) {
+      attenuations[i] = tuner_rf_attenuations_table[num_gains - 1] -
+                        tuner_rf_attenuations_table[num_gains - 1 - i];
+    }
+    uint16_t gain_index = usb_device_get_fw_register(this->usb_device,
+                                                     FW_REG_R82XX_ATTENUATOR);
+    if (gain_index >= num_gains) {
+      gain_index = num_gains - 1;
     }
+    return agc_start(this->agc, attenuations, num_gains,
+                     num_gains - 1 - gain_index);
+  }
+  if (this->hf_attenuator_levels != 32) {
+    fprintf(stderr, "ERROR - AGC in HF mode needs the DAT-31 attenuator\n");
+    return -1;
   }
+  return agc_start(this->agc, hf_attenuations_table,
+                   sizeof(hf_attenuations_table) / sizeof(hf_attenuations_table[0]),
+                   (uint32_t) this->hf_attenuation);
+}
 
-  /* stop ADC */
-  ret = usb_device_gpio_on(this->usb_device, GPIO_ADC_SHDN);
+/* from the thread delivering the samples */
+static int sddc_agc_set_attenuation(void *context, uint32_t index)
+{
+  sddc_t *this = (sddc_t *) context;
+  uint16_t address = FW_REG_R82XX_ATTENUATOR;
+  uint16_t value = sizeof(tuner_rf_attenuations_table) / sizeof(tuner_rf_attenuations_table[0]) - 1 - index;
+  if (atomic_load(&this->rf_mode) != VHF_MODE) {
+    address = FW_REG_DAT31_ATT;
+    value = this->hf_attenuator_levels - 1 - index;
+  }
+  /* hf_attenuation changes once the device has acknowledged it, which
+     may be before usb_device_set_fw_register_async() returns */
+  uint32_t previous_index = atomic_exchange(&this->agc_pending_index, index);
+  int ret = usb_device_set_fw_register_async(this->usb_device, address, value,
+                                             sddc_agc_applied, this);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_gpio_on(ADC_SHDN) failed\n");
+    fprintf(stderr, "ERROR - usb_device_set_fw_register_async() failed\n");
+    atomic_store(&this->agc_pending_index, previous_index);
     return -1;
   }
-
-  /* all good */
-  this->status = SDDC_STATUS_READY;
   return 0;
 }
 
-int sddc_reset_status(sddc_t *this)
+/* runs in the event loop; the stop and sddc_set_agc() wait for it
+   before the AGC can be closed, but once the AGC is stopped the stream
+   may be gone */
+static void sddc_agc_applied(int status, void *context)
 {
-  int ret = streaming_reset_status(this->streaming);
+  sddc_t *this = (sddc_t *) context;
+  if (status >= 0 && atomic_load(&this->rf_mode) != VHF_MODE) {
+    this->hf_attenuation = hf_attenuations_table[atomic_load(&this->agc_pending_index)];
+  }
+  if (this->agc && agc_is_running(this->agc)) {
+    agc_applied(this->agc, streaming_get_sample_index(this->streaming),
+                status);
+  }
+}
+
+/* from the thread delivering the samples */
+static int sddc_sweep_retune(void *context, double frequency)
+{
+  sddc_t *this = (sddc_t *) context;
+  uint64_t data = (uint64_t) frequency;
+  int ret = usb_device_control_async(this->usb_device, R82XXTUNE, 0, 0,
+                                     (uint8_t *) &data, sizeof(data),
+                                     sddc_sweep_tuned, this);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - streaming_reset_status() failed\n");
+    fprintf(stderr, "ERROR - usb_device_control_async(R82XXTUNE) failed\n");
     return -1;
   }
+  this->tuner_frequency = frequency;
   return 0;
 }
 
-int sddc_read_sync(sddc_t *this, uint8_t *data, int length, int *transferred)
+/* runs in the event loop; after the sweep is stopped the stream may be
+   gone */
+static void sddc_sweep_tuned(int status, void *context)
 {
-  return streaming_read_sync(this->streaming, data, length, transferred);
+  sddc_t *this = (sddc_t *) context;
+  if (this->sweep && sweep_is_running(this->sweep)) {
+    sweep_tuned(this->sweep, streaming_get_sample_index(this->streaming),
+                status);
+  }
 }
 
-
-/******************************
- * Misc functions
- ******************************/
-double sddc_get_frequency_correction(sddc_t *this)
+int sddc_add_channel(sddc_t *this, double center_frequency,
+                     uint32_t decimation, sddc_channel_cb_t callback,
+                     void *callback_context)
 {
-  return this->freq_corr_ppm;
+  if (this->channelizer == 0) {
+    fprintf(stderr, "ERROR - sddc_add_channel() failed - channelizer not enabled\n");
+    return -1;
+  }
+  return channelizer_add_channel(this->channelizer, center_frequency,
+                                 decimation, callback, callback_context);
 }
 
-int sddc_set_frequency_correction(sddc_t *this, double correction)
+int sddc_remove_channel(sddc_t *this, int channel)
 {
-  if (this->status == SDDC_STATUS_STREAMING) {
-    fprintf(stderr, "ERROR - sddc_set_frequency_correction() failed - device is streaming\n");
+  if (this->channelizer == 0) {
+    fprintf(stderr, "ERROR - sddc_remove_channel() failed - channelizer not enabled\n");
     return -1;
   }
-  this->freq_corr_ppm = correction;
-  return 0;
+  return channelizer_remove_channel(this->channelizer, channel);
 }
 
-
-/* internal functions */
-/* helper method to configure GPIOs for VHF */
-int sddc_set_vhf_gpios(sddc_t* this) {
-    return usb_device_gpio_set(this->usb_device, 0, GPIO_ATT_SEL0 | GPIO_ATT_SEL1);
+int sddc_set_worker_threads(sddc_t *this, uint32_t num_threads,
+                            const uint64_t *cpu_affinity_masks)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_worker_threads() failed - device is streaming\n");
+    return -1;
+  }
+  if (num_threads > SDDC_MAX_WORKER_THREADS) {
+    fprintf(stderr, "ERROR - sddc_set_worker_threads() failed - too many threads: %u\n", num_threads);
+    return -1;
+  }
+  if (this->worker_pool) {
+    worker_pool_close(this->worker_pool);
+    this->worker_pool = 0;
+  }
+  if (num_threads == 0) {
+    return 0;
+  }
+  this->worker_pool = worker_pool_open(num_threads, cpu_affinity_masks);
+  if (this->worker_pool == 0) {
+    fprintf(stderr, "ERROR - worker_pool_open() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+sddc_buffer_t *sddc_buffer_retain(sddc_t *this, const uint8_t *data)
+{
+  if (this->streaming == 0) {
+    fprintf(stderr, "ERROR - sddc_buffer_retain() failed - streaming not configured\n");
+    return 0;
+  }
+  return (sddc_buffer_t *) streaming_buffer_retain(this->streaming, data);
+}
+
+int sddc_buffer_release(sddc_t *this, sddc_buffer_t *buffer)
+{
+  if (this->streaming == 0) {
+    fprintf(stderr, "ERROR - sddc_buffer_release() failed - streaming not configured\n");
+    return -1;
+  }
+  return streaming_buffer_release(this->streaming, (struct frame *) buffer);
+}
+
+int sddc_get_stream_stats(sddc_t *this, struct sddc_stream_stats *stats)
+{
+  if (this->streaming == 0) {
+    fprintf(stderr, "ERROR - sddc_get_stream_stats() failed - streaming not configured\n");
+    return -1;
+  }
+  return streaming_get_stats(this->streaming, stats);
+}
+
+int sddc_trace_enable(int enable)
+{
+  return trace_enable(enable);
+}
+
+int sddc_trace_dump(const char *path)
+{
+  return trace_dump(path);
+}
+
+int sddc_set_event_thread_params(sddc_t *this,
+                                 const struct sddc_event_thread_params *params)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_event_thread_params() failed - device is streaming\n");
+    return -1;
+  }
+  if (params->realtime_priority < 0) {
+    fprintf(stderr, "ERROR - invalid realtime priority: %d\n", params->realtime_priority);
+    return -1;
+  }
+  this->event_thread_params = *params;
+  return 0;
+}
+
+int sddc_start_streaming(sddc_t *this)
+{
+  int status = sddc_set_status(this, SDDC_STATUS_READY, SDDC_STATUS_STARTING);
+  if (status != SDDC_STATUS_READY) {
+    fprintf(stderr, "ERROR - sddc_start_streaming() called with SDR status not READY: %d\n", status);
+    return -1;
+  }
+
+  int ret = sddc_start_streaming_prepare(this);
+  if (ret < 0) {
+    goto FAIL0;
+  }
+
+  /* start the event thread before the data starts flowing; in sync mode
+     nothing else would handle the events */
+  if (this->event_thread_params.enable || this->sync_buffer) {
+    struct sddc_event_thread_params params = this->event_thread_params;
+    params.enable = 1;
+    this->event_thread = event_thread_start(&params,
+                                            sddc_event_thread_handler, this);
+    if (this->event_thread == 0) {
+      fprintf(stderr, "ERROR - event_thread_start() failed\n");
+      goto FAIL1;
+    }
+  }
+
+  /* start the producer */
+  ret = usb_device_control(this->usb_device, STARTFX3, 0, 0, 0, 0);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - usb_device_control(STARTFX3) failed\n");
+    goto FAIL1;
+  }
+
+  /* all good */
+  atomic_store(&this->status, SDDC_STATUS_STREAMING);
+  return 0;
+
+FAIL1:
+  /* undo sddc_start_streaming_prepare(), as sddc_stop_streaming() would;
+     this also sets the status back to READY */
+  sddc_stop_streaming_transfers(this);
+  if (this->event_thread) {
+    event_thread_stop(this->event_thread);
+    this->event_thread = 0;
+  }
+  sddc_stop_streaming_finish(this);
+  return -1;
+
+FAIL0:
+  atomic_store(&this->status, SDDC_STATUS_READY);
+  return -1;
+}
+
+/* everything up to STARTFX3, except the event thread */
+static int sddc_start_streaming_prepare(sddc_t *this)
+{
+  /* ADC sampling frequency */
+  double correction = 1e-6 * this->freq_corr_ppm * this->sample_rate;
+  uint32_t data = (uint32_t) (this->sample_rate + correction);
+
+  int ret = usb_device_control(this->usb_device, STARTADC, 0, 0,
+                               (uint8_t *) &data, sizeof(data));
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - usb_device_control(STARTADC) failed\n");
+    return -1;
+  }
+
+  /* initialize tuner */
+  if (this->rf_mode == VHF_MODE) {
+    /* tuner reference frequency */
+    double correction = 1e-6 * this->freq_corr_ppm * TUNER_CLOCK;
+    uint32_t data = (uint32_t) (TUNER_CLOCK + correction);
+
+    int ret = usb_device_control(this->usb_device, R82XXINIT, 0, 0,
+                                 (uint8_t *) &data, sizeof(data));
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - usb_device_control(R82XXINIT) failed\n");
+      return -1;
+    }
+  }
+
+  /* without a callback the samples go to the sync buffer */
+  if (this->streaming == 0 || this->sync_buffer) {
+    int ret = sddc_open_sync_streaming(this);
+    if (ret < 0) {
+      return -1;
+    }
+  }
+
+  /* start async streaming */
+  if (this->streaming) {
+    streaming_set_sample_rate(this->streaming, (uint32_t) this->sample_rate);
+    streaming_set_random(this->streaming, sddc_get_adc_random(this));
+    int ret = streaming_set_spare_frames(this->streaming, this->num_spare_frames);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_spare_frames() failed\n");
+      return -1;
+    }
+    ret = streaming_set_buffer_strategy(this->streaming, this->buffer_strategy,
+                                        this->numa_node);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_buffer_strategy() failed\n");
+      return -1;
+    }
+    ret = streaming_set_ring(this->streaming, this->use_ring);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_ring() failed\n");
+      return -1;
+    }
+    /* a kept stream still has the DDC of the previous run */
+    ret = streaming_set_ddc(this->streaming, 0, 0, this->ddc_format);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_ddc() failed\n");
+      return -1;
+    }
+    ret = streaming_set_worker_pool(this->streaming, this->worker_pool);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_worker_pool() failed\n");
+      return -1;
+    }
+    ret = streaming_set_ddc(this->streaming, this->ddc_center_frequency,
+                            this->ddc_decimation, this->ddc_format);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_ddc() failed\n");
+      return -1;
+    }
+    ret = streaming_set_output_format(this->streaming, &this->output_format);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_output_format() failed\n");
+      return -1;
+    }
+    if (this->channelizer) {
+      channelizer_set_worker_pool(this->channelizer, this->worker_pool);
+    }
+    ret = streaming_set_channelizer(this->streaming, this->channelizer);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_channelizer() failed\n");
+      return -1;
+    }
+    if (this->sweep) {
+      if (this->ddc_decimation > 0) {
+        fprintf(stderr, "ERROR - sweep and DDC cannot be used together\n");
+        return -1;
+      }
+      /* the first hop is tuned before the data starts flowing */
+      double frequency = sweep_get_start_frequency(this->sweep);
+      if (this->rf_mode == VHF_MODE) {
+        ret = sddc_set_tuner_frequency(this, frequency);
+        if (ret < 0) {
+          return -1;
+        }
+      }
+      sweep_start(this->sweep);
+    }
+    ret = streaming_set_sweep(this->streaming, this->sweep);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_sweep() failed\n");
+      goto FAIL0;
+    }
+    ret = streaming_set_psd(this->streaming, this->psd);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_psd() failed\n");
+      goto FAIL0;
+    }
+    if (this->agc) {
+      ret = sddc_agc_start(this);
+      if (ret < 0) {
+        goto FAIL0;
+      }
+    }
+    ret = streaming_set_agc(this->streaming, this->agc);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_set_agc() failed\n");
+      goto FAIL1;
+    }
+    if (this->psd) {
+      ret = psd_start(this->psd);
+      if (ret < 0) {
+        fprintf(stderr, "ERROR - psd_start() failed\n");
+        goto FAIL1;
+      }
+    }
+    ret = streaming_start(this->streaming);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_start() failed\n");
+      goto FAIL2;
+    }
+  }
+
+  return 0;
+
+/* undo what has been started, the other way round */
+FAIL2:
+  if (this->psd) {
+    psd_stop(this->psd);
+  }
+FAIL1:
+  if (this->agc) {
+    agc_stop(this->agc);
+  }
+FAIL0:
+  if (this->sweep) {
+    sweep_stop(this->sweep);
+  }
+  return -1;
+}
+
+int sddc_handle_events(sddc_t *this)
+{
+  event_thread_t *event_thread = this->event_thread;
+  if (event_thread == 0 && this->session) {
+    event_thread = this->session->event_thread;
+  }
+  if (event_thread) {
+    /* events are handled by the library event thread */
+    if (event_thread_failed(event_thread)) {
+      fprintf(stderr, "ERROR - sddc_handle_events() failed - event thread failed\n");
+      return -1;
+    }
+    usleep(EVENT_THREAD_TIMEOUT * 1000);
+    return 0;
+  }
+  return usb_device_handle_events(this->usb_device);
+}
+
+int sddc_stop_streaming(sddc_t *this)
+{
+  int status = sddc_set_status(this, SDDC_STATUS_STREAMING, SDDC_STATUS_STOPPING);
+  if (status != SDDC_STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - sddc_stop_streaming() called with SDR status not STREAMING: %d\n", status);
+    return -1;
+  }
+
+  /* stop the producer */
+  int ret = usb_device_control(this->usb_device, STOPFX3, 0, 0, 0, 0);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - usb_device_control(STOPFX3) failed\n");
+    goto FAIL0;
+  }
+
+  /* stop async streaming */
+  ret = sddc_stop_streaming_transfers(this);
+  if (ret < 0) {
+    goto FAIL0;
+  }
+
+  /* the transfers have been cancelled by now */
+  if (this->event_thread) {
+    event_thread_stop(this->event_thread);
+    this->event_thread = 0;
+  }
+
+  return sddc_stop_streaming_finish(this);
+
+FAIL0:
+  /* still streaming, as far as we know */
+  atomic_store(&this->status, SDDC_STATUS_STREAMING);
+  return -1;
+}
+
+static int sddc_stop_streaming_transfers(sddc_t *this)
+{
+  int ret_val = 0;
+  if (this->sweep) {
+    sweep_stop(this->sweep);
+  }
+  if (this->agc) {
+    agc_stop(this->agc);
+  }
+  if (this->streaming) {
+    int ret = streaming_stop(this->streaming);
+    /* no more samples for the spectrum thread after this */
+    if (this->psd) {
+      psd_stop(this->psd);
+    }
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_stop() failed\n");
+      ret_val = -1;
+    }
+  }
+  /* no retunes or attenuation changes are started after this; the ones in
+     flight call back into the sweep and the AGC, which sddc_set_sweep()
+     and sddc_set_agc() could free once we are stopped */
+  usb_device_wait_batches(this->usb_device);
+  return ret_val;
+}
+
+/* everything after the event thread is stopped */
+static int sddc_stop_streaming_finish(sddc_t *this)
+{
+  /* the stream (with its buffers and transfers) is kept for the next
+     sddc_start_streaming(); if some transfers are still out, the device
+     is stopped anyway and sddc_reset_status() can be tried again later */
+  int ret_val = 0;
+  if (this->streaming) {
+    int ret = streaming_reset_status(this->streaming);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - streaming_reset_status() failed\n");
+      ret_val = -1;
+    }
+  }
+
+  /* the transfers and the event thread are gone by now, so whatever
+     happens next the device is READY again and can be restarted */
+  atomic_store(&this->status, SDDC_STATUS_READY);
+
+  /* stop tuner */
+  if (this->rf_mode == VHF_MODE) {
+    int ret = usb_device_control(this->usb_device, R82XXSTDBY, 0, 0, 0, 0);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - usb_device_control(R82XXSTDBY) failed\n");
+      return -1;
+    }
+  }
+
+  /* stop ADC */
+  int ret = usb_device_gpio_on(this->usb_device, GPIO_ADC_SHDN);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - usb_device_gpio_on(ADC_SHDN) failed\n");
+    return -1;
+  }
+
+  return ret_val;
+}
+
+int sddc_reset_status(sddc_t *this)
+{
+  if (this->streaming == 0) {
+    return 0;
+  }
+  int ret = streaming_reset_status(this->streaming);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - streaming_reset_status() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+int sddc_set_sync_params(sddc_t *this, uint32_t buffer_size)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_sync_params() failed - device is streaming\n");
+    return -1;
+  }
+  buffer_size = buffer_size > 0 ? buffer_size : DEFAULT_SYNC_BUFFER_SIZE;
+  if (buffer_size != this->sync_buffer_size && this->sync_buffer) {
+    /* reallocated by the next sddc_start_streaming() */
+    sync_buffer_close(this->sync_buffer);
+    this->sync_buffer = 0;
+    streaming_close(this->streaming);
+    this->streaming = 0;
+  }
+  this->sync_buffer_size = buffer_size;
+  return 0;
+}
+
+int sddc_read_sync(sddc_t *this, uint8_t *data, int length, int *transferred)
+{
+  *transferred = 0;
+  if (this->sync_buffer == 0) {
+    fprintf(stderr, "ERROR - sddc_read_sync() failed - not streaming in sync mode\n");
+    return -1;
+  }
+  if (length < 0 || (uint32_t) length > this->sync_buffer_size) {
+    fprintf(stderr, "ERROR - sddc_read_sync() failed - invalid length: %d\n", length);
+    return -1;
+  }
+  uint32_t size;
+  int ret = sync_buffer_read(this->sync_buffer, data, (uint32_t) length,
+                             &size, SYNC_READ_TIMEOUT);
+  *transferred = (int) size;
+  if (ret < 0) {
+    event_thread_t *event_thread = this->session ? this->session->event_thread
+                                                 : this->event_thread;
+    if (event_thread && event_thread_failed(event_thread)) {
+      fprintf(stderr, "ERROR - sddc_read_sync() failed - event thread failed\n");
+    }
+  }
+  return ret;
+}
+
+int sddc_get_sync_stats(sddc_t *this, struct sddc_sync_stats *stats)
+{
+  if (this->sync_buffer == 0) {
+    fprintf(stderr, "ERROR - sddc_get_sync_stats() failed - not in sync mode\n");
+    return -1;
+  }
+  sync_buffer_get_stats(this->sync_buffer, stats);
+  return 0;
+}
+
+
+/******************************
+ * recorder
+ ******************************/
+sddc_recorder_t *sddc_recorder_open(const struct sddc_recorder_params *params)
+{
+  if (params->path == 0) {
+    fprintf(stderr, "ERROR - sddc_recorder_open() failed - no path\n");
+    return 0;
+  }
+  return recorder_open(params);
+}
+
+void sddc_recorder_close(sddc_recorder_t *this)
+{
+  recorder_close(this);
+  return;
+}
+
+int sddc_recorder_write(sddc_recorder_t *this, const uint8_t *data,
+                        uint32_t size)
+{
+  return recorder_write(this, data, size);
+}
+
+int sddc_recorder_get_stats(sddc_recorder_t *this,
+                            struct sddc_recorder_stats *stats)
+{
+  return recorder_get_stats(this, stats);
+}
+
+
+/******************************
+ * trigger capture
+ ******************************/
+sddc_trigger_t *sddc_trigger_open(const struct sddc_trigger_params *params)
+{
+  if (params->recorder == 0) {
+    fprintf(stderr, "ERROR - sddc_trigger_open() failed - no recorder\n");
+    return 0;
+  }
+  return trigger_open(params);
+}
+
+void sddc_trigger_close(sddc_trigger_t *this)
+{
+  trigger_close(this);
+  return;
+}
+
+int sddc_trigger_write(sddc_trigger_t *this, const uint8_t *data,
+                       uint32_t size, const struct sddc_frame_info *info)
+{
+  return trigger_write(this, data, size, info);
+}
+
+void sddc_trigger_fire(sddc_trigger_t *this)
+{
+  trigger_fire(this);
+  return;
+}
+
+int sddc_trigger_get_stats(sddc_trigger_t *this,
+                           struct sddc_trigger_stats *stats)
+{
+  return trigger_get_stats(this, stats);
+}
+
+
+/******************************
+ * compressed capture
+ ******************************/
+sddc_compressed_writer_t *sddc_compressed_writer_open(
+                         const struct sddc_compressed_writer_params *params)
+{
+  if (params->path == 0) {
+    fprintf(stderr, "ERROR - sddc_compressed_writer_open() failed - no path\n");
+    return 0;
+  }
+  return compressed_writer_open(params);
+}
+
+void sddc_compressed_writer_close(sddc_compressed_writer_t *this)
+{
+  compressed_writer_close(this);
+  return;
+}
+
+int sddc_compressed_writer_write(sddc_compressed_writer_t *this,
+                                 const uint8_t *data, uint32_t size)
+{
+  return compressed_writer_write(this, data, size);
+}
+
+int sddc_compressed_writer_get_stats(sddc_compressed_writer_t *this,
+                                 struct sddc_compressed_writer_stats *stats)
+{
+  return compressed_writer_get_stats(this, stats);
+}
+
+sddc_compressed_reader_t *sddc_compressed_reader_open(const char *path)
+{
+  return compressed_reader_open(path);
+}
+
+void sddc_compressed_reader_close(sddc_compressed_reader_t *this)
+{
+  compressed_reader_close(this);
+  return;
+}
+
+double sddc_compressed_reader_get_sample_rate(sddc_compressed_reader_t *this)
+{
+  return compressed_reader_get_sample_rate(this);
+}
+
+uint64_t sddc_compressed_reader_get_num_samples(sddc_compressed_reader_t *this)
+{
+  return compressed_reader_get_num_samples(this);
+}
+
+int sddc_compressed_reader_seek(sddc_compressed_reader_t *this,
+                                uint64_t sample)
+{
+  return compressed_reader_seek(this, sample);
+}
+
+int sddc_compressed_reader_read(sddc_compressed_reader_t *this,
+                                uint8_t *data, uint32_t size)
+{
+  return compressed_reader_read(this, data, size);
+}
+
+
+/******************************
+ * file replay
+ ******************************/
+int sddc_set_replay_params(sddc_t *this,
+                           const struct sddc_replay_params *params)
+{
+  replay_t *replay = usb_device_get_replay(this->usb_device);
+  if (replay == 0) {
+    fprintf(stderr, "ERROR - sddc_set_replay_params() failed - not a file:// device\n");
+    return -1;
+  }
+  replay_set_params(replay, params->realtime, params->loop);
+  return 0;
+}
+
+int sddc_get_replay_position(sddc_t *this, uint64_t *samples, int *finished)
+{
+  replay_t *replay = usb_device_get_replay(this->usb_device);
+  if (replay == 0) {
+    fprintf(stderr, "ERROR - sddc_get_replay_position() failed - not a file:// device\n");
+    return -1;
+  }
+  replay_get_position(replay, samples, finished);
+  return 0;
+}
+
+
+/******************************
+ * network streams
+ ******************************/
+int sddc_get_net_stats(sddc_t *this, struct sddc_net_stats *stats)
+{
+  net_receiver_t *net_receiver = usb_device_get_net_receiver(this->usb_device);
+  if (net_receiver == 0) {
+    fprintf(stderr, "ERROR - sddc_get_net_stats() failed - not a udp:// or tcp:// device\n");
+    return -1;
+  }
+  net_receiver_get_stats(net_receiver, stats);
+  return 0;
+}
+
+
+/******************************
+ * shared memory
+ ******************************/
+sddc_publisher_t *sddc_publisher_open(const struct sddc_publisher_params *params)
+{
+  if (params->name == 0) {
+    fprintf(stderr, "ERROR - sddc_publisher_open() failed - no name\n");
+    return 0;
+  }
+  return publisher_open(params);
+}
+
+void sddc_publisher_close(sddc_publisher_t *this)
+{
+  publisher_close(this);
+  return;
+}
+
+int sddc_publisher_write(sddc_publisher_t *this, const uint8_t *data,
+                         uint32_t size, const struct sddc_frame_info *info)
+{
+  return publisher_write(this, data, size, info);
+}
+
+int sddc_publisher_get_stats(sddc_publisher_t *this,
+                             struct sddc_publisher_stats *stats)
+{
+  return publisher_get_stats(this, stats);
+}
+
+int sddc_get_shm_stats(sddc_t *this, struct sddc_shm_stats *stats)
+{
+  shm_reader_t *shm_reader = usb_device_get_shm_reader(this->usb_device);
+  if (shm_reader == 0) {
+    fprintf(stderr, "ERROR - sddc_get_shm_stats() failed - not a shm:// device\n");
+    return -1;
+  }
+  shm_reader_get_stats(shm_reader, stats);
+  return 0;
+}
+
+
+/******************************
+ * multi-device sessions
+ ******************************/
+sddc_session_t *sddc_session_open()
+{
+  sddc_session_t *ret_val = 0;
+
+  libusb_context *context = usb_device_open_context();
+  if (context == 0) {
+    fprintf(stderr, "ERROR - usb_device_open_context() failed\n");
+    return ret_val;
+  }
+
+  sddc_session_t *this = (sddc_session_t *) malloc(sizeof(sddc_session_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    usb_device_close_context(context);
+    return ret_val;
+  }
+  this->context = context;
+  this->num_devices = 0;
+  this->event_thread_params.enable = 0;                /* no event thread */
+  this->event_thread_params.cpu_affinity_mask = 0;
+  this->event_thread_params.realtime_priority = 0;
+  this->event_thread_params.lock_memory = 0;
+  this->event_thread = 0;
+
+  ret_val = this;
+  return ret_val;
+}
+
+void sddc_session_close(sddc_session_t *this)
+{
+  sddc_session_stop_streaming(this);
+  while (this->num_devices > 0) {
+    sddc_close(this->devices[this->num_devices - 1]);
+  }
+  usb_device_close_context(this->context);
+  free(this);
+  return;
+}
+
+sddc_t *sddc_session_open_device(sddc_session_t *this, int index,
+                                 const char* imagefile)
+{
+  sddc_t *ret_val = 0;
+
+  if (this->num_devices >= SDDC_MAX_SESSION_DEVICES) {
+    fprintf(stderr, "ERROR - sddc_session_open_device() failed - too many devices\n");
+    return ret_val;
+  }
+  usb_device_t *usb_device = usb_device_open_shared(this->context, index,
+                                                    imagefile, 0);
+  if (usb_device == 0) {
+    fprintf(stderr, "ERROR - usb_device_open_shared() failed\n");
+    return ret_val;
+  }
+  ret_val = sddc_open_usb_device(usb_device);
+  if (ret_val == 0) {
+    usb_device_close(usb_device);
+    return ret_val;
+  }
+  ret_val->session = this;
+  this->devices[this->num_devices++] = ret_val;
+  return ret_val;
+}
+
+int sddc_session_set_event_thread_params(sddc_session_t *this,
+                                 const struct sddc_event_thread_params *params)
+{
+  if (this->event_thread) {
+    fprintf(stderr, "ERROR - sddc_session_set_event_thread_params() failed - session is streaming\n");
+    return -1;
+  }
+  if (params->realtime_priority < 0) {
+    fprintf(stderr, "ERROR - invalid realtime priority: %d\n", params->realtime_priority);
+    return -1;
+  }
+  this->event_thread_params = *params;
+  return 0;
+}
+
+int sddc_session_start_streaming(sddc_session_t *this)
+{
+  usb_device_t *usb_devices[SDDC_MAX_SESSION_DEVICES];
+  int prepared = 0;
+  for (; prepared < this->num_devices; ++prepared) {
+    sddc_t *device = this->devices[prepared];
+    int status = sddc_set_status(device, SDDC_STATUS_READY, SDDC_STATUS_STARTING);
+    if (status != SDDC_STATUS_READY) {
+      fprintf(stderr, "ERROR - sddc_session_start_streaming() - device %d status not READY: %d\n",
+              prepared, status);
+      goto FAIL0;
+    }
+    if (sddc_start_streaming_prepare(device) < 0) {
+      atomic_store(&device->status, SDDC_STATUS_READY);
+      goto FAIL0;
+    }
+    usb_devices[prepared] = device->usb_device;
+  }
+
+  /* one event thread for all the devices; in sync mode nothing else
+     would handle the events */
+  int any_sync = 0;
+  for (int i = 0; i < this->num_devices; ++i) {
+    if (this->devices[i]->sync_buffer) {
+      any_sync = 1;
+    }
+  }
+  if (this->event_thread_params.enable || any_sync) {
+    struct sddc_event_thread_params params = this->event_thread_params;
+    params.enable = 1;
+    this->event_thread = event_thread_start(&params,
+                                            sddc_session_event_thread_handler,
+                                            this);
+    if (this->event_thread == 0) {
+      fprintf(stderr, "ERROR - event_thread_start() failed\n");
+      goto FAIL0;
+    }
+  }
+
+  /* start all the producers at the same time */
+  int ret = usb_device_control_all(usb_devices, this->num_devices, STARTFX3);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - usb_device_control_all(STARTFX3) failed\n");
+    usb_device_control_all(usb_devices, this->num_devices, STOPFX3);
+    goto FAIL0;
+  }
+
+  /* all good */
+  for (int i = 0; i < this->num_devices; ++i) {
+    atomic_store(&this->devices[i]->status, SDDC_STATUS_STREAMING);
+  }
+  return 0;
+
+FAIL0:
+  for (int i = 0; i < prepared; ++i) {
+    sddc_stop_streaming_transfers(this->devices[i]);
+  }
+  if (this->event_thread) {
+    event_thread_stop(this->event_thread);
+    this->event_thread = 0;
+  }
+  for (int i = 0; i < prepared; ++i) {
+    sddc_stop_streaming_finish(this->devices[i]);
+  }
+  return -1;
+}
+
+int sddc_session_handle_events(sddc_session_t *this)
+{
+  if (this->event_thread) {
+    /* events are handled by the session event thread */
+    if (event_thread_failed(this->event_thread)) {
+      fprintf(stderr, "ERROR - sddc_session_handle_events() failed - event thread failed\n");
+      return -1;
+    }
+    usleep(EVENT_THREAD_TIMEOUT * 1000);
+    return 0;
+  }
+  return usb_device_handle_context_events_timeout(this->context,
+                                                  EVENT_THREAD_TIMEOUT);
+}
+
+int sddc_session_stop_streaming(sddc_session_t *this)
+{
+  int ret_val = 0;
+
+  usb_device_t *usb_devices[SDDC_MAX_SESSION_DEVICES];
+  sddc_t *devices[SDDC_MAX_SESSION_DEVICES];
+  int num_devices = 0;
+  for (int i = 0; i < this->num_devices; ++i) {
+    if (sddc_set_status(this->devices[i], SDDC_STATUS_STREAMING,
+                        SDDC_STATUS_STOPPING) == SDDC_STATUS_STREAMING) {
+      devices[num_devices] = this->devices[i];
+      usb_devices[num_devices] = this->devices[i]->usb_device;
+      num_devices++;
+    }
+  }
+
+  /* stop all the producers */
+  int ret = usb_device_control_all(usb_devices, num_devices, STOPFX3);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - usb_device_control_all(STOPFX3) failed\n");
+    ret_val = -1;
+  }
+
+  for (int i = 0; i < num_devices; ++i) {
+    if (sddc_stop_streaming_transfers(devices[i]) < 0) {
+      ret_val = -1;
+    }
+  }
+
+  /* the transfers have been cancelled by now */
+  if (this->event_thread) {
+    event_thread_stop(this->event_thread);
+    this->event_thread = 0;
+  }
+
+  for (int i = 0; i < num_devices; ++i) {
+    if (sddc_stop_streaming_finish(devices[i]) < 0) {
+      ret_val = -1;
+    }
+  }
+  return ret_val;
+}
+
+
+/******************************
+ * Misc functions
+ ******************************/
+double sddc_get_frequency_correction(sddc_t *this)
+{
+  return this->freq_corr_ppm;
+}
+
+int sddc_set_frequency_correction(sddc_t *this, double correction)
+{
+  if (sddc_is_streaming(this)) {
+    fprintf(stderr, "ERROR - sddc_set_frequency_correction() failed - device is streaming\n");
+    return -1;
+  }
+  this->freq_corr_ppm = correction;
+  return 0;
+}
+
+
+/* internal functions */
+/* helper method to configure GPIOs for VHF */
+int sddc_set_vhf_gpios(sddc_t* this) {
+    return usb_device_gpio_set(this->usb_device, 0, GPIO_ATT_SEL0 | GPIO_ATT_SEL1);
+}
+
+/* event thread handler */
+static int sddc_event_thread_handler(void *context) {
+  sddc_t *this = (sddc_t *) context;
+  int ret = usb_device_handle_events_timeout(this->usb_device, EVENT_THREAD_TIMEOUT);
+  /* the event thread stops here: don't keep sddc_read_sync() waiting */
+  if (ret < 0 && this->sync_buffer) {
+    sync_buffer_fail(this->sync_buffer);
+  }
+  return ret;
+}
+
+/* sync mode: the stream and the buffer are set up once, and kept across
+   stop/start like the ones of async mode */
+static int sddc_open_sync_streaming(sddc_t *this)
+{
+  if (this->sync_buffer == 0) {
+    this->sync_buffer = sync_buffer_open(this->sync_buffer_size);
+    if (this->sync_buffer == 0) {
+      fprintf(stderr, "ERROR - sync_buffer_open() failed\n");
+      return -1;
+    }
+    this->streaming = streaming_open_async2(this->usb_device, SDDC_ASYNC_AUTO,
+                                            SDDC_ASYNC_AUTO,
+                                            sddc_sync_callback, this);
+    if (this->streaming == 0) {
+      fprintf(stderr, "ERROR - streaming_open_async2() failed\n");
+      sync_buffer_close(this->sync_buffer);
+      this->sync_buffer = 0;
+      return -1;
+    }
+  }
+  /* what was not read before the last stop is stale */
+  sync_buffer_reset(this->sync_buffer);
+  return 0;
+}
+
+static void sddc_sync_callback(uint32_t data_size, uint8_t *data,
+                               const struct sddc_frame_info *info,
+                               void *context)
+{
+  sddc_t *this = (sddc_t *) context;
+  (void) info;
+  sync_buffer_write(this->sync_buffer, data, data_size);
+}
+
+static int sddc_session_event_thread_handler(void *context) {
+  sddc_session_t *this = (sddc_session_t *) context;
+  int ret = usb_device_handle_context_events_timeout(this->context,
+                                                     EVENT_THREAD_TIMEOUT);
+  if (ret < 0) {
+    for (int i = 0; i < this->num_devices; ++i) {
+      if (this->devices[i]->sync_buffer) {
+        sync_buffer_fail(this->devices[i]->sync_buffer);
+      }
+    }
+  }
+  return ret;
+}
+
+/* returns the status before: the status is changed only if it was 'from' */
+static int sddc_set_status(sddc_t *this, int from, int to)
+{
+  int status = from;
+  atomic_compare_exchange_strong(&this->status, &status, to);
+  return status;
+}
+
+/* the configuration cannot change from the start of sddc_start_streaming()
+   to the end of sddc_stop_streaming() */
+static int sddc_is_streaming(sddc_t *this)
+{
+  int status = atomic_load(&this->status);
+  return status == SDDC_STATUS_STREAMING || status == SDDC_STATUS_STARTING ||
+         status == SDDC_STATUS_STOPPING;
 }
@@ -0,0 +1,147 @@
+/*
+ * net_protocol.h - sddc_server wire format
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __NET_PROTOCOL_H
+#define __NET_PROTOCOL_H
+
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* every UDP datagram, and every record on a TCP connection, is one of
+   these headers followed by payload_size bytes of samples (little endian,
+   like the USB frames). A frame is split into as many datagrams as the
+   payload size allows, each one a whole number of samples (of sample
+   pairs for SAMPLE_FORMAT_REAL_PACKED12); on TCP every frame is one
+   record. sample_index is the one of the first sample in the payload */
+#define NET_MAGIC 0x43444453            /* "SDDC" */
+#define NET_VERSION 1
+
+#define NET_FLAG_FRAME_START 0x00010000 /* first packet of a frame */
+#define NET_FLAG_FRAME_END   0x00020000 /* last packet of a frame */
+#define NET_FRAME_FLAGS_MASK 0x0000ffff /* the SDDC_FRAME_FLAG_* */
+
+struct net_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;         /* sizeof(struct net_header) */
+  uint32_t sequence;            /* per stream (UDP) or connection (TCP) */
+  uint32_t payload_size;
+  uint64_t sample_index;        /* struct sddc_frame_info ... */
+  uint64_t monotonic_time_ns;   /* ... of the frame */
+  uint64_t realtime_ns;
+  uint64_t lost_samples;        /* on the first packet of a frame only */
+  double sample_rate;           /* of the payload */
+  uint32_t flags;
+  uint8_t format;               /* enum SDDCSampleFormat */
+  uint8_t shift;                /* SAMPLE_FORMAT_REAL_INT8: sample >> shift
+                                   (SAMPLE_FORMAT_REAL_PACKED12 is 4) */
+  uint8_t reserved[2];
+};
+
+/* all the fields are naturally aligned, so there is no padding */
+_Static_assert(sizeof(struct net_header) == 64, "struct net_header must be 64 bytes");
+
+/* payload bytes per unit of a whole number of samples */
+static inline uint32_t net_unit_bytes(enum SDDCSampleFormat format)
+{
+  switch (format) {
+    case SAMPLE_FORMAT_REAL_INT16:
+      return sizeof(int16_t);
+    case SAMPLE_FORMAT_COMPLEX_INT16:
+      return 2 * sizeof(int16_t);
+    case SAMPLE_FORMAT_COMPLEX_FLOAT32:
+      return 2 * sizeof(float);
+    case SAMPLE_FORMAT_REAL_FLOAT32:
+      return sizeof(float);
+    case SAMPLE_FORMAT_REAL_INT8:
+      return sizeof(int8_t);
+    case SAMPLE_FORMAT_REAL_PACKED12:
+      return 3;
+  }
+  return 0;
+}
+
+static inline uint32_t net_unit_samples(enum SDDCSampleFormat format)
+{
+  return format == SAMPLE_FORMAT_REAL_PACKED12 ? 2 : 1;
+}
+
+/* "<host>:<port>" or "[<IPv6 address>]:<port>" - an empty host is the
+   wildcard address (to bind to) */
+static inline int net_resolve(const char *spec, int socktype,
+                              struct sockaddr_storage *addr,
+                              socklen_t *addrlen)
+{
+  char host[256];
+  const char *port;
+  if (spec[0] == '[') {
+    const char *end = strchr(spec, ']');
+    if (end == 0 || end[1] != ':' || (size_t) (end - spec - 1) >= sizeof(host)) {
+      fprintf(stderr, "ERROR - invalid address: %s\n", spec);
+      return -1;
+    }
+    memcpy(host, spec + 1, end - spec - 1);
+    host[end - spec - 1] = '\0';
+    port = end + 2;
+  } else {
+    const char *colon = strrchr(spec, ':');
+    if (colon == 0 || (size_t) (colon - spec) >= sizeof(host)) {
+      fprintf(stderr, "ERROR - invalid address: %s\n", spec);
+      return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    port = colon + 1;
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = socktype;
+  hints.ai_flags = host[0] ? 0 : AI_PASSIVE;
+  struct addrinfo *result;
+  int ret = getaddrinfo(host[0] ? host : 0, port, &hints, &result);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - getaddrinfo(%s) failed: %s\n", spec,
+            gai_strerror(ret));
+    return -1;
+  }
+  memcpy(addr, result->ai_addr, result->ai_addrlen);
+  *addrlen = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NET_PROTOCOL_H */
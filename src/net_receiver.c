@@ -0,0 +1,853 @@
+/*
+ * net_receiver.c - virtual device for the sddc_server streams
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net_receiver.h"
+#include "net_protocol.h"
+
+
+struct queued_transfer {
+  struct libusb_transfer *transfer;
+  int cancelled;
+  uint32_t filled;              /* bytes */
+};
+
+/* struct sddc_net_stats, atomic so that it can be read without the lock */
+struct net_receiver_counters {
+  atomic_ullong packets;
+  atomic_ullong bytes;
+  atomic_ullong lost_samples;
+  atomic_ullong dropped_packets;
+  atomic_ullong resyncs;
+  atomic_int connected;
+};
+
+typedef struct net_receiver {
+  int fd;
+  int tcp;
+  int wakeup_fd;                /* eventfd: submit, cancel, start and stop */
+  int has_stream;               /* format and sample rate known */
+  enum SDDCSampleFormat format;
+  uint8_t shift;
+  uint32_t unit_bytes;
+  uint32_t unit_samples;
+  double sample_rate;
+  pthread_mutex_t lock;
+  struct queued_transfer *queue;
+  uint32_t queue_length;
+  uint32_t queue_capacity;
+  int running;
+  int warned_format;
+
+  /* UDP: a batch of datagrams from recvmmsg() */
+  uint8_t *datagrams;
+  struct mmsghdr *messages;
+  struct iovec *iovecs;
+  uint32_t num_datagrams;
+  uint32_t next_datagram;
+
+  /* TCP: the record being read */
+  struct net_header record_header;
+  uint32_t record_header_bytes;
+  uint8_t *record;
+  uint32_t record_capacity;
+  uint32_t record_bytes;
+
+  /* the packet being delivered, after zero_fill samples of zeros */
+  const uint8_t *payload;
+  uint32_t payload_samples;
+  uint32_t consumed;            /* samples */
+  uint64_t zero_fill;
+  uint64_t next_sample_index;
+  int synced;
+
+  struct net_receiver_counters stats;
+} net_receiver_t;
+
+
+static const int DEFAULT_TIMEOUT = 1000;        /* ms */
+static const int OPEN_TIMEOUT = 5000;           /* ms */
+static const uint32_t RECV_BATCH = 32;
+static const uint32_t MAX_DATAGRAM_SIZE = 65536;
+static const uint32_t MAX_RECORD_SIZE = 64 * 1024 * 1024;
+static const uint32_t MAX_DRAIN_PACKETS = 65536;
+static const int RECEIVE_BUFFER_SIZE = 8 * 1024 * 1024;
+
+
+/* internal functions */
+static int open_udp(net_receiver_t *this, const char *spec);
+static int open_tcp(net_receiver_t *this, const char *spec);
+static int receive(net_receiver_t *this);
+static int receive_udp(net_receiver_t *this);
+static int receive_tcp(net_receiver_t *this);
+static int set_packet(net_receiver_t *this, const struct net_header *header,
+                      const uint8_t *payload);
+static int fill(net_receiver_t *this, uint8_t *data, uint32_t length,
+                uint32_t *filled);
+static void expand(net_receiver_t *this, int16_t *output, uint32_t n);
+static void wait_for_events(net_receiver_t *this, int with_socket,
+                            uint64_t deadline);
+static void wakeup(net_receiver_t *this);
+static inline uint64_t monotonic_ns(void);
+
+
+net_receiver_t *net_receiver_open(const char *url)
+{
+  net_receiver_t *ret_val = 0;
+
+  net_receiver_t *this = (net_receiver_t *) malloc(sizeof(net_receiver_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->fd = -1;
+  this->tcp = 0;
+  this->has_stream = 0;
+  this->format = SAMPLE_FORMAT_REAL_INT16;
+  this->shift = 0;
+  this->unit_bytes = sizeof(int16_t);
+  this->unit_samples = 1;
+  this->sample_rate = 0;
+  this->queue = 0;
+  this->queue_length = 0;
+  this->queue_capacity = 0;
+  this->running = 0;
+  this->warned_format = 0;
+  this->datagrams = 0;
+  this->messages = 0;
+  this->iovecs = 0;
+  this->num_datagrams = 0;
+  this->next_datagram = 0;
+  this->record_header_bytes = 0;
+  this->record = 0;
+  this->record_capacity = 0;
+  this->record_bytes = 0;
+  this->payload = 0;
+  this->payload_samples = 0;
+  this->consumed = 0;
+  this->zero_fill = 0;
+  this->next_sample_index = 0;
+  this->synced = 0;
+  memset(&this->stats, 0, sizeof(this->stats));
+  this->stats.connected = 1;
+
+  this->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (this->wakeup_fd < 0) {
+    fprintf(stderr, "ERROR - eventfd() failed: %s\n", strerror(errno));
+    goto FAIL1;
+  }
+  if (strncmp(url, "udp://", 6) == 0) {
+    if (open_udp(this, url + 6) < 0) {
+      goto FAIL2;
+    }
+  } else if (strncmp(url, "tcp://", 6) == 0) {
+    if (open_tcp(this, url + 6) < 0) {
+      goto FAIL2;
+    }
+  } else {
+    fprintf(stderr, "ERROR - not a udp:// or tcp:// stream: %s\n", url);
+    goto FAIL2;
+  }
+
+  /* the first packet says what the stream is */
+  uint64_t deadline = monotonic_ns() + (uint64_t) OPEN_TIMEOUT * 1000000;
+  while (1) {
+    int ret = receive(this);
+    if (ret > 0) {
+      break;
+    }
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - connection to %s closed\n", url);
+      goto FAIL3;
+    }
+    uint64_t now = monotonic_ns();
+    if (now >= deadline) {
+      fprintf(stderr, "ERROR - nothing received from %s\n", url);
+      goto FAIL3;
+    }
+    struct pollfd pollfd = { .fd = this->fd, .events = POLLIN };
+    poll(&pollfd, 1, (int) ((deadline - now + 999999) / 1000000));
+  }
+  if (this->format != SAMPLE_FORMAT_REAL_INT16 &&
+      this->format != SAMPLE_FORMAT_REAL_INT8 &&
+      this->format != SAMPLE_FORMAT_REAL_PACKED12) {
+    fprintf(stderr, "ERROR - %s is not a stream of raw real samples (format %d)\n",
+            url, this->format);
+    goto FAIL3;
+  }
+  pthread_mutex_init(&this->lock, 0);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL3:
+  free(this->record);
+  free(this->datagrams);
+  close(this->fd);
+FAIL2:
+  close(this->wakeup_fd);
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void net_receiver_close(net_receiver_t *this)
+{
+  pthread_mutex_destroy(&this->lock);
+  free(this->queue);
+  free(this->record);
+  free(this->datagrams);
+  close(this->fd);
+  close(this->wakeup_fd);
+  free(this);
+  return;
+}
+
+
+double net_receiver_get_sample_rate(net_receiver_t *this)
+{
+  return this->sample_rate;
+}
+
+
+void net_receiver_set_sample_rate(net_receiver_t *this, double sample_rate)
+{
+  if (sample_rate != this->sample_rate) {
+    fprintf(stderr, "WARNING - the remote stream is at %.0f sps, not %.0f sps\n",
+            this->sample_rate, sample_rate);
+  }
+}
+
+
+void net_receiver_start(net_receiver_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  /* throw away what was queued while stopped - keeping the TCP records
+     in sync */
+  this->payload = 0;
+  this->zero_fill = 0;
+  for (uint32_t i = 0; i < MAX_DRAIN_PACKETS && receive(this) > 0; ++i) {
+    this->payload = 0;
+    this->zero_fill = 0;
+  }
+  this->payload = 0;
+  this->zero_fill = 0;
+  this->synced = 0;
+  this->running = 1;
+  wakeup(this);
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void net_receiver_stop(net_receiver_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  this->running = 0;
+  wakeup(this);
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void net_receiver_get_stats(net_receiver_t *this,
+                            struct sddc_net_stats *stats)
+{
+  stats->packets = atomic_load_explicit(&this->stats.packets, memory_order_relaxed);
+  stats->bytes = atomic_load_explicit(&this->stats.bytes, memory_order_relaxed);
+  stats->lost_samples = atomic_load_explicit(&this->stats.lost_samples, memory_order_relaxed);
+  stats->dropped_packets = atomic_load_explicit(&this->stats.dropped_packets, memory_order_relaxed);
+  stats->resyncs = atomic_load_explicit(&this->stats.resyncs, memory_order_relaxed);
+  stats->connected = atomic_load_explicit(&this->stats.connected, memory_order_relaxed);
+}
+
+
+int net_receiver_submit_transfer(net_receiver_t *this,
+                                 struct libusb_transfer *transfer)
+{
+  int ret_val = 0;
+  pthread_mutex_lock(&this->lock);
+  for (uint32_t i = 0; i < this->queue_length; ++i) {
+    if (this->queue[i].transfer == transfer) {
+      ret_val = LIBUSB_ERROR_BUSY;
+      goto DONE;
+    }
+  }
+  if (this->queue_length == this->queue_capacity) {
+    uint32_t capacity = this->queue_capacity ? 2 * this->queue_capacity : 64;
+    struct queued_transfer *queue = (struct queued_transfer *) realloc(this->queue,
+                                        capacity * sizeof(struct queued_transfer));
+    if (queue == 0) {
+      ret_val = LIBUSB_ERROR_NO_MEM;
+      goto DONE;
+    }
+    this->queue = queue;
+    this->queue_capacity = capacity;
+  }
+  this->queue[this->queue_length].transfer = transfer;
+  this->queue[this->queue_length].cancelled = 0;
+  this->queue[this->queue_length].filled = 0;
+  this->queue_length++;
+  wakeup(this);
+DONE:
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+int net_receiver_cancel_transfer(net_receiver_t *this,
+                                 struct libusb_transfer *transfer)
+{
+  int ret_val = LIBUSB_ERROR_NOT_FOUND;
+  pthread_mutex_lock(&this->lock);
+  for (uint32_t i = 0; i < this->queue_length; ++i) {
+    if (this->queue[i].transfer == transfer) {
+      this->queue[i].cancelled = 1;
+      ret_val = 0;
+      wakeup(this);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+/* completes the transfers in order as the stream fills them, and returns
+   when at least one has been completed, or on timeout */
+int net_receiver_handle_events(net_receiver_t *this, int timeout_ms)
+{
+  if (timeout_ms < 0) {
+    timeout_ms = DEFAULT_TIMEOUT;
+  }
+  uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+
+  pthread_mutex_lock(&this->lock);
+  /* at most one pass over the queue, so that the callbacks resubmitting
+     their transfers do not keep us here */
+  uint32_t budget = 0;
+  uint32_t completed = 0;
+  while (1) {
+    if (completed == 0) {
+      budget = this->queue_length;
+    }
+    /* the cancelled transfers and the control transfers (already applied
+       by the virtual device) complete right away */
+    struct libusb_transfer *transfer = 0;
+    int cancelled = 0;
+    for (uint32_t i = 0; i < this->queue_length; ++i) {
+      if (this->queue[i].cancelled ||
+          this->queue[i].transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        transfer = this->queue[i].transfer;
+        cancelled = this->queue[i].cancelled;
+        memmove(&this->queue[i], &this->queue[i+1],
+                (this->queue_length - i - 1) * sizeof(struct queued_transfer));
+        this->queue_length--;
+        break;
+      }
+    }
+    if (transfer && cancelled) {
+      transfer->status = LIBUSB_TRANSFER_CANCELLED;
+      transfer->actual_length = 0;
+    } else if (transfer) {
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+      transfer->actual_length = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+    } else if (completed < budget && this->queue_length > 0 &&
+               this->running && this->stats.connected) {
+      struct queued_transfer *queued = &this->queue[0];
+      int ret = fill(this, queued->transfer->buffer,
+                     (uint32_t) queued->transfer->length, &queued->filled);
+      if (ret < 0) {
+        fprintf(stderr, "ERROR - the sddc_server connection was closed\n");
+        this->stats.connected = 0;
+        continue;
+      }
+      if (ret == 0) {
+        if (completed > 0 || monotonic_ns() >= deadline) {
+          break;
+        }
+        wait_for_events(this, 1, deadline);
+        continue;
+      }
+      transfer = queued->transfer;
+      memmove(&this->queue[0], &this->queue[1],
+              (this->queue_length - 1) * sizeof(struct queued_transfer));
+      this->queue_length--;
+      transfer->actual_length = transfer->length;
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    } else {
+      /* nothing to complete - wait for a submit, a cancel or a start */
+      if (completed > 0 || monotonic_ns() >= deadline) {
+        break;
+      }
+      wait_for_events(this, 0, deadline);
+      continue;
+    }
+    completed++;
+    pthread_mutex_unlock(&this->lock);
+    transfer->callback(transfer);
+    pthread_mutex_lock(&this->lock);
+  }
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+
+int net_receiver_bulk_transfer(net_receiver_t *this, uint8_t *data,
+                               int length, int *transferred, int timeout_ms)
+{
+  uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+  uint32_t filled = 0;
+  int ret_val = LIBUSB_ERROR_TIMEOUT;
+  pthread_mutex_lock(&this->lock);
+  while (1) {
+    int receiving = this->running && this->stats.connected;
+    if (receiving) {
+      int ret = fill(this, data, (uint32_t) length, &filled);
+      if (ret > 0) {
+        ret_val = 0;
+        break;
+      }
+      if (ret < 0) {
+        fprintf(stderr, "ERROR - the sddc_server connection was closed\n");
+        this->stats.connected = 0;
+        ret_val = LIBUSB_ERROR_IO;
+        break;
+      }
+    }
+    if (monotonic_ns() >= deadline) {
+      break;
+    }
+    wait_for_events(this, receiving, deadline);
+  }
+  pthread_mutex_unlock(&this->lock);
+  *transferred = (int) filled;
+  return ret_val;
+}
+
+
+/* internal functions */
+static int open_udp(net_receiver_t *this, const char *spec)
+{
+  /* <address>:<port>[@<interface>] */
+  char address[512];
+  unsigned int ifindex = 0;
+  const char *at = strchr(spec, '@');
+  size_t length = at ? (size_t) (at - spec) : strlen(spec);
+  if (length >= sizeof(address)) {
+    fprintf(stderr, "ERROR - invalid address: %s\n", spec);
+    return -1;
+  }
+  memcpy(address, spec, length);
+  address[length] = '\0';
+  if (at) {
+    ifindex = if_nametoindex(at + 1);
+    if (ifindex == 0) {
+      fprintf(stderr, "ERROR - unknown interface: %s\n", at + 1);
+      return -1;
+    }
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  if (net_resolve(address, SOCK_DGRAM, &addr, &addrlen) < 0) {
+    return -1;
+  }
+  int multicast = 0;
+  if (addr.ss_family == AF_INET6) {
+    multicast = IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *) &addr)->sin6_addr);
+  } else {
+    multicast = IN_MULTICAST(ntohl(((struct sockaddr_in *) &addr)->sin_addr.s_addr));
+  }
+
+  int fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - socket() failed: %s\n", strerror(errno));
+    return -1;
+  }
+  int one = 1;
+  int zero = 0;
+  /* several receivers of the same group on one host */
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &RECEIVE_BUFFER_SIZE,
+             sizeof(RECEIVE_BUFFER_SIZE));
+  if (addr.ss_family == AF_INET6) {
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, multicast ? &one : &zero,
+               sizeof(int));
+  }
+
+  struct sockaddr_storage bind_addr = addr;
+  if (multicast && addr.ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *) &bind_addr)->sin6_addr = in6addr_any;
+  } else if (multicast) {
+    ((struct sockaddr_in *) &bind_addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+  }
+  if (bind(fd, (struct sockaddr *) &bind_addr, addrlen) < 0) {
+    fprintf(stderr, "ERROR - bind(%s) failed: %s\n", address, strerror(errno));
+    goto FAIL;
+  }
+  if (multicast && addr.ss_family == AF_INET6) {
+    struct ipv6_mreq mreq;
+    mreq.ipv6mr_multiaddr = ((struct sockaddr_in6 *) &addr)->sin6_addr;
+    mreq.ipv6mr_interface = ifindex;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq,
+                   sizeof(mreq)) < 0) {
+      fprintf(stderr, "ERROR - setsockopt(IPV6_JOIN_GROUP) failed: %s\n",
+              strerror(errno));
+      goto FAIL;
+    }
+  } else if (multicast) {
+    struct ip_mreqn mreqn;
+    memset(&mreqn, 0, sizeof(mreqn));
+    mreqn.imr_multiaddr = ((struct sockaddr_in *) &addr)->sin_addr;
+    mreqn.imr_ifindex = ifindex;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreqn,
+                   sizeof(mreqn)) < 0) {
+      fprintf(stderr, "ERROR - setsockopt(IP_ADD_MEMBERSHIP) failed: %s\n",
+              strerror(errno));
+      goto FAIL;
+    }
+  }
+
+  /* one allocation for the datagrams, their iovecs and their headers */
+  size_t size = RECV_BATCH * ((size_t) MAX_DATAGRAM_SIZE +
+                              sizeof(struct iovec) + sizeof(struct mmsghdr));
+  this->datagrams = (uint8_t *) malloc(size);
+  if (this->datagrams == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL;
+  }
+  this->iovecs = (struct iovec *) (this->datagrams + RECV_BATCH * MAX_DATAGRAM_SIZE);
+  this->messages = (struct mmsghdr *) (this->iovecs + RECV_BATCH);
+  for (uint32_t i = 0; i < RECV_BATCH; ++i) {
+    this->iovecs[i].iov_base = this->datagrams + i * MAX_DATAGRAM_SIZE;
+    this->iovecs[i].iov_len = MAX_DATAGRAM_SIZE;
+    memset(&this->messages[i], 0, sizeof(struct mmsghdr));
+    this->messages[i].msg_hdr.msg_iov = &this->iovecs[i];
+    this->messages[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  this->fd = fd;
+  this->tcp = 0;
+  return 0;
+
+FAIL:
+  close(fd);
+  return -1;
+}
+
+static int open_tcp(net_receiver_t *this, const char *spec)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  if (net_resolve(spec, SOCK_STREAM, &addr, &addrlen) < 0) {
+    return -1;
+  }
+  int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - socket() failed: %s\n", strerror(errno));
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &RECEIVE_BUFFER_SIZE,
+             sizeof(RECEIVE_BUFFER_SIZE));
+  if (connect(fd, (struct sockaddr *) &addr, addrlen) < 0) {
+    fprintf(stderr, "ERROR - connect(%s) failed: %s\n", spec, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  this->fd = fd;
+  this->tcp = 1;
+  return 0;
+}
+
+/* 1 with a new packet to deliver, 0 when there is nothing to read right
+   now, -1 when the TCP connection is gone */
+static int receive(net_receiver_t *this)
+{
+  return this->tcp ? receive_tcp(this) : receive_udp(this);
+}
+
+static int receive_udp(net_receiver_t *this)
+{
+  while (1) {
+    if (this->next_datagram == this->num_datagrams) {
+      int ret = recvmmsg(this->fd, this->messages, RECV_BATCH, MSG_DONTWAIT, 0);
+      if (ret <= 0) {
+        return 0;
+      }
+      this->num_datagrams = (uint32_t) ret;
+      this->next_datagram = 0;
+    }
+    uint32_t i = this->next_datagram++;
+    const uint8_t *datagram = this->datagrams + i * MAX_DATAGRAM_SIZE;
+    uint32_t size = this->messages[i].msg_len;
+    struct net_header header;
+    if (size < sizeof(header)) {
+      this->stats.dropped_packets++;
+      continue;
+    }
+    memcpy(&header, datagram, sizeof(header));
+    if (header.magic != NET_MAGIC || header.version != NET_VERSION ||
+        header.header_size != sizeof(header) ||
+        header.payload_size != size - sizeof(header)) {
+      this->stats.dropped_packets++;
+      continue;
+    }
+    if (set_packet(this, &header, datagram + sizeof(header))) {
+      return 1;
+    }
+  }
+}
+
+static int receive_tcp(net_receiver_t *this)
+{
+  while (1) {
+    uint8_t *buffer;
+    uint32_t wanted;
+    if (this->record_header_bytes < sizeof(struct net_header)) {
+      buffer = (uint8_t *) &this->record_header + this->record_header_bytes;
+      wanted = sizeof(struct net_header) - this->record_header_bytes;
+    } else {
+      buffer = this->record + this->record_bytes;
+      wanted = this->record_header.payload_size - this->record_bytes;
+    }
+    if (wanted > 0) {
+      ssize_t ret = recv(this->fd, buffer, wanted, MSG_DONTWAIT);
+      if (ret == 0) {
+        return -1;
+      }
+      if (ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+      }
+      if (this->record_header_bytes < sizeof(struct net_header)) {
+        this->record_header_bytes += (uint32_t) ret;
+        if (this->record_header_bytes < sizeof(struct net_header)) {
+          continue;
+        }
+        /* a bad header means we are out of sync with the stream */
+        const struct net_header *header = &this->record_header;
+        if (header->magic != NET_MAGIC || header->version != NET_VERSION ||
+            header->header_size != sizeof(struct net_header) ||
+            header->payload_size > MAX_RECORD_SIZE) {
+          fprintf(stderr, "ERROR - invalid record from sddc_server\n");
+          return -1;
+        }
+        if (header->payload_size > this->record_capacity) {
+          uint8_t *record = (uint8_t *) realloc(this->record,
+                                                header->payload_size);
+          if (record == 0) {
+            fprintf(stderr, "ERROR - realloc() failed\n");
+            return -1;
+          }
+          this->record = record;
+          this->record_capacity = header->payload_size;
+        }
+        continue;
+      }
+      this->record_bytes += (uint32_t) ret;
+      if (this->record_bytes < this->record_header.payload_size) {
+        continue;
+      }
+    }
+    /* a whole record - the buffer is only read into again once it has
+       been delivered */
+    this->record_header_bytes = 0;
+    this->record_bytes = 0;
+    if (set_packet(this, &this->record_header, this->record)) {
+      return 1;
+    }
+  }
+}
+
+/* makes the packet the one to deliver next (and returns 1), after as many
+   zeros as samples are missing before it */
+static int set_packet(net_receiver_t *this, const struct net_header *header,
+                      const uint8_t *payload)
+{
+  if (!this->has_stream) {
+    uint32_t unit_bytes = net_unit_bytes((enum SDDCSampleFormat) header->format);
+    if (unit_bytes == 0 || header->sample_rate <= 0) {
+      this->stats.dropped_packets++;
+      return 0;
+    }
+    this->format = (enum SDDCSampleFormat) header->format;
+    this->shift = header->shift;
+    this->unit_bytes = unit_bytes;
+    this->unit_samples = net_unit_samples(this->format);
+    this->sample_rate = header->sample_rate;
+    this->has_stream = 1;
+  }
+  if (header->format != this->format || header->shift != this->shift ||
+      header->sample_rate != this->sample_rate ||
+      header->payload_size % this->unit_bytes != 0) {
+    /* the server was restarted with other settings */
+    if (!this->warned_format) {
+      fprintf(stderr, "WARNING - the sddc_server stream has changed format or sample rate\n");
+      this->warned_format = 1;
+    }
+    this->stats.dropped_packets++;
+    return 0;
+  }
+
+  uint32_t num_samples = header->payload_size / this->unit_bytes *
+                         this->unit_samples;
+  uint64_t max_gap = (uint64_t) this->sample_rate;
+  this->zero_fill = 0;
+  if (this->synced && header->sample_index < this->next_sample_index) {
+    if (this->next_sample_index - header->sample_index <= max_gap) {
+      this->stats.dropped_packets++;
+      return 0;
+    }
+    this->stats.resyncs++;
+  } else if (this->synced && header->sample_index > this->next_sample_index) {
+    uint64_t gap = header->sample_index - this->next_sample_index;
+    if (gap <= max_gap) {
+      this->zero_fill = gap;
+      this->stats.lost_samples += gap;
+    } else {
+      this->stats.resyncs++;
+    }
+  }
+  this->synced = 1;
+  this->next_sample_index = header->sample_index + num_samples;
+  this->payload = payload;
+  this->payload_samples = num_samples;
+  this->consumed = 0;
+  this->stats.packets++;
+  this->stats.bytes += sizeof(struct net_header) + header->payload_size;
+  return 1;
+}
+
+/* called with the lock held: 1 once length bytes are filled in, 0 when
+   the stream has nothing more for now, -1 when the TCP connection is gone */
+static int fill(net_receiver_t *this, uint8_t *data, uint32_t length,
+                uint32_t *filled)
+{
+  while (*filled + sizeof(int16_t) <= length) {
+    int16_t *output = (int16_t *) (data + *filled);
+    uint32_t room = (length - *filled) / sizeof(int16_t);
+    uint32_t n;
+    if (this->zero_fill > 0) {
+      n = this->zero_fill < room ? (uint32_t) this->zero_fill : room;
+      memset(output, 0, n * sizeof(int16_t));
+      this->zero_fill -= n;
+    } else if (this->payload && this->consumed < this->payload_samples) {
+      n = this->payload_samples - this->consumed;
+      n = n < room ? n : room;
+      expand(this, output, n);
+      this->consumed += n;
+    } else {
+      this->payload = 0;
+      int ret = receive(this);
+      if (ret <= 0) {
+        return ret;
+      }
+      continue;
+    }
+    *filled += n * sizeof(int16_t);
+  }
+  return 1;
+}
+
+/* the next n samples of the payload, as 16 bit samples */
+static void expand(net_receiver_t *this, int16_t *output, uint32_t n)
+{
+  uint32_t first = this->consumed;
+  switch (this->format) {
+    case SAMPLE_FORMAT_REAL_INT8: {
+      const int8_t *input = (const int8_t *) this->payload + first;
+      for (uint32_t k = 0; k < n; ++k) {
+        int32_t value = (int32_t) input[k] * (1 << this->shift);
+        value = value > INT16_MAX ? INT16_MAX : value;
+        value = value < INT16_MIN ? INT16_MIN : value;
+        output[k] = (int16_t) value;
+      }
+      break;
+    }
+    case SAMPLE_FORMAT_REAL_PACKED12:
+      /* the first sample of each pair in the low 12 bits */
+      for (uint32_t k = 0; k < n; ++k) {
+        uint32_t index = first + k;
+        const uint8_t *pair = this->payload + (index >> 1) * 3;
+        uint32_t word = pair[0] | (pair[1] << 8) | (pair[2] << 16);
+        uint16_t value = (uint16_t) ((index & 1 ? word >> 12 : word) & 0xfff);
+        output[k] = (int16_t) (uint16_t) (value << 4);
+      }
+      break;
+    default:
+      memcpy(output, this->payload + first * sizeof(int16_t),
+             n * sizeof(int16_t));
+      break;
+  }
+}
+
+/* called with the lock held, which is released while waiting */
+static void wait_for_events(net_receiver_t *this, int with_socket,
+                            uint64_t deadline)
+{
+  uint64_t now = monotonic_ns();
+  if (now >= deadline) {
+    return;
+  }
+  struct pollfd pollfds[2] = {
+    { .fd = this->wakeup_fd, .events = POLLIN },
+    { .fd = this->fd, .events = POLLIN }
+  };
+  pthread_mutex_unlock(&this->lock);
+  poll(pollfds, with_socket ? 2 : 1, (int) ((deadline - now + 999999) / 1000000));
+  if (pollfds[0].revents & POLLIN) {
+    uint64_t value;
+    if (read(this->wakeup_fd, &value, sizeof(value)) < 0) {
+      /* already read by another waiter */
+    }
+  }
+  pthread_mutex_lock(&this->lock);
+}
+
+static void wakeup(net_receiver_t *this)
+{
+  uint64_t one = 1;
+  if (write(this->wakeup_fd, &one, sizeof(one)) < 0) {
+    /* the counter is already non zero */
+  }
+}
+
+static inline uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
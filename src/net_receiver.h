@@ -0,0 +1,74 @@
+/*
+ * net_receiver.h - virtual device for the sddc_server streams
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __NET_RECEIVER_H
+#define __NET_RECEIVER_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct net_receiver net_receiver_t;
+
+/* "udp://..." or "tcp://..." (with the prefix): waits for the first
+   packet of the stream, which says its sample format and rate */
+net_receiver_t *net_receiver_open(const char *url);
+
+void net_receiver_close(net_receiver_t *this);
+
+double net_receiver_get_sample_rate(net_receiver_t *this);
+
+/* what the application asked for (from STARTADC) */
+void net_receiver_set_sample_rate(net_receiver_t *this, double sample_rate);
+
+/* STARTFX3/STOPFX3: whatever is queued in the socket when streaming
+   starts is stale and thrown away */
+void net_receiver_start(net_receiver_t *this);
+
+void net_receiver_stop(net_receiver_t *this);
+
+void net_receiver_get_stats(net_receiver_t *this,
+                            struct sddc_net_stats *stats);
+
+/* the libusb transfer API, served from the socket: same contract as
+   replay_submit_transfer() and friends */
+int net_receiver_submit_transfer(net_receiver_t *this,
+                                 struct libusb_transfer *transfer);
+
+int net_receiver_cancel_transfer(net_receiver_t *this,
+                                 struct libusb_transfer *transfer);
+
+int net_receiver_handle_events(net_receiver_t *this, int timeout_ms);
+
+int net_receiver_bulk_transfer(net_receiver_t *this, uint8_t *data,
+                               int length, int *transferred, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NET_RECEIVER_H */
@@ -0,0 +1,875 @@
+/*
+ * net_sender.c - sends the frames over UDP (multicast) and TCP
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net_sender.h"
+#include "net_protocol.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+
+/* struct net_sender_stats, atomic so that it can be read without the lock */
+struct net_sender_counters {
+  atomic_ullong frames;
+  atomic_ullong packets;
+  atomic_ullong bytes;
+  atomic_ullong send_errors;
+  atomic_ullong zerocopy_frames;
+  atomic_ullong zerocopy_copied;
+  atomic_uint tcp_clients;
+  atomic_ullong tcp_dropped_frames;
+};
+
+/* a frame the kernel still has zerocopy references to: its buffer and
+   the headers of its packets stay untouched until all the sends with ids
+   first_id .. first_id + num_ids - 1 have completed */
+struct inflight_frame {
+  sddc_buffer_t *buffer;        /* 0 = free slot */
+  struct net_header *headers;
+  uint32_t headers_capacity;
+  uint64_t first_id;
+  uint32_t num_ids;
+  uint32_t remaining;
+};
+
+struct tcp_client {
+  int fd;
+  uint32_t sequence;
+  uint64_t lost_samples;        /* frames not sent since the last one */
+  uint8_t *pending;             /* the rest of a partially sent record */
+  uint32_t pending_offset;
+  uint32_t pending_size;
+};
+
+typedef struct net_sender {
+  sddc_t *sddc;
+  enum SDDCSampleFormat format;
+  uint8_t shift;
+  double sample_rate;
+  uint32_t unit_bytes;
+  uint32_t unit_samples;
+  pthread_mutex_t lock;
+  int shutdown;
+
+  /* UDP */
+  int udp_fd;
+  uint32_t payload_size;
+  int zerocopy;
+  int gso;
+  uint32_t sequence;
+  struct net_header *headers;   /* for the frames sent without zerocopy */
+  uint32_t headers_capacity;
+  struct iovec *iovecs;
+  uint32_t iovecs_capacity;
+  struct mmsghdr *messages;
+  uint32_t messages_capacity;
+  uint64_t next_zerocopy_id;
+  struct inflight_frame *inflight;
+  uint32_t num_inflight;
+
+  /* TCP */
+  int listen_fd;
+  struct tcp_client *clients;
+  uint32_t num_clients;
+
+  struct net_sender_counters stats;
+} net_sender_t;
+
+
+static const uint32_t MAX_INFLIGHT_FRAMES = 256;
+static const uint32_t GSO_MAX_SEGMENTS = 64;
+/* a zerocopy skb points to the pages of the iovecs, and can have no more
+   than MAX_SKB_FRAGS (17) fragments: a header and a payload, which can
+   cross a page boundary, take up to three */
+static const uint32_t ZEROCOPY_GSO_MAX_SEGMENTS = 5;
+static const uint32_t GSO_MAX_SIZE = 65000;
+static const uint32_t MAX_TCP_CLIENTS = 64;
+static const int SEND_BUFFER_SIZE = 4 * 1024 * 1024;
+static const int SHUTDOWN_POLL_INTERVAL = 10;           /* ms */
+
+
+/* internal functions */
+static int open_udp_socket(net_sender_t *this,
+                           const struct net_sender_params *params);
+static int open_listen_socket(net_sender_t *this, int port);
+static int ensure_capacity(void **array, uint32_t *capacity, uint32_t needed,
+                           size_t element_size);
+static uint32_t fill_headers(net_sender_t *this, struct net_header *headers,
+                             uint32_t size, const struct sddc_frame_info *info);
+static int send_udp(net_sender_t *this, const uint8_t *data, uint32_t size,
+                    const struct sddc_frame_info *info);
+static struct inflight_frame *inflight_get(net_sender_t *this);
+static void reap_zerocopy(net_sender_t *this);
+static void send_tcp(net_sender_t *this, struct tcp_client *client,
+                     const uint8_t *data, uint32_t size,
+                     const struct sddc_frame_info *info);
+static int flush_tcp_client(struct tcp_client *client);
+static void close_tcp_client(net_sender_t *this, uint32_t index);
+static void accept_tcp_clients(net_sender_t *this);
+
+
+net_sender_t *net_sender_open(const struct net_sender_params *params,
+                              sddc_t *sddc)
+{
+  net_sender_t *ret_val = 0;
+
+  if (params->udp_destination == 0 && params->tcp_port == 0) {
+    fprintf(stderr, "ERROR - net_sender_open() failed - neither UDP nor TCP\n");
+    goto FAIL0;
+  }
+  uint32_t unit_bytes = net_unit_bytes(params->format);
+  if (unit_bytes == 0) {
+    fprintf(stderr, "ERROR - net_sender_open() failed - invalid sample format\n");
+    goto FAIL0;
+  }
+
+  net_sender_t *this = (net_sender_t *) malloc(sizeof(net_sender_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->sddc = sddc;
+  this->format = params->format;
+  this->shift = params->format == SAMPLE_FORMAT_REAL_PACKED12 ? 4 :
+                params->format == SAMPLE_FORMAT_REAL_INT8 ? params->shift : 0;
+  this->sample_rate = params->sample_rate;
+  this->unit_bytes = unit_bytes;
+  this->unit_samples = net_unit_samples(params->format);
+  this->shutdown = 0;
+  this->udp_fd = -1;
+  this->payload_size = 0;
+  this->zerocopy = 0;
+  this->gso = 0;
+  this->sequence = 0;
+  this->headers = 0;
+  this->headers_capacity = 0;
+  this->iovecs = 0;
+  this->iovecs_capacity = 0;
+  this->messages = 0;
+  this->messages_capacity = 0;
+  this->next_zerocopy_id = 0;
+  this->inflight = 0;
+  this->num_inflight = 0;
+  this->listen_fd = -1;
+  this->clients = 0;
+  this->num_clients = 0;
+  memset(&this->stats, 0, sizeof(this->stats));
+
+  if (params->udp_destination && open_udp_socket(this, params) < 0) {
+    goto FAIL1;
+  }
+  if (this->zerocopy) {
+    this->inflight = (struct inflight_frame *) calloc(MAX_INFLIGHT_FRAMES,
+                                                sizeof(struct inflight_frame));
+    if (this->inflight == 0) {
+      fprintf(stderr, "ERROR - calloc() failed\n");
+      goto FAIL2;
+    }
+  }
+  if (params->tcp_port) {
+    if (open_listen_socket(this, params->tcp_port) < 0) {
+      goto FAIL3;
+    }
+    this->clients = (struct tcp_client *) malloc(MAX_TCP_CLIENTS *
+                                                 sizeof(struct tcp_client));
+    if (this->clients == 0) {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+      goto FAIL4;
+    }
+  }
+  pthread_mutex_init(&this->lock, 0);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL4:
+  close(this->listen_fd);
+FAIL3:
+  free(this->inflight);
+FAIL2:
+  if (this->udp_fd >= 0) {
+    close(this->udp_fd);
+  }
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void net_sender_close(net_sender_t *this)
+{
+  net_sender_shutdown(this, 0);
+  while (this->num_clients > 0) {
+    close_tcp_client(this, this->num_clients - 1);
+  }
+  free(this->clients);
+  if (this->listen_fd >= 0) {
+    close(this->listen_fd);
+  }
+  if (this->inflight) {
+    for (uint32_t i = 0; i < MAX_INFLIGHT_FRAMES; ++i) {
+      /* the sends still in flight may read their headers - leaked, like
+         their frame buffers (see net_sender_shutdown()) */
+      if (this->inflight[i].buffer == 0) {
+        free(this->inflight[i].headers);
+      }
+    }
+    free(this->inflight);
+  }
+  free(this->messages);
+  free(this->iovecs);
+  free(this->headers);
+  if (this->udp_fd >= 0) {
+    close(this->udp_fd);
+  }
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+  return;
+}
+
+
+int net_sender_send(net_sender_t *this, const uint8_t *data, uint32_t size,
+                    const struct sddc_frame_info *info)
+{
+  int ret_val = 0;
+  pthread_mutex_lock(&this->lock);
+  if (this->shutdown) {
+    goto DONE;
+  }
+  this->stats.frames++;
+  if (this->udp_fd >= 0) {
+    ret_val = send_udp(this, data, size, info);
+  }
+  for (uint32_t i = 0; i < this->num_clients; ) {
+    send_tcp(this, &this->clients[i], data, size, info);
+    if (this->clients[i].fd < 0) {
+      close_tcp_client(this, i);
+    } else {
+      i++;
+    }
+  }
+DONE:
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+void net_sender_poll(net_sender_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  if (this->zerocopy) {
+    reap_zerocopy(this);
+  }
+  if (this->listen_fd >= 0 && !this->shutdown) {
+    accept_tcp_clients(this);
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void net_sender_shutdown(net_sender_t *this, int timeout_ms)
+{
+  pthread_mutex_lock(&this->lock);
+  this->shutdown = 1;
+  int waited = 0;
+  while (this->num_inflight > 0) {
+    reap_zerocopy(this);
+    if (this->num_inflight == 0 || waited >= timeout_ms) {
+      break;
+    }
+    pthread_mutex_unlock(&this->lock);
+    struct pollfd pollfd = { .fd = this->udp_fd, .events = 0 };
+    poll(&pollfd, 1, SHUTDOWN_POLL_INTERVAL);
+    waited += SHUTDOWN_POLL_INTERVAL;
+    pthread_mutex_lock(&this->lock);
+  }
+  if (this->num_inflight > 0) {
+    /* the kernel never told us - better to leak than to hand the buffers
+       back while they might still be read */
+    fprintf(stderr, "WARNING - %u frame buffers still in flight\n",
+            this->num_inflight);
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void net_sender_get_stats(net_sender_t *this, struct net_sender_stats *stats)
+{
+  stats->frames = atomic_load_explicit(&this->stats.frames, memory_order_relaxed);
+  stats->packets = atomic_load_explicit(&this->stats.packets, memory_order_relaxed);
+  stats->bytes = atomic_load_explicit(&this->stats.bytes, memory_order_relaxed);
+  stats->send_errors = atomic_load_explicit(&this->stats.send_errors, memory_order_relaxed);
+  stats->zerocopy_frames = atomic_load_explicit(&this->stats.zerocopy_frames, memory_order_relaxed);
+  stats->zerocopy_copied = atomic_load_explicit(&this->stats.zerocopy_copied, memory_order_relaxed);
+  stats->tcp_clients = atomic_load_explicit(&this->stats.tcp_clients, memory_order_relaxed);
+  stats->tcp_dropped_frames = atomic_load_explicit(&this->stats.tcp_dropped_frames, memory_order_relaxed);
+}
+
+
+/* internal functions */
+static int open_udp_socket(net_sender_t *this,
+                           const struct net_sender_params *params)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  if (net_resolve(params->udp_destination, SOCK_DGRAM, &addr, &addrlen) < 0) {
+    return -1;
+  }
+  int fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - socket() failed: %s\n", strerror(errno));
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SEND_BUFFER_SIZE,
+             sizeof(SEND_BUFFER_SIZE));
+
+  int ttl = params->ttl > 0 ? params->ttl : 1;
+  unsigned int ifindex = 0;
+  if (params->interface) {
+    ifindex = if_nametoindex(params->interface);
+    if (ifindex == 0) {
+      fprintf(stderr, "ERROR - unknown interface: %s\n", params->interface);
+      goto FAIL;
+    }
+  }
+  if (addr.ss_family == AF_INET6) {
+    setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+    if (ifindex &&
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex,
+                   sizeof(ifindex)) < 0) {
+      fprintf(stderr, "ERROR - setsockopt(IPV6_MULTICAST_IF) failed: %s\n",
+              strerror(errno));
+      goto FAIL;
+    }
+  } else {
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    struct ip_mreqn mreqn;
+    memset(&mreqn, 0, sizeof(mreqn));
+    mreqn.imr_ifindex = ifindex;
+    if (ifindex &&
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreqn,
+                   sizeof(mreqn)) < 0) {
+      fprintf(stderr, "ERROR - setsockopt(IP_MULTICAST_IF) failed: %s\n",
+              strerror(errno));
+      goto FAIL;
+    }
+  }
+  if (connect(fd, (struct sockaddr *) &addr, addrlen) < 0) {
+    fprintf(stderr, "ERROR - connect(%s) failed: %s\n",
+            params->udp_destination, strerror(errno));
+    goto FAIL;
+  }
+
+  /* a whole number of samples per packet, and IP + UDP + our header in a
+     standard MTU by default */
+  uint32_t payload_size = params->payload_size;
+  if (payload_size == 0) {
+    payload_size = 1500 - (addr.ss_family == AF_INET6 ? 40 : 20) - 8 -
+                   sizeof(struct net_header);
+  }
+  payload_size -= payload_size % this->unit_bytes;
+  if (payload_size == 0 ||
+      payload_size + sizeof(struct net_header) > GSO_MAX_SIZE) {
+    fprintf(stderr, "ERROR - invalid UDP payload size: %u\n",
+            params->payload_size);
+    goto FAIL;
+  }
+  this->payload_size = payload_size;
+
+  if (params->zerocopy) {
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+      fprintf(stderr, "WARNING - setsockopt(SO_ZEROCOPY) failed: %s - copying\n",
+              strerror(errno));
+    } else {
+      this->zerocopy = 1;
+    }
+  }
+  if (params->gso) {
+    /* the default segment size of the socket: one header + payload */
+    int segment_size = (int) (sizeof(struct net_header) + payload_size);
+    if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment_size,
+                   sizeof(segment_size)) < 0) {
+      fprintf(stderr, "WARNING - setsockopt(UDP_SEGMENT) failed: %s - one packet per message\n",
+              strerror(errno));
+    } else {
+      this->gso = 1;
+    }
+  }
+
+  this->udp_fd = fd;
+  return 0;
+
+FAIL:
+  close(fd);
+  return -1;
+}
+
+static int open_listen_socket(net_sender_t *this, int port)
+{
+  /* dual stack if possible */
+  int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  int one = 1;
+  int zero = 0;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  memset(&addr, 0, sizeof(addr));
+  if (fd >= 0) {
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) &addr;
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_addr = in6addr_any;
+    addr6->sin6_port = htons(port);
+    addrlen = sizeof(struct sockaddr_in6);
+  } else {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+      fprintf(stderr, "ERROR - socket() failed: %s\n", strerror(errno));
+      return -1;
+    }
+    struct sockaddr_in *addr4 = (struct sockaddr_in *) &addr;
+    addr4->sin_family = AF_INET;
+    addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+    addr4->sin_port = htons(port);
+    addrlen = sizeof(struct sockaddr_in);
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *) &addr, addrlen) < 0) {
+    fprintf(stderr, "ERROR - bind(TCP port %d) failed: %s\n", port,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (listen(fd, 8) < 0) {
+    fprintf(stderr, "ERROR - listen() failed: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  this->listen_fd = fd;
+  return 0;
+}
+
+static int ensure_capacity(void **array, uint32_t *capacity, uint32_t needed,
+                           size_t element_size)
+{
+  if (needed <= *capacity) {
+    return 0;
+  }
+  void *new_array = realloc(*array, needed * element_size);
+  if (new_array == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  *array = new_array;
+  *capacity = needed;
+  return 0;
+}
+
+/* the headers of the packets of a frame; returns how many */
+static uint32_t fill_headers(net_sender_t *this, struct net_header *headers,
+                             uint32_t size, const struct sddc_frame_info *info)
+{
+  uint32_t num_packets = (size + this->payload_size - 1) / this->payload_size;
+  uint64_t sample_index = info->sample_index;
+  for (uint32_t i = 0; i < num_packets; ++i) {
+    struct net_header *header = &headers[i];
+    uint32_t offset = i * this->payload_size;
+    uint32_t payload_size = size - offset < this->payload_size ?
+                            size - offset : this->payload_size;
+    header->magic = NET_MAGIC;
+    header->version = NET_VERSION;
+    header->header_size = sizeof(struct net_header);
+    header->sequence = this->sequence++;
+    header->payload_size = payload_size;
+    header->sample_index = sample_index;
+    header->monotonic_time_ns = info->monotonic_time_ns;
+    header->realtime_ns = info->realtime_ns;
+    header->lost_samples = i == 0 ? info->lost_samples : 0;
+    header->sample_rate = this->sample_rate;
+    header->flags = (i == 0 ? NET_FLAG_FRAME_START | info->flags : 0) |
+                    (i == num_packets - 1 ? NET_FLAG_FRAME_END : 0);
+    header->format = this->format;
+    header->shift = this->shift;
+    memset(header->reserved, 0, sizeof(header->reserved));
+    sample_index += payload_size / this->unit_bytes * this->unit_samples;
+  }
+  return num_packets;
+}
+
+static int send_udp(net_sender_t *this, const uint8_t *data, uint32_t size,
+                    const struct sddc_frame_info *info)
+{
+  if (size == 0) {
+    return 0;
+  }
+  uint32_t num_packets = (size + this->payload_size - 1) / this->payload_size;
+
+  /* zerocopy only for the raw frames (not the converted data), and only
+     while there is a spare frame to lend */
+  struct inflight_frame *inflight = 0;
+  sddc_buffer_t *buffer = 0;
+  if (this->zerocopy) {
+    reap_zerocopy(this);
+    inflight = inflight_get(this);
+    if (inflight) {
+      buffer = sddc_buffer_retain(this->sddc, data);
+    }
+    if (buffer == 0) {
+      inflight = 0;
+    }
+  }
+  struct net_header *headers;
+  if (inflight) {
+    if (ensure_capacity((void **) &inflight->headers,
+                        &inflight->headers_capacity, num_packets,
+                        sizeof(struct net_header)) < 0) {
+      sddc_buffer_release(this->sddc, buffer);
+      return -1;
+    }
+    headers = inflight->headers;
+  } else {
+    if (ensure_capacity((void **) &this->headers, &this->headers_capacity,
+                        num_packets, sizeof(struct net_header)) < 0) {
+      return -1;
+    }
+    headers = this->headers;
+  }
+  fill_headers(this, headers, size, info);
+
+  /* with GSO each message is up to GSO_MAX_SEGMENTS header + payload
+     pairs, which the kernel splits at the segment size; only the last
+     packet of the frame can be short, and it is the last one of its
+     message */
+  uint32_t packets_per_message = 1;
+  if (this->gso) {
+    packets_per_message = GSO_MAX_SIZE /
+                          (sizeof(struct net_header) + this->payload_size);
+    uint32_t max_segments = buffer ? ZEROCOPY_GSO_MAX_SEGMENTS :
+                                     GSO_MAX_SEGMENTS;
+    if (packets_per_message > max_segments) {
+      packets_per_message = max_segments;
+    }
+  }
+  uint32_t num_messages = (num_packets + packets_per_message - 1) /
+                          packets_per_message;
+  if (ensure_capacity((void **) &this->iovecs, &this->iovecs_capacity,
+                      2 * num_packets, sizeof(struct iovec)) < 0 ||
+      ensure_capacity((void **) &this->messages, &this->messages_capacity,
+                      num_messages, sizeof(struct mmsghdr)) < 0) {
+    if (buffer) {
+      sddc_buffer_release(this->sddc, buffer);
+    }
+    return -1;
+  }
+  for (uint32_t i = 0; i < num_packets; ++i) {
+    this->iovecs[2*i].iov_base = &headers[i];
+    this->iovecs[2*i].iov_len = sizeof(struct net_header);
+    this->iovecs[2*i+1].iov_base = (void *) (data + i * this->payload_size);
+    this->iovecs[2*i+1].iov_len = headers[i].payload_size;
+  }
+  for (uint32_t i = 0; i < num_messages; ++i) {
+    uint32_t first = i * packets_per_message;
+    uint32_t count = num_packets - first < packets_per_message ?
+                     num_packets - first : packets_per_message;
+    struct msghdr *msg = &this->messages[i].msg_hdr;
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = &this->iovecs[2*first];
+    msg->msg_iovlen = 2 * count;
+  }
+
+  int flags = buffer ? MSG_ZEROCOPY : 0;
+  uint32_t sent = 0;
+  while (sent < num_messages) {
+    int ret = sendmmsg(this->udp_fd, &this->messages[sent],
+                       num_messages - sent, flags);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* ECONNREFUSED (nobody is listening to the unicast destination),
+         or ENOBUFS: skip the message */
+      this->stats.send_errors++;
+      sent++;
+      continue;
+    }
+    for (int i = 0; i < ret; ++i) {
+      this->stats.packets += this->messages[sent + i].msg_hdr.msg_iovlen / 2;
+      this->stats.bytes += this->messages[sent + i].msg_len;
+    }
+    if (buffer) {
+      /* one zerocopy id per message sent */
+      if (inflight->buffer == 0) {
+        inflight->buffer = buffer;
+        inflight->first_id = this->next_zerocopy_id;
+        inflight->num_ids = 0;
+        inflight->remaining = 0;
+        this->num_inflight++;
+      }
+      inflight->num_ids += ret;
+      inflight->remaining += ret;
+      this->next_zerocopy_id += ret;
+    }
+    sent += ret;
+  }
+  if (buffer) {
+    if (inflight->buffer == 0) {
+      /* nothing went out */
+      sddc_buffer_release(this->sddc, buffer);
+    } else {
+      this->stats.zerocopy_frames++;
+    }
+  }
+  return 0;
+}
+
+static struct inflight_frame *inflight_get(net_sender_t *this)
+{
+  if (this->num_inflight == MAX_INFLIGHT_FRAMES) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < MAX_INFLIGHT_FRAMES; ++i) {
+    if (this->inflight[i].buffer == 0) {
+      return &this->inflight[i];
+    }
+  }
+  return 0;
+}
+
+/* the completions are ranges of ids (32 bit, wrapping) on the error queue */
+static void reap_zerocopy(net_sender_t *this)
+{
+  while (this->num_inflight > 0) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(this->udp_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      return;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      struct sock_extended_err serr;
+      memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+      if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      uint64_t lo = this->next_zerocopy_id -
+                    (uint32_t) ((uint32_t) this->next_zerocopy_id - serr.ee_info);
+      uint64_t hi = lo + (uint32_t) (serr.ee_data - serr.ee_info);
+      if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        this->stats.zerocopy_copied += hi - lo + 1;
+      }
+      for (uint32_t i = 0; i < MAX_INFLIGHT_FRAMES; ++i) {
+        struct inflight_frame *inflight = &this->inflight[i];
+        if (inflight->buffer == 0) {
+          continue;
+        }
+        uint64_t first = inflight->first_id;
+        uint64_t last = first + inflight->num_ids - 1;
+        uint64_t from = first > lo ? first : lo;
+        uint64_t to = last < hi ? last : hi;
+        if (from > to) {
+          continue;
+        }
+        inflight->remaining -= (uint32_t) (to - from + 1);
+        if (inflight->remaining == 0) {
+          sddc_buffer_release(this->sddc, inflight->buffer);
+          inflight->buffer = 0;
+          this->num_inflight--;
+        }
+      }
+    }
+  }
+}
+
+static void send_tcp(net_sender_t *this, struct tcp_client *client,
+                     const uint8_t *data, uint32_t size,
+                     const struct sddc_frame_info *info)
+{
+  uint64_t num_samples = size / this->unit_bytes * this->unit_samples;
+  if (client->pending_size > 0 && flush_tcp_client(client) < 0) {
+    return;
+  }
+  if (client->pending_size > 0) {
+    /* still behind */
+    client->lost_samples += num_samples;
+    this->stats.tcp_dropped_frames++;
+    return;
+  }
+
+  struct net_header header = {
+    .magic = NET_MAGIC,
+    .version = NET_VERSION,
+    .header_size = sizeof(struct net_header),
+    .sequence = client->sequence++,
+    .payload_size = size,
+    .sample_index = info->sample_index,
+    .monotonic_time_ns = info->monotonic_time_ns,
+    .realtime_ns = info->realtime_ns,
+    .lost_samples = info->lost_samples + client->lost_samples,
+    .sample_rate = this->sample_rate,
+    .flags = NET_FLAG_FRAME_START | NET_FLAG_FRAME_END | info->flags |
+             (client->lost_samples ? SDDC_FRAME_FLAG_GAP : 0),
+    .format = this->format,
+    .shift = this->shift
+  };
+  struct iovec iov[2] = {
+    { .iov_base = &header, .iov_len = sizeof(header) },
+    { .iov_base = (void *) data, .iov_len = size }
+  };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  ssize_t ret = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      client->sequence--;
+      client->lost_samples += num_samples;
+      this->stats.tcp_dropped_frames++;
+    } else {
+      close(client->fd);
+      client->fd = -1;
+    }
+    return;
+  }
+  client->lost_samples = 0;
+  uint32_t total = sizeof(header) + size;
+  if ((uint32_t) ret < total) {
+    /* keep the rest of the record, so that the stream stays in sync */
+    uint32_t rest = total - (uint32_t) ret;
+    client->pending = (uint8_t *) malloc(rest);
+    if (client->pending == 0) {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+      close(client->fd);
+      client->fd = -1;
+      return;
+    }
+    uint32_t header_rest = (uint32_t) ret < sizeof(header) ?
+                           sizeof(header) - (uint32_t) ret : 0;
+    memcpy(client->pending, (uint8_t *) &header + sizeof(header) - header_rest,
+           header_rest);
+    memcpy(client->pending + header_rest, data + size - (rest - header_rest),
+           rest - header_rest);
+    client->pending_offset = 0;
+    client->pending_size = rest;
+  }
+}
+
+static int flush_tcp_client(struct tcp_client *client)
+{
+  ssize_t ret = send(client->fd, client->pending + client->pending_offset,
+                     client->pending_size - client->pending_offset,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    close(client->fd);
+    client->fd = -1;
+    return -1;
+  }
+  client->pending_offset += (uint32_t) ret;
+  if (client->pending_offset == client->pending_size) {
+    free(client->pending);
+    client->pending = 0;
+    client->pending_offset = 0;
+    client->pending_size = 0;
+  }
+  return 0;
+}
+
+static void close_tcp_client(net_sender_t *this, uint32_t index)
+{
+  struct tcp_client *client = &this->clients[index];
+  if (client->fd >= 0) {
+    close(client->fd);
+  }
+  free(client->pending);
+  fprintf(stderr, "TCP client disconnected\n");
+  this->clients[index] = this->clients[this->num_clients - 1];
+  this->num_clients--;
+  this->stats.tcp_clients = this->num_clients;
+}
+
+static void accept_tcp_clients(net_sender_t *this)
+{
+  while (1) {
+    int fd = accept4(this->listen_fd, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+      return;
+    }
+    if (this->num_clients == MAX_TCP_CLIENTS) {
+      fprintf(stderr, "WARNING - too many TCP clients\n");
+      close(fd);
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SEND_BUFFER_SIZE,
+               sizeof(SEND_BUFFER_SIZE));
+    struct tcp_client *client = &this->clients[this->num_clients++];
+    this->stats.tcp_clients = this->num_clients;
+    client->fd = fd;
+    client->sequence = 0;
+    client->lost_samples = 0;
+    client->pending = 0;
+    client->pending_offset = 0;
+    client->pending_size = 0;
+    fprintf(stderr, "TCP client connected\n");
+  }
+}
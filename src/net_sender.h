@@ -0,0 +1,92 @@
+/*
+ * net_sender.h - sends the frames over UDP (multicast) and TCP
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __NET_SENDER_H
+#define __NET_SENDER_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct net_sender net_sender_t;
+
+struct net_sender_params {
+  const char *udp_destination;  /* "<address>:<port>" ([<address>] for
+                                   IPv6), unicast or multicast; 0 = none */
+  const char *interface;        /* multicast interface name; 0 = default */
+  int ttl;                      /* multicast TTL/hop limit; 0 = 1 */
+  uint32_t payload_size;        /* UDP payload bytes after the header;
+                                   0 = what fits in a 1500 bytes MTU */
+  int zerocopy;                 /* MSG_ZEROCOPY for the raw frames */
+  int gso;                      /* UDP_SEGMENT (one send per 64 packets) */
+  int tcp_port;                 /* listen for TCP clients; 0 = none */
+  enum SDDCSampleFormat format; /* of the frames passed to send */
+  uint32_t shift;               /* of SAMPLE_FORMAT_REAL_INT8 (for the
+                                   receivers to scale back) */
+  double sample_rate;           /* of the frames passed to send */
+};
+
+struct net_sender_stats {
+  uint64_t frames;
+  uint64_t packets;             /* UDP datagrams */
+  uint64_t bytes;               /* UDP payload + header bytes */
+  uint64_t send_errors;
+  uint64_t zerocopy_frames;     /* sent from retained frame buffers */
+  uint64_t zerocopy_copied;     /* completions the kernel copied anyway */
+  uint32_t tcp_clients;
+  uint64_t tcp_dropped_frames;  /* not sent to a client that fell behind */
+};
+
+/* sddc is needed for sddc_buffer_retain() when zerocopy is set */
+net_sender_t *net_sender_open(const struct net_sender_params *params,
+                              sddc_t *sddc);
+
+void net_sender_close(net_sender_t *this);
+
+/* from the v2 streaming callback: the UDP packets of a frame go out with
+   one sendmmsg() - with MSG_ZEROCOPY the frame buffer is retained until
+   the kernel is done with it, and with GSO each message carries up to 64
+   packets; a TCP client that is not keeping up misses whole frames (and
+   gets the lost samples in the header of the next one) */
+int net_sender_send(net_sender_t *this, const uint8_t *data, uint32_t size,
+                    const struct sddc_frame_info *info);
+
+/* from the main loop: accepts the TCP clients and releases the frame
+   buffers the kernel has completed */
+void net_sender_poll(net_sender_t *this);
+
+/* stops sending and waits (up to timeout_ms) for the zerocopy sends in
+   flight, so that all the frame buffers are released - call it before
+   sddc_stop_streaming() */
+void net_sender_shutdown(net_sender_t *this, int timeout_ms);
+
+void net_sender_get_stats(net_sender_t *this, struct net_sender_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NET_SENDER_H */
@@ -0,0 +1,503 @@
+/*
+ * psd.c - averaged power spectra (waterfall) on a thread of their own
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* The stream side only copies samples into free buffers of a pool (and
+ * skips them when there is none), so it never waits for the FFTs. The
+ * spectrum thread measures each row from its first sample on: blocks of
+ * fft_size samples, each hop = fft_size - overlap samples after the
+ * previous one, until 'averages' of them are done or the next one would
+ * not fit in the row; then it tells the stream side which sample it needs
+ * next, so that the rest of the row is not even copied. A gap in the
+ * samples (skipped frames) restarts the block being filled.
+ *
+ * The window multiply and the power accumulation are plain loops over
+ * float arrays that the compiler vectorizes; the FFTs are those of fft.c
+ * (FFTW when available).
+ *
+ * Each row is the average of the FFTs over the first samples of each
+ * 1/row_rate seconds; a row with no FFTs at all (the thread fell behind)
+ * is not emitted. The fft_size/2+1 bins from 0 to sample_rate/2 are in
+ * dBFS (a full scale sine in the center of a bin reads 0 dB), as float or
+ * as uint8 from min_db (0) to max_db (255).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "psd.h"
+#include "fft.h"
+#include "spsc_ring.h"
+
+
+typedef struct psd psd_t;
+
+struct buffer {
+  int16_t *data;
+  uint32_t length;              /* samples */
+  uint64_t sample_index;
+};
+
+typedef struct psd {
+  uint32_t fft_size;
+  uint32_t overlap;             /* samples */
+  uint32_t hop;
+  uint32_t averages;
+  uint64_t row_interval;        /* samples */
+  double bin_width;
+  uint32_t num_bins;
+  enum SDDCPSDFormat format;
+  float min_db;
+  float max_db;
+  sddc_psd_cb_t callback;
+  void *callback_context;
+  fft_t *fft;
+  float *window;
+  float power_gain;             /* |X|^2 to full scale */
+  float *block;                 /* samples, in order */
+  float *fft_input;             /* windowed */
+  float complex *spectrum;
+  float *accumulator;
+  void *output;
+  /* buffer pool */
+  int16_t *arena;
+  struct buffer *buffers;
+  spsc_ring_t *filled_buffers;  /* stream -> spectrum thread */
+  spsc_ring_t *free_buffers;    /* spectrum thread -> stream */
+  sem_t filled_buffers_sem;
+  pthread_t thread;
+  atomic_int running;
+  /* stream side */
+  atomic_ullong wanted_from;    /* first sample index still needed */
+  /* spectrum thread side */
+  uint32_t fill;
+  uint64_t next_index;
+  uint64_t row;
+  uint64_t row_end;
+  uint64_t measure_index;
+  uint32_t count;
+  int emitted;
+  atomic_ullong rows;
+  atomic_ullong ffts;
+  atomic_ullong skipped_frames;
+} psd_t;
+
+
+static const uint32_t DEFAULT_FFT_SIZE = 4096;
+static const double DEFAULT_ROW_RATE = 10;
+static const float DEFAULT_MIN_DB = -130;
+static const float DEFAULT_MAX_DB = 0;
+static const float MAX_OVERLAP = 0.9f;
+static const uint32_t BUFFER_SAMPLES = 65536;
+static const uint32_t NUM_BUFFERS = 64;
+
+
+/* internal functions */
+static void *psd_thread(void *arg);
+static void psd_process_buffer(psd_t *this, const int16_t *input,
+                               uint32_t num_samples, uint64_t sample_index);
+static void psd_transform(psd_t *this);
+static void psd_finish_row(psd_t *this);
+
+
+psd_t *psd_open(const struct sddc_psd_params *params, double sample_rate)
+{
+  psd_t *ret_val = 0;
+
+  uint32_t fft_size = params->fft_size > 0 ? params->fft_size : DEFAULT_FFT_SIZE;
+  if (fft_size < 64 || (fft_size & (fft_size - 1)) != 0) {
+    fprintf(stderr, "ERROR - psd_open() failed - FFT size must be a power of two >= 64: %u\n", fft_size);
+    return ret_val;
+  }
+  if (!(params->overlap >= 0 && params->overlap <= MAX_OVERLAP)) {
+    fprintf(stderr, "ERROR - psd_open() failed - overlap must be within 0 and %.1f: %f\n",
+            MAX_OVERLAP, params->overlap);
+    return ret_val;
+  }
+  double row_rate = params->row_rate > 0 ? params->row_rate : DEFAULT_ROW_RATE;
+  uint64_t row_interval = (uint64_t) llround(sample_rate / row_rate);
+  uint32_t overlap = (uint32_t) (params->overlap * fft_size);
+  uint32_t hop = fft_size - overlap;
+  uint32_t averages = params->averages;
+  if (fft_size + (uint64_t) (averages > 0 ? averages - 1 : 0) * hop > row_interval) {
+    fprintf(stderr, "ERROR - psd_open() failed - the FFTs of a row take more than 1/%g s\n",
+            row_rate);
+    return ret_val;
+  }
+  if (params->format != SDDC_PSD_FLOAT32_DB &&
+      params->format != SDDC_PSD_UINT8_DB) {
+    fprintf(stderr, "ERROR - psd_open() failed - invalid format: %d\n",
+            params->format);
+    return ret_val;
+  }
+  if (params->callback == 0) {
+    fprintf(stderr, "ERROR - psd_open() failed - no callback\n");
+    return ret_val;
+  }
+
+  psd_t *this = (psd_t *) calloc(1, sizeof(psd_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL0;
+  }
+  this->fft_size = fft_size;
+  this->overlap = overlap;
+  this->hop = hop;
+  this->averages = averages;
+  this->row_interval = row_interval;
+  this->bin_width = sample_rate / fft_size;
+  this->num_bins = fft_size / 2 + 1;
+  this->format = params->format;
+  this->min_db = DEFAULT_MIN_DB;
+  this->max_db = DEFAULT_MAX_DB;
+  if (params->max_db > params->min_db) {
+    this->min_db = params->min_db;
+    this->max_db = params->max_db;
+  }
+  this->callback = params->callback;
+  this->callback_context = params->callback_context;
+
+  this->fft = fft_open_r2c(fft_size);
+  this->window = (float *) malloc(fft_size * sizeof(float));
+  this->block = (float *) malloc(fft_size * sizeof(float));
+  this->fft_input = (float *) malloc(fft_size * sizeof(float));
+  this->spectrum = (float complex *) malloc(this->num_bins * sizeof(float complex));
+  this->accumulator = (float *) malloc(this->num_bins * sizeof(float));
+  this->output = malloc(this->num_bins * sizeof(float));
+  this->arena = (int16_t *) malloc((size_t) NUM_BUFFERS * BUFFER_SAMPLES * sizeof(int16_t));
+  this->buffers = (struct buffer *) malloc(NUM_BUFFERS * sizeof(struct buffer));
+  this->filled_buffers = spsc_ring_open(NUM_BUFFERS);
+  this->free_buffers = spsc_ring_open(NUM_BUFFERS);
+  if (this->fft == 0 || this->window == 0 || this->block == 0 ||
+      this->fft_input == 0 || this->spectrum == 0 || this->accumulator == 0 ||
+      this->output == 0 || this->arena == 0 || this->buffers == 0 ||
+      this->filled_buffers == 0 || this->free_buffers == 0) {
+    fprintf(stderr, "ERROR - psd_open() failed - out of memory\n");
+    goto FAIL1;
+  }
+  for (uint32_t i = 0; i < NUM_BUFFERS; ++i) {
+    this->buffers[i].data = this->arena + (size_t) i * BUFFER_SAMPLES;
+    this->buffers[i].length = 0;
+    this->buffers[i].sample_index = 0;
+    spsc_ring_push(this->free_buffers, &this->buffers[i]);
+  }
+
+  /* Hann window; a sine of amplitude A gives |X| = A sum(w) / 2 */
+  double window_sum = 0;
+  for (uint32_t i = 0; i < fft_size; ++i) {
+    this->window[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * i / fft_size));
+    window_sum += this->window[i];
+  }
+  double full_scale = window_sum * 32768.0 / 2;
+  this->power_gain = (float) (1.0 / (full_scale * full_scale));
+
+  atomic_init(&this->running, 0);
+  atomic_init(&this->wanted_from, 0);
+  atomic_init(&this->rows, 0);
+  atomic_init(&this->ffts, 0);
+  atomic_init(&this->skipped_frames, 0);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL1:
+  psd_close(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void psd_close(psd_t *this)
+{
+  psd_stop(this);
+  if (this->fft) {
+    fft_close(this->fft);
+  }
+  if (this->free_buffers) {
+    spsc_ring_close(this->free_buffers);
+  }
+  if (this->filled_buffers) {
+    spsc_ring_close(this->filled_buffers);
+  }
+  free(this->buffers);
+  free(this->arena);
+  free(this->window);
+  free(this->block);
+  free(this->fft_input);
+  free(this->spectrum);
+  free(this->accumulator);
+  free(this->output);
+  free(this);
+  return;
+}
+
+
+int psd_start(psd_t *this)
+{
+  if (atomic_load(&this->running)) {
+    fprintf(stderr, "ERROR - psd_start() - already running\n");
+    return -1;
+  }
+  this->fill = 0;
+  this->next_index = 0;
+  this->row = 0;
+  this->row_end = 0;
+  this->measure_index = 0;
+  this->count = 0;
+  this->emitted = 0;
+  atomic_store(&this->wanted_from, 0);
+  atomic_store(&this->rows, 0);
+  atomic_store(&this->ffts, 0);
+  atomic_store(&this->skipped_frames, 0);
+
+  if (sem_init(&this->filled_buffers_sem, 0, 0) < 0) {
+    fprintf(stderr, "ERROR - sem_init() failed: %s\n", strerror(errno));
+    return -1;
+  }
+  atomic_store(&this->running, 1);
+  int ret = pthread_create(&this->thread, 0, psd_thread, this);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+    atomic_store(&this->running, 0);
+    sem_destroy(&this->filled_buffers_sem);
+    return -1;
+  }
+  return 0;
+}
+
+
+void psd_stop(psd_t *this)
+{
+  if (!atomic_exchange(&this->running, 0)) {
+    return;
+  }
+  sem_post(&this->filled_buffers_sem);
+  pthread_join(this->thread, 0);
+  sem_destroy(&this->filled_buffers_sem);
+  return;
+}
+
+
+void psd_process(psd_t *this, const int16_t *input, uint32_t num_samples,
+                 uint64_t sample_index)
+{
+  uint64_t wanted_from = atomic_load_explicit(&this->wanted_from,
+                                              memory_order_relaxed);
+  if (sample_index + num_samples <= wanted_from) {
+    return;
+  }
+  uint32_t i = sample_index < wanted_from ? (uint32_t) (wanted_from - sample_index) : 0;
+  while (i < num_samples) {
+    struct buffer *buffer = (struct buffer *) spsc_ring_pop(this->free_buffers);
+    if (buffer == 0) {
+      /* the spectrum thread is not keeping up - the rest of this frame
+         is skipped */
+      atomic_fetch_add_explicit(&this->skipped_frames, 1, memory_order_relaxed);
+      return;
+    }
+    uint32_t n = num_samples - i < BUFFER_SAMPLES ? num_samples - i : BUFFER_SAMPLES;
+    memcpy(buffer->data, input + i, n * sizeof(int16_t));
+    buffer->length = n;
+    buffer->sample_index = sample_index + i;
+    spsc_ring_push(this->filled_buffers, buffer);
+    sem_post(&this->filled_buffers_sem);
+    i += n;
+  }
+  return;
+}
+
+
+void psd_get_stats(psd_t *this, struct sddc_psd_stats *stats)
+{
+  stats->rows = atomic_load_explicit(&this->rows, memory_order_relaxed);
+  stats->ffts = atomic_load_explicit(&this->ffts, memory_order_relaxed);
+  stats->skipped_frames = atomic_load_explicit(&this->skipped_frames,
+                                               memory_order_relaxed);
+  return;
+}
+
+
+/* internal functions */
+static void *psd_thread(void *arg)
+{
+  psd_t *this = (psd_t *) arg;
+  while (1) {
+    if (sem_wait(&this->filled_buffers_sem) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR - sem_wait() failed: %s\n", strerror(errno));
+      break;
+    }
+    struct buffer *buffer = (struct buffer *) spsc_ring_pop(this->filled_buffers);
+    if (buffer == 0) {
+      /* woken up with an empty ring - time to go */
+      if (!atomic_load(&this->running)) {
+        break;
+      }
+      continue;
+    }
+    /* once stopped, what is left is just handed back */
+    if (atomic_load(&this->running)) {
+      psd_process_buffer(this, buffer->data, buffer->length,
+                         buffer->sample_index);
+    }
+    spsc_ring_push(this->free_buffers, buffer);
+  }
+  return 0;
+}
+
+static void psd_process_buffer(psd_t *this, const int16_t *input,
+                               uint32_t num_samples, uint64_t sample_index)
+{
+  uint32_t i = 0;
+  while (i < num_samples) {
+    uint64_t index = sample_index + i;
+    /* the FFT blocks must be made of consecutive samples */
+    if (this->fill > 0 && index != this->next_index) {
+      this->fill = 0;
+    }
+    if (this->fill == 0) {
+      if (index >= this->row_end) {
+        psd_finish_row(this);
+        this->row = index / this->row_interval;
+        this->row_end = (this->row + 1) * this->row_interval;
+        this->count = 0;
+        this->emitted = 0;
+      }
+      if ((this->averages > 0 && this->count == this->averages) ||
+          index + this->fft_size > this->row_end) {
+        /* nothing more fits in this row */
+        psd_finish_row(this);
+        atomic_store_explicit(&this->wanted_from, this->row_end,
+                              memory_order_relaxed);
+        uint64_t skip = this->row_end - index;
+        if (skip >= num_samples - i) {
+          return;
+        }
+        i += (uint32_t) skip;
+        continue;
+      }
+      if (this->count == 0) {
+        this->measure_index = index;
+      }
+    }
+
+    uint32_t n = this->fft_size - this->fill;
+    n = n < num_samples - i ? n : num_samples - i;
+    float *block = this->block + this->fill;
+    const int16_t *samples = input + i;
+    for (uint32_t k = 0; k < n; ++k) {
+      block[k] = samples[k];
+    }
+    this->fill += n;
+    i += n;
+    this->next_index = sample_index + i;
+    if (this->fill < this->fft_size) {
+      break;
+    }
+
+    psd_transform(this);
+    /* the next block starts hop samples later */
+    if (this->overlap > 0) {
+      memmove(this->block, this->block + this->hop,
+              this->overlap * sizeof(float));
+    }
+    this->fill = this->overlap;
+    if (this->next_index - this->fill + this->fft_size > this->row_end ||
+        (this->averages > 0 && this->count == this->averages)) {
+      this->fill = 0;
+    }
+  }
+  return;
+}
+
+static void psd_transform(psd_t *this)
+{
+  const float *window = this->window;
+  const float *block = this->block;
+  float *fft_input = this->fft_input;
+  for (uint32_t k = 0; k < this->fft_size; ++k) {
+    fft_input[k] = window[k] * block[k];
+  }
+  fft_execute_r2c(this->fft, this->fft_input, this->spectrum);
+
+  const float *bins = (const float *) this->spectrum;
+  float *accumulator = this->accumulator;
+  if (this->count == 0) {
+    for (uint32_t k = 0; k < this->num_bins; ++k) {
+      accumulator[k] = bins[2*k] * bins[2*k] + bins[2*k+1] * bins[2*k+1];
+    }
+  } else {
+    for (uint32_t k = 0; k < this->num_bins; ++k) {
+      accumulator[k] += bins[2*k] * bins[2*k] + bins[2*k+1] * bins[2*k+1];
+    }
+  }
+  this->count++;
+  atomic_fetch_add_explicit(&this->ffts, 1, memory_order_relaxed);
+  return;
+}
+
+static void psd_finish_row(psd_t *this)
+{
+  if (this->count == 0 || this->emitted) {
+    return;
+  }
+  this->emitted = 1;
+  float scale = this->power_gain / this->count;
+  if (this->format == SDDC_PSD_UINT8_DB) {
+    uint8_t *output = (uint8_t *) this->output;
+    float gain = 255.0f / (this->max_db - this->min_db);
+    for (uint32_t k = 0; k < this->num_bins; ++k) {
+      float power = this->accumulator[k] * scale;
+      float level = power > 0 ? (10 * log10f(power) - this->min_db) * gain : 0;
+      level = level > 255 ? 255 : level;
+      level = level < 0 ? 0 : level;
+      output[k] = (uint8_t) (level + 0.5f);
+    }
+  } else {
+    float *output = (float *) this->output;
+    for (uint32_t k = 0; k < this->num_bins; ++k) {
+      float power = this->accumulator[k] * scale;
+      output[k] = power > 0 ? 10 * log10f(power) : -INFINITY;
+    }
+  }
+  struct sddc_psd_row row = {
+    .row = this->row,
+    .sample_index = this->measure_index,
+    .averages = this->count,
+    .bin_width = this->bin_width,
+    .num_bins = this->num_bins,
+    .format = this->format,
+    .data = this->output
+  };
+  this->callback(&row, this->callback_context);
+  atomic_fetch_add_explicit(&this->rows, 1, memory_order_relaxed);
+  return;
+}
@@ -0,0 +1,58 @@
+/*
+ * psd.h - averaged power spectra (waterfall) on a thread of their own
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __PSD_H
+#define __PSD_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct psd psd_t;
+
+psd_t *psd_open(const struct sddc_psd_params *params, double sample_rate);
+
+void psd_close(psd_t *this);
+
+/* starts the spectrum thread; the rows are counted from sample index 0 */
+int psd_start(psd_t *this);
+
+/* after the last psd_process(): waits for the spectrum thread to exit */
+void psd_stop(psd_t *this);
+
+/* real samples from the stream, in order; called from one thread. Never
+   blocks: the samples are copied (only those the spectrum thread needs),
+   or skipped when it has no free buffer */
+void psd_process(psd_t *this, const int16_t *input, uint32_t num_samples,
+                 uint64_t sample_index);
+
+void psd_get_stats(psd_t *this, struct sddc_psd_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PSD_H */
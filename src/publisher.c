@@ -0,0 +1,260 @@
+/*
+ * publisher.c - shared memory frame publisher
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "publisher.h"
+#include "shm_ring.h"
+
+
+typedef struct sddc_publisher publisher_t;
+
+typedef struct sddc_publisher {
+  char *path;                   /* of the shared memory object */
+  struct shm_ring_header *header;
+  size_t size;
+  uint64_t sequence;            /* next slot to write */
+} publisher_t;
+
+
+static const uint32_t DEFAULT_SLOT_SIZE = 65536 - SHM_SLOT_HEADER_SIZE;
+static const uint32_t DEFAULT_NUM_SLOTS = 2048;
+static const mode_t DEFAULT_MODE = 0600;
+static const size_t MAX_NAME_LENGTH = 200;
+
+
+/* internal functions */
+static int publisher_check_existing(const char *path);
+
+
+publisher_t *publisher_open(const struct sddc_publisher_params *params)
+{
+  publisher_t *ret_val = 0;
+
+  if (params->name == 0 || params->name[0] == '\0' ||
+      strlen(params->name) > MAX_NAME_LENGTH || strchr(params->name, '/')) {
+    fprintf(stderr, "ERROR - invalid publisher name\n");
+    return ret_val;
+  }
+  uint32_t slot_size = params->slot_size ? params->slot_size : DEFAULT_SLOT_SIZE;
+  uint32_t num_slots = params->num_slots ? params->num_slots : DEFAULT_NUM_SLOTS;
+  if (params->mode & ~(uint32_t) 0777) {
+    fprintf(stderr, "ERROR - invalid publisher mode: %o\n", params->mode);
+    return ret_val;
+  }
+  if (slot_size % sizeof(int16_t) != 0 || num_slots < 2) {
+    fprintf(stderr, "ERROR - invalid publisher slot size or number of slots\n");
+    return ret_val;
+  }
+
+  publisher_t *this = (publisher_t *) malloc(sizeof(publisher_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->path = (char *) malloc(strlen(SHM_RING_NAME_PREFIX) +
+                               strlen(params->name) + 1);
+  if (this->path == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL1;
+  }
+  strcpy(this->path, SHM_RING_NAME_PREFIX);
+  strcat(this->path, params->name);
+  this->sequence = 0;
+
+  /* left behind by a publisher that did not close it - the readers still
+     attached to it keep their mapping and see that its publisher is gone */
+  if (publisher_check_existing(this->path) < 0) {
+    goto FAIL2;
+  }
+  shm_unlink(this->path);
+
+  /* whoever can open it can also corrupt the ring, so by default only
+     this user */
+  mode_t mode = params->mode ? (mode_t) params->mode : DEFAULT_MODE;
+  int fd = shm_open(this->path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, mode);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - shm_open(%s) failed: %s\n", this->path,
+            strerror(errno));
+    goto FAIL2;
+  }
+  this->size = shm_ring_size(num_slots, slot_size);
+  if (ftruncate(fd, (off_t) this->size) < 0) {
+    fprintf(stderr, "ERROR - ftruncate(%s) failed: %s\n", this->path,
+            strerror(errno));
+    goto FAIL3;
+  }
+  void *map = mmap(0, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap(%s) failed: %s\n", this->path,
+            strerror(errno));
+    goto FAIL3;
+  }
+  close(fd);
+
+  /* ftruncate() zeroed everything; the magic goes in last, so that a
+     reader never sees a half initialized header */
+  this->header = (struct shm_ring_header *) map;
+  this->header->version = SHM_RING_VERSION;
+  this->header->num_slots = num_slots;
+  this->header->slot_size = slot_size;
+  this->header->slot_stride = shm_ring_slot_stride(slot_size);
+  this->header->sample_rate = params->sample_rate;
+  this->header->publisher_pid = (int32_t) getpid();
+  atomic_thread_fence(memory_order_release);
+  this->header->magic = SHM_RING_MAGIC;
+
+  ret_val = this;
+  return ret_val;
+
+FAIL3:
+  close(fd);
+  shm_unlink(this->path);
+FAIL2:
+  free(this->path);
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void publisher_close(publisher_t *this)
+{
+  atomic_store_explicit(&this->header->closed, 1, memory_order_release);
+  atomic_fetch_add_explicit(&this->header->futex, 1, memory_order_release);
+  shm_ring_futex_wake(&this->header->futex);
+  munmap(this->header, this->size);
+  shm_unlink(this->path);
+  free(this->path);
+  free(this);
+  return;
+}
+
+
+int publisher_write(publisher_t *this, const uint8_t *data, uint32_t size,
+                    const struct sddc_frame_info *info)
+{
+  struct shm_ring_header *header = this->header;
+  if (size % sizeof(int16_t) != 0) {
+    fprintf(stderr, "ERROR - publisher_write() - frame of %u bytes is not raw 16 bit samples\n",
+            size);
+    return -1;
+  }
+
+  uint32_t offset = 0;
+  while (offset < size) {
+    uint32_t chunk = size - offset < header->slot_size ? size - offset :
+                                                         header->slot_size;
+    struct shm_slot *slot = shm_ring_slot(header, this->sequence);
+    /* the readers copying this slot out find that it changed under them */
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(shm_slot_data(slot), data + offset, chunk);
+    slot->size = chunk;
+    slot->info = *info;
+    slot->info.sample_index = info->sample_index + offset / sizeof(int16_t);
+    if (offset > 0) {
+      slot->info.flags = 0;
+      slot->info.lost_samples = 0;
+    }
+    atomic_store_explicit(&slot->sequence, this->sequence + 1,
+                          memory_order_release);
+    this->sequence++;
+    offset += chunk;
+  }
+
+  atomic_store_explicit(&header->write_sequence, this->sequence,
+                        memory_order_release);
+  atomic_fetch_add_explicit(&header->futex, 1, memory_order_seq_cst);
+  /* the system call only when somebody is waiting */
+  if (atomic_load_explicit(&header->waiters, memory_order_seq_cst) > 0) {
+    shm_ring_futex_wake(&header->futex);
+  }
+  return 0;
+}
+
+
+int publisher_get_stats(publisher_t *this, struct sddc_publisher_stats *stats)
+{
+  struct shm_ring_header *header = this->header;
+  uint64_t write_sequence = atomic_load_explicit(&header->write_sequence,
+                                                 memory_order_acquire);
+  stats->slots_written = write_sequence;
+  stats->readers = 0;
+  stats->max_reader_lag = 0;
+  stats->reader_dropped_slots = 0;
+  for (uint32_t i = 0; i < SHM_RING_MAX_READERS; ++i) {
+    struct shm_reader_entry *reader = &header->readers[i];
+    if (atomic_load_explicit(&reader->pid, memory_order_acquire) == 0) {
+      continue;
+    }
+    stats->readers++;
+    uint64_t cursor = atomic_load_explicit(&reader->cursor,
+                                           memory_order_relaxed);
+    uint64_t lag = write_sequence > cursor ? write_sequence - cursor : 0;
+    if (lag > stats->max_reader_lag) {
+      stats->max_reader_lag = lag;
+    }
+    stats->reader_dropped_slots += atomic_load_explicit(&reader->dropped_frames,
+                                                        memory_order_relaxed);
+  }
+  return 0;
+}
+
+
+/* internal functions */
+static int publisher_check_existing(const char *path)
+{
+  int fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    return 0;
+  }
+  int ret_val = 0;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct shm_ring_header)) {
+    struct shm_ring_header *header = (struct shm_ring_header *)
+        mmap(0, sizeof(struct shm_ring_header), PROT_READ, MAP_SHARED, fd, 0);
+    if (header != MAP_FAILED) {
+      if (header->magic == SHM_RING_MAGIC &&
+          !atomic_load_explicit(&header->closed, memory_order_acquire) &&
+          (kill(header->publisher_pid, 0) == 0 || errno != ESRCH)) {
+        fprintf(stderr, "ERROR - %s is already published by process %d\n",
+                path, (int) header->publisher_pid);
+        ret_val = -1;
+      }
+      munmap(header, sizeof(struct shm_ring_header));
+    }
+  }
+  close(fd);
+  return ret_val;
+}
@@ -0,0 +1,52 @@
+/*
+ * publisher.h - shared memory frame publisher
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __PUBLISHER_H
+#define __PUBLISHER_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sddc_publisher publisher_t;
+
+publisher_t *publisher_open(const struct sddc_publisher_params *params);
+
+/* the readers still attached see the stream end */
+void publisher_close(publisher_t *this);
+
+/* producer side - never blocks, and must always be called from the same
+   thread */
+int publisher_write(publisher_t *this, const uint8_t *data, uint32_t size,
+                    const struct sddc_frame_info *info);
+
+int publisher_get_stats(publisher_t *this, struct sddc_publisher_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PUBLISHER_H */
@@ -0,0 +1,507 @@
+/*
+ * recorder.c - high throughput recorder to disk
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "recorder.h"
+#include "spsc_ring.h"
+
+
+typedef struct sddc_recorder recorder_t;
+
+struct buffer {
+  uint8_t *data;
+  uint32_t length;
+};
+
+typedef struct sddc_recorder {
+  char *path;
+  uint64_t max_file_size;
+  uint32_t max_file_time;
+  int direct_io;
+  uint32_t buffer_size;
+  uint32_t num_buffers;
+  uint8_t *arena;
+  struct buffer *buffers;
+  spsc_ring_t *filled_buffers;  /* producer -> writer */
+  spsc_ring_t *free_buffers;    /* writer -> producer */
+  sem_t filled_buffers_sem;
+  pthread_t writer_thread;
+  atomic_int running;
+  /* producer side */
+  struct buffer *current;
+  atomic_ullong dropped_bytes;
+  /* writer side */
+  int fd;
+  uint64_t file_offset;
+  uint64_t file_data_size;      /* file_offset without the O_DIRECT padding */
+  uint64_t file_allocated;
+  time_t file_start_time;
+  uint32_t file_index;
+  uint32_t in_flight;
+  atomic_ullong bytes_written;
+  atomic_uint files;
+  atomic_uint io_errors;
+#ifdef HAVE_LIBURING
+  int use_io_uring;
+  struct io_uring ring;
+#endif
+} recorder_t;
+
+
+static const uint32_t DEFAULT_BUFFER_SIZE = 4 * 1024 * 1024;
+static const uint32_t DEFAULT_NUM_BUFFERS = 64;
+static const uint32_t IO_ALIGNMENT = 4096;      /* O_DIRECT */
+static const uint64_t PREALLOCATE_SIZE = 1024ULL * 1024 * 1024;
+#ifdef HAVE_LIBURING
+static const unsigned int IO_URING_DEPTH = 8;   /* writes in flight */
+#endif
+
+
+/* internal functions */
+static void *recorder_writer_thread(void *arg);
+static int recorder_write_buffer(recorder_t *this, struct buffer *buffer);
+static void recorder_buffer_done(recorder_t *this, struct buffer *buffer,
+                                 ssize_t result, uint32_t length);
+static int recorder_wait_in_flight(recorder_t *this, uint32_t max_in_flight);
+static int recorder_open_file(recorder_t *this);
+static void recorder_close_file(recorder_t *this);
+
+
+recorder_t *recorder_open(const struct sddc_recorder_params *params)
+{
+  recorder_t *ret_val = 0;
+
+  uint32_t buffer_size = params->buffer_size ? params->buffer_size : DEFAULT_BUFFER_SIZE;
+  if (buffer_size % IO_ALIGNMENT != 0) {
+    fprintf(stderr, "ERROR - recorder buffer size must be a multiple of %u\n",
+            (unsigned) IO_ALIGNMENT);
+    return ret_val;
+  }
+  uint32_t num_buffers = params->num_buffers ? params->num_buffers : DEFAULT_NUM_BUFFERS;
+
+  recorder_t *this = (recorder_t *) malloc(sizeof(recorder_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->path = strdup(params->path);
+  this->max_file_size = params->max_file_size;
+  this->max_file_time = params->max_file_time;
+  this->direct_io = params->direct_io;
+  this->buffer_size = buffer_size;
+  this->num_buffers = num_buffers;
+  this->current = 0;
+  atomic_init(&this->dropped_bytes, 0);
+  this->fd = -1;
+  this->file_offset = 0;
+  this->file_data_size = 0;
+  this->file_allocated = 0;
+  this->file_start_time = 0;
+  this->file_index = 0;
+  this->in_flight = 0;
+  atomic_init(&this->bytes_written, 0);
+  atomic_init(&this->files, 0);
+  atomic_init(&this->io_errors, 0);
+
+  void *arena = 0;
+  int ret = posix_memalign(&arena, IO_ALIGNMENT, (size_t) buffer_size * num_buffers);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - posix_memalign() failed: %s\n", strerror(ret));
+    goto FAIL1;
+  }
+  this->arena = (uint8_t *) arena;
+  this->buffers = (struct buffer *) malloc(num_buffers * sizeof(struct buffer));
+  this->filled_buffers = spsc_ring_open(num_buffers);
+  this->free_buffers = spsc_ring_open(num_buffers);
+  if (this->buffers == 0 || this->filled_buffers == 0 || this->free_buffers == 0) {
+    fprintf(stderr, "ERROR - recorder buffer allocation failed\n");
+    goto FAIL2;
+  }
+  for (uint32_t i = 0; i < num_buffers; ++i) {
+    this->buffers[i].data = this->arena + (size_t) i * buffer_size;
+    this->buffers[i].length = 0;
+    spsc_ring_push(this->free_buffers, &this->buffers[i]);
+  }
+
+  /* the first file is opened right away, so that errors show up here */
+  if (recorder_open_file(this) < 0) {
+    goto FAIL2;
+  }
+
+#ifdef HAVE_LIBURING
+  this->use_io_uring = io_uring_queue_init(IO_URING_DEPTH, &this->ring, 0) == 0;
+  if (!this->use_io_uring) {
+    fprintf(stderr, "WARNING - io_uring not available - using pwrite()\n");
+  }
+#endif
+
+  if (sem_init(&this->filled_buffers_sem, 0, 0) < 0) {
+    fprintf(stderr, "ERROR - sem_init() failed: %s\n", strerror(errno));
+    goto FAIL3;
+  }
+  atomic_init(&this->running, 1);
+  ret = pthread_create(&this->writer_thread, 0, recorder_writer_thread, this);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+    goto FAIL4;
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL4:
+  sem_destroy(&this->filled_buffers_sem);
+FAIL3:
+#ifdef HAVE_LIBURING
+  if (this->use_io_uring) {
+    io_uring_queue_exit(&this->ring);
+  }
+#endif
+  recorder_close_file(this);
+FAIL2:
+  if (this->free_buffers) {
+    spsc_ring_close(this->free_buffers);
+  }
+  if (this->filled_buffers) {
+    spsc_ring_close(this->filled_buffers);
+  }
+  free(this->buffers);
+  free(this->arena);
+FAIL1:
+  free(this->path);
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void recorder_close(recorder_t *this)
+{
+  /* the producer is done - queue the last partial buffer */
+  if (this->current && this->current->length > 0) {
+    spsc_ring_push(this->filled_buffers, this->current);
+    sem_post(&this->filled_buffers_sem);
+  }
+  this->current = 0;
+
+  /* let the writer thread drain the queue and exit */
+  atomic_store(&this->running, 0);
+  sem_post(&this->filled_buffers_sem);
+  pthread_join(this->writer_thread, 0);
+  sem_destroy(&this->filled_buffers_sem);
+
+#ifdef HAVE_LIBURING
+  if (this->use_io_uring) {
+    io_uring_queue_exit(&this->ring);
+  }
+#endif
+  recorder_close_file(this);
+  spsc_ring_close(this->free_buffers);
+  spsc_ring_close(this->filled_buffers);
+  free(this->buffers);
+  free(this->arena);
+  free(this->path);
+  free(this);
+  return;
+}
+
+
+int recorder_write(recorder_t *this, const uint8_t *data, uint32_t length)
+{
+  return recorder_write_wait(this, data, length, 0);
+}
+
+
+int recorder_write_wait(recorder_t *this, const uint8_t *data,
+                        uint32_t length, int timeout_ms)
+{
+  while (length > 0) {
+    if (this->current == 0) {
+      this->current = (struct buffer *) spsc_ring_pop(this->free_buffers);
+      /* the writer thread hands the buffers back one write at a time */
+      for (int waited = 0; this->current == 0 && waited < timeout_ms; ++waited) {
+        const struct timespec interval = { 0, 1000000 };
+        nanosleep(&interval, 0);
+        this->current = (struct buffer *) spsc_ring_pop(this->free_buffers);
+      }
+      if (this->current == 0) {
+        /* the disk is not keeping up */
+        unsigned long long v = atomic_load_explicit(&this->dropped_bytes, memory_order_relaxed);
+        atomic_store_explicit(&this->dropped_bytes, v + length, memory_order_relaxed);
+        return -1;
+      }
+    }
+    struct buffer *buffer = this->current;
+    uint32_t n = this->buffer_size - buffer->length;
+    n = n < length ? n : length;
+    memcpy(buffer->data + buffer->length, data, n);
+    buffer->length += n;
+    data += n;
+    length -= n;
+    if (buffer->length == this->buffer_size) {
+      spsc_ring_push(this->filled_buffers, buffer);
+      sem_post(&this->filled_buffers_sem);
+      this->current = 0;
+    }
+  }
+  return 0;
+}
+
+
+int recorder_get_stats(recorder_t *this, struct sddc_recorder_stats *stats)
+{
+  stats->bytes_written = atomic_load(&this->bytes_written);
+  stats->dropped_bytes = atomic_load(&this->dropped_bytes);
+  stats->files = atomic_load(&this->files);
+  stats->max_queued_buffers = spsc_ring_high_water_mark(this->filled_buffers);
+  stats->io_errors = atomic_load(&this->io_errors);
+#ifdef HAVE_LIBURING
+  stats->uses_io_uring = this->use_io_uring;
+#else
+  stats->uses_io_uring = 0;
+#endif
+  return 0;
+}
+
+
+/* internal functions */
+static void *recorder_writer_thread(void *arg)
+{
+  recorder_t *this = (recorder_t *) arg;
+  while (1) {
+    /* while writes are in flight, reap them instead of sleeping */
+    if (this->in_flight > 0 && sem_trywait(&this->filled_buffers_sem) < 0) {
+      recorder_wait_in_flight(this, this->in_flight - 1);
+      continue;
+    }
+    if (this->in_flight == 0 && sem_wait(&this->filled_buffers_sem) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR - sem_wait() failed: %s\n", strerror(errno));
+      break;
+    }
+    struct buffer *buffer = (struct buffer *) spsc_ring_pop(this->filled_buffers);
+    if (buffer == 0) {
+      /* woken up with an empty queue - time to go */
+      if (!atomic_load(&this->running)) {
+        break;
+      }
+      continue;
+    }
+    recorder_write_buffer(this, buffer);
+  }
+  recorder_wait_in_flight(this, 0);
+  return 0;
+}
+
+
+static int recorder_write_buffer(recorder_t *this, struct buffer *buffer)
+{
+  /* rotate at buffer boundaries */
+  int rotate = 0;
+  if (this->max_file_size && this->file_offset > 0 &&
+      this->file_offset + buffer->length > this->max_file_size) {
+    rotate = 1;
+  }
+  if (this->max_file_time &&
+      time(0) - this->file_start_time >= (time_t) this->max_file_time) {
+    rotate = 1;
+  }
+  if (rotate || this->fd < 0) {
+    recorder_wait_in_flight(this, 0);
+    recorder_close_file(this);
+    if (recorder_open_file(this) < 0) {
+      recorder_buffer_done(this, buffer, -1, buffer->length);
+      return -1;
+    }
+  }
+
+  /* preallocate ahead, so that the file system does not have to find
+     space in the middle of the writes */
+  uint32_t length = buffer->length;
+  uint32_t io_length = (length + IO_ALIGNMENT - 1) & ~(IO_ALIGNMENT - 1);
+  if (this->file_offset + io_length > this->file_allocated) {
+    uint64_t size = this->max_file_size ? this->max_file_size : PREALLOCATE_SIZE;
+    if (fallocate(this->fd, FALLOC_FL_KEEP_SIZE, this->file_allocated,
+                  size) == 0) {
+      this->file_allocated += size;
+    } else {
+      /* not supported here - do not try again */
+      this->file_allocated = UINT64_MAX;
+    }
+  }
+
+  uint64_t offset = this->file_offset;
+  this->file_offset += io_length;
+  this->file_data_size = offset + length;
+
+#ifdef HAVE_LIBURING
+  if (this->use_io_uring) {
+    if (this->in_flight >= IO_URING_DEPTH) {
+      recorder_wait_in_flight(this, IO_URING_DEPTH - 1);
+    }
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
+    io_uring_prep_write(sqe, this->fd, buffer->data, io_length, offset);
+    io_uring_sqe_set_data(sqe, buffer);
+    int ret = io_uring_submit(&this->ring);
+    if (ret >= 0) {
+      this->in_flight++;
+      return 0;
+    }
+    fprintf(stderr, "ERROR - io_uring_submit() failed: %s\n", strerror(-ret));
+    recorder_buffer_done(this, buffer, -1, io_length);
+    return -1;
+  }
+#endif
+
+  ssize_t ret;
+  uint32_t done = 0;
+  do {
+    ret = pwrite(this->fd, buffer->data + done, io_length - done, offset + done);
+    if (ret > 0) {
+      done += ret;
+    }
+  } while ((ret > 0 && done < io_length) || (ret < 0 && errno == EINTR));
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - pwrite() failed: %s\n", strerror(errno));
+  }
+  recorder_buffer_done(this, buffer, ret < 0 ? -1 : (ssize_t) done, io_length);
+  return ret < 0 ? -1 : 0;
+}
+
+
+static void recorder_buffer_done(recorder_t *this, struct buffer *buffer,
+                                 ssize_t result, uint32_t length)
+{
+  if (result == (ssize_t) length) {
+    atomic_fetch_add(&this->bytes_written, buffer->length);
+  } else {
+    atomic_fetch_add(&this->io_errors, 1);
+  }
+  buffer->length = 0;
+  spsc_ring_push(this->free_buffers, buffer);
+  return;
+}
+
+
+static int recorder_wait_in_flight(recorder_t *this, uint32_t max_in_flight)
+{
+#ifdef HAVE_LIBURING
+  while (this->in_flight > max_in_flight) {
+    struct io_uring_cqe *cqe;
+    int ret = io_uring_wait_cqe(&this->ring, &cqe);
+    if (ret < 0) {
+      if (ret == -EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR - io_uring_wait_cqe() failed: %s\n", strerror(-ret));
+      return -1;
+    }
+    struct buffer *buffer = (struct buffer *) io_uring_cqe_get_data(cqe);
+    uint32_t io_length = (buffer->length + IO_ALIGNMENT - 1) & ~(IO_ALIGNMENT - 1);
+    if (cqe->res < 0) {
+      fprintf(stderr, "ERROR - io_uring write failed: %s\n", strerror(-cqe->res));
+    }
+    recorder_buffer_done(this, buffer, cqe->res, io_length);
+    io_uring_cqe_seen(&this->ring, cqe);
+    this->in_flight--;
+  }
+#else
+  (void) this;
+  (void) max_in_flight;
+#endif
+  return 0;
+}
+
+
+static int recorder_open_file(recorder_t *this)
+{
+  char path[4096];
+  time_t now = time(0);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  size_t n = strftime(path, sizeof(path), this->path, &tm);
+  if (n == 0) {
+    fprintf(stderr, "ERROR - invalid recorder path: %s\n", this->path);
+    return -1;
+  }
+  if (this->max_file_size || this->max_file_time) {
+    snprintf(path + n, sizeof(path) - n, ".%04u", (unsigned) this->file_index);
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  int fd = -1;
+  if (this->direct_io) {
+    fd = open(path, flags | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) {
+      fprintf(stderr, "WARNING - O_DIRECT not supported for %s\n", path);
+      this->direct_io = 0;
+    }
+  }
+  if (fd < 0) {
+    fd = open(path, flags, 0644);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - open(%s) failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  this->fd = fd;
+  this->file_offset = 0;
+  this->file_data_size = 0;
+  this->file_allocated = 0;
+  this->file_start_time = now;
+  this->file_index++;
+  atomic_fetch_add(&this->files, 1);
+  return 0;
+}
+
+
+static void recorder_close_file(recorder_t *this)
+{
+  if (this->fd < 0) {
+    return;
+  }
+  /* drop the O_DIRECT padding of the last buffer and the preallocated
+     space past the end */
+  if (ftruncate(this->fd, this->file_data_size) < 0) {
+    fprintf(stderr, "WARNING - ftruncate() failed: %s\n", strerror(errno));
+  }
+  close(this->fd);
+  this->fd = -1;
+  return;
+}
@@ -0,0 +1,55 @@
+/*
+ * recorder.h - high throughput recorder to disk
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RECORDER_H
+#define __RECORDER_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sddc_recorder recorder_t;
+
+recorder_t *recorder_open(const struct sddc_recorder_params *params);
+
+/* flushes the data still buffered */
+void recorder_close(recorder_t *this);
+
+/* producer side - never blocks on disk I/O */
+int recorder_write(recorder_t *this, const uint8_t *data, uint32_t length);
+
+/* the same, for a producer that can wait for the disk: waits up to
+   timeout_ms for each free buffer before dropping the rest of the data */
+int recorder_write_wait(recorder_t *this, const uint8_t *data,
+                        uint32_t length, int timeout_ms);
+
+int recorder_get_stats(recorder_t *this, struct sddc_recorder_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RECORDER_H */
@@ -0,0 +1,491 @@
+/*
+ * replay.c - capture file replay as a virtual device
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+
+struct queued_transfer {
+  struct libusb_transfer *transfer;
+  int cancelled;
+};
+
+typedef struct replay {
+  int fd;
+  const uint8_t *map;
+  size_t map_size;
+  const uint8_t *data;          /* the samples in the file */
+  uint64_t data_size;
+  double file_sample_rate;
+  int realtime;
+  int loop;
+  double sample_rate;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct queued_transfer *queue;
+  uint32_t queue_length;
+  uint32_t queue_capacity;
+  int running;
+  int finished;
+  uint64_t position;            /* bytes */
+  uint64_t delivered;           /* bytes since start */
+  uint64_t start_time;          /* ns */
+} replay_t;
+
+
+static const int DEFAULT_TIMEOUT = 1000;        /* ms */
+
+
+/* internal functions */
+static int replay_parse_wav(replay_t *this);
+static uint32_t replay_copy(replay_t *this, uint8_t *data, uint32_t length);
+static uint64_t replay_due_time(replay_t *this, uint32_t length);
+static inline uint64_t monotonic_ns(void);
+static void timespec_from_ns(struct timespec *ts, uint64_t ns);
+
+
+replay_t *replay_open(const char *path)
+{
+  replay_t *ret_val = 0;
+
+  replay_t *this = (replay_t *) malloc(sizeof(replay_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+
+  this->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (this->fd < 0) {
+    fprintf(stderr, "ERROR - open(%s) failed: %s\n", path, strerror(errno));
+    goto FAIL1;
+  }
+  struct stat statbuf;
+  if (fstat(this->fd, &statbuf) < 0) {
+    fprintf(stderr, "ERROR - fstat(%s) failed: %s\n", path, strerror(errno));
+    goto FAIL2;
+  }
+  this->map_size = statbuf.st_size;
+  if (this->map_size < sizeof(int16_t)) {
+    fprintf(stderr, "ERROR - %s is empty\n", path);
+    goto FAIL2;
+  }
+  void *map = mmap(0, this->map_size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap(%s) failed: %s\n", path, strerror(errno));
+    goto FAIL2;
+  }
+  this->map = (const uint8_t *) map;
+  madvise(map, this->map_size, MADV_SEQUENTIAL);
+
+  /* raw samples unless it is a WAV file */
+  this->data = this->map;
+  this->data_size = this->map_size;
+  this->file_sample_rate = 0;
+  if (this->map_size >= 12 &&
+      (memcmp(this->map, "RIFF", 4) == 0 || memcmp(this->map, "RF64", 4) == 0 ||
+       memcmp(this->map, "BW64", 4) == 0) &&
+      memcmp(this->map + 8, "WAVE", 4) == 0) {
+    if (replay_parse_wav(this) < 0) {
+      fprintf(stderr, "ERROR - %s: unsupported WAV file\n", path);
+      goto FAIL3;
+    }
+  }
+  this->data_size &= ~(uint64_t) (sizeof(int16_t) - 1);
+  if (this->data_size == 0) {
+    /* nothing to replay - and looping over it would never end */
+    fprintf(stderr, "ERROR - %s: no samples\n", path);
+    goto FAIL3;
+  }
+
+  this->realtime = 1;
+  this->loop = 0;
+  this->sample_rate = this->file_sample_rate;
+  this->queue = 0;
+  this->queue_length = 0;
+  this->queue_capacity = 0;
+  this->running = 0;
+  this->finished = 0;
+  this->position = 0;
+  this->delivered = 0;
+  this->start_time = 0;
+  pthread_mutex_init(&this->lock, 0);
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&this->cond, &condattr);
+  pthread_condattr_destroy(&condattr);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL3:
+  munmap((void *) this->map, this->map_size);
+FAIL2:
+  close(this->fd);
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void replay_close(replay_t *this)
+{
+  pthread_cond_destroy(&this->cond);
+  pthread_mutex_destroy(&this->lock);
+  free(this->queue);
+  munmap((void *) this->map, this->map_size);
+  close(this->fd);
+  free(this);
+  return;
+}
+
+
+double replay_get_file_sample_rate(replay_t *this)
+{
+  return this->file_sample_rate;
+}
+
+
+void replay_set_params(replay_t *this, int realtime, int loop)
+{
+  pthread_mutex_lock(&this->lock);
+  this->realtime = realtime;
+  this->loop = loop;
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void replay_set_sample_rate(replay_t *this, double sample_rate)
+{
+  if (this->file_sample_rate > 0 && sample_rate != this->file_sample_rate) {
+    fprintf(stderr, "WARNING - replaying a %.0f sps file at %.0f sps\n",
+            this->file_sample_rate, sample_rate);
+  }
+  pthread_mutex_lock(&this->lock);
+  this->sample_rate = sample_rate;
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void replay_start(replay_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  this->running = 1;
+  this->finished = 0;
+  this->position = 0;
+  this->delivered = 0;
+  this->start_time = monotonic_ns();
+  pthread_cond_broadcast(&this->cond);
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void replay_stop(replay_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  this->running = 0;
+  pthread_cond_broadcast(&this->cond);
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void replay_get_position(replay_t *this, uint64_t *samples, int *finished)
+{
+  pthread_mutex_lock(&this->lock);
+  if (samples) {
+    *samples = this->delivered / sizeof(int16_t);
+  }
+  if (finished) {
+    *finished = this->finished;
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+int replay_submit_transfer(replay_t *this, struct libusb_transfer *transfer)
+{
+  int ret_val = 0;
+  pthread_mutex_lock(&this->lock);
+  for (uint32_t i = 0; i < this->queue_length; ++i) {
+    if (this->queue[i].transfer == transfer) {
+      ret_val = LIBUSB_ERROR_BUSY;
+      goto DONE;
+    }
+  }
+  if (this->queue_length == this->queue_capacity) {
+    uint32_t capacity = this->queue_capacity ? 2 * this->queue_capacity : 64;
+    struct queued_transfer *queue = (struct queued_transfer *) realloc(this->queue,
+                                        capacity * sizeof(struct queued_transfer));
+    if (queue == 0) {
+      ret_val = LIBUSB_ERROR_NO_MEM;
+      goto DONE;
+    }
+    this->queue = queue;
+    this->queue_capacity = capacity;
+  }
+  this->queue[this->queue_length].transfer = transfer;
+  this->queue[this->queue_length].cancelled = 0;
+  this->queue_length++;
+  pthread_cond_broadcast(&this->cond);
+DONE:
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+int replay_cancel_transfer(replay_t *this, struct libusb_transfer *transfer)
+{
+  int ret_val = LIBUSB_ERROR_NOT_FOUND;
+  pthread_mutex_lock(&this->lock);
+  for (uint32_t i = 0; i < this->queue_length; ++i) {
+    if (this->queue[i].transfer == transfer) {
+      this->queue[i].cancelled = 1;
+      ret_val = 0;
+      pthread_cond_broadcast(&this->cond);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+/* completes the transfers that are due - in order, like the bulk endpoint
+   would - and returns when at least one has been completed, or on timeout */
+int replay_handle_events(replay_t *this, int timeout_ms)
+{
+  if (timeout_ms < 0) {
+    timeout_ms = DEFAULT_TIMEOUT;
+  }
+  uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+
+  pthread_mutex_lock(&this->lock);
+  /* at most one pass over the queue, so that the callbacks resubmitting
+     their transfers do not keep us here */
+  uint32_t budget = 0;
+  uint32_t completed = 0;
+  while (1) {
+    if (completed == 0) {
+      budget = this->queue_length;
+    }
+    /* the cancelled transfers and the control transfers (already applied
+       by the virtual device) complete right away */
+    struct libusb_transfer *transfer = 0;
+    int cancelled = 0;
+    for (uint32_t i = 0; i < this->queue_length; ++i) {
+      if (this->queue[i].cancelled ||
+          this->queue[i].transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        transfer = this->queue[i].transfer;
+        cancelled = this->queue[i].cancelled;
+        memmove(&this->queue[i], &this->queue[i+1],
+                (this->queue_length - i - 1) * sizeof(struct queued_transfer));
+        this->queue_length--;
+        break;
+      }
+    }
+    if (transfer && cancelled) {
+      transfer->status = LIBUSB_TRANSFER_CANCELLED;
+      transfer->actual_length = 0;
+    } else if (transfer) {
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+      transfer->actual_length = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+    } else if (completed < budget && this->queue_length > 0 &&
+               this->running && !this->finished) {
+      uint64_t due = replay_due_time(this,
+                                     (uint32_t) this->queue[0].transfer->length);
+      uint64_t now = monotonic_ns();
+      if (due > now) {
+        if (completed > 0 || now >= deadline) {
+          break;
+        }
+        struct timespec ts;
+        timespec_from_ns(&ts, due < deadline ? due : deadline);
+        pthread_cond_timedwait(&this->cond, &this->lock, &ts);
+        continue;
+      }
+      transfer = this->queue[0].transfer;
+      memmove(&this->queue[0], &this->queue[1],
+              (this->queue_length - 1) * sizeof(struct queued_transfer));
+      this->queue_length--;
+      transfer->actual_length = replay_copy(this, transfer->buffer,
+                                            (uint32_t) transfer->length);
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    } else {
+      /* nothing to complete - wait for a submit, a cancel or a start */
+      if (completed > 0 || monotonic_ns() >= deadline) {
+        break;
+      }
+      struct timespec ts;
+      timespec_from_ns(&ts, deadline);
+      pthread_cond_timedwait(&this->cond, &this->lock, &ts);
+      continue;
+    }
+    completed++;
+    pthread_mutex_unlock(&this->lock);
+    transfer->callback(transfer);
+    pthread_mutex_lock(&this->lock);
+  }
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+
+int replay_bulk_transfer(replay_t *this, uint8_t *data, int length,
+                         int *transferred, int timeout_ms)
+{
+  uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+  pthread_mutex_lock(&this->lock);
+  while (1) {
+    if (this->running && !this->finished) {
+      uint64_t due = replay_due_time(this, (uint32_t) length);
+      if (due <= monotonic_ns()) {
+        break;
+      }
+    }
+    if (monotonic_ns() >= deadline) {
+      pthread_mutex_unlock(&this->lock);
+      *transferred = 0;
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+    uint64_t wakeup = deadline;
+    if (this->running && !this->finished) {
+      uint64_t due = replay_due_time(this, (uint32_t) length);
+      wakeup = due < deadline ? due : deadline;
+    }
+    struct timespec ts;
+    timespec_from_ns(&ts, wakeup);
+    pthread_cond_timedwait(&this->cond, &this->lock, &ts);
+  }
+  *transferred = (int) replay_copy(this, data, (uint32_t) length);
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+
+/* internal functions */
+static int replay_parse_wav(replay_t *this)
+{
+  const uint8_t *p = this->map + 12;
+  const uint8_t *end = this->map + this->map_size;
+  uint64_t ds64_data_size = 0;
+  int has_fmt = 0;
+  while (p + 8 <= end) {
+    uint32_t size;
+    memcpy(&size, p + 4, sizeof(size));
+    const uint8_t *chunk = p + 8;
+    if (memcmp(p, "ds64", 4) == 0 && size >= 16 && chunk + 16 <= end) {
+      memcpy(&ds64_data_size, chunk + 8, sizeof(ds64_data_size));
+    } else if (memcmp(p, "fmt ", 4) == 0 && size >= 16 && chunk + 16 <= end) {
+      uint16_t format_tag, num_channels, bits_per_sample;
+      uint32_t sample_rate;
+      memcpy(&format_tag, chunk, sizeof(format_tag));
+      memcpy(&num_channels, chunk + 2, sizeof(num_channels));
+      memcpy(&sample_rate, chunk + 4, sizeof(sample_rate));
+      memcpy(&bits_per_sample, chunk + 14, sizeof(bits_per_sample));
+      if (format_tag != 1 || num_channels != 1 || bits_per_sample != 16) {
+        fprintf(stderr, "ERROR - only 16 bit mono PCM WAV files can be replayed\n");
+        return -1;
+      }
+      this->file_sample_rate = sample_rate;
+      has_fmt = 1;
+    } else if (memcmp(p, "data", 4) == 0) {
+      if (!has_fmt) {
+        return -1;
+      }
+      uint64_t data_size = size;
+      if (size == UINT32_MAX && ds64_data_size > 0) {
+        data_size = ds64_data_size;
+      }
+      /* a capture that was not finalized - take what is there */
+      uint64_t available = end - chunk;
+      this->data = chunk;
+      this->data_size = data_size < available && data_size > 0 ? data_size : available;
+      return 0;
+    }
+    p = chunk + size + (size & 1);
+  }
+  return -1;
+}
+
+/* called with the lock held */
+static uint32_t replay_copy(replay_t *this, uint8_t *data, uint32_t length)
+{
+  uint32_t done = 0;
+  while (done < length) {
+    if (this->position == this->data_size) {
+      if (!this->loop) {
+        this->finished = 1;
+        break;
+      }
+      this->position = 0;
+    }
+    uint64_t n = this->data_size - this->position;
+    n = n < length - done ? n : length - done;
+    memcpy(data + done, this->data + this->position, n);
+    done += n;
+    this->position += n;
+  }
+  if (this->position == this->data_size && !this->loop) {
+    this->finished = 1;
+  }
+  this->delivered += done;
+  return done;
+}
+
+/* when the next length bytes, after the ones delivered so far, have all
+   been sampled (a transfer completes once it is full) */
+static uint64_t replay_due_time(replay_t *this, uint32_t length)
+{
+  if (!this->realtime || this->sample_rate <= 0) {
+    return 0;
+  }
+  uint64_t end = this->delivered + length;
+  if (!this->loop && this->data_size - this->position < length) {
+    /* the last one is short */
+    end = this->delivered + (this->data_size - this->position);
+  }
+  double elapsed = end / (sizeof(int16_t) * this->sample_rate);
+  return this->start_time + (uint64_t) (elapsed * 1e9);
+}
+
+static inline uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void timespec_from_ns(struct timespec *ts, uint64_t ns)
+{
+  ts->tv_sec = ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
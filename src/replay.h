@@ -0,0 +1,72 @@
+/*
+ * replay.h - capture file replay as a virtual device
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct replay replay_t;
+
+/* a raw file of 16 bit samples, or a 16 bit mono WAV (RIFF/RF64/BW64) */
+replay_t *replay_open(const char *path);
+
+void replay_close(replay_t *this);
+
+/* 0 for raw files */
+double replay_get_file_sample_rate(replay_t *this);
+
+void replay_set_params(replay_t *this, int realtime, int loop);
+
+/* what the data is paced to (from STARTADC) */
+void replay_set_sample_rate(replay_t *this, double sample_rate);
+
+/* STARTFX3/STOPFX3: the replay starts again from the beginning of the
+   file on every start */
+void replay_start(replay_t *this);
+
+void replay_stop(replay_t *this);
+
+void replay_get_position(replay_t *this, uint64_t *samples, int *finished);
+
+/* the libusb transfer API, served from the file: return libusb error
+   codes. The callbacks run from replay_handle_events(); control transfers
+   complete at once (the caller applies them) */
+int replay_submit_transfer(replay_t *this, struct libusb_transfer *transfer);
+
+int replay_cancel_transfer(replay_t *this, struct libusb_transfer *transfer);
+
+int replay_handle_events(replay_t *this, int timeout_ms);
+
+int replay_bulk_transfer(replay_t *this, uint8_t *data, int length,
+                         int *transferred, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __REPLAY_H */
@@ -0,0 +1,619 @@
+/*
+ * sddc_bench - throughput benchmarks for libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Results are printed on stdout as one JSON object, so that runs on
+ * different releases and hosts can be compared; progress goes to stderr.
+ * The kernel benchmarks need no device: the DDC and channelizer run on a
+ * synthetic capture replayed (as fast as they take it) through a file://
+ * device, i.e. through the same streaming path as the USB frames. The
+ * conversion kernels are timed one ISA at a time through the private
+ * convert.h, so this is a build tree tool, linked with its own copy of
+ * convert.c, and it is not installed */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsddc.h"
+#include "convert.h"
+
+
+struct stream_run {
+  /* parameters */
+  const char *imagefile;
+  double sample_rate;
+  uint32_t frame_size;
+  uint32_t num_frames;
+  uint32_t num_threads;
+  uint32_t ddc_decimation;
+  uint32_t channelizer_fft_size;
+  uint32_t num_channels;
+  int replay;
+  double duration;
+  /* results */
+  double elapsed;
+  uint64_t bytes;
+  uint64_t output_bytes;
+  uint64_t short_transfers;
+  uint64_t lost_samples;
+  uint32_t num_latencies;
+  uint64_t *latencies;          /* ns */
+};
+
+static double monotonic_time(void);
+static int bench_derandomize(double duration);
+static int bench_convert(double duration);
+static int bench_stream(struct stream_run *run);
+static void stream_callback(uint32_t data_size, uint8_t *data,
+                            const struct sddc_frame_info *info,
+                            void *context);
+static void channel_callback(int channel, uint32_t data_size, uint8_t *data,
+                             void *context);
+static void print_stream_run(const struct stream_run *run, int latencies);
+static int compare_uint64(const void *a, const void *b);
+static char *write_synthetic_capture(const char *directory, double sample_rate,
+                                     uint32_t num_samples);
+static int bench_recorder(const char *path, double duration);
+
+#define MAX_LATENCIES (1 << 20)
+#define SYNTHETIC_SAMPLES (16 * 1024 * 1024)
+
+#define SDDC_CHECK(function, ...)\
+if(function(__VA_ARGS__) < 0) {\
+  fprintf(stderr, "ERROR - " #function "() failed\n");\
+  goto DONE;\
+}
+
+static const uint32_t frame_sizes[] = { SDDC_ASYNC_AUTO, 65536, 131072,
+                                        262144, 1048576 };
+static const uint32_t queue_depths[] = { 16, 32, 64 };
+static const uint32_t ddc_decimations[] = { 4, 16, 64 };
+static const uint32_t channelizer_fft_size = 65536;
+static const uint32_t channelizer_channels = 8;
+static const uint32_t channelizer_decimation = 256;
+
+
+int main(int argc, char **argv)
+{
+  const char *imagefile = 0;
+  double sample_rate = 64e6;
+  double duration = 2.0;
+  const char *directory = "/tmp";
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:t:o:j:")) != -1) {
+    switch (opt) {
+      case 'd':
+        imagefile = optarg;
+        break;
+      case 's':
+        sscanf(optarg, "%lf", &sample_rate);
+        break;
+      case 't':
+        sscanf(optarg, "%lf", &duration);
+        break;
+      case 'o':
+        directory = optarg;
+        break;
+      case 'j':
+        max_threads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-d <image file>] [-s <sample rate>] [-t <seconds per run>] [-o <scratch directory>] [-j <max worker threads>]\n", argv[0]);
+        fprintf(stderr, "       the USB benchmarks run only with -d (a file:// capture works too)\n");
+        return -1;
+    }
+  }
+  if (max_threads < 0) {
+    max_threads = 0;
+  }
+  if (max_threads > SDDC_MAX_WORKER_THREADS) {
+    max_threads = SDDC_MAX_WORKER_THREADS;
+  }
+
+  int ret_val = -1;
+  char *synthetic = 0;
+  char *recorder_path = 0;
+
+  printf("{\n");
+  printf("  \"host\": { \"cpus\": %ld, \"isa\": \"%s\" },\n",
+         sysconf(_SC_NPROCESSORS_ONLN), convert_get_isa());
+  printf("  \"sample_rate\": %.0f,\n", sample_rate);
+  printf("  \"duration\": %.3f,\n", duration);
+
+  /* de-randomization kernels */
+  SDDC_CHECK(bench_derandomize, duration);
+  SDDC_CHECK(bench_convert, duration);
+
+  /* USB transfers */
+  printf("  \"usb\": [");
+  if (imagefile) {
+    int first = 1;
+    for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); ++i) {
+      for (size_t j = 0; j < sizeof(queue_depths) / sizeof(queue_depths[0]); ++j) {
+        uint32_t num_frames = frame_sizes[i] == SDDC_ASYNC_AUTO ?
+                              SDDC_ASYNC_AUTO : queue_depths[j];
+        if (frame_sizes[i] == SDDC_ASYNC_AUTO && j > 0) {
+          continue;
+        }
+        struct stream_run run = {
+          .imagefile = imagefile,
+          .sample_rate = sample_rate,
+          .frame_size = frame_sizes[i],
+          .num_frames = num_frames,
+          .duration = duration,
+        };
+        fprintf(stderr, "usb: frame_size=%d num_frames=%d (-1 = auto)\n",
+                (int) run.frame_size, (int) run.num_frames);
+        SDDC_CHECK(bench_stream, &run);
+        printf("%s\n    ", first ? "" : ",");
+        print_stream_run(&run, 1);
+        free(run.latencies);
+        first = 0;
+      }
+    }
+    printf("\n  ");
+  }
+  printf("],\n");
+
+  /* DDC and channelizer on a synthetic capture */
+  synthetic = write_synthetic_capture(directory, sample_rate,
+                                      SYNTHETIC_SAMPLES);
+  if (synthetic == 0) {
+    goto DONE;
+  }
+  printf("  \"ddc\": [");
+  int first = 1;
+  for (size_t i = 0; i < sizeof(ddc_decimations) / sizeof(ddc_decimations[0]); ++i) {
+    for (int threads = 0; threads <= max_threads; threads = threads ? 2 * threads : 1) {
+      struct stream_run run = {
+        .imagefile = synthetic,
+        .sample_rate = sample_rate,
+        .frame_size = SDDC_ASYNC_AUTO,
+        .num_frames = SDDC_ASYNC_AUTO,
+        .num_threads = threads,
+        .ddc_decimation = ddc_decimations[i],
+        .replay = 1,
+        .duration = duration,
+      };
+      fprintf(stderr, "ddc: decimation=%u threads=%d\n", run.ddc_decimation,
+              threads);
+      SDDC_CHECK(bench_stream, &run);
+      printf("%s\n    ", first ? "" : ",");
+      print_stream_run(&run, 0);
+      free(run.latencies);
+      first = 0;
+    }
+  }
+  printf("\n  ],\n");
+  printf("  \"channelizer\": [");
+  first = 1;
+  for (int threads = 0; threads <= max_threads; threads = threads ? 2 * threads : 1) {
+    struct stream_run run = {
+      .imagefile = synthetic,
+      .sample_rate = sample_rate,
+      .frame_size = SDDC_ASYNC_AUTO,
+      .num_frames = SDDC_ASYNC_AUTO,
+      .num_threads = threads,
+      .channelizer_fft_size = channelizer_fft_size,
+      .num_channels = channelizer_channels,
+      .replay = 1,
+      .duration = duration,
+    };
+    fprintf(stderr, "channelizer: channels=%u threads=%d\n", run.num_channels,
+            threads);
+    SDDC_CHECK(bench_stream, &run);
+    printf("%s\n    ", first ? "" : ",");
+    print_stream_run(&run, 0);
+    free(run.latencies);
+    first = 0;
+  }
+  printf("\n  ],\n");
+
+  /* recorder */
+  recorder_path = (char *) malloc(strlen(directory) + 32);
+  sprintf(recorder_path, "%s/sddc_bench.%d.raw", directory, (int) getpid());
+  fprintf(stderr, "recorder: %s\n", recorder_path);
+  SDDC_CHECK(bench_recorder, recorder_path, duration);
+  printf("}\n");
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  fflush(stdout);
+  if (synthetic) {
+    unlink(synthetic + strlen("file://"));
+    free(synthetic);
+  }
+  if (recorder_path) {
+    unlink(recorder_path);
+    free(recorder_path);
+  }
+  return ret_val;
+}
+
+
+static double monotonic_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* every kernel the CPU has, on a buffer that fits in L2 and on one that
+   does not */
+static int bench_derandomize(double duration)
+{
+  static const char *isas[] = { "scalar", "sse2", "avx2", "avx512", "neon" };
+  static const size_t sizes[] = { 64 * 1024, 64 * 1024 * 1024 };
+  const char *default_isa = convert_get_isa();
+
+  uint16_t *samples = (uint16_t *) malloc(sizes[1]);
+  if (samples == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  for (size_t i = 0; i < sizes[1] / sizeof(uint16_t); ++i) {
+    samples[i] = (uint16_t) (i * 2654435761u);
+  }
+
+  printf("  \"derandomize\": [");
+  int first = 1;
+  for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); ++i) {
+    if (convert_select_isa(isas[i]) < 0) {
+      continue;
+    }
+    for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j) {
+      size_t n = sizes[j] / sizeof(uint16_t);
+      uint64_t bytes = 0;
+      double start = monotonic_time();
+      double elapsed;
+      do {
+        for (int k = 0; k < 16; ++k) {
+          convert_derandomize(samples, n);
+          bytes += sizes[j];
+        }
+        elapsed = monotonic_time() - start;
+      } while (elapsed < duration / 4);
+      printf("%s\n    { \"isa\": \"%s\", \"buffer_bytes\": %zu, \"gbytes_per_s\": %.3f }",
+             first ? "" : ",", isas[i], sizes[j], bytes / elapsed / 1e9);
+      first = 0;
+    }
+  }
+  printf("\n  ],\n");
+
+  convert_select_isa(default_isa);
+  free(samples);
+  return 0;
+}
+
+/* output format conversions fused with the de-randomization; the rate
+   is in input bytes */
+static int bench_convert(double duration)
+{
+  static const char *isas[] = { "scalar", "sse2", "avx2", "avx512", "neon" };
+  static const char *formats[] = { "float32", "int8", "int8_dither", "packed12" };
+  static const size_t sizes[] = { 64 * 1024, 64 * 1024 * 1024 };
+  const char *default_isa = convert_get_isa();
+
+  uint16_t *samples = (uint16_t *) malloc(sizes[1]);
+  uint8_t *output = (uint8_t *) malloc(sizes[1] * 2);
+  if (samples == 0 || output == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    free(samples);
+    free(output);
+    return -1;
+  }
+  for (size_t i = 0; i < sizes[1] / sizeof(uint16_t); ++i) {
+    samples[i] = (uint16_t) (i * 2654435761u);
+  }
+  memset(output, 0, sizes[1] * 2);
+
+  printf("  \"convert\": [");
+  int first = 1;
+  uint16_t dither = 1;
+  for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); ++i) {
+    if (convert_select_isa(isas[i]) < 0) {
+      continue;
+    }
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+      for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j) {
+        size_t n = sizes[j] / sizeof(uint16_t);
+        uint64_t bytes = 0;
+        double start = monotonic_time();
+        double elapsed;
+        do {
+          for (int k = 0; k < 16; ++k) {
+            switch (f) {
+              case 0:
+                convert_to_float32(samples, (float *) output, n, 1, 1.0f / 32768.0f);
+                break;
+              case 1:
+                convert_to_int8(samples, (int8_t *) output, n, 1, 8, 0);
+                break;
+              case 2:
+                convert_to_int8(samples, (int8_t *) output, n, 1, 8, &dither);
+                break;
+              case 3:
+                convert_to_packed12(samples, output, n, 1);
+                break;
+            }
+            bytes += sizes[j];
+          }
+          elapsed = monotonic_time() - start;
+        } while (elapsed < duration / 8);
+        printf("%s\n    { \"isa\": \"%s\", \"format\": \"%s\", \"buffer_bytes\": %zu, \"gbytes_per_s\": %.3f }",
+               first ? "" : ",", isas[i], formats[f], sizes[j],
+               bytes / elapsed / 1e9);
+        first = 0;
+      }
+    }
+  }
+  printf("\n  ],\n");
+
+  convert_select_isa(default_isa);
+  free(samples);
+  free(output);
+  return 0;
+}
+
+static int bench_stream(struct stream_run *run)
+{
+  int ret_val = -1;
+
+  run->elapsed = 0;
+  run->bytes = 0;
+  run->output_bytes = 0;
+  run->short_transfers = 0;
+  run->lost_samples = 0;
+  run->num_latencies = 0;
+  run->latencies = (uint64_t *) malloc(MAX_LATENCIES * sizeof(uint64_t));
+  if (run->latencies == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return ret_val;
+  }
+
+  sddc_t *sddc = sddc_open(0, run->imagefile);
+  if (sddc == NULL) {
+    fprintf(stderr, "ERROR - sddc_open() failed\n");
+    goto DONE;
+  }
+
+  if (run->replay) {
+    struct sddc_replay_params replay_params = { .realtime = 0, .loop = 1 };
+    SDDC_CHECK(sddc_set_replay_params, sddc, &replay_params);
+  }
+  SDDC_CHECK(sddc_set_sample_rate, sddc, run->sample_rate);
+  SDDC_CHECK(sddc_set_async_params2, sddc, run->frame_size, run->num_frames,
+             stream_callback, run);
+  SDDC_CHECK(sddc_set_worker_threads, sddc, run->num_threads, 0);
+  if (run->ddc_decimation) {
+    SDDC_CHECK(sddc_set_ddc, sddc, run->sample_rate / 8, run->ddc_decimation,
+               SAMPLE_FORMAT_COMPLEX_FLOAT32);
+  }
+  if (run->channelizer_fft_size) {
+    SDDC_CHECK(sddc_set_channelizer, sddc, run->channelizer_fft_size);
+    for (uint32_t i = 0; i < run->num_channels; ++i) {
+      double frequency = run->sample_rate * (i + 1) / (2 * (run->num_channels + 1));
+      if (sddc_add_channel(sddc, frequency, channelizer_decimation,
+                           channel_callback, run) < 0) {
+        fprintf(stderr, "ERROR - sddc_add_channel() failed\n");
+        goto DONE;
+      }
+    }
+  }
+  if (!run->replay) {
+    SDDC_CHECK(sddc_set_rf_mode, sddc, HF_MODE);
+  }
+
+  SDDC_CHECK(sddc_start_streaming, sddc);
+  double start = monotonic_time();
+  while (monotonic_time() - start < run->duration) {
+    sddc_handle_events(sddc);
+  }
+  SDDC_CHECK(sddc_stop_streaming, sddc);
+  run->elapsed = monotonic_time() - start;
+
+  struct sddc_stream_stats stats;
+  SDDC_CHECK(sddc_get_stream_stats, sddc, &stats);
+  run->bytes = stats.bytes;
+  run->short_transfers = stats.short_transfers;
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  if (sddc != NULL)
+    sddc_close(sddc);
+  return ret_val;
+}
+
+static void stream_callback(uint32_t data_size, uint8_t *data,
+                            const struct sddc_frame_info *info,
+                            void *context)
+{
+  (void) data;
+  struct stream_run *run = (struct stream_run *) context;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  if (run->num_latencies < MAX_LATENCIES && now >= info->monotonic_time_ns) {
+    run->latencies[run->num_latencies++] = now - info->monotonic_time_ns;
+  }
+  run->output_bytes += data_size;
+  run->lost_samples += info->lost_samples;
+}
+
+/* the channel callbacks can run on the worker threads */
+static void channel_callback(int channel, uint32_t data_size, uint8_t *data,
+                             void *context)
+{
+  (void) channel;
+  (void) data_size;
+  (void) data;
+  (void) context;
+}
+
+static void print_stream_run(const struct stream_run *run, int latencies)
+{
+  double samples = run->bytes / sizeof(int16_t);
+  /* null = SDDC_ASYNC_AUTO */
+  if (run->frame_size == SDDC_ASYNC_AUTO) {
+    printf("{ \"frame_size\": null, ");
+  } else {
+    printf("{ \"frame_size\": %u, ", run->frame_size);
+  }
+  if (run->num_frames == SDDC_ASYNC_AUTO) {
+    printf("\"num_frames\": null, ");
+  } else {
+    printf("\"num_frames\": %u, ", run->num_frames);
+  }
+  printf("\"threads\": %u, ", run->num_threads);
+  if (run->ddc_decimation) {
+    printf("\"decimation\": %u, ", run->ddc_decimation);
+  }
+  if (run->channelizer_fft_size) {
+    printf("\"fft_size\": %u, \"channels\": %u, ", run->channelizer_fft_size,
+           run->num_channels);
+  }
+  printf("\"mbytes_per_s\": %.3f, \"msamples_per_s\": %.3f, \"short_transfers\": %llu, \"lost_samples\": %llu",
+         run->bytes / run->elapsed / 1e6, samples / run->elapsed / 1e6,
+         (unsigned long long) run->short_transfers,
+         (unsigned long long) run->lost_samples);
+  if (latencies && run->num_latencies > 0) {
+    qsort(run->latencies, run->num_latencies, sizeof(uint64_t),
+          compare_uint64);
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    printf(", \"callback_latency_us\": {");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+      uint32_t k = (uint32_t) (percentiles[i] / 100 * (run->num_latencies - 1));
+      printf(" \"p%g\": %.1f,", percentiles[i], run->latencies[k] / 1e3);
+    }
+    printf(" \"max\": %.1f }", run->latencies[run->num_latencies - 1] / 1e3);
+  }
+  printf(" }");
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* a tone plus noise, as the ADC would give it; returns the file:// image
+   name of the capture */
+static char *write_synthetic_capture(const char *directory, double sample_rate,
+                                     uint32_t num_samples)
+{
+  char *imagefile = (char *) malloc(strlen(directory) + 64);
+  if (imagefile == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return 0;
+  }
+  sprintf(imagefile, "file://%s/sddc_bench.%d.synthetic", directory,
+          (int) getpid());
+  const char *path = imagefile + strlen("file://");
+  FILE *fp = fopen(path, "wb");
+  if (fp == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", path);
+    free(imagefile);
+    return 0;
+  }
+  const uint32_t block = 65536;
+  int16_t *samples = (int16_t *) malloc(block * sizeof(int16_t));
+  uint32_t seed = 1;
+  double phase_step = 2 * M_PI * (sample_rate / 8 + 12345.0) / sample_rate;
+  for (uint32_t i = 0; i < num_samples; i += block) {
+    for (uint32_t j = 0; j < block; ++j) {
+      seed = seed * 1664525u + 1013904223u;
+      double noise = (int32_t) seed / 2147483648.0;
+      samples[j] = (int16_t) (8000 * sin(phase_step * (i + j)) + 1000 * noise);
+    }
+    if (fwrite(samples, sizeof(int16_t), block, fp) != block) {
+      fprintf(stderr, "ERROR - fwrite(%s) failed\n", path);
+      fclose(fp);
+      unlink(path);
+      free(samples);
+      free(imagefile);
+      return 0;
+    }
+  }
+  free(samples);
+  fclose(fp);
+  return imagefile;
+}
+
+/* as fast as the recorder takes it: the time includes the flush in
+   sddc_recorder_close() */
+static int bench_recorder(const char *path, double duration)
+{
+  const uint32_t size = 1048576;
+  uint8_t *data = (uint8_t *) malloc(size);
+  if (data == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  memset(data, 0x5a, size);
+
+  printf("  \"recorder\": [");
+  int first = 1;
+  for (int direct_io = 0; direct_io <= 1; ++direct_io) {
+    struct sddc_recorder_params params = {
+      .path = path,
+      .direct_io = direct_io,
+    };
+    sddc_recorder_t *recorder = sddc_recorder_open(&params);
+    if (recorder == 0) {
+      fprintf(stderr, "ERROR - sddc_recorder_open() failed\n");
+      free(data);
+      return -1;
+    }
+    double start = monotonic_time();
+    uint64_t offered = 0;
+    while (monotonic_time() - start < duration) {
+      offered += size;
+      if (sddc_recorder_write(recorder, data, size) < 0) {
+        /* the queue is full - give the writer thread some time */
+        usleep(100);
+      }
+    }
+    struct sddc_recorder_stats stats;
+    sddc_recorder_get_stats(recorder, &stats);
+    sddc_recorder_close(recorder);
+    double elapsed = monotonic_time() - start;
+    uint64_t written = offered - stats.dropped_bytes;
+    printf("%s\n    { \"direct_io\": %d, \"io_uring\": %d, \"mbytes_per_s\": %.3f, \"dropped_bytes\": %llu, \"max_queued_buffers\": %u, \"io_errors\": %u }",
+           first ? "" : ",", direct_io, stats.uses_io_uring,
+           written / elapsed / 1e6, (unsigned long long) stats.dropped_bytes,
+           stats.max_queued_buffers, stats.io_errors);
+    first = 0;
+    unlink(path);
+  }
+  printf("\n  ]\n");
+  free(data);
+  return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * sddc_record - command line recording program for libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libsddc.h"
+
+
+static void record_callback(uint32_t data_size, uint8_t *data,
+                            void *context);
+static void stop_handler(int signum);
+
+static volatile sig_atomic_t stop_reception = 0;
+
+#define SDDC_CHECK(function, ...)\
+if(function(__VA_ARGS__) < 0) {\
+  fprintf(stderr, "ERROR - " #function "() failed\n");\
+  goto DONE;\
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 4) {
+    fprintf(stderr, "usage: %s <image file> <sample rate> <output file> [<max file size (MB)> [<max file time (s)>]]\n", argv[0]);
+    fprintf(stderr, "       the output file name can contain strftime() conversions\n");
+    return -1;
+  }
+  char *imagefile = argv[1];
+  double sample_rate = 0.0;
+  sscanf(argv[2], "%lf", &sample_rate);
+  struct sddc_recorder_params recorder_params = {
+    .path = argv[3],
+    .max_file_size = argc > 4 ? strtoull(argv[4], 0, 10) * 1024 * 1024 : 0,
+    .max_file_time = argc > 5 ? strtoul(argv[5], 0, 10) : 0,
+    .direct_io = 1
+  };
+
+  int ret_val = -1;
+  sddc_t *sddc = NULL;
+
+  sddc_recorder_t *recorder = sddc_recorder_open(&recorder_params);
+  if (recorder == NULL) {
+    fprintf(stderr, "ERROR - sddc_recorder_open() failed\n");
+    goto DONE;
+  }
+
+  sddc = sddc_open(0, imagefile);
+  if (sddc == NULL) {
+    fprintf(stderr, "ERROR - sddc_open() failed\n");
+    goto DONE;
+  }
+
+  SDDC_CHECK(sddc_set_sample_rate, sddc, sample_rate);
+  SDDC_CHECK(sddc_set_async_params, sddc, SDDC_ASYNC_AUTO, SDDC_ASYNC_AUTO,
+             record_callback, recorder);
+  /* the callback only copies into the recorder buffers, but keep the
+     event loop free of it anyway */
+  SDDC_CHECK(sddc_set_spare_frames, sddc, 32);
+  SDDC_CHECK(sddc_set_async_ring, sddc, 1);
+  struct sddc_event_thread_params event_thread_params = { .enable = 1 };
+  SDDC_CHECK(sddc_set_event_thread_params, sddc, &event_thread_params);
+  SDDC_CHECK(sddc_set_rf_mode, sddc, HF_MODE);
+  SDDC_CHECK(sddc_set_hf_attenuation, sddc, 0);
+  /* 1 disables the bias-T on RX888, 0 enables */
+  SDDC_CHECK(sddc_set_hf_bias, sddc, 1);
+
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+
+  SDDC_CHECK(sddc_start_streaming, sddc);
+  fprintf(stderr, "started recording - ^C to stop ..\n");
+
+  while (!stop_reception) {
+    if (sddc_handle_events(sddc) < 0) {
+      fprintf(stderr, "ERROR - sddc_handle_events() failed\n");
+      sddc_stop_streaming(sddc);
+      goto DONE;
+    }
+  }
+
+  fprintf(stderr, "finished. now stop streaming ..\n");
+  SDDC_CHECK(sddc_stop_streaming, sddc);
+
+  uint32_t ring_high_water_mark = 0;
+  uint64_t ring_dropped_frames = 0;
+  sddc_get_async_ring_status(sddc, 0, &ring_high_water_mark,
+                             &ring_dropped_frames);
+  fprintf(stderr, "ring high water mark=%u dropped frames=%llu\n",
+          ring_high_water_mark, (unsigned long long) ring_dropped_frames);
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  if (sddc != NULL)
+    sddc_close(sddc);
+  if (recorder != NULL) {
+    struct sddc_recorder_stats stats;
+    sddc_recorder_get_stats(recorder, &stats);
+    sddc_recorder_close(recorder);
+    /* the buffers still queued are written by sddc_recorder_close() */
+    fprintf(stderr, "files=%u dropped=%llu queue high water mark=%u io errors=%u io_uring=%s\n",
+            stats.files, (unsigned long long) stats.dropped_bytes,
+            stats.max_queued_buffers, stats.io_errors,
+            stats.uses_io_uring ? "yes" : "no");
+  }
+
+  return ret_val;
+}
+
+static void record_callback(uint32_t data_size,
+                            uint8_t *data,
+                            void *context)
+{
+  if (stop_reception)
+    return;
+  sddc_recorder_write((sddc_recorder_t *) context, data, data_size);
+}
+
+static void stop_handler(int signum __attribute__((unused)))
+{
+  stop_reception = 1;
+}
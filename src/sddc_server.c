@@ -0,0 +1,291 @@
+/*
+ * sddc_server.c - stream the samples over UDP (multicast), TCP and shared memory
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libsddc.h"
+#include "net_sender.h"
+
+
+static void server_callback(uint32_t data_size, uint8_t *data,
+                            const struct sddc_frame_info *info,
+                            void *context);
+static void stop_handler(int signum);
+
+static volatile sig_atomic_t stop_reception = 0;
+
+struct server {
+  net_sender_t *sender;
+  sddc_publisher_t *publisher;
+};
+
+#define SDDC_CHECK(function, ...)\
+if(function(__VA_ARGS__) < 0) {\
+  fprintf(stderr, "ERROR - " #function "() failed\n");\
+  goto DONE;\
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "usage: %s [-u <address>:<port>] [-t <TCP port>] [-p <shared memory name>] [-i <multicast interface>] [-T <multicast TTL>] [-m <UDP payload size>] [-z] [-G] [-f int16|int8|packed12|float32] [-D <DDC center frequency>:<decimation>] <image file> <sample rate>\n", program);
+  fprintf(stderr, "       -z sends the raw frames with MSG_ZEROCOPY, -G batches the UDP packets with GSO\n");
+  fprintf(stderr, "       clients open \"udp://<address>:<port>\", \"tcp://<server>:<port>\" or (local ones, raw int16 frames only) \"shm://<name>\" as the image file\n");
+}
+
+int main(int argc, char **argv)
+{
+  struct net_sender_params params = {
+    .format = SAMPLE_FORMAT_REAL_INT16
+  };
+  const char *publisher_name = 0;
+  double ddc_frequency = 0.0;
+  uint32_t ddc_decimation = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "u:t:p:i:T:m:zGf:D:")) != -1) {
+    switch (opt) {
+      case 'u':
+        params.udp_destination = optarg;
+        break;
+      case 't':
+        params.tcp_port = atoi(optarg);
+        break;
+      case 'p':
+        publisher_name = optarg;
+        break;
+      case 'i':
+        params.interface = optarg;
+        break;
+      case 'T':
+        params.ttl = atoi(optarg);
+        break;
+      case 'm':
+        params.payload_size = strtoul(optarg, 0, 10);
+        break;
+      case 'z':
+        params.zerocopy = 1;
+        break;
+      case 'G':
+        params.gso = 1;
+        break;
+      case 'f':
+        if (strcmp(optarg, "int16") == 0) {
+          params.format = SAMPLE_FORMAT_REAL_INT16;
+        } else if (strcmp(optarg, "int8") == 0) {
+          params.format = SAMPLE_FORMAT_REAL_INT8;
+        } else if (strcmp(optarg, "packed12") == 0) {
+          params.format = SAMPLE_FORMAT_REAL_PACKED12;
+        } else if (strcmp(optarg, "float32") == 0) {
+          params.format = SAMPLE_FORMAT_REAL_FLOAT32;
+        } else {
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'D':
+        if (sscanf(optarg, "%lf:%u", &ddc_frequency, &ddc_decimation) != 2) {
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+  if (argc - optind < 2 ||
+      (params.udp_destination == 0 && params.tcp_port == 0 &&
+       publisher_name == 0)) {
+    usage(argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[optind];
+  double sample_rate = 0.0;
+  sscanf(argv[optind+1], "%lf", &sample_rate);
+
+  /* the DDC outputs complex samples: int16, or float32 with -f float32 */
+  enum SDDCSampleFormat ddc_format = SAMPLE_FORMAT_COMPLEX_INT16;
+  if (ddc_decimation > 0) {
+    if (params.format == SAMPLE_FORMAT_REAL_FLOAT32) {
+      ddc_format = SAMPLE_FORMAT_COMPLEX_FLOAT32;
+    } else if (params.format != SAMPLE_FORMAT_REAL_INT16) {
+      fprintf(stderr, "ERROR - the DDC output is complex int16 or float32\n");
+      return -1;
+    }
+  }
+  if (publisher_name &&
+      (ddc_decimation > 0 || params.format != SAMPLE_FORMAT_REAL_INT16)) {
+    fprintf(stderr, "ERROR - the shared memory ring is of raw int16 frames\n");
+    return -1;
+  }
+  if (params.zerocopy &&
+      (ddc_decimation > 0 || params.format != SAMPLE_FORMAT_REAL_INT16)) {
+    /* only the raw frames can be lent to the kernel */
+    fprintf(stderr, "WARNING - MSG_ZEROCOPY needs raw int16 frames - copying\n");
+    params.zerocopy = 0;
+  }
+
+  int ret_val = -1;
+  struct server server = { .sender = NULL, .publisher = NULL };
+  net_sender_t *sender = NULL;
+  int streaming = 0;
+
+  sddc_t *sddc = sddc_open(0, imagefile);
+  if (sddc == NULL) {
+    fprintf(stderr, "ERROR - sddc_open() failed\n");
+    goto DONE;
+  }
+
+  /* a file:// WAV capture comes with its own sample rate */
+  if (sample_rate > 0) {
+    SDDC_CHECK(sddc_set_sample_rate, sddc, sample_rate);
+  }
+  params.sample_rate = sddc_get_sample_rate(sddc);
+  if (ddc_decimation > 0) {
+    SDDC_CHECK(sddc_set_ddc, sddc, ddc_frequency, ddc_decimation, ddc_format);
+    params.format = ddc_format;
+    params.sample_rate /= ddc_decimation;
+  } else if (params.format != SAMPLE_FORMAT_REAL_INT16) {
+    struct sddc_output_format output_format = {
+      .format = params.format,
+      .shift = 8
+    };
+    params.shift = output_format.shift;
+    SDDC_CHECK(sddc_set_output_format, sddc, &output_format);
+  }
+
+  if (params.udp_destination || params.tcp_port) {
+    sender = net_sender_open(&params, sddc);
+    if (sender == NULL) {
+      fprintf(stderr, "ERROR - net_sender_open() failed\n");
+      goto DONE;
+    }
+    server.sender = sender;
+  }
+  if (publisher_name) {
+    struct sddc_publisher_params publisher_params = {
+      .name = publisher_name,
+      .sample_rate = params.sample_rate
+    };
+    server.publisher = sddc_publisher_open(&publisher_params);
+    if (server.publisher == NULL) {
+      fprintf(stderr, "ERROR - sddc_publisher_open() failed\n");
+      goto DONE;
+    }
+  }
+
+  SDDC_CHECK(sddc_set_async_params2, sddc, SDDC_ASYNC_AUTO, SDDC_ASYNC_AUTO,
+             server_callback, &server);
+  /* a full socket buffer blocks the sends - keep that off the event loop;
+     the spare frames are also the ones lent to the kernel with -z */
+  SDDC_CHECK(sddc_set_spare_frames, sddc, 96);
+  SDDC_CHECK(sddc_set_async_ring, sddc, 1);
+  struct sddc_event_thread_params event_thread_params = { .enable = 1 };
+  SDDC_CHECK(sddc_set_event_thread_params, sddc, &event_thread_params);
+  SDDC_CHECK(sddc_set_rf_mode, sddc, HF_MODE);
+  SDDC_CHECK(sddc_set_hf_attenuation, sddc, 0);
+  /* 1 disables the bias-T on RX888, 0 enables */
+  SDDC_CHECK(sddc_set_hf_bias, sddc, 1);
+
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+
+  SDDC_CHECK(sddc_start_streaming, sddc);
+  streaming = 1;
+  fprintf(stderr, "started streaming at %.0f sps - ^C to stop ..\n",
+          params.sample_rate);
+
+  while (!stop_reception) {
+    if (sddc_handle_events(sddc) < 0) {
+      fprintf(stderr, "ERROR - sddc_handle_events() failed\n");
+      goto DONE;
+    }
+    if (sender != NULL)
+      net_sender_poll(sender);
+  }
+
+  fprintf(stderr, "finished. now stop streaming ..\n");
+  /* all the frames lent to the kernel have to be back first */
+  if (sender != NULL)
+    net_sender_shutdown(sender, 1000);
+  streaming = 0;
+  SDDC_CHECK(sddc_stop_streaming, sddc);
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  if (streaming) {
+    if (sender != NULL)
+      net_sender_shutdown(sender, 1000);
+    sddc_stop_streaming(sddc);
+  }
+  if (server.publisher != NULL) {
+    struct sddc_publisher_stats stats;
+    sddc_publisher_get_stats(server.publisher, &stats);
+    fprintf(stderr, "shared memory slots=%llu readers=%u max reader lag=%llu reader dropped slots=%llu\n",
+            (unsigned long long) stats.slots_written,
+            stats.readers,
+            (unsigned long long) stats.max_reader_lag,
+            (unsigned long long) stats.reader_dropped_slots);
+    sddc_publisher_close(server.publisher);
+  }
+  if (sender != NULL) {
+    struct net_sender_stats stats;
+    net_sender_get_stats(sender, &stats);
+    fprintf(stderr, "frames=%llu packets=%llu bytes=%llu send errors=%llu zerocopy frames=%llu copied=%llu TCP clients=%u TCP dropped frames=%llu\n",
+            (unsigned long long) stats.frames,
+            (unsigned long long) stats.packets,
+            (unsigned long long) stats.bytes,
+            (unsigned long long) stats.send_errors,
+            (unsigned long long) stats.zerocopy_frames,
+            (unsigned long long) stats.zerocopy_copied,
+            stats.tcp_clients,
+            (unsigned long long) stats.tcp_dropped_frames);
+    net_sender_close(sender);
+  }
+  if (sddc != NULL)
+    sddc_close(sddc);
+
+  return ret_val;
+}
+
+static void server_callback(uint32_t data_size,
+                            uint8_t *data,
+                            const struct sddc_frame_info *info,
+                            void *context)
+{
+  struct server *server = (struct server *) context;
+  if (stop_reception)
+    return;
+  if (server->publisher)
+    sddc_publisher_write(server->publisher, data, data_size, info);
+  if (server->sender)
+    net_sender_send(server->sender, data, data_size, info);
+}
+
+static void stop_handler(int signum __attribute__((unused)))
+{
+  stop_reception = 1;
+}
@@ -0,0 +1,165 @@
+/*
+ * sddc_session_sync_test - sync mode test program for libsddc sessions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libsddc.h"
+
+
+#define READ_SIZE (256 * 1024)
+
+static int runtime = 3000;
+static struct timespec clk_start, clk_end;
+
+static double clk_diff() {
+  return ((double)clk_end.tv_sec + 1.0e-9*clk_end.tv_nsec) -
+           ((double)clk_start.tv_sec + 1.0e-9*clk_start.tv_nsec);
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <image file> <sample rate> [<num devices> [<runtime_in_ms>]]\n", argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[1];
+  double sample_rate = 0.0;
+  sscanf(argv[2], "%lf", &sample_rate);
+  int num_devices = 1;
+  if (3 < argc)
+    num_devices = atoi(argv[3]);
+  if (4 < argc)
+    runtime = atoi(argv[4]);
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+    return -1;
+  }
+  if (num_devices <= 0 || num_devices > SDDC_MAX_SESSION_DEVICES) {
+    fprintf(stderr, "ERROR - given number of devices %d should be 1..%d\n",
+            num_devices, SDDC_MAX_SESSION_DEVICES);
+    return -1;
+  }
+
+  int ret_val = -1;
+
+  sddc_session_t *session = sddc_session_open();
+  if (session == 0) {
+    fprintf(stderr, "ERROR - sddc_session_open() failed\n");
+    return -1;
+  }
+
+  /* no sddc_set_async_params() and no session event thread enabled: the
+     devices are in sync mode, and the session event thread must be
+     started anyway to serve them */
+  sddc_t *devices[SDDC_MAX_SESSION_DEVICES];
+  for (int i = 0; i < num_devices; ++i) {
+    devices[i] = sddc_session_open_device(session, i, imagefile);
+    if (devices[i] == 0) {
+      fprintf(stderr, "ERROR - sddc_session_open_device(%d) failed\n", i);
+      goto DONE;
+    }
+    if (sddc_set_sample_rate(devices[i], sample_rate) < 0) {
+      fprintf(stderr, "ERROR - sddc_set_sample_rate() failed\n");
+      goto DONE;
+    }
+    if (sddc_set_sync_params(devices[i], 0) < 0) {
+      fprintf(stderr, "ERROR - sddc_set_sync_params() failed\n");
+      goto DONE;
+    }
+    if (sddc_set_rf_mode(devices[i], HF_MODE) < 0) {
+      fprintf(stderr, "ERROR - sddc_set_rf_mode failed\n");
+      goto DONE;
+    }
+  }
+
+  uint8_t *data = (uint8_t *) malloc(READ_SIZE);
+  if (data == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto DONE;
+  }
+
+  if (sddc_session_start_streaming(session) < 0) {
+    fprintf(stderr, "ERROR - sddc_session_start_streaming() failed\n");
+    free(data);
+    goto DONE;
+  }
+
+  fprintf(stderr, "started streaming .. for %d ms ..\n", runtime);
+  unsigned long long total_bytes = (unsigned long long)(runtime * sample_rate / 1000.0) * sizeof(int16_t);
+  unsigned long long received_bytes[SDDC_MAX_SESSION_DEVICES] = { 0 };
+
+  int read_failed = 0;
+  int done = 0;
+  clock_gettime(CLOCK_REALTIME, &clk_start);
+  while (!read_failed && !done) {
+    done = 1;
+    for (int i = 0; i < num_devices; ++i) {
+      int transferred = 0;
+      if (sddc_read_sync(devices[i], data, READ_SIZE, &transferred) < 0) {
+        fprintf(stderr, "ERROR - sddc_read_sync() failed on device %d after %llu bytes\n",
+                i, received_bytes[i] + transferred);
+        read_failed = 1;
+        break;
+      }
+      received_bytes[i] += transferred;
+      if (received_bytes[i] < total_bytes)
+        done = 0;
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &clk_end);
+  free(data);
+
+  for (int i = 0; i < num_devices; ++i) {
+    struct sddc_sync_stats stats;
+    if (sddc_get_sync_stats(devices[i], &stats) == 0) {
+      fprintf(stderr, "device %d: read=%llu dropped=%llu high water mark=%u\n", i,
+              (unsigned long long) stats.bytes_read,
+              (unsigned long long) stats.dropped_bytes,
+              stats.high_water_mark);
+    }
+  }
+
+  fprintf(stderr, "finished. now stop streaming ..\n");
+  if (sddc_session_stop_streaming(session) < 0) {
+    fprintf(stderr, "ERROR - sddc_session_stop_streaming() failed\n");
+    goto DONE;
+  }
+
+  double dur = clk_diff();
+  fprintf(stderr, "run for %f sec\n", dur);
+  for (int i = 0; i < num_devices; ++i) {
+    fprintf(stderr, "device %d: approx. samplerate is %f kSamples/sec\n", i,
+            received_bytes[i] / sizeof(int16_t) / (1000.0*dur));
+  }
+
+  /* done - all good */
+  if (!read_failed)
+    ret_val = 0;
+
+DONE:
+  sddc_session_close(session);
+
+  return ret_val;
+}
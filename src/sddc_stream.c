@@ -63,6 +63,11 @@ int main(int argc, char **argv)
   /* TODO: all parameters as command line arguments */
   SDDC_CHECK(sddc_set_sample_rate, sddc, sample_rate);
   SDDC_CHECK(sddc_set_async_params, sddc, 0, 0, stream_callback, sddc);
+  /* fwrite() can block - run the callback from the ring consumer thread */
+  SDDC_CHECK(sddc_set_spare_frames, sddc, 96);
+  SDDC_CHECK(sddc_set_async_ring, sddc, 1);
+  struct sddc_event_thread_params event_thread_params = { .enable = 1 };
+  SDDC_CHECK(sddc_set_event_thread_params, sddc, &event_thread_params);
   SDDC_CHECK(sddc_set_rf_mode, sddc, HF_MODE);
   SDDC_CHECK(sddc_set_hf_attenuation, sddc, 0);
   /* 1 disables the bias-T on RX888, 0 enables */
@@ -19,6 +19,7 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,13 +33,14 @@
 static void count_bytes_callback(uint32_t data_size, uint8_t *data,
                                  void *context);
 
-static unsigned long long received_samples = 0;
+/* shared with the library event thread running the callback */
+static atomic_ullong received_samples = 0;
 static unsigned long long total_samples = 0;
-static int num_callbacks;
+static atomic_int num_callbacks;
 static int16_t *sampleData = 0;
 static int runtime = 3000;
 static struct timespec clk_start, clk_end;
-static int stop_reception = 0;
+static atomic_int stop_reception = 0;
 
 static double clk_diff() {
   return ((double)clk_end.tv_sec + 1.0e-9*clk_end.tv_nsec) - 
@@ -103,23 +105,30 @@ int main(int argc, char **argv)
     goto DONE;
   }
 
-  received_samples = 0;
-  num_callbacks = 0;
+  /* handle the USB events in a library thread */
+  struct sddc_event_thread_params event_thread_params = { .enable = 1 };
+  if (sddc_set_event_thread_params(sddc, &event_thread_params) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_event_thread_params() failed\n");
+    goto DONE;
+  }
+
+  /* the callbacks start as soon as sddc_start_streaming() returns */
+  total_samples = (unsigned long long)(runtime * sample_rate / 1000.0);
+  if (outfilename)
+    sampleData = (int16_t*)malloc(total_samples * sizeof(int16_t));
+  atomic_store(&received_samples, 0);
+  atomic_store(&num_callbacks, 0);
+  atomic_store(&stop_reception, 0);
+  clock_gettime(CLOCK_REALTIME, &clk_start);
+
   if (sddc_start_streaming(sddc) < 0) {
     fprintf(stderr, "ERROR - sddc_start_streaming() failed\n");
     return -1;
   }
 
   fprintf(stderr, "started streaming .. for %d ms ..\n", runtime);
-  total_samples = (unsigned long long)(runtime * sample_rate / 1000.0);
-
-  if (outfilename)
-    sampleData = (int16_t*)malloc(total_samples * sizeof(int16_t));
 
-  /* todo: move this into a thread */
-  stop_reception = 0;
-  clock_gettime(CLOCK_REALTIME, &clk_start);
-  while (!stop_reception)
+  while (!atomic_load(&stop_reception))
     sddc_handle_events(sddc);
 
   fprintf(stderr, "finished. now stop streaming ..\n");
@@ -129,19 +138,19 @@ int main(int argc, char **argv)
   }
 
   double dur = clk_diff();
-  fprintf(stderr, "received=%llu 16-Bit samples in %d callbacks\n", received_samples, num_callbacks);
+  unsigned long long num_samples = atomic_load(&received_samples);
+  fprintf(stderr, "received=%llu 16-Bit samples in %d callbacks\n", num_samples, atomic_load(&num_callbacks));
   fprintf(stderr, "run for %f sec\n", dur);
-  fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", received_samples / (1000.0*dur) );
+  fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", num_samples / (1000.0*dur) );
 
-  if (outfilename && sampleData && received_samples) {
-    FILE * f = fopen(outfilename, "wb");
-    if (f) {
+  if (outfilename && sampleData && num_samples) {
+    waveWriter * w = waveWriterOpen(outfilename, (unsigned)(0.5 + sample_rate), 0U /*frequency*/, 16 /*bitsPerSample*/, 1 /*numChannels*/, 0 /*flags*/);
+    if (w) {
       fprintf(stderr, "saving received real samples to file ..\n");
-      waveWriteHeader( (unsigned)(0.5 + sample_rate), 0U /*frequency*/, 16 /*bitsPerSample*/, 1 /*numChannels*/, f);
-      for ( unsigned long long off = 0; off + 65536 < received_samples; off += 65536 )
-        waveWriteSamples(f,  sampleData + off, 65536, 0 /*needCleanData*/);
-      waveFinalizeHeader(f);
-      fclose(f);
+      int err = waveWriterWriteFrames(w, sampleData, num_samples);
+      err |= waveWriterClose(w);
+      if (err)
+        fprintf(stderr, "ERROR - writing %s failed\n", outfilename);
     }
   }
 
@@ -158,17 +167,18 @@ static void count_bytes_callback(uint32_t data_size,
                                  uint8_t *data,
                                  void *context __attribute__((unused)) )
 {
-  if (stop_reception)
+  if (atomic_load(&stop_reception))
     return;
-  ++num_callbacks;
+  atomic_fetch_add(&num_callbacks, 1);
   unsigned N = data_size / sizeof(int16_t);
-  if ( received_samples + N < total_samples ) {
+  unsigned long long received = atomic_load(&received_samples);
+  if ( received + N < total_samples ) {
     if (sampleData)
-      memcpy( sampleData+received_samples, data, data_size);
-    received_samples += N;
+      memcpy( sampleData+received, data, data_size);
+    atomic_store(&received_samples, received + N);
   }
   else {
     clock_gettime(CLOCK_REALTIME, &clk_end);
-    stop_reception = 1;
+    atomic_store(&stop_reception, 1);
   }
 }
@@ -0,0 +1,643 @@
+/*
+ * shm_reader.c - virtual device for the shared memory publisher frames
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_reader.h"
+#include "shm_ring.h"
+
+
+struct queued_transfer {
+  struct libusb_transfer *transfer;
+  int cancelled;
+  uint32_t filled;              /* bytes */
+};
+
+/* struct sddc_shm_stats, atomic so that it can be read without the lock */
+struct shm_reader_counters {
+  atomic_ullong slots;
+  atomic_ullong lost_samples;
+  atomic_ullong dropped_slots;
+  atomic_ullong resyncs;
+  atomic_int connected;
+};
+
+typedef struct shm_reader {
+  struct shm_ring_header *header;
+  size_t size;
+  struct shm_reader_entry *entry;
+  double sample_rate;
+  pthread_mutex_t lock;
+  pthread_cond_t events;        /* submit, cancel, start and stop */
+  uint32_t num_events;
+  struct queued_transfer *queue;
+  uint32_t queue_length;
+  uint32_t queue_capacity;
+  int running;
+
+  /* the slot being delivered, after zero_fill samples of zeros */
+  uint64_t cursor;              /* next slot to read */
+  struct shm_slot *slot;
+  uint64_t slot_sequence;
+  uint32_t slot_size;           /* bytes */
+  uint32_t consumed;            /* bytes */
+  uint64_t zero_fill;
+  uint64_t next_sample_index;
+  int synced;
+
+  int gone;                     /* the publisher died without closing */
+  struct shm_reader_counters stats;
+} shm_reader_t;
+
+
+static const int DEFAULT_TIMEOUT = 1000;        /* ms */
+static const int FUTEX_WAIT_SLICE = 10;         /* ms */
+
+
+/* internal functions */
+static int attach(shm_reader_t *this);
+static int next_slot(shm_reader_t *this);
+static void skip_to(shm_reader_t *this, uint64_t cursor);
+static int fill(shm_reader_t *this, uint8_t *data, uint32_t length,
+                uint32_t *filled);
+static int publisher_gone(shm_reader_t *this);
+static void wait_for_events(shm_reader_t *this, int with_data,
+                            uint64_t deadline);
+static void wakeup(shm_reader_t *this);
+static inline uint64_t monotonic_ns(void);
+
+
+shm_reader_t *shm_reader_open(const char *url)
+{
+  shm_reader_t *ret_val = 0;
+
+  if (strncmp(url, "shm://", 6) != 0 || url[6] == '\0' ||
+      strchr(url + 6, '/')) {
+    fprintf(stderr, "ERROR - not a shm://<name> stream: %s\n", url);
+    return ret_val;
+  }
+  char path[256];
+  if (snprintf(path, sizeof(path), "%s%s", SHM_RING_NAME_PREFIX, url + 6) >=
+      (int) sizeof(path)) {
+    fprintf(stderr, "ERROR - invalid shared memory name: %s\n", url);
+    return ret_val;
+  }
+
+  shm_reader_t *this = (shm_reader_t *) malloc(sizeof(shm_reader_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->entry = 0;
+  this->num_events = 0;
+  this->queue = 0;
+  this->queue_length = 0;
+  this->queue_capacity = 0;
+  this->running = 0;
+  this->cursor = 0;
+  this->slot = 0;
+  this->slot_sequence = 0;
+  this->slot_size = 0;
+  this->consumed = 0;
+  this->zero_fill = 0;
+  this->next_sample_index = 0;
+  this->synced = 0;
+  this->gone = 0;
+  memset(&this->stats, 0, sizeof(this->stats));
+  this->stats.connected = 1;
+
+  /* the readers keep their cursor in the shared memory object too */
+  int fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - shm_open(%s) failed: %s\n", path, strerror(errno));
+    goto FAIL1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      st.st_size < (off_t) shm_ring_slots_offset()) {
+    fprintf(stderr, "ERROR - %s is not an sddc publisher ring\n", path);
+    goto FAIL2;
+  }
+  this->size = (size_t) st.st_size;
+  void *map = mmap(0, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap(%s) failed: %s\n", path, strerror(errno));
+    goto FAIL2;
+  }
+  this->header = (struct shm_ring_header *) map;
+  if (this->header->magic != SHM_RING_MAGIC ||
+      this->header->version != SHM_RING_VERSION ||
+      this->header->num_slots == 0 ||
+      this->header->slot_stride != shm_ring_slot_stride(this->header->slot_size) ||
+      shm_ring_size(this->header->num_slots, this->header->slot_size) > this->size) {
+    fprintf(stderr, "ERROR - %s is not an sddc publisher ring\n", path);
+    goto FAIL3;
+  }
+  atomic_thread_fence(memory_order_acquire);
+  if (publisher_gone(this)) {
+    fprintf(stderr, "ERROR - the publisher of %s has gone away\n", path);
+    goto FAIL3;
+  }
+  this->sample_rate = this->header->sample_rate;
+  if (attach(this) < 0) {
+    fprintf(stderr, "ERROR - %s already has %d readers\n", path,
+            SHM_RING_MAX_READERS);
+    goto FAIL3;
+  }
+  close(fd);
+
+  pthread_mutex_init(&this->lock, 0);
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&this->events, &condattr);
+  pthread_condattr_destroy(&condattr);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL3:
+  munmap(this->header, this->size);
+FAIL2:
+  close(fd);
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void shm_reader_close(shm_reader_t *this)
+{
+  atomic_store_explicit(&this->entry->pid, 0, memory_order_release);
+  pthread_cond_destroy(&this->events);
+  pthread_mutex_destroy(&this->lock);
+  free(this->queue);
+  munmap(this->header, this->size);
+  free(this);
+  return;
+}
+
+
+double shm_reader_get_sample_rate(shm_reader_t *this)
+{
+  return this->sample_rate;
+}
+
+
+void shm_reader_set_sample_rate(shm_reader_t *this, double sample_rate)
+{
+  if (sample_rate != this->sample_rate) {
+    fprintf(stderr, "WARNING - the published stream is at %.0f sps, not %.0f sps\n",
+            this->sample_rate, sample_rate);
+  }
+}
+
+
+void shm_reader_start(shm_reader_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  /* what was published while stopped is not of interest */
+  this->cursor = atomic_load_explicit(&this->header->write_sequence,
+                                      memory_order_acquire);
+  atomic_store_explicit(&this->entry->cursor, this->cursor,
+                        memory_order_relaxed);
+  this->slot = 0;
+  this->zero_fill = 0;
+  this->synced = 0;
+  this->running = 1;
+  wakeup(this);
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void shm_reader_stop(shm_reader_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  this->running = 0;
+  wakeup(this);
+  pthread_mutex_unlock(&this->lock);
+}
+
+
+void shm_reader_get_stats(shm_reader_t *this, struct sddc_shm_stats *stats)
+{
+  stats->slots = atomic_load_explicit(&this->stats.slots, memory_order_relaxed);
+  stats->lost_samples = atomic_load_explicit(&this->stats.lost_samples, memory_order_relaxed);
+  stats->dropped_slots = atomic_load_explicit(&this->stats.dropped_slots, memory_order_relaxed);
+  stats->resyncs = atomic_load_explicit(&this->stats.resyncs, memory_order_relaxed);
+  stats->connected = atomic_load_explicit(&this->stats.connected, memory_order_relaxed);
+}
+
+
+int shm_reader_submit_transfer(shm_reader_t *this,
+                               struct libusb_transfer *transfer)
+{
+  int ret_val = 0;
+  pthread_mutex_lock(&this->lock);
+  for (uint32_t i = 0; i < this->queue_length; ++i) {
+    if (this->queue[i].transfer == transfer) {
+      ret_val = LIBUSB_ERROR_BUSY;
+      goto DONE;
+    }
+  }
+  if (this->queue_length == this->queue_capacity) {
+    uint32_t capacity = this->queue_capacity ? 2 * this->queue_capacity : 64;
+    struct queued_transfer *queue = (struct queued_transfer *) realloc(this->queue,
+                                        capacity * sizeof(struct queued_transfer));
+    if (queue == 0) {
+      ret_val = LIBUSB_ERROR_NO_MEM;
+      goto DONE;
+    }
+    this->queue = queue;
+    this->queue_capacity = capacity;
+  }
+  this->queue[this->queue_length].transfer = transfer;
+  this->queue[this->queue_length].cancelled = 0;
+  this->queue[this->queue_length].filled = 0;
+  this->queue_length++;
+  wakeup(this);
+DONE:
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+int shm_reader_cancel_transfer(shm_reader_t *this,
+                               struct libusb_transfer *transfer)
+{
+  int ret_val = LIBUSB_ERROR_NOT_FOUND;
+  pthread_mutex_lock(&this->lock);
+  for (uint32_t i = 0; i < this->queue_length; ++i) {
+    if (this->queue[i].transfer == transfer) {
+      this->queue[i].cancelled = 1;
+      ret_val = 0;
+      wakeup(this);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+/* completes the transfers in order as the ring fills them, and returns
+   when at least one has been completed, or on timeout */
+int shm_reader_handle_events(shm_reader_t *this, int timeout_ms)
+{
+  if (timeout_ms < 0) {
+    timeout_ms = DEFAULT_TIMEOUT;
+  }
+  uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+
+  pthread_mutex_lock(&this->lock);
+  /* at most one pass over the queue, so that the callbacks resubmitting
+     their transfers do not keep us here */
+  uint32_t budget = 0;
+  uint32_t completed = 0;
+  while (1) {
+    if (completed == 0) {
+      budget = this->queue_length;
+    }
+    /* the cancelled transfers and the control transfers (already applied
+       by the virtual device) complete right away */
+    struct libusb_transfer *transfer = 0;
+    int cancelled = 0;
+    for (uint32_t i = 0; i < this->queue_length; ++i) {
+      if (this->queue[i].cancelled ||
+          this->queue[i].transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        transfer = this->queue[i].transfer;
+        cancelled = this->queue[i].cancelled;
+        memmove(&this->queue[i], &this->queue[i+1],
+                (this->queue_length - i - 1) * sizeof(struct queued_transfer));
+        this->queue_length--;
+        break;
+      }
+    }
+    if (transfer && cancelled) {
+      transfer->status = LIBUSB_TRANSFER_CANCELLED;
+      transfer->actual_length = 0;
+    } else if (transfer) {
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+      transfer->actual_length = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+    } else if (completed < budget && this->queue_length > 0 &&
+               this->running && this->stats.connected) {
+      struct queued_transfer *queued = &this->queue[0];
+      int ret = fill(this, queued->transfer->buffer,
+                     (uint32_t) queued->transfer->length, &queued->filled);
+      if (ret < 0) {
+        fprintf(stderr, "ERROR - the shared memory publisher has gone away\n");
+        this->stats.connected = 0;
+        continue;
+      }
+      if (ret == 0) {
+        if (completed > 0 || monotonic_ns() >= deadline) {
+          break;
+        }
+        wait_for_events(this, 1, deadline);
+        continue;
+      }
+      transfer = queued->transfer;
+      memmove(&this->queue[0], &this->queue[1],
+              (this->queue_length - 1) * sizeof(struct queued_transfer));
+      this->queue_length--;
+      transfer->actual_length = transfer->length;
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    } else {
+      /* nothing to complete - wait for a submit, a cancel or a start */
+      if (completed > 0 || monotonic_ns() >= deadline) {
+        break;
+      }
+      wait_for_events(this, 0, deadline);
+      continue;
+    }
+    completed++;
+    pthread_mutex_unlock(&this->lock);
+    transfer->callback(transfer);
+    pthread_mutex_lock(&this->lock);
+  }
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+
+int shm_reader_bulk_transfer(shm_reader_t *this, uint8_t *data, int length,
+                             int *transferred, int timeout_ms)
+{
+  uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+  uint32_t filled = 0;
+  int ret_val = LIBUSB_ERROR_TIMEOUT;
+  pthread_mutex_lock(&this->lock);
+  while (1) {
+    int receiving = this->running && this->stats.connected;
+    if (receiving) {
+      int ret = fill(this, data, (uint32_t) length, &filled);
+      if (ret > 0) {
+        ret_val = 0;
+        break;
+      }
+      if (ret < 0) {
+        fprintf(stderr, "ERROR - the shared memory publisher has gone away\n");
+        this->stats.connected = 0;
+        ret_val = LIBUSB_ERROR_IO;
+        break;
+      }
+    }
+    if (monotonic_ns() >= deadline) {
+      break;
+    }
+    wait_for_events(this, receiving, deadline);
+  }
+  pthread_mutex_unlock(&this->lock);
+  *transferred = (int) filled;
+  return ret_val;
+}
+
+
+/* internal functions */
+
+/* takes a free entry in the reader table, or the one of a reader that
+   died without closing */
+static int attach(shm_reader_t *this)
+{
+  int pid = (int) getpid();
+  uint64_t cursor = atomic_load_explicit(&this->header->write_sequence,
+                                         memory_order_acquire);
+  for (uint32_t i = 0; i < SHM_RING_MAX_READERS; ++i) {
+    struct shm_reader_entry *entry = &this->header->readers[i];
+    int owner = atomic_load_explicit(&entry->pid, memory_order_acquire);
+    if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) {
+      continue;
+    }
+    if (atomic_compare_exchange_strong(&entry->pid, &owner, pid)) {
+      atomic_store_explicit(&entry->cursor, cursor, memory_order_relaxed);
+      atomic_store_explicit(&entry->dropped_frames, 0, memory_order_relaxed);
+      this->entry = entry;
+      this->cursor = cursor;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* makes the next slot the one to deliver (and returns 1), after as many
+   zeros as samples are missing before it; 0 when the ring has nothing new,
+   -1 once the publisher has gone away */
+static int next_slot(shm_reader_t *this)
+{
+  struct shm_ring_header *header = this->header;
+  while (1) {
+    uint64_t write_sequence = atomic_load_explicit(&header->write_sequence,
+                                                   memory_order_acquire);
+    if (this->cursor == write_sequence) {
+      return this->gone ||
+             atomic_load_explicit(&header->closed, memory_order_acquire) ? -1 : 0;
+    }
+    /* the slot at the cursor is already being rewritten - skip half a
+       ring ahead, so as not to be lapped again right away */
+    if (write_sequence - this->cursor >= header->num_slots) {
+      skip_to(this, write_sequence - header->num_slots / 2);
+      continue;
+    }
+    struct shm_slot *slot = shm_ring_slot(header, this->cursor);
+    uint64_t sequence = atomic_load_explicit(&slot->sequence,
+                                             memory_order_acquire);
+    uint32_t size = slot->size;
+    struct sddc_frame_info info = slot->info;
+    atomic_thread_fence(memory_order_acquire);
+    if (sequence != this->cursor + 1 ||
+        atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence) {
+      skip_to(this, this->cursor + 1);
+      continue;
+    }
+    if (size > header->slot_size || size % sizeof(int16_t) != 0) {
+      skip_to(this, this->cursor + 1);
+      continue;
+    }
+
+    uint32_t num_samples = size / sizeof(int16_t);
+    uint64_t max_gap = (uint64_t) this->sample_rate;
+    this->zero_fill = 0;
+    if (this->synced && info.sample_index != this->next_sample_index) {
+      uint64_t gap = info.sample_index - this->next_sample_index;
+      if (info.sample_index > this->next_sample_index && gap <= max_gap) {
+        this->zero_fill = gap;
+        this->stats.lost_samples += gap;
+      } else {
+        /* the publisher restarted its stream */
+        this->stats.resyncs++;
+      }
+    }
+    this->synced = 1;
+    this->next_sample_index = info.sample_index + num_samples;
+    this->slot = slot;
+    this->slot_sequence = sequence;
+    this->slot_size = size;
+    this->consumed = 0;
+    this->cursor++;
+    atomic_store_explicit(&this->entry->cursor, this->cursor,
+                          memory_order_relaxed);
+    this->stats.slots++;
+    return 1;
+  }
+}
+
+static void skip_to(shm_reader_t *this, uint64_t cursor)
+{
+  uint64_t dropped = cursor - this->cursor;
+  this->stats.dropped_slots += dropped;
+  atomic_fetch_add_explicit(&this->entry->dropped_frames, dropped,
+                            memory_order_relaxed);
+  this->cursor = cursor;
+  atomic_store_explicit(&this->entry->cursor, cursor, memory_order_relaxed);
+}
+
+/* called with the lock held: 1 once length bytes are filled in, 0 when
+   the ring has nothing more for now, -1 once the publisher has gone away */
+static int fill(shm_reader_t *this, uint8_t *data, uint32_t length,
+                uint32_t *filled)
+{
+  while (*filled + sizeof(int16_t) <= length) {
+    uint8_t *output = data + *filled;
+    uint32_t room = (length - *filled) & ~(uint32_t) 1;
+    uint32_t n;
+    if (this->zero_fill > 0) {
+      uint64_t bytes = this->zero_fill * sizeof(int16_t);
+      n = bytes < room ? (uint32_t) bytes : room;
+      memset(output, 0, n);
+      this->zero_fill -= n / sizeof(int16_t);
+    } else if (this->slot && this->consumed < this->slot_size) {
+      n = this->slot_size - this->consumed;
+      n = n < room ? n : room;
+      memcpy(output, shm_slot_data(this->slot) + this->consumed, n);
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&this->slot->sequence, memory_order_relaxed) !=
+          this->slot_sequence) {
+        /* overwritten while we were copying it: what is left of it is lost */
+        uint32_t left = this->slot_size - this->consumed;
+        memset(output, 0, n);
+        this->zero_fill = (left - n) / sizeof(int16_t);
+        this->stats.lost_samples += left / sizeof(int16_t);
+        this->stats.dropped_slots++;
+        atomic_fetch_add_explicit(&this->entry->dropped_frames, 1,
+                                  memory_order_relaxed);
+        this->slot = 0;
+      } else {
+        this->consumed += n;
+      }
+    } else {
+      this->slot = 0;
+      int ret = next_slot(this);
+      if (ret <= 0) {
+        return ret;
+      }
+      continue;
+    }
+    *filled += n;
+  }
+  return 1;
+}
+
+static int publisher_gone(shm_reader_t *this)
+{
+  if (atomic_load_explicit(&this->header->closed, memory_order_acquire)) {
+    return 1;
+  }
+  return kill(this->header->publisher_pid, 0) < 0 && errno == ESRCH;
+}
+
+/* called with the lock held, which is released while waiting: for a new
+   frame in the ring (with_data) or only for a submit, a cancel, a start
+   or a stop */
+static void wait_for_events(shm_reader_t *this, int with_data,
+                            uint64_t deadline)
+{
+  uint64_t now = monotonic_ns();
+  if (now >= deadline) {
+    return;
+  }
+  if (!with_data) {
+    struct timespec timeout = {
+      .tv_sec = deadline / 1000000000ULL,
+      .tv_nsec = deadline % 1000000000ULL
+    };
+    pthread_cond_timedwait(&this->events, &this->lock, &timeout);
+    return;
+  }
+
+  /* a futex cannot also wait for the local events: short waits, and a
+     look at them in between */
+  struct shm_ring_header *header = this->header;
+  uint32_t num_events = this->num_events;
+  while (now < deadline && this->num_events == num_events) {
+    if (publisher_gone(this)) {
+      this->gone = 1;
+      return;
+    }
+    uint64_t left = (deadline - now + 999999) / 1000000;
+    int timeout_ms = left < (uint64_t) FUTEX_WAIT_SLICE ? (int) left :
+                                                          FUTEX_WAIT_SLICE;
+    uint64_t cursor = this->cursor;
+    pthread_mutex_unlock(&this->lock);
+    /* counted as a waiter before looking at the ring, so that the
+       publisher either sees us or we see its frame */
+    atomic_fetch_add_explicit(&header->waiters, 1, memory_order_seq_cst);
+    unsigned int value = atomic_load_explicit(&header->futex,
+                                              memory_order_seq_cst);
+    int empty = atomic_load_explicit(&header->write_sequence,
+                                     memory_order_acquire) == cursor;
+    if (empty) {
+      shm_ring_futex_wait(&header->futex, value, timeout_ms);
+    }
+    atomic_fetch_sub_explicit(&header->waiters, 1, memory_order_seq_cst);
+    pthread_mutex_lock(&this->lock);
+    if (!empty) {
+      return;
+    }
+    now = monotonic_ns();
+  }
+}
+
+static void wakeup(shm_reader_t *this)
+{
+  this->num_events++;
+  pthread_cond_broadcast(&this->events);
+}
+
+static inline uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,72 @@
+/*
+ * shm_reader.h - virtual device for the shared memory publisher frames
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __SHM_READER_H
+#define __SHM_READER_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct shm_reader shm_reader_t;
+
+/* "shm://<name>" (with the prefix): attaches to the ring of a running
+   publisher as one of its readers */
+shm_reader_t *shm_reader_open(const char *url);
+
+void shm_reader_close(shm_reader_t *this);
+
+double shm_reader_get_sample_rate(shm_reader_t *this);
+
+/* what the application asked for (from STARTADC) */
+void shm_reader_set_sample_rate(shm_reader_t *this, double sample_rate);
+
+/* STARTFX3/STOPFX3: streaming starts from the latest frame */
+void shm_reader_start(shm_reader_t *this);
+
+void shm_reader_stop(shm_reader_t *this);
+
+void shm_reader_get_stats(shm_reader_t *this, struct sddc_shm_stats *stats);
+
+/* the libusb transfer API, served from the ring: same contract as
+   replay_submit_transfer() and friends */
+int shm_reader_submit_transfer(shm_reader_t *this,
+                               struct libusb_transfer *transfer);
+
+int shm_reader_cancel_transfer(shm_reader_t *this,
+                               struct libusb_transfer *transfer);
+
+int shm_reader_handle_events(shm_reader_t *this, int timeout_ms);
+
+int shm_reader_bulk_transfer(shm_reader_t *this, uint8_t *data, int length,
+                             int *transferred, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHM_READER_H */
@@ -0,0 +1,135 @@
+/*
+ * shm_ring.h - shared memory frame ring layout
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __SHM_RING_H
+#define __SHM_RING_H
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the POSIX shared memory object "/sddc-<name>": a header, the reader
+   table and num_slots slots of slot_size bytes of 16 bit samples, each
+   slot after its own struct shm_slot. Frame n goes into slot
+   n % num_slots; its sequence is 0 while the publisher writes it and
+   n + 1 once it is complete, so that a reader copying it out can tell
+   (from the sequence before and after the copy) whether it was
+   overwritten in the meantime. The publisher never waits for the
+   readers: they keep their own cursor, and the ones that fall more than
+   num_slots frames behind skip ahead and count the frames they missed */
+#define SHM_RING_MAGIC 0x52444453       /* "SDDR" */
+#define SHM_RING_VERSION 1
+#define SHM_RING_MAX_READERS 32
+#define SHM_RING_NAME_PREFIX "/sddc-"
+
+struct shm_reader_entry {
+  atomic_int pid;               /* 0 = free */
+  atomic_ullong cursor;         /* next frame to read */
+  atomic_ullong dropped_frames;
+};
+
+struct shm_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_slots;
+  uint32_t slot_size;           /* bytes of samples per slot */
+  uint64_t slot_stride;         /* bytes from a slot to the next one */
+  double sample_rate;
+  int32_t publisher_pid;
+  atomic_int closed;            /* the publisher has gone away */
+  atomic_ullong write_sequence; /* frames published */
+  atomic_uint futex;            /* bumped on every frame */
+  atomic_uint waiters;          /* readers in futex_wait() */
+  struct shm_reader_entry readers[SHM_RING_MAX_READERS];
+};
+
+struct shm_slot {
+  atomic_ullong sequence;
+  uint32_t size;                /* bytes */
+  uint32_t reserved;
+  struct sddc_frame_info info;
+};
+
+static inline uint64_t shm_ring_slots_offset(void)
+{
+  /* page aligned, and so are the slots (slot_stride) */
+  return (sizeof(struct shm_ring_header) + 4095) & ~(uint64_t) 4095;
+}
+
+/* the samples start one cache line into the slot */
+#define SHM_SLOT_HEADER_SIZE 64
+_Static_assert(sizeof(struct shm_slot) <= SHM_SLOT_HEADER_SIZE, "struct shm_slot is too large");
+
+static inline uint64_t shm_ring_slot_stride(uint32_t slot_size)
+{
+  return (SHM_SLOT_HEADER_SIZE + slot_size + 4095) & ~(uint64_t) 4095;
+}
+
+static inline uint64_t shm_ring_size(uint32_t num_slots, uint32_t slot_size)
+{
+  return shm_ring_slots_offset() + num_slots * shm_ring_slot_stride(slot_size);
+}
+
+static inline struct shm_slot *shm_ring_slot(struct shm_ring_header *header,
+                                             uint64_t sequence)
+{
+  return (struct shm_slot *) ((uint8_t *) header + shm_ring_slots_offset() +
+                              (sequence % header->num_slots) *
+                              header->slot_stride);
+}
+
+static inline uint8_t *shm_slot_data(struct shm_slot *slot)
+{
+  return (uint8_t *) slot + SHM_SLOT_HEADER_SIZE;
+}
+
+/* the futex is in shared memory - no FUTEX_PRIVATE_FLAG */
+static inline void shm_ring_futex_wait(atomic_uint *futex, unsigned int value,
+                                       int timeout_ms)
+{
+  struct timespec timeout = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_nsec = (timeout_ms % 1000) * 1000000L
+  };
+  syscall(SYS_futex, futex, FUTEX_WAIT, value, &timeout, 0, 0);
+}
+
+static inline void shm_ring_futex_wake(atomic_uint *futex)
+{
+  syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHM_RING_H */
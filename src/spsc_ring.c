@@ -0,0 +1,119 @@
+/*
+ * spsc_ring.c - lock-free single producer/single consumer ring
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "spsc_ring.h"
+
+
+typedef struct spsc_ring spsc_ring_t;
+
+typedef struct spsc_ring {
+  /* head is written only by the producer, tail only by the consumer; keep
+     them on separate cache lines */
+  alignas(64) atomic_uint head;
+  alignas(64) atomic_uint tail;
+  alignas(64) atomic_uint high_water_mark;
+  uint32_t mask;
+  void **items;
+} spsc_ring_t;
+
+
+spsc_ring_t *spsc_ring_open(uint32_t capacity)
+{
+  uint32_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  spsc_ring_t *this = (spsc_ring_t *) aligned_alloc(alignof(spsc_ring_t),
+                                                    sizeof(spsc_ring_t));
+  if (this == 0) {
+    return 0;
+  }
+  this->items = (void **) malloc(size * sizeof(void *));
+  if (this->items == 0) {
+    free(this);
+    return 0;
+  }
+  atomic_init(&this->head, 0);
+  atomic_init(&this->tail, 0);
+  atomic_init(&this->high_water_mark, 0);
+  this->mask = size - 1;
+  return this;
+}
+
+
+void spsc_ring_close(spsc_ring_t *this)
+{
+  free(this->items);
+  free(this);
+  return;
+}
+
+
+int spsc_ring_push(spsc_ring_t *this, void *item)
+{
+  unsigned int head = atomic_load_explicit(&this->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&this->tail, memory_order_acquire);
+  unsigned int depth = head - tail;
+  if (depth > this->mask) {
+    return -1;
+  }
+  this->items[head & this->mask] = item;
+  atomic_store_explicit(&this->head, head + 1, memory_order_release);
+
+  /* only the producer updates the high water mark */
+  if (depth + 1 > atomic_load_explicit(&this->high_water_mark, memory_order_relaxed)) {
+    atomic_store_explicit(&this->high_water_mark, depth + 1, memory_order_relaxed);
+  }
+  return 0;
+}
+
+
+void *spsc_ring_pop(spsc_ring_t *this)
+{
+  unsigned int tail = atomic_load_explicit(&this->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&this->head, memory_order_acquire);
+  if (head == tail) {
+    return 0;
+  }
+  void *item = this->items[tail & this->mask];
+  atomic_store_explicit(&this->tail, tail + 1, memory_order_release);
+  return item;
+}
+
+
+uint32_t spsc_ring_depth(spsc_ring_t *this)
+{
+  unsigned int tail = atomic_load_explicit(&this->tail, memory_order_acquire);
+  unsigned int head = atomic_load_explicit(&this->head, memory_order_acquire);
+  return head - tail;
+}
+
+
+uint32_t spsc_ring_high_water_mark(spsc_ring_t *this)
+{
+  return atomic_load_explicit(&this->high_water_mark, memory_order_relaxed);
+}
@@ -0,0 +1,54 @@
+/*
+ * spsc_ring.h - lock-free single producer/single consumer ring
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __SPSC_RING_H
+#define __SPSC_RING_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct spsc_ring spsc_ring_t;
+
+/* capacity is rounded up to a power of 2 */
+spsc_ring_t *spsc_ring_open(uint32_t capacity);
+
+void spsc_ring_close(spsc_ring_t *this);
+
+/* producer side - returns -1 if the ring is full */
+int spsc_ring_push(spsc_ring_t *this, void *item);
+
+/* consumer side - returns 0 if the ring is empty */
+void *spsc_ring_pop(spsc_ring_t *this);
+
+/* these can be called from any thread */
+uint32_t spsc_ring_depth(spsc_ring_t *this);
+
+uint32_t spsc_ring_high_water_mark(spsc_ring_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SPSC_RING_H */
@@ -33,18 +33,54 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdatomic.h>
+#include <time.h>
 
 #include "streaming.h"
 #include "usb_device.h"
 #include "usb_device_internals.h"
+#include "convert.h"
+#include "spsc_ring.h"
+#include "buffer_pool.h"
+#include "ddc.h"
+#include "worker_pool.h"
+#include "trace.h"
 #include "logging.h"
 
 
 typedef struct streaming streaming_t;
+typedef struct frame frame_t;
 
 /* internal functions */
+static streaming_t *streaming_open_async_common(usb_device_t *usb_device,
+                      uint32_t frame_size, uint32_t num_frames,
+                      sddc_read_async_cb_t callback,
+                      sddc_read_async_cb2_t callback2, void *callback_context);
 static void streaming_read_async_callback(struct libusb_transfer *transfer);
+static void *streaming_consumer_thread(void *arg);
+static uint32_t streaming_convert_output(streaming_t *this,
+                                         const uint16_t *samples,
+                                         uint32_t num_samples);
+static void streaming_deliver(streaming_t *this, frame_t *frame);
+static int streaming_alloc_buffers(streaming_t *this);
+static int streaming_free_buffers(streaming_t *this);
+static void streaming_calibrate(streaming_t *this, uint64_t completion_time);
+static void streaming_frame_init(streaming_t *this, frame_t *frame);
+static void streaming_frame_unref(streaming_t *this, frame_t *frame);
+static void spare_stack_push(streaming_t *this, frame_t *frame);
+static frame_t *spare_stack_pop(streaming_t *this);
+static int streaming_open_ddc_workers(streaming_t *this, double center_frequency,
+                                      uint32_t decimation,
+                                      enum SDDCSampleFormat format);
+static void streaming_close_ddc_workers(streaming_t *this);
+static uint32_t streaming_ddc_parallel(streaming_t *this, const int16_t *input,
+                                       uint32_t num_samples);
+static void streaming_ddc_task(void *context, uint32_t index);
+static inline uint64_t monotonic_ns(void);
+static inline uint64_t realtime_ns(void);
+static inline void counter_add(atomic_ullong *counter, uint64_t value);
 
 
 enum StreamingStatus {
@@ -55,18 +91,112 @@ enum StreamingStatus {
   STREAMING_STATUS_FAILED = 0xff
 };
 
+/* a frame buffer; in ring mode frames are swapped between the transfers,
+   the ring, and the pool of spare frames */
+typedef struct frame {
+  streaming_t *streaming;
+  uint8_t *data;
+  uint32_t length;
+  uint64_t completion_time;     /* CLOCK_MONOTONIC - ns */
+  uint64_t realtime;            /* CLOCK_REALTIME - ns */
+  uint64_t sample_index;
+  uint64_t lost_samples;        /* since the previous delivered frame */
+  /* buffer lending - a lent frame goes back to the spare stack when its
+     last reference is released */
+  atomic_int refcount;
+  atomic_int lent;              /* set by the callback thread, cleared by the
+                                   last release from any thread */
+  struct frame *replacement;    /* takes the place of a lent transfer frame */
+  struct frame *next;           /* spare stack link */
+} frame_t;
+
+/* every counter has a single writer (the event loop or the thread running
+   the callback), so they are updated with plain relaxed loads and stores */
+struct streaming_stats {
+  atomic_ullong completed_transfers;
+  atomic_ullong bytes;
+  atomic_ullong short_transfers;
+  atomic_ullong transfer_status[LIBUSB_TRANSFER_OVERFLOW + 1];
+  atomic_ullong max_callback_duration;
+  atomic_ullong callback_latency_histogram[SDDC_STATS_LATENCY_BUCKETS];
+};
+
 typedef struct streaming {
-  enum StreamingStatus status;
+  atomic_int status;             /* enum StreamingStatus */
   int random;
   usb_device_t *usb_device;
   uint32_t sample_rate;
   uint32_t frame_size;
   uint32_t num_frames;
+  /* automatic frame size and queue depth (SDDC_ASYNC_AUTO) */
+  uint32_t max_xfer_size;
+  int auto_frame_size;
+  int auto_num_frames;
+  uint32_t allocated_frames;    /* frames and transfers, >= num_frames */
+  uint32_t queue_depth;         /* transfers kept in flight */
+  uint32_t calibration_frames;  /* left in the calibration burst */
+  int queue_depth_measured;     /* by the first start; kept after it */
+  uint64_t last_completion_time;
+  uint64_t max_completion_gap;
   sddc_read_async_cb_t callback;
+  sddc_read_async_cb2_t callback2;
   void *callback_context;
-  uint8_t **frames;
+  frame_t *frames;
+  uint32_t num_spare_frames;
+  frame_t *spare_frames;
   struct libusb_transfer **transfers;
   atomic_int active_transfers;
+  enum SDDCBufferStrategy buffer_strategy;
+  int numa_node;
+  buffer_pool_t *buffer_pool;
+  /* ring mode */
+  int use_ring;
+  spsc_ring_t *ready_frames;
+  spsc_ring_t *free_frames;
+  sem_t ready_frames_sem;
+  pthread_t consumer_thread;
+  atomic_int consumer_running;
+  atomic_ullong ring_dropped_frames;
+  /* sample accounting - only used by the USB completion path */
+  uint64_t next_sample_index;
+  uint64_t pending_lost_samples;
+  /* digital downconverter */
+  ddc_t *ddc;
+  uint32_t ddc_decimation;
+  uint32_t ddc_sample_size;
+  uint8_t *ddc_output;
+  /* output format conversion; when nothing else needs the raw samples
+     the de-randomization is done by the conversion */
+  struct sddc_output_format output_format;
+  uint8_t *output;
+  uint16_t dither_state;
+  int fused_derandomize;
+  /* parallel DDC: each worker runs its own copy of the DDC on a block of
+     the frame, after a preroll on the samples that precede the block */
+  worker_pool_t *worker_pool;
+  uint32_t num_ddc_workers;
+  ddc_t **ddc_workers;
+  uint8_t **ddc_discard;
+  int16_t *ddc_tail;            /* last ddc_preroll samples */
+  uint32_t ddc_tail_length;
+  int16_t *ddc_carry;           /* samples short of a whole output sample + frame */
+  uint32_t ddc_carry_length;
+  uint32_t ddc_preroll;
+  uint32_t ddc_alignment;
+  uint64_t ddc_input_index;
+  const int16_t *ddc_job_input;
+  uint32_t ddc_job_samples;
+  uint32_t ddc_job_block;
+  channelizer_t *channelizer;
+  sweep_t *sweep;
+  psd_t *psd;
+  agc_t *agc;
+  /* buffer lending: the frame passed to the running callback, and a stack
+     of spare frames that any thread can push (released frames) but only
+     the event loop pops, so the CAS loops have no ABA problem */
+  frame_t *current_frame;
+  _Atomic(frame_t *) spare_stack;
+  struct streaming_stats stats;
 } streaming_t;
 
 
@@ -74,40 +204,42 @@ static const uint32_t DEFAULT_SAMPLE_RATE = 64000000;   /* 64Msps */
 static uint32_t DEFAULT_FRAME_SIZE = (2 * DEFAULT_SAMPLE_RATE / 1000);  /* ~ 1 ms */
 static const uint32_t DEFAULT_NUM_FRAMES = 96;  /* we should not exceed 120 ms in total! */
 static const unsigned int BULK_XFER_TIMEOUT = 5000; // timeout (in ms) for each bulk transfer
+static const int STOP_POLL_INTERVAL = 10;       /* ms - events while stopping */
 
+/* automatic sizing: ~1 ms frames; the queue depth is picked by watching
+   how late the event loop gets to the completed transfers during the
+   first AUTO_CALIBRATION_TIME of streaming, and it is kept within 120 ms
+   and 16 MB of transfers in flight (the default usbfs_memory_mb limit) */
+static const uint32_t AUTO_FRAME_TIME = 1000;           /* us */
+static const uint32_t AUTO_CALIBRATION_TIME = 250000;   /* us */
+static const uint32_t AUTO_MIN_QUEUE_TIME = 16000;      /* us */
+static const uint32_t AUTO_MAX_QUEUE_TIME = 120000;     /* us */
+static const uint32_t AUTO_MAX_QUEUE_BYTES = 16 * 1024 * 1024;
+static const uint32_t AUTO_JITTER_MARGIN = 4;   /* times the worst gap seen */
 
-streaming_t *streaming_open_sync(usb_device_t *usb_device)
-{
-  streaming_t *ret_val = 0;
 
-  /* we must have a bulk in device to transfer data from */
-  if (usb_device->bulk_in_endpoint_address == 0) {
-    log_error("no USB bulk in endpoint found", __func__, __FILE__, __LINE__);
-    return ret_val;
-  }
+streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
+                      uint32_t num_frames, sddc_read_async_cb_t callback,
+                      void *callback_context)
+{
+  return streaming_open_async_common(usb_device, frame_size, num_frames,
+                                     callback, 0, callback_context);
+}
 
-  /* we are good here - create and initialize the streaming */
-  streaming_t *this = (streaming_t *) malloc(sizeof(streaming_t));
-  this->status = STREAMING_STATUS_READY;
-  this->random = 0;
-  this->usb_device = usb_device;
-  this->sample_rate = DEFAULT_SAMPLE_RATE;
-  this->frame_size = 0;
-  this->num_frames = 0;
-  this->callback = 0;
-  this->callback_context = 0;
-  this->frames = 0;
-  this->transfers = 0;
-  atomic_init(&this->active_transfers, 0);
 
-  ret_val = this;
-  return ret_val;
+streaming_t *streaming_open_async2(usb_device_t *usb_device, uint32_t frame_size,
+                      uint32_t num_frames, sddc_read_async_cb2_t callback2,
+                      void *callback_context)
+{
+  return streaming_open_async_common(usb_device, frame_size, num_frames,
+                                     0, callback2, callback_context);
 }
 
 
-streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
-                      uint32_t num_frames, sddc_read_async_cb_t callback,
-                      void *callback_context)
+static streaming_t *streaming_open_async_common(usb_device_t *usb_device,
+                      uint32_t frame_size, uint32_t num_frames,
+                      sddc_read_async_cb_t callback,
+                      sddc_read_async_cb2_t callback2, void *callback_context)
 {
   streaming_t *ret_val = 0;
 
@@ -125,9 +257,22 @@ streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
     return ret_val;
   }
 
-  num_frames = num_frames > 0 ? num_frames : DEFAULT_NUM_FRAMES;
+  /* with SDDC_ASYNC_AUTO the final values are only known once the sample
+     rate is set (streaming_set_sample_rate()); allocate enough frames and
+     transfers for the deepest queue we may choose */
+  int auto_frame_size = frame_size == SDDC_ASYNC_AUTO;
+  int auto_num_frames = num_frames == SDDC_ASYNC_AUTO;
+  if (auto_frame_size) {
+    frame_size = 0;
+  }
   frame_size = frame_size > 0 ? frame_size : DEFAULT_FRAME_SIZE;
   frame_size = max_xfer_size * ((frame_size +max_xfer_size -1) / max_xfer_size);  // round up
+  if (auto_num_frames) {
+    num_frames = auto_frame_size ? AUTO_MAX_QUEUE_TIME / AUTO_FRAME_TIME :
+                                   AUTO_MAX_QUEUE_BYTES / frame_size;
+    num_frames = num_frames > 0 ? num_frames : 1;
+  }
+  num_frames = num_frames > 0 ? num_frames : DEFAULT_NUM_FRAMES;
   int iso_packets_per_frame = frame_size / usb_device->bulk_in_max_packet_size;
   fprintf(stderr, "frame_size = %u, iso_packets_per_frame = %d\n", (unsigned)frame_size, iso_packets_per_frame);
 
@@ -136,30 +281,44 @@ streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
     return ret_val;
   }
 
-  /* allocate frames for zerocopy USB bulk transfers */
-  uint8_t **frames = (uint8_t **) malloc(num_frames * sizeof(uint8_t *));
+  /* the frame buffers are allocated when streaming starts, once the
+     buffer strategy and the number of spare frames are known */
+  frame_t *frames = (frame_t *) malloc(num_frames * sizeof(frame_t));
+  if (frames == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return ret_val;
+  }
   for (uint32_t i = 0; i < num_frames; ++i) {
-    frames[i] = libusb_dev_mem_alloc(usb_device->dev_handle, frame_size);
-    if (frames[i] == 0) {
-      log_error("libusb_dev_mem_alloc() failed", __func__, __FILE__, __LINE__);
-      for (uint32_t j = 0; j < i; j++) {
-        libusb_dev_mem_free(usb_device->dev_handle, frames[j], frame_size);
-      }
-      return ret_val;
-    }
+    frames[i].data = 0;
+    frames[i].length = 0;
   }
 
   /* we are good here - create and initialize the streaming */
   streaming_t *this = (streaming_t *) malloc(sizeof(streaming_t));
-  this->status = STREAMING_STATUS_READY;
+  atomic_init(&this->status, STREAMING_STATUS_READY);
   this->random = 0;
   this->usb_device = usb_device;
   this->sample_rate = DEFAULT_SAMPLE_RATE;
   this->frame_size = frame_size > 0 ? frame_size : DEFAULT_FRAME_SIZE;
   this->num_frames = num_frames > 0 ? num_frames : DEFAULT_NUM_FRAMES;
+  this->max_xfer_size = max_xfer_size;
+  this->auto_frame_size = auto_frame_size;
+  this->auto_num_frames = auto_num_frames;
+  this->allocated_frames = this->num_frames;
+  this->queue_depth = this->num_frames;
+  this->calibration_frames = 0;
+  this->queue_depth_measured = 0;
+  this->last_completion_time = 0;
+  this->max_completion_gap = 0;
   this->callback = callback;
+  this->callback2 = callback2;
   this->callback_context = callback_context;
   this->frames = frames;
+  for (uint32_t i = 0; i < num_frames; ++i) {
+    streaming_frame_init(this, &frames[i]);
+  }
+  this->num_spare_frames = 0;
+  this->spare_frames = 0;
 
   /* populate the required libusb_transfer fields */
   struct libusb_transfer **transfers = (struct libusb_transfer **) malloc(num_frames * sizeof(struct libusb_transfer *));
@@ -167,11 +326,48 @@ streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
     transfers[i] = libusb_alloc_transfer(0);	// iso_packets_per_frame ?
     libusb_fill_bulk_transfer(transfers[i], usb_device->dev_handle,
                               usb_device->bulk_in_endpoint_address,
-                              frames[i], frame_size, streaming_read_async_callback,
-                              this, BULK_XFER_TIMEOUT);
+                              frames[i].data, frame_size,
+                              streaming_read_async_callback, &frames[i],
+                              BULK_XFER_TIMEOUT);
   }
   this->transfers = transfers;
   atomic_init(&this->active_transfers, 0);
+  this->buffer_strategy = BUFFER_STRATEGY_AUTO;
+  this->numa_node = -1;
+  this->buffer_pool = 0;
+  this->use_ring = 0;
+  this->ready_frames = 0;
+  this->free_frames = 0;
+  atomic_init(&this->consumer_running, 0);
+  atomic_init(&this->ring_dropped_frames, 0);
+  this->next_sample_index = 0;
+  this->pending_lost_samples = 0;
+  this->ddc = 0;
+  this->ddc_decimation = 1;
+  this->ddc_sample_size = sizeof(int16_t);
+  this->ddc_output = 0;
+  this->output_format.format = SAMPLE_FORMAT_REAL_INT16;
+  this->output = 0;
+  this->dither_state = 1;
+  this->fused_derandomize = 0;
+  this->worker_pool = 0;
+  this->num_ddc_workers = 0;
+  this->ddc_workers = 0;
+  this->ddc_discard = 0;
+  this->ddc_tail = 0;
+  this->ddc_tail_length = 0;
+  this->ddc_carry = 0;
+  this->ddc_carry_length = 0;
+  this->ddc_preroll = 0;
+  this->ddc_alignment = 1;
+  this->ddc_input_index = 0;
+  this->channelizer = 0;
+  this->sweep = 0;
+  this->psd = 0;
+  this->agc = 0;
+  this->current_frame = 0;
+  atomic_init(&this->spare_stack, 0);
+  memset(&this->stats, 0, sizeof(this->stats));
 
   ret_val = this;
   return ret_val;
@@ -181,18 +377,28 @@ streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
 void streaming_close(streaming_t *this)
 {
   if (this->transfers) {
-    for (uint32_t i = 0; i < this->num_frames; ++i) {
+    for (uint32_t i = 0; i < this->allocated_frames; ++i) {
       libusb_free_transfer(this->transfers[i]);
     }
     free(this->transfers);
   }
-  if (this->frames != 0) {
-    for (uint32_t i = 0; i < this->num_frames; ++i) {
-      libusb_dev_mem_free(this->usb_device->dev_handle, this->frames[i],
-                          this->frame_size);
-    }
-    free(this->frames);
+  if (this->buffer_pool) {
+    buffer_pool_close(this->buffer_pool);
+  }
+  free(this->frames);
+  free(this->spare_frames);
+  if (this->ready_frames) {
+    spsc_ring_close(this->ready_frames);
+  }
+  if (this->free_frames) {
+    spsc_ring_close(this->free_frames);
   }
+  if (this->ddc) {
+    ddc_close(this->ddc);
+  }
+  streaming_close_ddc_workers(this);
+  free(this->ddc_output);
+  free(this->output);
   free(this);
   return;
 }
@@ -202,6 +408,30 @@ int streaming_set_sample_rate(streaming_t *this, uint32_t sample_rate)
 {
   /* no checks yet */
   this->sample_rate = sample_rate;
+  if (this->buffer_pool || !(this->auto_frame_size || this->auto_num_frames)) {
+    return 0;
+  }
+
+  /* the sizes are final once the buffers are allocated */
+  uint32_t max_xfer_size = this->max_xfer_size;
+  if (this->auto_frame_size) {
+    uint64_t frame_size = 2ULL * sample_rate * AUTO_FRAME_TIME / 1000000;
+    frame_size = max_xfer_size * ((frame_size + max_xfer_size - 1) / max_xfer_size);
+    frame_size = frame_size < AUTO_MAX_QUEUE_BYTES ? frame_size : AUTO_MAX_QUEUE_BYTES;
+    this->frame_size = (uint32_t) frame_size;
+  }
+  if (this->auto_num_frames) {
+    uint64_t frame_time = 1000000ULL * this->frame_size / (2ULL * sample_rate);
+    frame_time = frame_time > 0 ? frame_time : 1;
+    uint32_t num_frames = (uint32_t) (AUTO_MAX_QUEUE_TIME / frame_time);
+    if (num_frames > AUTO_MAX_QUEUE_BYTES / this->frame_size) {
+      num_frames = AUTO_MAX_QUEUE_BYTES / this->frame_size;
+    }
+    num_frames = num_frames < this->allocated_frames ? num_frames : this->allocated_frames;
+    this->num_frames = num_frames > 0 ? num_frames : 1;
+  }
+  fprintf(stderr, "auto frame_size = %u, num_frames = %u\n",
+          (unsigned) this->frame_size, (unsigned) this->num_frames);
   return 0;
 }
 
@@ -213,32 +443,481 @@ int streaming_set_random(streaming_t *this, int random)
 }
 
 
+int streaming_set_spare_frames(streaming_t *this, uint32_t num_spare_frames)
+{
+  if (num_spare_frames == this->num_spare_frames) {
+    return 0;
+  }
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY ||
+      (this->callback == 0 && this->callback2 == 0)) {
+    fprintf(stderr, "ERROR - streaming_set_spare_frames() called with streaming status not READY or in sync mode\n");
+    return -1;
+  }
+  /* spare frames may have already been swapped with the transfer frames */
+  if (streaming_free_buffers(this) < 0) {
+    return -1;
+  }
+  free(this->spare_frames);
+  this->spare_frames = 0;
+  if (this->ready_frames) {
+    spsc_ring_close(this->ready_frames);
+    this->ready_frames = 0;
+  }
+  if (this->free_frames) {
+    spsc_ring_close(this->free_frames);
+    this->free_frames = 0;
+  }
+  this->num_spare_frames = 0;
+  if (num_spare_frames == 0) {
+    return 0;
+  }
+
+  /* both rings must be able to hold every frame */
+  uint32_t total_frames = this->num_frames + num_spare_frames;
+  spsc_ring_t *ready_frames = spsc_ring_open(total_frames);
+  spsc_ring_t *free_frames = spsc_ring_open(total_frames);
+  if (ready_frames == 0 || free_frames == 0) {
+    log_error("spsc_ring_open() failed", __func__, __FILE__, __LINE__);
+    goto FAIL0;
+  }
+
+  /* the buffers come with the transfer ones in streaming_start() */
+  frame_t *spare_frames = (frame_t *) malloc(num_spare_frames * sizeof(frame_t));
+  if (spare_frames == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  for (uint32_t i = 0; i < num_spare_frames; ++i) {
+    streaming_frame_init(this, &spare_frames[i]);
+    spare_frames[i].data = 0;
+    spare_frames[i].length = 0;
+  }
+
+  for (uint32_t i = 0; i < num_spare_frames; ++i) {
+    spsc_ring_push(free_frames, &spare_frames[i]);
+  }
+
+  this->num_spare_frames = num_spare_frames;
+  this->spare_frames = spare_frames;
+  this->ready_frames = ready_frames;
+  this->free_frames = free_frames;
+  return 0;
+
+FAIL0:
+  if (ready_frames) {
+    spsc_ring_close(ready_frames);
+  }
+  if (free_frames) {
+    spsc_ring_close(free_frames);
+  }
+  return -1;
+}
+
+
+int streaming_set_buffer_strategy(streaming_t *this,
+                                  enum SDDCBufferStrategy strategy,
+                                  int numa_node)
+{
+  if (this->buffer_strategy == strategy && this->numa_node == numa_node) {
+    return 0;
+  }
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_buffer_strategy() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+  /* the buffers are allocated again by the next streaming_start() */
+  if (streaming_free_buffers(this) < 0) {
+    return -1;
+  }
+  this->buffer_strategy = strategy;
+  this->numa_node = numa_node;
+  return 0;
+}
+
+
+enum SDDCBufferStrategy streaming_get_buffer_strategy(streaming_t *this)
+{
+  if (this->buffer_pool == 0) {
+    return BUFFER_STRATEGY_AUTO;
+  }
+  return buffer_pool_get_strategy(this->buffer_pool);
+}
+
+
+int streaming_set_ring(streaming_t *this, int use_ring)
+{
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_ring() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+  if (use_ring && this->num_spare_frames == 0) {
+    fprintf(stderr, "ERROR - streaming_set_ring() - ring mode requires spare frames\n");
+    return -1;
+  }
+  this->use_ring = use_ring;
+  return 0;
+}
+
+
+int streaming_set_ddc(streaming_t *this, double center_frequency,
+                      uint32_t decimation, enum SDDCSampleFormat format)
+{
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_ddc() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+
+  /* always start from a clean filter state */
+  if (this->ddc) {
+    ddc_close(this->ddc);
+    this->ddc = 0;
+  }
+  streaming_close_ddc_workers(this);
+  free(this->ddc_output);
+  this->ddc_output = 0;
+  this->ddc_decimation = 1;
+  this->ddc_sample_size = sizeof(int16_t);
+  if (decimation == 0) {
+    return 0;
+  }
+
+  if (this->callback == 0 && this->callback2 == 0) {
+    fprintf(stderr, "ERROR - streaming_set_ddc() called in sync mode\n");
+    return -1;
+  }
+  uint32_t frame_samples = this->frame_size / sizeof(int16_t);
+  if (frame_samples % decimation != 0) {
+    fprintf(stderr, "ERROR - streaming_set_ddc() - frame size must be a multiple of %u samples\n",
+            decimation);
+    return -1;
+  }
+  this->ddc = ddc_open(this->sample_rate, center_frequency, decimation, format);
+  if (this->ddc == 0) {
+    fprintf(stderr, "ERROR - ddc_open() failed\n");
+    return -1;
+  }
+  /* one more for the samples carried over from a short transfer */
+  this->ddc_output = (uint8_t *) malloc((frame_samples / decimation + 1) *
+                                        ddc_get_sample_size(format));
+  if (this->ddc_output == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    ddc_close(this->ddc);
+    this->ddc = 0;
+    return -1;
+  }
+  this->ddc_decimation = decimation;
+  this->ddc_sample_size = ddc_get_sample_size(format);
+  if (this->worker_pool) {
+    if (streaming_open_ddc_workers(this, center_frequency, decimation, format) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int streaming_set_output_format(streaming_t *this,
+                                const struct sddc_output_format *output_format)
+{
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_output_format() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+  free(this->output);
+  this->output = 0;
+  this->output_format.format = SAMPLE_FORMAT_REAL_INT16;
+  if (output_format->format == SAMPLE_FORMAT_REAL_INT16) {
+    return 0;
+  }
+
+  if (this->callback == 0 && this->callback2 == 0) {
+    fprintf(stderr, "ERROR - streaming_set_output_format() called in sync mode\n");
+    return -1;
+  }
+  if (this->ddc) {
+    fprintf(stderr, "ERROR - streaming_set_output_format() - output format and DDC cannot be used together\n");
+    return -1;
+  }
+  uint32_t frame_samples = this->frame_size / sizeof(int16_t);
+  size_t output_size;
+  switch (output_format->format) {
+    case SAMPLE_FORMAT_REAL_FLOAT32:
+    case SAMPLE_FORMAT_REAL_INT8:
+      output_size = frame_samples * ddc_get_sample_size(output_format->format);
+      break;
+    case SAMPLE_FORMAT_REAL_PACKED12:
+      output_size = CONVERT_PACKED12_SIZE(frame_samples);
+      break;
+    default:
+      fprintf(stderr, "ERROR - streaming_set_output_format() - invalid output format: %d\n",
+              output_format->format);
+      return -1;
+  }
+  this->output = (uint8_t *) malloc(output_size);
+  if (this->output == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  this->output_format = *output_format;
+  return 0;
+}
+
+
+int streaming_set_worker_pool(streaming_t *this, worker_pool_t *worker_pool)
+{
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_worker_pool() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+  if (worker_pool == this->worker_pool) {
+    return 0;
+  }
+  if (this->ddc) {
+    fprintf(stderr, "ERROR - streaming_set_worker_pool() must be called before streaming_set_ddc()\n");
+    return -1;
+  }
+  this->worker_pool = worker_pool;
+  return 0;
+}
+
+
+int streaming_set_channelizer(streaming_t *this,
+                              channelizer_t *channelizer)
+{
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_channelizer() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+  if (channelizer && this->callback == 0 && this->callback2 == 0) {
+    fprintf(stderr, "ERROR - streaming_set_channelizer() called in sync mode\n");
+    return -1;
+  }
+  this->channelizer = channelizer;
+  return 0;
+}
+
+
+int streaming_set_sweep(streaming_t *this, sweep_t *sweep)
+{
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_sweep() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+  if (sweep && this->callback == 0 && this->callback2 == 0) {
+    fprintf(stderr, "ERROR - streaming_set_sweep() called in sync mode\n");
+    return -1;
+  }
+  this->sweep = sweep;
+  return 0;
+}
+
+
+int streaming_set_psd(streaming_t *this, psd_t *psd)
+{
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_psd() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+  if (psd && this->callback == 0 && this->callback2 == 0) {
+    fprintf(stderr, "ERROR - streaming_set_psd() called in sync mode\n");
+    return -1;
+  }
+  this->psd = psd;
+  return 0;
+}
+
+
+int streaming_set_agc(streaming_t *this, agc_t *agc)
+{
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_set_agc() called with streaming status not READY: %d\n", atomic_load(&this->status));
+    return -1;
+  }
+  if (agc && this->callback == 0 && this->callback2 == 0) {
+    fprintf(stderr, "ERROR - streaming_set_agc() called in sync mode\n");
+    return -1;
+  }
+  this->agc = agc;
+  return 0;
+}
+
+
+int streaming_get_ring_status(streaming_t *this, uint32_t *depth,
+                              uint32_t *high_water_mark,
+                              uint64_t *dropped_frames)
+{
+  if (this->ready_frames == 0) {
+    fprintf(stderr, "ERROR - streaming_get_ring_status() - ring mode not configured\n");
+    return -1;
+  }
+  if (depth) {
+    *depth = spsc_ring_depth(this->ready_frames);
+  }
+  if (high_water_mark) {
+    *high_water_mark = spsc_ring_high_water_mark(this->ready_frames);
+  }
+  if (dropped_frames) {
+    *dropped_frames = atomic_load_explicit(&this->ring_dropped_frames,
+                                           memory_order_relaxed);
+  }
+  return 0;
+}
+
+
+int streaming_get_stats(streaming_t *this, struct sddc_stream_stats *stats)
+{
+  struct streaming_stats *s = &this->stats;
+  memset(stats, 0, sizeof(struct sddc_stream_stats));
+  stats->completed_transfers = atomic_load_explicit(&s->completed_transfers, memory_order_relaxed);
+  stats->bytes = atomic_load_explicit(&s->bytes, memory_order_relaxed);
+  stats->short_transfers = atomic_load_explicit(&s->short_transfers, memory_order_relaxed);
+  stats->errors = atomic_load_explicit(&s->transfer_status[LIBUSB_TRANSFER_ERROR], memory_order_relaxed);
+  stats->timeouts = atomic_load_explicit(&s->transfer_status[LIBUSB_TRANSFER_TIMED_OUT], memory_order_relaxed);
+  stats->cancelled = atomic_load_explicit(&s->transfer_status[LIBUSB_TRANSFER_CANCELLED], memory_order_relaxed);
+  stats->stalls = atomic_load_explicit(&s->transfer_status[LIBUSB_TRANSFER_STALL], memory_order_relaxed);
+  stats->no_device = atomic_load_explicit(&s->transfer_status[LIBUSB_TRANSFER_NO_DEVICE], memory_order_relaxed);
+  stats->overflows = atomic_load_explicit(&s->transfer_status[LIBUSB_TRANSFER_OVERFLOW], memory_order_relaxed);
+  stats->dropped_frames = atomic_load_explicit(&this->ring_dropped_frames, memory_order_relaxed);
+  stats->max_callback_duration_ns = atomic_load_explicit(&s->max_callback_duration, memory_order_relaxed);
+  for (int i = 0; i < SDDC_STATS_LATENCY_BUCKETS; ++i) {
+    stats->callback_latency_histogram[i] = atomic_load_explicit(&s->callback_latency_histogram[i], memory_order_relaxed);
+  }
+  stats->in_flight_transfers = atomic_load(&this->active_transfers);
+  return 0;
+}
+
+
+uint64_t streaming_get_sample_index(streaming_t *this)
+{
+  return this->next_sample_index / this->ddc_decimation;
+}
+
+
+frame_t *streaming_buffer_retain(streaming_t *this, const uint8_t *data)
+{
+  frame_t *frame = this->current_frame;
+  /* data that is not a raw frame (e.g. the DDC output) cannot be retained;
+     the API documents it, so this is not reported as an error */
+  if (frame == 0 || data != frame->data) {
+    return 0;
+  }
+  if (atomic_load(&frame->lent)) {
+    atomic_fetch_add(&frame->refcount, 1);
+    return frame;
+  }
+  if (!this->use_ring) {
+    /* the transfer needs a frame to be resubmitted with */
+    frame_t *replacement = spare_stack_pop(this);
+    if (replacement == 0) {
+      return 0;
+    }
+    frame->replacement = replacement;
+  }
+  /* one reference for the caller and one held until the callback returns */
+  atomic_store(&frame->refcount, 2);
+  atomic_store(&frame->lent, 1);
+  return frame;
+}
+
+
+int streaming_buffer_release(streaming_t *this, frame_t *frame)
+{
+  if (frame == 0 || frame->streaming != this || !atomic_load(&frame->lent)) {
+    fprintf(stderr, "ERROR - streaming_buffer_release() - invalid buffer\n");
+    return -1;
+  }
+  streaming_frame_unref(this, frame);
+  return 0;
+}
+
+
 int streaming_start(streaming_t *this)
 {
-  if (this->status != STREAMING_STATUS_READY) {
-    fprintf(stderr, "ERROR - streaming_start() called with streaming status not READY: %d\n", this->status);
+  if (atomic_load(&this->status) != STREAMING_STATUS_READY) {
+    fprintf(stderr, "ERROR - streaming_start() called with streaming status not READY: %d\n", atomic_load(&this->status));
     return -1;
   }
 
   /* if there is no callback, then streaming is synchronous - nothing to do */
-  if (this->callback == 0) {
-    this->status = STREAMING_STATUS_STREAMING;
+  if (this->callback == 0 && this->callback2 == 0) {
+    atomic_store(&this->status, STREAMING_STATUS_STREAMING);
     return 0;
   }
 
-  /* submit all the transfers */
+  if (this->buffer_pool == 0) {
+    if (streaming_alloc_buffers(this) < 0) {
+      return -1;
+    }
+  }
+
+  /* start the consumer thread before any frame comes in */
+  if (this->use_ring) {
+    if (sem_init(&this->ready_frames_sem, 0, 0) < 0) {
+      fprintf(stderr, "ERROR - sem_init() failed: %s\n", strerror(errno));
+      return -1;
+    }
+    atomic_store(&this->consumer_running, 1);
+    int ret = pthread_create(&this->consumer_thread, 0,
+                             streaming_consumer_thread, this);
+    if (ret != 0) {
+      fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+      atomic_store(&this->consumer_running, 0);
+      sem_destroy(&this->ready_frames_sem);
+      return -1;
+    }
+  }
+
+  /* without the ring the spare frames are only used to back-fill lent
+     buffers */
+  if (!this->use_ring && this->free_frames) {
+    frame_t *frame;
+    while ((frame = (frame_t *) spsc_ring_pop(this->free_frames)) != 0) {
+      spare_stack_push(this, frame);
+    }
+  }
+
+  /* the channelizer, the sweep, the spectrum and the AGC take the raw
+     samples too */
+  this->fused_derandomize = this->random && this->output != 0 &&
+                            this->channelizer == 0 && this->sweep == 0 &&
+                            this->psd == 0 && this->agc == 0;
+
+  /* sample counter starts from zero on every start */
+  this->next_sample_index = 0;
+  this->pending_lost_samples = 0;
+
+  /* with an automatic queue depth all the transfers are queued for the
+     calibration burst of the first start, and the ones in excess are
+     retired after it; the next starts queue just the depth measured then */
+  if (!this->queue_depth_measured) {
+    this->queue_depth = this->num_frames;
+  }
+  this->calibration_frames = 0;
+  if (this->auto_num_frames && !this->queue_depth_measured) {
+    uint64_t frame_time = 1000000ULL * this->frame_size / (2ULL * this->sample_rate);
+    frame_time = frame_time > 0 ? frame_time : 1;
+    this->calibration_frames = (uint32_t) (AUTO_CALIBRATION_TIME / frame_time) + 1;
+  }
+  this->last_completion_time = 0;
+  this->max_completion_gap = 0;
+
+  /* submit the transfers */
   atomic_init(&this->active_transfers, 0);
-  for (uint32_t i = 0; i < this->num_frames; ++i) {
-    int ret = libusb_submit_transfer(this->transfers[i]);
+  for (uint32_t i = 0; i < this->queue_depth; ++i) {
+    TRACE(SUBMIT, this->transfers[i]->user_data, this->transfers[i]->length);
+    int ret = usb_device_submit_transfer(this->usb_device, this->transfers[i]);
     if (ret < 0) {
       log_usb_error(ret, __func__, __FILE__, __LINE__);
-      this->status = STREAMING_STATUS_FAILED;
+      /* take back the transfers already submitted and stop the consumer
+         thread */
+      streaming_stop(this);
+      atomic_store(&this->status, STREAMING_STATUS_FAILED);
       return -1;
     }
     atomic_fetch_add(&this->active_transfers, 1);
   }
 
-  this->status = STREAMING_STATUS_STREAMING;
+  atomic_store(&this->status, STREAMING_STATUS_STREAMING);
 
   return 0;
 }
@@ -247,32 +926,51 @@ int streaming_start(streaming_t *this)
 int streaming_stop(streaming_t *this)
 {
   /* if there is no callback, then streaming is synchronous - nothing to do */
-  if (this->callback == 0) {
-    if (this->status == STREAMING_STATUS_STREAMING) {
-      this->status = STREAMING_STATUS_READY;
+  if (this->callback == 0 && this->callback2 == 0) {
+    if (atomic_load(&this->status) == STREAMING_STATUS_STREAMING) {
+      atomic_store(&this->status, STREAMING_STATUS_READY);
     }
     return 0;
   }
 
-  this->status = STREAMING_STATUS_CANCELLED;
+  atomic_store(&this->status, STREAMING_STATUS_CANCELLED);
   /* cancel all the active transfers */
   for (uint32_t i = 0; i < this->num_frames; ++i) {
-    int ret = libusb_cancel_transfer(this->transfers[i]);
+    int ret = usb_device_cancel_transfer(this->usb_device, this->transfers[i]);
+    TRACE(CANCEL, this->transfers[i]->user_data, ret);
     if (ret < 0) {
       if (ret == LIBUSB_ERROR_NOT_FOUND) {
         continue;
       }
       log_usb_error(ret, __func__, __FILE__, __LINE__);
-      this->status = STREAMING_STATUS_FAILED;
+      atomic_store(&this->status, STREAMING_STATUS_FAILED);
     }
   }
 
-  /* flush all the events */
-  struct timeval noblock = { 0, 0 };
-  int ret = libusb_handle_events_timeout_completed(this->usb_device->context, &noblock, 0);
+  /* flush all the events, until every transfer is back (they then keep
+     their frames for the next streaming_start()) */
+  int ret = usb_device_handle_events_timeout(this->usb_device, 0);
+  for (unsigned int elapsed = 0;
+       ret >= 0 && atomic_load(&this->active_transfers) > 0 &&
+       elapsed < BULK_XFER_TIMEOUT; elapsed += STOP_POLL_INTERVAL) {
+    /* with an event thread a callback that started before the status
+       changed may have resubmitted its transfer after we cancelled it */
+    for (uint32_t i = 0; i < this->num_frames; ++i) {
+      usb_device_cancel_transfer(this->usb_device, this->transfers[i]);
+    }
+    ret = usb_device_handle_events_timeout(this->usb_device,
+                                           STOP_POLL_INTERVAL);
+  }
   if (ret < 0) {
     log_usb_error(ret, __func__, __FILE__, __LINE__);
-    this->status = STREAMING_STATUS_FAILED;
+    atomic_store(&this->status, STREAMING_STATUS_FAILED);
+  }
+
+  /* let the consumer thread drain the ring and exit */
+  if (atomic_exchange(&this->consumer_running, 0)) {
+    sem_post(&this->ready_frames_sem);
+    pthread_join(this->consumer_thread, 0);
+    sem_destroy(&this->ready_frames_sem);
   }
 
   return 0;
@@ -281,7 +979,7 @@ int streaming_stop(streaming_t *this)
 
 int streaming_reset_status(streaming_t *this)
 {
-  switch (this->status) {
+  switch (atomic_load(&this->status)) {
     case STREAMING_STATUS_READY:
       /* nothing to do here */
       return 0;
@@ -295,37 +993,12 @@ int streaming_reset_status(streaming_t *this)
       break;
     default:
       fprintf(stderr, "ERROR - streaming_reset_status() called with invalid status: %d\n",
-                      this->status);
+                      atomic_load(&this->status));
       return -1;
   }
 
   /* we are good here; reset the status */
-  this->status = STREAMING_STATUS_READY;
-  return 0;
-}
-
-
-int streaming_read_sync(streaming_t *this, uint8_t *data, int length, int *transferred)
-{
-  int ret = libusb_bulk_transfer(this->usb_device->dev_handle,
-                                 this->usb_device->bulk_in_endpoint_address,
-                                 data, length, transferred, BULK_XFER_TIMEOUT);
-  if (ret < 0) {
-    log_usb_error(ret, __func__, __FILE__, __LINE__);
-    return -1;
-  }
-
-  /* remove ADC randomization */
-  if (this->random) {
-    uint16_t *samples = (uint16_t *) data;
-    int n = *transferred / 2;
-    for (int i = 0; i < n; ++i) {
-      if (samples[i] & 1) {
-        samples[i] ^= 0xfffe;
-      }
-    }
-  }
-
+  atomic_store(&this->status, STREAMING_STATUS_READY);
   return 0;
 }
 
@@ -333,33 +1006,87 @@ int streaming_read_sync(streaming_t *this, uint8_t *data, int length, int *trans
 /* internal functions */
 static void LIBUSB_CALL streaming_read_async_callback(struct libusb_transfer *transfer)
 {
-  streaming_t *this = (streaming_t *) transfer->user_data;
+  frame_t *frame = (frame_t *) transfer->user_data;
+  streaming_t *this = frame->streaming;
   int ret;
+  TRACE(COMPLETE, frame, ((uint64_t) transfer->status << 32) |
+                         (uint32_t) transfer->actual_length);
+  if (transfer->status <= LIBUSB_TRANSFER_OVERFLOW) {
+    counter_add(&this->stats.transfer_status[transfer->status], 1);
+  }
   switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED:
       /* success!!! */
-      if (this->status == STREAMING_STATUS_STREAMING) {
+      if (atomic_load(&this->status) == STREAMING_STATUS_STREAMING) {
+        frame->completion_time = monotonic_ns();
+        frame->realtime = realtime_ns();
+        uint32_t num_samples = transfer->actual_length / sizeof(uint16_t);
+        frame->sample_index = this->next_sample_index;
+        this->next_sample_index += num_samples;
+        counter_add(&this->stats.completed_transfers, 1);
+        counter_add(&this->stats.bytes, transfer->actual_length);
+        if (transfer->actual_length < transfer->length) {
+          counter_add(&this->stats.short_transfers, 1);
+        }
         /* remove ADC randomization */
-        if (this->random) {
-          uint16_t *samples = (uint16_t *) transfer->buffer;
-          int n = transfer->actual_length / 2;
-          for (int i = 0; i < n; ++i) {
-            if (samples[i] & 1) {
-              samples[i] ^= 0xfffe;
-            }
+        if (this->random && !this->fused_derandomize) {
+          convert_derandomize((uint16_t *) transfer->buffer,
+                              transfer->actual_length / 2);
+        }
+        frame->length = transfer->actual_length;
+        frame->lost_samples = this->pending_lost_samples;
+        if (this->calibration_frames > 0) {
+          streaming_calibrate(this, frame->completion_time);
+        }
+        if (this->use_ring) {
+          /* hand the frame over to the consumer thread and resubmit the
+             transfer right away with a spare frame */
+          frame_t *spare = (frame_t *) spsc_ring_pop(this->free_frames);
+          if (spare == 0) {
+            spare = spare_stack_pop(this);
+          }
+          if (spare) {
+            this->pending_lost_samples = 0;
+            spsc_ring_push(this->ready_frames, frame);
+            sem_post(&this->ready_frames_sem);
+            transfer->buffer = spare->data;
+            transfer->user_data = spare;
+          } else {
+            /* the consumer is not keeping up - drop this frame */
+            counter_add(&this->ring_dropped_frames, 1);
+            TRACE(DROP, frame, num_samples);
+            this->pending_lost_samples += num_samples;
           }
+        } else {
+          streaming_deliver(this, frame);
+          if (atomic_load(&frame->lent)) {
+            /* the callback kept the frame - carry on with its replacement */
+            frame_t *replacement = frame->replacement;
+            frame->replacement = 0;
+            transfer->buffer = replacement->data;
+            transfer->user_data = replacement;
+            streaming_frame_unref(this, frame);
+          }
+        }
+        if ((uint32_t) atomic_load(&this->active_transfers) > this->queue_depth) {
+          /* retired after the calibration */
+          atomic_fetch_sub(&this->active_transfers, 1);
+          return;
         }
-        this->callback(transfer->actual_length, transfer->buffer,
-                       this->callback_context);
-        ret = libusb_submit_transfer(transfer);
+        ret = usb_device_submit_transfer(this->usb_device, transfer);
+        TRACE(RESUBMIT, transfer->user_data, ret);
         if (ret == 0) {
           return;
         }
         log_usb_error(ret, __func__, __FILE__, __LINE__);
+        break;
       }
-      break;
+      /* completed while stopping - same as cancelled */
+      atomic_fetch_sub(&this->active_transfers, 1);
+      return;
     case LIBUSB_TRANSFER_CANCELLED:
       /* librtlsdr does also ignore LIBUSB_TRANSFER_CANCELLED */
+      atomic_fetch_sub(&this->active_transfers, 1);
       return;
     case LIBUSB_TRANSFER_ERROR:
     case LIBUSB_TRANSFER_TIMED_OUT:
@@ -370,12 +1097,13 @@ static void LIBUSB_CALL streaming_read_async_callback(struct libusb_transfer *tr
       break;
   }
 
-  this->status = STREAMING_STATUS_FAILED;
+  atomic_store(&this->status, STREAMING_STATUS_FAILED);
   atomic_fetch_sub(&this->active_transfers, 1);
   fprintf(stderr, "Cancelling\n");
   /* cancel all the active transfers */
   for (uint32_t i = 0; i < this->num_frames; ++i) {
-    int ret = libusb_cancel_transfer(transfer);
+    int ret = usb_device_cancel_transfer(this->usb_device, this->transfers[i]);
+    TRACE(CANCEL, this->transfers[i]->user_data, ret);
     if (ret < 0) {
       if (ret == LIBUSB_ERROR_NOT_FOUND) {
         continue;
@@ -385,3 +1113,438 @@ static void LIBUSB_CALL streaming_read_async_callback(struct libusb_transfer *tr
   }
   return;
 }
+
+
+static void *streaming_consumer_thread(void *arg)
+{
+  streaming_t *this = (streaming_t *) arg;
+  while (1) {
+    if (sem_wait(&this->ready_frames_sem) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR - sem_wait() failed: %s\n", strerror(errno));
+      break;
+    }
+    frame_t *frame = (frame_t *) spsc_ring_pop(this->ready_frames);
+    if (frame == 0) {
+      /* woken up with an empty ring - time to go */
+      if (!atomic_load(&this->consumer_running)) {
+        break;
+      }
+      continue;
+    }
+    streaming_deliver(this, frame);
+    if (atomic_load(&frame->lent)) {
+      streaming_frame_unref(this, frame);
+    } else {
+      spsc_ring_push(this->free_frames, frame);
+    }
+  }
+  return 0;
+}
+
+
+static uint32_t streaming_convert_output(streaming_t *this,
+                                         const uint16_t *samples,
+                                         uint32_t num_samples)
+{
+  const struct sddc_output_format *f = &this->output_format;
+  switch (f->format) {
+    case SAMPLE_FORMAT_REAL_FLOAT32:
+      convert_to_float32(samples, (float *) this->output, num_samples,
+                         this->fused_derandomize,
+                         f->scale != 0 ? f->scale : 1.0f / 32768.0f);
+      return num_samples * sizeof(float);
+    case SAMPLE_FORMAT_REAL_INT8:
+      convert_to_int8(samples, (int8_t *) this->output, num_samples,
+                      this->fused_derandomize, f->shift > 0 ? f->shift : 8,
+                      f->dither ? &this->dither_state : 0);
+      return num_samples * sizeof(int8_t);
+    case SAMPLE_FORMAT_REAL_PACKED12:
+      convert_to_packed12(samples, this->output, num_samples,
+                          this->fused_derandomize);
+      return CONVERT_PACKED12_SIZE(num_samples);
+    default:
+      return 0;
+  }
+}
+
+
+static void streaming_deliver(streaming_t *this, frame_t *frame)
+{
+  uint64_t start = monotonic_ns();
+  uint8_t *data = frame->data;
+  uint32_t length = frame->length;
+  if (this->ddc_workers) {
+    uint32_t num_samples = streaming_ddc_parallel(this, (int16_t *) frame->data,
+                                                  frame->length / sizeof(int16_t));
+    data = this->ddc_output;
+    length = num_samples * this->ddc_sample_size;
+  } else if (this->ddc) {
+    uint32_t num_samples = ddc_process(this->ddc, (int16_t *) frame->data,
+                                       frame->length / sizeof(int16_t),
+                                       this->ddc_output);
+    data = this->ddc_output;
+    length = num_samples * this->ddc_sample_size;
+  } else if (this->output) {
+    length = streaming_convert_output(this, (uint16_t *) frame->data,
+                                      frame->length / sizeof(uint16_t));
+    data = this->output;
+  }
+  if (this->channelizer) {
+    channelizer_process(this->channelizer, (int16_t *) frame->data,
+                        frame->length / sizeof(int16_t));
+  }
+  if (this->sweep) {
+    sweep_process(this->sweep, (int16_t *) frame->data,
+                  frame->length / sizeof(int16_t), frame->sample_index);
+  }
+  if (this->psd) {
+    psd_process(this->psd, (int16_t *) frame->data,
+                frame->length / sizeof(int16_t), frame->sample_index);
+  }
+  if (this->agc) {
+    agc_process(this->agc, (int16_t *) frame->data,
+                frame->length / sizeof(int16_t), frame->sample_index);
+  }
+  this->current_frame = frame;
+  TRACE(CALLBACK_ENTER, frame, frame->sample_index);
+  if (this->callback2) {
+    struct sddc_frame_info info = {
+      .sample_index = frame->sample_index / this->ddc_decimation,
+      .monotonic_time_ns = frame->completion_time,
+      .realtime_ns = frame->realtime,
+      .flags = frame->lost_samples ? SDDC_FRAME_FLAG_GAP : 0,
+      .lost_samples = frame->lost_samples / this->ddc_decimation
+    };
+    this->callback2(length, data, &info, this->callback_context);
+  } else {
+    this->callback(length, data, this->callback_context);
+  }
+  this->current_frame = 0;
+  TRACE(CALLBACK_EXIT, frame, length);
+  uint64_t end = monotonic_ns();
+
+  /* callback duration and latency (from transfer completion) */
+  uint64_t duration = end - start;
+  if (duration > atomic_load_explicit(&this->stats.max_callback_duration, memory_order_relaxed)) {
+    atomic_store_explicit(&this->stats.max_callback_duration, duration, memory_order_relaxed);
+  }
+  uint64_t latency_us = (end - frame->completion_time) / 1000;
+  int bucket = 63 - __builtin_clzll(latency_us | 1);
+  if (bucket >= SDDC_STATS_LATENCY_BUCKETS) {
+    bucket = SDDC_STATS_LATENCY_BUCKETS - 1;
+  }
+  counter_add(&this->stats.callback_latency_histogram[bucket], 1);
+  return;
+}
+
+
+static int streaming_open_ddc_workers(streaming_t *this, double center_frequency,
+                                      uint32_t decimation,
+                                      enum SDDCSampleFormat format)
+{
+  uint32_t num_workers = worker_pool_get_concurrency(this->worker_pool);
+  this->ddc_workers = (ddc_t **) calloc(num_workers, sizeof(ddc_t *));
+  this->ddc_discard = (uint8_t **) calloc(num_workers, sizeof(uint8_t *));
+  if (this->ddc_workers == 0 || this->ddc_discard == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL;
+  }
+  this->num_ddc_workers = num_workers;
+  this->ddc_preroll = ddc_get_preroll(this->ddc);
+  this->ddc_alignment = ddc_get_alignment(this->ddc);
+  uint32_t sample_size = ddc_get_sample_size(format);
+  for (uint32_t i = 0; i < num_workers; ++i) {
+    this->ddc_workers[i] = ddc_open(this->sample_rate, center_frequency,
+                                    decimation, format);
+    this->ddc_discard[i] = (uint8_t *) malloc(this->ddc_preroll / decimation * sample_size + 1);
+    if (this->ddc_workers[i] == 0 || this->ddc_discard[i] == 0) {
+      fprintf(stderr, "ERROR - streaming_open_ddc_workers() failed\n");
+      goto FAIL;
+    }
+  }
+  this->ddc_tail = (int16_t *) malloc(this->ddc_preroll * sizeof(int16_t) + 1);
+  if (this->ddc_tail == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL;
+  }
+  this->ddc_tail_length = 0;
+  this->ddc_carry = (int16_t *) malloc(this->frame_size + decimation * sizeof(int16_t));
+  if (this->ddc_carry == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL;
+  }
+  this->ddc_carry_length = 0;
+  this->ddc_input_index = 0;
+  return 0;
+
+FAIL:
+  streaming_close_ddc_workers(this);
+  return -1;
+}
+
+
+static void streaming_close_ddc_workers(streaming_t *this)
+{
+  for (uint32_t i = 0; i < this->num_ddc_workers; ++i) {
+    if (this->ddc_workers[i]) {
+      ddc_close(this->ddc_workers[i]);
+    }
+    free(this->ddc_discard[i]);
+  }
+  free(this->ddc_workers);
+  free(this->ddc_discard);
+  free(this->ddc_tail);
+  free(this->ddc_carry);
+  this->num_ddc_workers = 0;
+  this->ddc_workers = 0;
+  this->ddc_discard = 0;
+  this->ddc_tail = 0;
+  this->ddc_tail_length = 0;
+  this->ddc_carry = 0;
+  this->ddc_carry_length = 0;
+  return;
+}
+
+
+static uint32_t streaming_ddc_parallel(streaming_t *this, const int16_t *input,
+                                       uint32_t num_samples)
+{
+  /* like ddc_process(), the samples short of a whole output sample
+     (after a short transfer) go in front of the next frame */
+  if (this->ddc_carry_length > 0) {
+    memcpy(this->ddc_carry + this->ddc_carry_length, input,
+           num_samples * sizeof(int16_t));
+    input = this->ddc_carry;
+    num_samples += this->ddc_carry_length;
+  }
+  uint32_t remainder = num_samples % this->ddc_decimation;
+  num_samples -= remainder;
+  uint32_t block = (num_samples + this->num_ddc_workers - 1) / this->num_ddc_workers;
+  block = (block + this->ddc_alignment - 1) / this->ddc_alignment * this->ddc_alignment;
+  this->ddc_job_input = input;
+  this->ddc_job_samples = num_samples;
+  this->ddc_job_block = block;
+  worker_pool_run(this->worker_pool, streaming_ddc_task, this,
+                  this->num_ddc_workers);
+
+  /* keep the last samples for the preroll of the next frame */
+  uint32_t preroll = this->ddc_preroll;
+  if (num_samples >= preroll) {
+    memcpy(this->ddc_tail, input + num_samples - preroll,
+           preroll * sizeof(int16_t));
+    this->ddc_tail_length = preroll;
+  } else {
+    uint32_t keep = this->ddc_tail_length + num_samples > preroll ?
+                    preroll - num_samples : this->ddc_tail_length;
+    memmove(this->ddc_tail, this->ddc_tail + this->ddc_tail_length - keep,
+            keep * sizeof(int16_t));
+    memcpy(this->ddc_tail + keep, input, num_samples * sizeof(int16_t));
+    this->ddc_tail_length = keep + num_samples;
+  }
+  this->ddc_input_index += num_samples;
+  memmove(this->ddc_carry, input + num_samples, remainder * sizeof(int16_t));
+  this->ddc_carry_length = remainder;
+  return num_samples / this->ddc_decimation;
+}
+
+
+static void streaming_ddc_task(void *context, uint32_t index)
+{
+  streaming_t *this = (streaming_t *) context;
+  uint32_t begin = index * this->ddc_job_block;
+  if (begin >= this->ddc_job_samples) {
+    return;
+  }
+  uint32_t end = begin + this->ddc_job_block;
+  end = end < this->ddc_job_samples ? end : this->ddc_job_samples;
+  ddc_t *ddc = this->ddc_workers[index];
+  uint8_t *discard = this->ddc_discard[index];
+
+  /* the preroll comes from the tail of the previous frames and/or from
+     the beginning of this frame (or starts with the stream) */
+  uint64_t base = this->ddc_input_index;
+  uint64_t start = base + begin;
+  uint64_t preroll_start = start > this->ddc_preroll ? start - this->ddc_preroll : 0;
+  ddc_reset(ddc, preroll_start);
+  if (preroll_start < base) {
+    uint32_t length = (uint32_t) (base - preroll_start);
+    ddc_process(ddc, this->ddc_tail + this->ddc_tail_length - length, length,
+                discard);
+  }
+  uint64_t frame_preroll_start = preroll_start > base ? preroll_start : base;
+  if (frame_preroll_start < start) {
+    ddc_process(ddc, this->ddc_job_input + (frame_preroll_start - base),
+                (uint32_t) (start - frame_preroll_start), discard);
+  }
+  ddc_process(ddc, this->ddc_job_input + begin, end - begin,
+              this->ddc_output + begin / this->ddc_decimation * this->ddc_sample_size);
+  return;
+}
+
+
+static inline uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static inline uint64_t realtime_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static inline void counter_add(atomic_ullong *counter, uint64_t value)
+{
+  unsigned long long v = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, v + value, memory_order_relaxed);
+}
+
+
+static int streaming_alloc_buffers(streaming_t *this)
+{
+  buffer_pool_t *buffer_pool = buffer_pool_open(this->usb_device->dev_handle,
+                                   this->num_frames + this->num_spare_frames,
+                                   this->frame_size, this->buffer_strategy,
+                                   this->numa_node);
+  if (buffer_pool == 0) {
+    log_error("buffer_pool_open() failed", __func__, __FILE__, __LINE__);
+    return -1;
+  }
+  for (uint32_t i = 0; i < this->num_frames; ++i) {
+    this->frames[i].data = buffer_pool_get_buffer(buffer_pool, i);
+    this->transfers[i]->buffer = this->frames[i].data;
+    this->transfers[i]->length = this->frame_size;
+  }
+  for (uint32_t i = 0; i < this->num_spare_frames; ++i) {
+    this->spare_frames[i].data = buffer_pool_get_buffer(buffer_pool,
+                                                        this->num_frames + i);
+  }
+  this->buffer_pool = buffer_pool;
+  return 0;
+}
+
+
+static int streaming_free_buffers(streaming_t *this)
+{
+  if (this->buffer_pool == 0) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < this->allocated_frames; ++i) {
+    if (atomic_load(&this->frames[i].lent)) {
+      fprintf(stderr, "ERROR - streaming_free_buffers() - buffers still retained\n");
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < this->num_spare_frames; ++i) {
+    if (atomic_load(&this->spare_frames[i].lent)) {
+      fprintf(stderr, "ERROR - streaming_free_buffers() - buffers still retained\n");
+      return -1;
+    }
+  }
+
+  /* every transfer goes back to its own frame, and the spare frames to
+     the free ring, as streaming_set_spare_frames() left them */
+  for (uint32_t i = 0; i < this->allocated_frames; ++i) {
+    this->frames[i].data = 0;
+    this->transfers[i]->buffer = 0;
+    this->transfers[i]->user_data = &this->frames[i];
+  }
+  atomic_store(&this->spare_stack, 0);
+  if (this->free_frames) {
+    /* the consumer thread left the ready ring empty */
+    while (spsc_ring_pop(this->free_frames) != 0) {
+      continue;
+    }
+    for (uint32_t i = 0; i < this->num_spare_frames; ++i) {
+      this->spare_frames[i].data = 0;
+      spsc_ring_push(this->free_frames, &this->spare_frames[i]);
+    }
+  }
+  buffer_pool_close(this->buffer_pool);
+  this->buffer_pool = 0;
+  return 0;
+}
+
+
+static void streaming_calibrate(streaming_t *this, uint64_t completion_time)
+{
+  /* the longest time between two completions is how long the transfers
+     had to wait for the event loop */
+  if (this->last_completion_time > 0) {
+    uint64_t gap = completion_time - this->last_completion_time;
+    if (gap > this->max_completion_gap) {
+      this->max_completion_gap = gap;
+    }
+  }
+  this->last_completion_time = completion_time;
+  if (--this->calibration_frames > 0) {
+    return;
+  }
+
+  uint64_t frame_time = 1000000000ULL * this->frame_size / (2ULL * this->sample_rate);
+  frame_time = frame_time > 0 ? frame_time : 1;
+  uint64_t depth = (AUTO_JITTER_MARGIN * this->max_completion_gap + frame_time - 1) / frame_time;
+  uint64_t min_depth = 1000ULL * AUTO_MIN_QUEUE_TIME / frame_time;
+  depth = depth > min_depth ? depth : min_depth;
+  depth = depth < this->num_frames ? depth : this->num_frames;
+  this->queue_depth = (uint32_t) (depth > 0 ? depth : 1);
+  this->queue_depth_measured = 1;
+  fprintf(stderr, "auto queue depth = %u frames (max completion gap = %llu us)\n",
+          (unsigned) this->queue_depth,
+          (unsigned long long) (this->max_completion_gap / 1000));
+  return;
+}
+
+
+static void streaming_frame_init(streaming_t *this, frame_t *frame)
+{
+  frame->streaming = this;
+  atomic_init(&frame->refcount, 0);
+  atomic_init(&frame->lent, 0);
+  frame->replacement = 0;
+  frame->next = 0;
+}
+
+
+static void streaming_frame_unref(streaming_t *this, frame_t *frame)
+{
+  if (atomic_fetch_sub(&frame->refcount, 1) == 1) {
+    atomic_store(&frame->lent, 0);
+    spare_stack_push(this, frame);
+  }
+  return;
+}
+
+
+static void spare_stack_push(streaming_t *this, frame_t *frame)
+{
+  frame_t *head = atomic_load_explicit(&this->spare_stack, memory_order_relaxed);
+  do {
+    frame->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&this->spare_stack, &head,
+                                                  frame, memory_order_release,
+                                                  memory_order_relaxed));
+  return;
+}
+
+
+static frame_t *spare_stack_pop(streaming_t *this)
+{
+  /* single consumer: the head cannot be popped and pushed back behind our
+     back, so reading head->next is safe */
+  frame_t *head = atomic_load_explicit(&this->spare_stack, memory_order_acquire);
+  while (head != 0 &&
+         !atomic_compare_exchange_weak_explicit(&this->spare_stack, &head,
+                                                head->next, memory_order_acquire,
+                                                memory_order_acquire)) {
+  }
+  return head;
+}
@@ -23,6 +23,11 @@
 #define __STREAMING_H
 
 #include "usb_device.h"
+#include "channelizer.h"
+#include "sweep.h"
+#include "psd.h"
+#include "agc.h"
+#include "worker_pool.h"
 #include "libsddc.h"
 
 
@@ -32,28 +37,83 @@ extern "C" {
 
 typedef struct streaming streaming_t;
 
-streaming_t *streaming_open_sync(usb_device_t *usb_device);
-
 streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
                                   uint32_t num_frames,
                                   sddc_read_async_cb_t callback,
                                   void *callback_context);
 
+streaming_t *streaming_open_async2(usb_device_t *usb_device, uint32_t frame_size,
+                                   uint32_t num_frames,
+                                   sddc_read_async_cb2_t callback2,
+                                   void *callback_context);
+
 void streaming_close(streaming_t *this);
 
+/* also sets the automatic frame size and queue depth, until the buffers
+   are allocated */
 int streaming_set_sample_rate(streaming_t *this, uint32_t sample_rate);
 
 int streaming_set_random(streaming_t *this, int random);
 
+int streaming_set_spare_frames(streaming_t *this, uint32_t num_spare_frames);
+
+/* the frame buffers are allocated by the first streaming_start(), and
+   again by the next one after the strategy or the number of spare frames
+   change */
+int streaming_set_buffer_strategy(streaming_t *this,
+                                  enum SDDCBufferStrategy strategy,
+                                  int numa_node);
+
+enum SDDCBufferStrategy streaming_get_buffer_strategy(streaming_t *this);
+
+int streaming_set_ring(streaming_t *this, int use_ring);
+
+/* decimation 0 = no DDC */
+int streaming_set_ddc(streaming_t *this, double center_frequency,
+                      uint32_t decimation, enum SDDCSampleFormat format);
+
+/* output format conversion of the real samples (no DDC) */
+int streaming_set_output_format(streaming_t *this,
+                                const struct sddc_output_format *output_format);
+
+/* DDC on the worker threads - must be set before streaming_set_ddc() */
+int streaming_set_worker_pool(streaming_t *this, worker_pool_t *worker_pool);
+
+int streaming_set_channelizer(streaming_t *this,
+                              channelizer_t *channelizer);
+
+int streaming_set_sweep(streaming_t *this, sweep_t *sweep);
+
+int streaming_set_psd(streaming_t *this, psd_t *psd);
+
+int streaming_set_agc(streaming_t *this, agc_t *agc);
+
+int streaming_get_ring_status(streaming_t *this, uint32_t *depth,
+                              uint32_t *high_water_mark,
+                              uint64_t *dropped_frames);
+
+int streaming_get_stats(streaming_t *this, struct sddc_stream_stats *stats);
+
+/* the sample index (at the callback rate, like the v2 frame info) of the
+   first sample of the next frame to complete; only meaningful from the
+   thread running the event loop */
+uint64_t streaming_get_sample_index(streaming_t *this);
+
+/* buffer lending - see sddc_buffer_retain() */
+struct frame *streaming_buffer_retain(streaming_t *this, const uint8_t *data);
+
+int streaming_buffer_release(streaming_t *this, struct frame *buffer);
+
+/* can be called again after streaming_stop() and streaming_reset_status():
+   the frames and transfers allocated by the first start are reused */
 int streaming_start(streaming_t *this);
 
+/* returns when all the transfers have been cancelled and reaped (or after
+   the bulk transfer timeout) */
 int streaming_stop(streaming_t *this);
 
 int streaming_reset_status(streaming_t *this);
 
-int streaming_read_sync(streaming_t *this, uint8_t *data, int length,
-                        int *transferred);
-
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,366 @@
+/*
+ * sweep.c - frequency sweep with per-hop power spectra
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* The tuner hops through a list of frequencies while the stream keeps
+ * running. Each retune is sent as an asynchronous control request; when
+ * the device acknowledges it, the samples still in the device FIFO and in
+ * the transfer being filled may have been acquired before the change, so
+ * the measurement starts one frame (the largest seen so far) plus the
+ * settling time after the sample index of the acknowledgement.
+ *
+ * The measurement is the average of 'averages' Hann windowed FFTs of
+ * fft_size consecutive real samples, limited to the bins within span/2 of
+ * the tuner IF frequency and expressed in dBFS (a full scale sine in the
+ * center of a bin reads 0 dB); invert is set when the tuner output is
+ * spectrally inverted, and the bins are then flipped. At the end of the
+ * list the sweep starts over if loop is set, otherwise it stops. The
+ * callback is called from the thread delivering the samples, right before
+ * the stream callback of the frame that completed the measurement.
+ */
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sweep.h"
+#include "fft.h"
+
+
+typedef struct sweep sweep_t;
+
+static const uint32_t DEFAULT_FFT_SIZE = 1024;
+
+enum SweepState {
+  SWEEP_IDLE,
+  SWEEP_RUNNING,
+  SWEEP_DONE
+};
+
+typedef struct sweep {
+  double *frequencies;
+  uint32_t num_frequencies;
+  double if_frequency;
+  int invert;
+  int loop;
+  uint32_t fft_size;
+  uint32_t averages;
+  uint64_t settling_samples;
+  double bin_width;
+  uint32_t first_bin;
+  uint32_t num_bins;
+  sddc_sweep_cb_t callback;
+  void *callback_context;
+  sweep_retune_fn_t retune;
+  void *retune_context;
+  fft_t *fft;
+  float *window;
+  double power_gain;            /* |X|^2 to full scale */
+  float *input;
+  float complex *spectrum;
+  double *accumulator;
+  float *power;
+  atomic_int state;
+  /* first sample to measure; UINT64_MAX while a retune is in flight */
+  atomic_ullong settle_from;
+  atomic_uint max_frame_samples;
+  uint32_t hop;
+  uint32_t sweep;
+  double frequency;
+  uint32_t fill;
+  uint32_t count;
+  uint64_t next_index;
+  uint64_t measure_index;
+} sweep_t;
+
+
+/* internal functions */
+static void sweep_finish_hop(sweep_t *this);
+
+
+sweep_t *sweep_open(const struct sddc_sweep_params *params,
+                    double sample_rate, sweep_retune_fn_t retune,
+                    void *retune_context)
+{
+  sweep_t *ret_val = 0;
+
+  uint32_t fft_size = params->fft_size > 0 ? params->fft_size : DEFAULT_FFT_SIZE;
+  if (fft_size < 64 || (fft_size & (fft_size - 1)) != 0) {
+    fprintf(stderr, "ERROR - sweep_open() failed - FFT size must be a power of two >= 64: %u\n", fft_size);
+    return ret_val;
+  }
+  if (params->frequencies == 0 || params->num_frequencies == 0) {
+    fprintf(stderr, "ERROR - sweep_open() failed - no frequencies\n");
+    return ret_val;
+  }
+  if (params->if_frequency <= 0 || params->span <= 0 ||
+      params->if_frequency + params->span / 2 > sample_rate / 2 ||
+      params->if_frequency - params->span / 2 < 0) {
+    fprintf(stderr, "ERROR - sweep_open() failed - IF frequency +/- span/2 must be within 0 and sample_rate/2\n");
+    return ret_val;
+  }
+  if (params->settling_time < 0) {
+    fprintf(stderr, "ERROR - sweep_open() failed - invalid settling time: %f\n", params->settling_time);
+    return ret_val;
+  }
+  if (params->callback == 0) {
+    fprintf(stderr, "ERROR - sweep_open() failed - no callback\n");
+    return ret_val;
+  }
+
+  sweep_t *this = (sweep_t *) calloc(1, sizeof(sweep_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL0;
+  }
+  this->num_frequencies = params->num_frequencies;
+  this->if_frequency = params->if_frequency;
+  this->invert = params->invert;
+  this->loop = params->loop;
+  this->fft_size = fft_size;
+  this->averages = params->averages > 0 ? params->averages : 1;
+  this->settling_samples = (uint64_t) (params->settling_time * sample_rate);
+  this->bin_width = sample_rate / fft_size;
+  uint32_t first_bin = (uint32_t) ceil((params->if_frequency - params->span / 2) / this->bin_width);
+  uint32_t last_bin = (uint32_t) floor((params->if_frequency + params->span / 2) / this->bin_width);
+  last_bin = last_bin < fft_size / 2 ? last_bin : fft_size / 2;
+  if (last_bin < first_bin) {
+    fprintf(stderr, "ERROR - sweep_open() failed - span narrower than one bin\n");
+    goto FAIL1;
+  }
+  this->first_bin = first_bin;
+  this->num_bins = last_bin - first_bin + 1;
+  this->callback = params->callback;
+  this->callback_context = params->callback_context;
+  this->retune = retune;
+  this->retune_context = retune_context;
+
+  this->frequencies = (double *) malloc(params->num_frequencies * sizeof(double));
+  this->fft = fft_open_r2c(fft_size);
+  this->window = (float *) malloc(fft_size * sizeof(float));
+  this->input = (float *) malloc(fft_size * sizeof(float));
+  this->spectrum = (float complex *) malloc((fft_size / 2 + 1) * sizeof(float complex));
+  this->accumulator = (double *) malloc(this->num_bins * sizeof(double));
+  this->power = (float *) malloc(this->num_bins * sizeof(float));
+  if (this->frequencies == 0 || this->fft == 0 || this->window == 0 ||
+      this->input == 0 || this->spectrum == 0 || this->accumulator == 0 ||
+      this->power == 0) {
+    fprintf(stderr, "ERROR - sweep_open() failed - out of memory\n");
+    goto FAIL1;
+  }
+  memcpy(this->frequencies, params->frequencies,
+         params->num_frequencies * sizeof(double));
+
+  /* Hann window; a sine of amplitude A gives |X| = A sum(w) / 2 */
+  double window_sum = 0;
+  for (uint32_t i = 0; i < fft_size; ++i) {
+    this->window[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * i / fft_size));
+    window_sum += this->window[i];
+  }
+  double full_scale = window_sum * 32768.0 / 2;
+  this->power_gain = 1.0 / (full_scale * full_scale);
+
+  atomic_init(&this->state, SWEEP_IDLE);
+  atomic_init(&this->settle_from, UINT64_MAX);
+  atomic_init(&this->max_frame_samples, 0);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL1:
+  sweep_close(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void sweep_close(sweep_t *this)
+{
+  if (this->fft) {
+    fft_close(this->fft);
+  }
+  free(this->frequencies);
+  free(this->window);
+  free(this->input);
+  free(this->spectrum);
+  free(this->accumulator);
+  free(this->power);
+  free(this);
+  return;
+}
+
+
+double sweep_get_start_frequency(sweep_t *this)
+{
+  return this->frequencies[0];
+}
+
+
+void sweep_start(sweep_t *this)
+{
+  this->hop = 0;
+  this->sweep = 0;
+  this->frequency = this->frequencies[0];
+  this->fill = 0;
+  this->count = 0;
+  this->next_index = 0;
+  atomic_store(&this->max_frame_samples, 0);
+  atomic_store(&this->settle_from, this->settling_samples);
+  atomic_store(&this->state, SWEEP_RUNNING);
+  return;
+}
+
+
+void sweep_stop(sweep_t *this)
+{
+  atomic_store(&this->state, SWEEP_IDLE);
+  return;
+}
+
+
+int sweep_is_running(sweep_t *this)
+{
+  return atomic_load(&this->state) == SWEEP_RUNNING;
+}
+
+
+void sweep_tuned(sweep_t *this, uint64_t sample_index, int status)
+{
+  if (atomic_load(&this->state) != SWEEP_RUNNING) {
+    return;
+  }
+  if (status < 0) {
+    fprintf(stderr, "ERROR - sweep retune failed - sweep stopped\n");
+    atomic_store(&this->state, SWEEP_DONE);
+    return;
+  }
+  atomic_store(&this->settle_from, sample_index +
+               atomic_load(&this->max_frame_samples) + this->settling_samples);
+  return;
+}
+
+
+void sweep_process(sweep_t *this, const int16_t *input, uint32_t num_samples,
+                   uint64_t sample_index)
+{
+  if (num_samples > atomic_load_explicit(&this->max_frame_samples, memory_order_relaxed)) {
+    atomic_store_explicit(&this->max_frame_samples, num_samples, memory_order_relaxed);
+  }
+  if (atomic_load(&this->state) != SWEEP_RUNNING) {
+    return;
+  }
+  uint64_t settle_from = atomic_load(&this->settle_from);
+  if (settle_from == UINT64_MAX || sample_index + num_samples <= settle_from) {
+    return;
+  }
+
+  uint32_t i = sample_index < settle_from ? (uint32_t) (settle_from - sample_index) : 0;
+  /* the FFT blocks must be made of consecutive samples */
+  if (this->fill > 0 && sample_index + i != this->next_index) {
+    this->fill = 0;
+  }
+  while (i < num_samples) {
+    if (this->fill == 0 && this->count == 0) {
+      this->measure_index = sample_index + i;
+    }
+    uint32_t n = this->fft_size - this->fill;
+    n = n < num_samples - i ? n : num_samples - i;
+    const float *window = this->window + this->fill;
+    float *block = this->input + this->fill;
+    for (uint32_t k = 0; k < n; ++k) {
+      block[k] = window[k] * input[i + k];
+    }
+    this->fill += n;
+    i += n;
+    this->next_index = sample_index + i;
+    if (this->fill < this->fft_size) {
+      break;
+    }
+
+    this->fill = 0;
+    fft_execute_r2c(this->fft, this->input, this->spectrum);
+    const float complex *bins = this->spectrum + this->first_bin;
+    for (uint32_t k = 0; k < this->num_bins; ++k) {
+      float re = crealf(bins[k]);
+      float im = cimagf(bins[k]);
+      double power = (double) re * re + (double) im * im;
+      this->accumulator[k] = this->count == 0 ? power : this->accumulator[k] + power;
+    }
+    if (++this->count == this->averages) {
+      this->count = 0;
+      sweep_finish_hop(this);
+      /* the rest of the frame belongs to the old frequency (or the
+         settling of the same one if it is repeated) */
+      return;
+    }
+  }
+  return;
+}
+
+
+static void sweep_finish_hop(sweep_t *this)
+{
+  /* ascending frequency order in the output */
+  double scale = this->power_gain / this->averages;
+  for (uint32_t k = 0; k < this->num_bins; ++k) {
+    uint32_t j = this->invert ? this->num_bins - 1 - k : k;
+    double power = this->accumulator[j] * scale;
+    this->power[k] = power > 0 ? (float) (10 * log10(power)) : -INFINITY;
+  }
+  double first_offset = this->first_bin * this->bin_width - this->if_frequency;
+  double last_offset = first_offset + (this->num_bins - 1) * this->bin_width;
+  struct sddc_sweep_spectrum spectrum = {
+    .hop = this->hop,
+    .sweep = this->sweep,
+    .frequency = this->frequency,
+    .first_bin_frequency = this->invert ? this->frequency - last_offset :
+                                          this->frequency + first_offset,
+    .bin_width = this->bin_width,
+    .num_bins = this->num_bins,
+    .power = this->power,
+    .sample_index = this->measure_index
+  };
+  this->callback(&spectrum, this->callback_context);
+
+  /* next hop */
+  if (++this->hop == this->num_frequencies) {
+    this->hop = 0;
+    this->sweep++;
+    if (!this->loop) {
+      atomic_store(&this->state, SWEEP_DONE);
+      return;
+    }
+  }
+  double frequency = this->frequencies[this->hop];
+  if (frequency == this->frequency) {
+    atomic_store(&this->settle_from, this->next_index);
+    return;
+  }
+  atomic_store(&this->settle_from, UINT64_MAX);
+  this->frequency = frequency;
+  if (this->retune(this->retune_context, frequency) < 0) {
+    fprintf(stderr, "ERROR - sweep retune to %f failed - sweep stopped\n", frequency);
+    atomic_store(&this->state, SWEEP_DONE);
+  }
+  return;
+}
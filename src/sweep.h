@@ -0,0 +1,72 @@
+/*
+ * sweep.h - frequency sweep with per-hop power spectra
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __SWEEP_H
+#define __SWEEP_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sweep sweep_t;
+
+/* starts retuning the tuner to frequency and returns right away; when the
+   tuner has been retuned sweep_tuned() must be called */
+typedef int (*sweep_retune_fn_t)(void *context, double frequency);
+
+sweep_t *sweep_open(const struct sddc_sweep_params *params,
+                    double sample_rate, sweep_retune_fn_t retune,
+                    void *retune_context);
+
+void sweep_close(sweep_t *this);
+
+/* the first frequency of the list */
+double sweep_get_start_frequency(sweep_t *this);
+
+/* back to the first hop, with the tuner already on its frequency; the
+   samples from sample index 0 are measured after the settling time */
+void sweep_start(sweep_t *this);
+
+/* after sweep_stop() (or the end of a sweep without loop) the retunes
+   still in flight are ignored */
+void sweep_stop(sweep_t *this);
+
+int sweep_is_running(sweep_t *this);
+
+/* called when the device acknowledged a retune; sample_index is the index
+   of the next sample to come out of the stream at that point */
+void sweep_tuned(sweep_t *this, uint64_t sample_index, int status);
+
+/* real samples from the stream, in order; called from one thread */
+void sweep_process(sweep_t *this, const int16_t *input, uint32_t num_samples,
+                   uint64_t sample_index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SWEEP_H */
@@ -0,0 +1,219 @@
+/*
+ * sync_buffer.c - buffer between the stream and sddc_read_sync()
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* A byte ring with one producer (the stream callback, on the event
+   thread) and one consumer (sddc_read_sync()). The producer only takes
+   the lock to wake up the consumer when it is waiting */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sync_buffer.h"
+
+
+typedef struct sync_buffer {
+  uint8_t *data;
+  uint32_t size;
+  atomic_ullong written;        /* bytes, since the last reset */
+  atomic_ullong read;
+  atomic_int waiting;
+  atomic_int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  atomic_ullong dropped_bytes;
+  atomic_uint high_water_mark;
+} sync_buffer_t;
+
+
+/* internal functions */
+static inline uint64_t monotonic_ns(void);
+
+
+sync_buffer_t *sync_buffer_open(uint32_t size)
+{
+  sync_buffer_t *ret_val = 0;
+
+  if (size == 0) {
+    fprintf(stderr, "ERROR - sync_buffer_open() failed - no size\n");
+    return ret_val;
+  }
+
+  sync_buffer_t *this = (sync_buffer_t *) malloc(sizeof(sync_buffer_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->data = (uint8_t *) malloc(size);
+  if (this->data == 0) {
+    fprintf(stderr, "ERROR - malloc() of %u bytes failed\n", size);
+    goto FAIL1;
+  }
+  /* fault the pages in now, not in the stream callback */
+  memset(this->data, 0, size);
+  this->size = size;
+  atomic_init(&this->written, 0);
+  atomic_init(&this->read, 0);
+  atomic_init(&this->waiting, 0);
+  atomic_init(&this->failed, 0);
+  pthread_mutex_init(&this->lock, 0);
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&this->ready, &condattr);
+  pthread_condattr_destroy(&condattr);
+  atomic_init(&this->dropped_bytes, 0);
+  atomic_init(&this->high_water_mark, 0);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void sync_buffer_close(sync_buffer_t *this)
+{
+  pthread_cond_destroy(&this->ready);
+  pthread_mutex_destroy(&this->lock);
+  free(this->data);
+  free(this);
+  return;
+}
+
+
+void sync_buffer_reset(sync_buffer_t *this)
+{
+  atomic_store(&this->written, 0);
+  atomic_store(&this->read, 0);
+  atomic_store(&this->dropped_bytes, 0);
+  atomic_store(&this->high_water_mark, 0);
+  atomic_store(&this->failed, 0);
+  return;
+}
+
+
+void sync_buffer_fail(sync_buffer_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  atomic_store(&this->failed, 1);
+  pthread_cond_signal(&this->ready);
+  pthread_mutex_unlock(&this->lock);
+  return;
+}
+
+
+int sync_buffer_write(sync_buffer_t *this, const uint8_t *data,
+                      uint32_t size)
+{
+  uint64_t written = atomic_load_explicit(&this->written, memory_order_relaxed);
+  uint64_t read = atomic_load_explicit(&this->read, memory_order_acquire);
+  uint32_t depth = (uint32_t) (written - read);
+  if (size > this->size - depth) {
+    atomic_fetch_add_explicit(&this->dropped_bytes, size, memory_order_relaxed);
+    return 0;
+  }
+
+  uint32_t position = (uint32_t) (written % this->size);
+  uint32_t n = this->size - position < size ? this->size - position : size;
+  memcpy(this->data + position, data, n);
+  memcpy(this->data, data + n, size - n);
+  atomic_store_explicit(&this->written, written + size, memory_order_seq_cst);
+  if (depth + size > atomic_load_explicit(&this->high_water_mark, memory_order_relaxed)) {
+    atomic_store_explicit(&this->high_water_mark, depth + size, memory_order_relaxed);
+  }
+
+  /* the consumer sets waiting before it looks at written, and we look at
+     waiting after updating written: one of the two sees the other */
+  if (atomic_load_explicit(&this->waiting, memory_order_seq_cst)) {
+    pthread_mutex_lock(&this->lock);
+    pthread_cond_signal(&this->ready);
+    pthread_mutex_unlock(&this->lock);
+  }
+  return 0;
+}
+
+
+int sync_buffer_read(sync_buffer_t *this, uint8_t *data, uint32_t length,
+                     uint32_t *transferred, int timeout_ms)
+{
+  uint64_t read = atomic_load_explicit(&this->read, memory_order_relaxed);
+  uint64_t written = atomic_load_explicit(&this->written, memory_order_acquire);
+  if (written - read < length) {
+    uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000ULL;
+    struct timespec timeout = {
+      .tv_sec = deadline / 1000000000ULL,
+      .tv_nsec = deadline % 1000000000ULL
+    };
+    pthread_mutex_lock(&this->lock);
+    atomic_store_explicit(&this->waiting, 1, memory_order_seq_cst);
+    while ((written = atomic_load_explicit(&this->written, memory_order_seq_cst)) - read < length) {
+      if (atomic_load_explicit(&this->failed, memory_order_relaxed)) {
+        break;
+      }
+      int ret = pthread_cond_timedwait(&this->ready, &this->lock, &timeout);
+      if (ret == ETIMEDOUT) {
+        written = atomic_load_explicit(&this->written, memory_order_acquire);
+        break;
+      }
+    }
+    atomic_store_explicit(&this->waiting, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&this->lock);
+  }
+
+  uint32_t size = written - read < length ? (uint32_t) (written - read) : length;
+  uint32_t position = (uint32_t) (read % this->size);
+  uint32_t n = this->size - position < size ? this->size - position : size;
+  memcpy(data, this->data + position, n);
+  memcpy(data + n, this->data, size - n);
+  atomic_store_explicit(&this->read, read + size, memory_order_release);
+  *transferred = size;
+  return size == length ? 0 : -1;
+}
+
+
+void sync_buffer_get_stats(sync_buffer_t *this, struct sddc_sync_stats *stats)
+{
+  uint64_t read = atomic_load(&this->read);
+  uint64_t written = atomic_load(&this->written);
+  stats->bytes_read = read;
+  stats->dropped_bytes = atomic_load(&this->dropped_bytes);
+  stats->depth = (uint32_t) (written - read);
+  stats->high_water_mark = atomic_load(&this->high_water_mark);
+  return;
+}
+
+
+/* internal functions */
+static inline uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,65 @@
+/*
+ * sync_buffer.h - buffer between the stream and sddc_read_sync()
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __SYNC_BUFFER_H
+#define __SYNC_BUFFER_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sync_buffer sync_buffer_t;
+
+sync_buffer_t *sync_buffer_open(uint32_t size);
+
+void sync_buffer_close(sync_buffer_t *this);
+
+/* throws away what has not been read yet (and the stats); only while
+   nothing is writing or reading */
+void sync_buffer_reset(sync_buffer_t *this);
+
+/* producer side - never blocks: a frame that does not fit is dropped
+   (and counted) */
+int sync_buffer_write(sync_buffer_t *this, const uint8_t *data,
+                      uint32_t size);
+
+/* the producer is gone for good (until the next reset): the consumer
+   stops waiting */
+void sync_buffer_fail(sync_buffer_t *this);
+
+/* consumer side: waits up to timeout_ms for length bytes; on timeout, or
+   after sync_buffer_fail(), what is there is returned in data
+   (transferred bytes) and -1 */
+int sync_buffer_read(sync_buffer_t *this, uint8_t *data, uint32_t length,
+                     uint32_t *transferred, int timeout_ms);
+
+void sync_buffer_get_stats(sync_buffer_t *this, struct sddc_sync_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SYNC_BUFFER_H */
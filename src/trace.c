@@ -0,0 +1,170 @@
+/*
+ * trace.c - hot path tracepoints
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+
+#ifdef SDDC_TRACING
+
+/* each entry is a tiny seqlock: seq is 0 while the entry is written, and
+   then 1 + the event number, so that sddc_trace_dump() can skip the
+   entries overwritten while it reads them */
+struct trace_entry {
+  atomic_ullong seq;
+  atomic_ullong time;           /* CLOCK_MONOTONIC - ns */
+  atomic_ullong arg0;
+  atomic_ullong arg1;
+  atomic_uint event;
+  atomic_uint thread;
+};
+
+atomic_int trace_enabled = 0;
+
+static struct trace_entry trace_ring[TRACE_RING_SIZE];
+static atomic_ullong trace_next = 0;
+static const char *trace_exit_path = 0;
+static __thread uint32_t trace_thread = 0;
+
+static const char *trace_event_names[TRACE_NUM_EVENTS] = {
+  "submit",
+  "complete",
+  "resubmit",
+  "cancel",
+  "callback_enter",
+  "callback_exit",
+  "drop",
+  "control",
+  "control_done"
+};
+
+
+void trace_record(enum TraceEvent event, uint64_t arg0, uint64_t arg1)
+{
+  if (trace_thread == 0) {
+    trace_thread = (uint32_t) syscall(SYS_gettid);
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t n = atomic_fetch_add_explicit(&trace_next, 1, memory_order_relaxed);
+  struct trace_entry *entry = &trace_ring[n & (TRACE_RING_SIZE - 1)];
+  atomic_store_explicit(&entry->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&entry->time, (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+                        memory_order_relaxed);
+  atomic_store_explicit(&entry->arg0, arg0, memory_order_relaxed);
+  atomic_store_explicit(&entry->arg1, arg1, memory_order_relaxed);
+  atomic_store_explicit(&entry->event, event, memory_order_relaxed);
+  atomic_store_explicit(&entry->thread, trace_thread, memory_order_relaxed);
+  atomic_store_explicit(&entry->seq, n + 1, memory_order_release);
+}
+
+
+int trace_enable(int enable)
+{
+  atomic_store(&trace_enabled, enable ? 1 : 0);
+  return 0;
+}
+
+
+int trace_dump(const char *path)
+{
+  FILE *fp = path ? fopen(path, "w") : stderr;
+  if (fp == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", path);
+    return -1;
+  }
+  uint64_t last = atomic_load(&trace_next);
+  uint64_t first = last > TRACE_RING_SIZE ? last - TRACE_RING_SIZE : 0;
+  uint64_t start_time = 0;
+  fprintf(fp, "# time (us) thread event arg0 arg1\n");
+  for (uint64_t n = first; n < last; ++n) {
+    struct trace_entry *entry = &trace_ring[n & (TRACE_RING_SIZE - 1)];
+    uint64_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+    uint64_t time = atomic_load_explicit(&entry->time, memory_order_relaxed);
+    uint64_t arg0 = atomic_load_explicit(&entry->arg0, memory_order_relaxed);
+    uint64_t arg1 = atomic_load_explicit(&entry->arg1, memory_order_relaxed);
+    uint32_t event = atomic_load_explicit(&entry->event, memory_order_relaxed);
+    uint32_t thread = atomic_load_explicit(&entry->thread, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (seq != n + 1 ||
+        atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq ||
+        event >= TRACE_NUM_EVENTS) {
+      continue;
+    }
+    if (start_time == 0) {
+      start_time = time;
+    }
+    fprintf(fp, "%.3f %u %s 0x%llx %llu\n", (time - start_time) / 1e3,
+            thread, trace_event_names[event], (unsigned long long) arg0,
+            (unsigned long long) arg1);
+  }
+  if (path) {
+    fclose(fp);
+  }
+  return 0;
+}
+
+
+/* SDDC_TRACE=1 turns tracing on at load time, and SDDC_TRACE=<file> also
+   dumps the ring to that file at exit */
+__attribute__((constructor))
+static void trace_init(void)
+{
+  const char *value = getenv("SDDC_TRACE");
+  if (value == 0 || *value == '\0' || strcmp(value, "0") == 0) {
+    return;
+  }
+  trace_enable(1);
+  if (strcmp(value, "1") != 0) {
+    trace_exit_path = value;
+  }
+}
+
+__attribute__((destructor))
+static void trace_fini(void)
+{
+  if (trace_exit_path) {
+    trace_dump(trace_exit_path);
+  }
+}
+
+#else
+
+int trace_enable(int enable __attribute__((unused)))
+{
+  fprintf(stderr, "ERROR - tracing not compiled in (ENABLE_TRACING)\n");
+  return -1;
+}
+
+int trace_dump(const char *path __attribute__((unused)))
+{
+  fprintf(stderr, "ERROR - tracing not compiled in (ENABLE_TRACING)\n");
+  return -1;
+}
+
+#endif /* SDDC_TRACING */
@@ -0,0 +1,100 @@
+/*
+ * trace.h - hot path tracepoints
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Tracepoints on the streaming hot path. They are compiled in only with
+ * the ENABLE_TRACING build option (SDDC_TRACING); otherwise TRACE()
+ * expands to nothing. When compiled in, every tracepoint is:
+ *  - a USDT probe 'sddc:<event>' (if <sys/sdt.h> is available), which is
+ *    a nop until a tracer (perf, bpftrace, ...) attaches to it
+ *  - while tracing is enabled (sddc_trace_enable() or SDDC_TRACE in the
+ *    environment), an entry in a lock-free in-memory ring of the last
+ *    TRACE_RING_SIZE events, written out by sddc_trace_dump()
+ * so with tracing compiled in and disabled each one costs a relaxed load
+ * and a predicted branch */
+enum TraceEvent {
+  TRACE_SUBMIT,                 /* frame, length */
+  TRACE_COMPLETE,               /* frame, status << 32 | actual length */
+  TRACE_RESUBMIT,               /* frame, ret */
+  TRACE_CANCEL,                 /* frame, ret */
+  TRACE_CALLBACK_ENTER,         /* frame, sample index */
+  TRACE_CALLBACK_EXIT,          /* frame, bytes passed to the callback */
+  TRACE_DROP,                   /* frame, samples (ring mode) */
+  TRACE_CONTROL,                /* request, value << 16 | index */
+  TRACE_CONTROL_DONE,           /* request, ret */
+  TRACE_NUM_EVENTS
+};
+
+#define TRACE_RING_SIZE (1 << 16)
+
+#ifdef SDDC_TRACING
+
+#include <stdatomic.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_USDT(event, arg0, arg1) DTRACE_PROBE2(sddc, event, arg0, arg1)
+#else
+#define TRACE_USDT(event, arg0, arg1) do { } while (0)
+#endif
+
+extern atomic_int trace_enabled;
+
+void trace_record(enum TraceEvent event, uint64_t arg0, uint64_t arg1);
+
+#define TRACE(event, arg0, arg1) do {\
+  TRACE_USDT(event, arg0, arg1);\
+  if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {\
+    trace_record(TRACE_##event, (uint64_t) (arg0), (uint64_t) (arg1));\
+  }\
+} while (0)
+
+#else
+
+#define TRACE(event, arg0, arg1) do {\
+  if (0) {\
+    (void) (arg0);\
+    (void) (arg1);\
+  }\
+} while (0)
+
+#endif /* SDDC_TRACING */
+
+/* return -1 when tracing is not compiled in */
+int trace_enable(int enable);
+
+/* the events still in the ring, oldest first, one per line; path 0 =
+   stderr */
+int trace_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRACE_H */
@@ -0,0 +1,482 @@
+/*
+ * trigger.c - trigger capture from a pre-trigger history in memory
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* The stream side copies each frame into the history ring (at its sample
+ * index, so that the ring is always in step with the stream), computes
+ * its mean power, and when a capture triggers just records where it
+ * starts and ends and wakes up the capture thread. That thread copies
+ * the capture out of the ring in chunks - checking that the stream has
+ * not overwritten a chunk meanwhile - and writes them to the recorder,
+ * waiting for its buffers as needed; if it falls behind by more than the
+ * ring the oldest samples of the capture are lost.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "trigger.h"
+#include "recorder.h"
+
+
+typedef struct sddc_trigger trigger_t;
+
+typedef struct sddc_trigger {
+  int16_t *history;
+  size_t history_size;          /* bytes mapped */
+  uint64_t capacity;            /* samples */
+  int huge_pages;
+  uint64_t pre_samples;
+  uint64_t post_samples;
+  double threshold;             /* mean square; 0 = no energy trigger */
+  recorder_t *recorder;
+  sddc_trigger_cb_t callback;
+  void *callback_context;
+  /* stream side */
+  int started;
+  uint64_t next_index;
+  atomic_ullong head;           /* samples before this index are in the ring */
+  atomic_ullong valid_from;     /* since the stream (re)started */
+  atomic_uint max_frame;        /* samples */
+  atomic_int fire;
+  /* the capture, set up by the stream side before capturing is set */
+  atomic_int capturing;
+  struct sddc_trigger_capture capture;
+  uint64_t capture_end;
+  /* capture thread */
+  sem_t sem;
+  pthread_t thread;
+  atomic_int running;
+  int16_t *chunk;
+  atomic_uint captures;
+  atomic_uint ignored_triggers;
+  atomic_ullong captured_samples;
+  atomic_ullong lost_samples;
+  atomic_ullong max_power;      /* mean square */
+} trigger_t;
+
+
+static const double DEFAULT_HISTORY_TIME = 4;   /* s */
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static const uint32_t CHUNK_SAMPLES = 512 * 1024;
+static const int RECORDER_TIMEOUT = 1000;       /* ms - for each buffer */
+static const double FULL_SCALE_POWER = 32768.0 * 32768.0;
+
+
+/* internal functions */
+static int trigger_alloc_history(trigger_t *this);
+static void *trigger_capture_thread(void *arg);
+static void trigger_run_capture(trigger_t *this);
+static void trigger_copy_out(trigger_t *this, int16_t *output,
+                             uint64_t index, uint32_t n);
+static void trigger_zero_fill(trigger_t *this, uint64_t index, uint64_t n);
+static void trigger_copy_in(trigger_t *this, const int16_t *input,
+                            uint64_t index, uint32_t n);
+static uint64_t trigger_mean_square(const int16_t *input, uint32_t n);
+static uint64_t trigger_oldest(trigger_t *this);
+
+
+trigger_t *trigger_open(const struct sddc_trigger_params *params)
+{
+  trigger_t *ret_val = 0;
+
+  double history_time = params->history_time > 0 ? params->history_time :
+                                                   DEFAULT_HISTORY_TIME;
+  if (params->sample_rate <= 0) {
+    fprintf(stderr, "ERROR - trigger_open() failed - no sample rate\n");
+    return ret_val;
+  }
+  if (params->pre_trigger_time < 0 || params->post_trigger_time < 0 ||
+      params->pre_trigger_time > history_time) {
+    fprintf(stderr, "ERROR - trigger_open() failed - the pre-trigger time must be within 0 and the history time\n");
+    return ret_val;
+  }
+  if (params->threshold_db > 0) {
+    fprintf(stderr, "ERROR - trigger_open() failed - threshold above full scale: %f\n",
+            params->threshold_db);
+    return ret_val;
+  }
+
+  trigger_t *this = (trigger_t *) calloc(1, sizeof(trigger_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL0;
+  }
+  this->capacity = (uint64_t) (history_time * params->sample_rate);
+  this->pre_samples = (uint64_t) (params->pre_trigger_time * params->sample_rate);
+  this->post_samples = (uint64_t) (params->post_trigger_time * params->sample_rate);
+  this->threshold = params->threshold_db < 0 ?
+                    FULL_SCALE_POWER * pow(10, params->threshold_db / 10) : 0;
+  this->recorder = params->recorder;
+  this->callback = params->callback;
+  this->callback_context = params->callback_context;
+
+  if (trigger_alloc_history(this) < 0) {
+    goto FAIL1;
+  }
+  this->chunk = (int16_t *) malloc(CHUNK_SAMPLES * sizeof(int16_t));
+  if (this->chunk == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL2;
+  }
+
+  this->started = 0;
+  this->next_index = 0;
+  atomic_init(&this->head, 0);
+  atomic_init(&this->valid_from, 0);
+  atomic_init(&this->max_frame, 0);
+  atomic_init(&this->fire, 0);
+  atomic_init(&this->capturing, 0);
+  atomic_init(&this->captures, 0);
+  atomic_init(&this->ignored_triggers, 0);
+  atomic_init(&this->captured_samples, 0);
+  atomic_init(&this->lost_samples, 0);
+  atomic_init(&this->max_power, 0);
+
+  if (sem_init(&this->sem, 0, 0) < 0) {
+    fprintf(stderr, "ERROR - sem_init() failed: %s\n", strerror(errno));
+    goto FAIL3;
+  }
+  atomic_init(&this->running, 1);
+  int ret = pthread_create(&this->thread, 0, trigger_capture_thread, this);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+    goto FAIL4;
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL4:
+  sem_destroy(&this->sem);
+FAIL3:
+  free(this->chunk);
+FAIL2:
+  munmap(this->history, this->history_size);
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void trigger_close(trigger_t *this)
+{
+  atomic_store(&this->running, 0);
+  sem_post(&this->sem);
+  pthread_join(this->thread, 0);
+  sem_destroy(&this->sem);
+  free(this->chunk);
+  munmap(this->history, this->history_size);
+  free(this);
+  return;
+}
+
+
+int trigger_write(trigger_t *this, const uint8_t *data, uint32_t size,
+                  const struct sddc_frame_info *info)
+{
+  const int16_t *input = (const int16_t *) data;
+  uint32_t n = size / sizeof(int16_t);
+  uint64_t index = info->sample_index;
+  if (n == 0) {
+    return 0;
+  }
+  if (n > atomic_load_explicit(&this->max_frame, memory_order_relaxed)) {
+    atomic_store_explicit(&this->max_frame, n, memory_order_relaxed);
+  }
+
+  if (!this->started || index < this->next_index ||
+      index - this->next_index >= this->capacity) {
+    /* the stream (re)started, or lost more than the whole ring - what is
+       in the ring is of no use; the capture thread must see that before
+       the ring is overwritten */
+    this->started = 1;
+    atomic_store_explicit(&this->valid_from, index, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+  } else {
+    /* the samples the stream lost are zeros, written one frame at a time
+       and published as they go, so that they never reach further past
+       head than trigger_oldest() allows for */
+    uint64_t step = atomic_load_explicit(&this->max_frame, memory_order_relaxed);
+    while (this->next_index < index) {
+      uint64_t m = index - this->next_index < step ? index - this->next_index : step;
+      trigger_zero_fill(this, this->next_index, m);
+      this->next_index += m;
+      atomic_store_explicit(&this->head, this->next_index, memory_order_release);
+    }
+  }
+  trigger_copy_in(this, input, index, n);
+  this->next_index = index + n;
+  atomic_store_explicit(&this->head, this->next_index, memory_order_release);
+
+  uint64_t power = trigger_mean_square(input, n);
+  if (power > atomic_load_explicit(&this->max_power, memory_order_relaxed)) {
+    atomic_store_explicit(&this->max_power, power, memory_order_relaxed);
+  }
+  int fire = atomic_exchange_explicit(&this->fire, 0, memory_order_relaxed);
+  int energy = this->threshold > 0 && power > this->threshold;
+  if (!fire && !energy) {
+    if (atomic_load_explicit(&this->capturing, memory_order_relaxed)) {
+      /* more samples for the capture thread */
+      sem_post(&this->sem);
+    }
+    return 0;
+  }
+  if (atomic_load_explicit(&this->capturing, memory_order_acquire)) {
+    atomic_fetch_add_explicit(&this->ignored_triggers, 1, memory_order_relaxed);
+    sem_post(&this->sem);
+    return 0;
+  }
+
+  uint64_t first = index > this->pre_samples ? index - this->pre_samples : 0;
+  uint64_t oldest = trigger_oldest(this);
+  this->capture.capture = atomic_load_explicit(&this->captures, memory_order_relaxed);
+  this->capture.external = fire;
+  this->capture.power_db = power > 0 ? 10 * log10(power / FULL_SCALE_POWER) : -INFINITY;
+  this->capture.trigger_sample_index = index;
+  this->capture.first_sample_index = first > oldest ? first : oldest;
+  this->capture.num_samples = 0;
+  this->capture.lost_samples = 0;
+  this->capture_end = index + this->post_samples;
+  atomic_store_explicit(&this->capturing, 1, memory_order_release);
+  sem_post(&this->sem);
+  return 0;
+}
+
+
+void trigger_fire(trigger_t *this)
+{
+  atomic_store_explicit(&this->fire, 1, memory_order_relaxed);
+  return;
+}
+
+
+int trigger_get_stats(trigger_t *this, struct sddc_trigger_stats *stats)
+{
+  stats->captures = atomic_load(&this->captures);
+  stats->ignored_triggers = atomic_load(&this->ignored_triggers);
+  stats->captured_samples = atomic_load(&this->captured_samples);
+  stats->lost_samples = atomic_load(&this->lost_samples);
+  uint64_t power = atomic_exchange(&this->max_power, 0);
+  stats->max_power_db = power > 0 ? 10 * log10(power / FULL_SCALE_POWER) : -INFINITY;
+  stats->huge_pages = this->huge_pages;
+  return 0;
+}
+
+
+/* internal functions */
+static int trigger_alloc_history(trigger_t *this)
+{
+  size_t size = this->capacity * sizeof(int16_t);
+  /* huge pages first, then the transparent ones if the kernel is willing */
+  size_t huge_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  void *history = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  history = mmap(0, huge_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (history != MAP_FAILED) {
+    this->huge_pages = 1;
+    size = huge_size;
+  } else {
+    history = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (history == MAP_FAILED) {
+      fprintf(stderr, "ERROR - mmap() of %zu bytes of history failed: %s\n",
+              size, strerror(errno));
+      return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(history, size, MADV_HUGEPAGE);
+#endif
+    this->huge_pages = 0;
+  }
+  /* fault the pages in now, not in the stream callback */
+  memset(history, 0, size);
+  this->history = (int16_t *) history;
+  this->history_size = size;
+  return 0;
+}
+
+static void *trigger_capture_thread(void *arg)
+{
+  trigger_t *this = (trigger_t *) arg;
+  while (1) {
+    if (sem_wait(&this->sem) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR - sem_wait() failed: %s\n", strerror(errno));
+      break;
+    }
+    if (atomic_load_explicit(&this->capturing, memory_order_acquire)) {
+      trigger_run_capture(this);
+    }
+    if (!atomic_load(&this->running)) {
+      break;
+    }
+  }
+  return 0;
+}
+
+/* returns when the capture is done, or when it has to wait for the
+   stream */
+static void trigger_run_capture(trigger_t *this)
+{
+  struct sddc_trigger_capture *capture = &this->capture;
+  while (1) {
+    uint64_t next = capture->first_sample_index + capture->num_samples +
+                    capture->lost_samples;
+    uint64_t head = atomic_load_explicit(&this->head, memory_order_acquire);
+    int running = atomic_load(&this->running);
+    /* the stream restarted (or we are closing): whatever is left is not
+       coming */
+    uint64_t end = this->capture_end;
+    if (head < next) {
+      end = next;
+    } else if (!running && head < end) {
+      end = head;
+    }
+    if (next >= end) {
+      break;
+    }
+    if (next >= head) {
+      /* wait for the stream */
+      return;
+    }
+
+    uint64_t oldest = trigger_oldest(this);
+    if (next < oldest) {
+      uint64_t lost = (oldest < end ? oldest : end) - next;
+      capture->lost_samples += lost;
+      continue;
+    }
+    uint64_t limit = head < end ? head : end;
+    uint32_t n = limit - next < CHUNK_SAMPLES ? (uint32_t) (limit - next) : CHUNK_SAMPLES;
+    trigger_copy_out(this, this->chunk, next, n);
+    /* the copy must be done before head is read again */
+    atomic_thread_fence(memory_order_acquire);
+    if (next < trigger_oldest(this)) {
+      /* overwritten while we were copying it */
+      capture->lost_samples += n;
+      continue;
+    }
+    if (recorder_write_wait(this->recorder, (const uint8_t *) this->chunk,
+                            n * sizeof(int16_t), RECORDER_TIMEOUT) < 0) {
+      capture->lost_samples += n;
+      continue;
+    }
+    capture->num_samples += n;
+  }
+
+  /* the first sample index of what was actually written */
+  if (capture->num_samples == 0) {
+    capture->first_sample_index += capture->lost_samples;
+  }
+  atomic_fetch_add(&this->captured_samples, capture->num_samples);
+  atomic_fetch_add(&this->lost_samples, capture->lost_samples);
+  if (this->callback) {
+    this->callback(capture, this->callback_context);
+  }
+  atomic_fetch_add(&this->captures, 1);
+  atomic_store_explicit(&this->capturing, 0, memory_order_release);
+  return;
+}
+
+static void trigger_copy_out(trigger_t *this, int16_t *output,
+                             uint64_t index, uint32_t n)
+{
+  while (n > 0) {
+    uint64_t position = index % this->capacity;
+    uint64_t m = this->capacity - position;
+    m = m < n ? m : n;
+    memcpy(output, this->history + position, m * sizeof(int16_t));
+    output += m;
+    index += m;
+    n -= (uint32_t) m;
+  }
+}
+
+static void trigger_zero_fill(trigger_t *this, uint64_t index, uint64_t n)
+{
+  while (n > 0) {
+    uint64_t position = index % this->capacity;
+    uint64_t m = this->capacity - position;
+    m = m < n ? m : n;
+    memset(this->history + position, 0, m * sizeof(int16_t));
+    index += m;
+    n -= m;
+  }
+}
+
+static void trigger_copy_in(trigger_t *this, const int16_t *input,
+                            uint64_t index, uint32_t n)
+{
+  /* a frame larger than the whole history leaves just its tail */
+  if (n > this->capacity) {
+    input += n - this->capacity;
+    index += n - this->capacity;
+    n = (uint32_t) this->capacity;
+  }
+  while (n > 0) {
+    uint64_t position = index % this->capacity;
+    uint64_t m = this->capacity - position;
+    m = m < n ? m : n;
+    memcpy(this->history + position, input, m * sizeof(int16_t));
+    input += m;
+    index += m;
+    n -= (uint32_t) m;
+  }
+}
+
+/* the energy detector: a plain loop the compiler vectorizes */
+static uint64_t trigger_mean_square(const int16_t *input, uint32_t n)
+{
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    int32_t x = input[i];
+    sum += (uint32_t) (x * x);
+  }
+  return sum / n;
+}
+
+/* the first sample index the capture thread can still copy out of the
+   ring: the stream might be writing a frame past head right now */
+static uint64_t trigger_oldest(trigger_t *this)
+{
+  uint64_t head = atomic_load_explicit(&this->head, memory_order_acquire);
+  uint64_t valid_from = atomic_load_explicit(&this->valid_from,
+                                             memory_order_relaxed);
+  uint64_t reach = this->capacity -
+                   atomic_load_explicit(&this->max_frame, memory_order_relaxed);
+  uint64_t oldest = head > reach ? head - reach : 0;
+  return oldest > valid_from ? oldest : valid_from;
+}
@@ -0,0 +1,53 @@
+/*
+ * trigger.h - trigger capture from a pre-trigger history in memory
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __TRIGGER_H
+#define __TRIGGER_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sddc_trigger trigger_t;
+
+trigger_t *trigger_open(const struct sddc_trigger_params *params);
+
+void trigger_close(trigger_t *this);
+
+/* producer side - never blocks */
+int trigger_write(trigger_t *this, const uint8_t *data, uint32_t size,
+                  const struct sddc_frame_info *info);
+
+/* any thread */
+void trigger_fire(trigger_t *this);
+
+int trigger_get_stats(trigger_t *this, struct sddc_trigger_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRIGGER_H */
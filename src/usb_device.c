@@ -33,12 +33,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <libusb.h>
 
 #include "usb_device.h"
 #include "usb_device_internals.h"
-#include "ezusb.h"
 #include "logging.h"
+#include "trace.h"
 
 
 typedef struct usb_device usb_device_t;
@@ -46,14 +47,66 @@ typedef struct usb_device usb_device_t;
 /* internal functions */
 static libusb_device_handle *find_usb_device(int index, libusb_context *ctx,
                              libusb_device **device, int *needs_firmware);
+static int usb_device_present(int index, libusb_context *ctx,
+                              int needs_firmware);
+static libusb_device_handle *wait_for_usb_device(int index,
+                             libusb_context *ctx, libusb_device **device,
+                             int needs_firmware);
+static int firmware_is_running(libusb_device_handle *dev_handle);
 static int load_image(libusb_device_handle *dev_handle,
                       const char *imagefile);
+static struct firmware_image *firmware_image_get(const char *imagefile);
+static void firmware_image_put(struct firmware_image *image);
 static int validate_image(const uint8_t *image, const size_t size);
 static int transfer_image(const uint8_t *image,
                           libusb_device_handle *dev_handle);
 static int list_endpoints(struct libusb_endpoint_descriptor endpoints[],
                           struct libusb_ss_endpoint_companion_descriptor ss_endpoints[],
                           libusb_device *device);
+static usb_device_t *open_replay_device(const char *path,
+                                        uint16_t gpio_register);
+static usb_device_t *open_net_device(const char *url,
+                                     uint16_t gpio_register);
+static usb_device_t *open_shm_device(const char *url,
+                                     uint16_t gpio_register);
+static usb_device_t *open_virtual_device(replay_t *replay,
+                                         net_receiver_t *net_receiver,
+                                         shm_reader_t *shm_reader,
+                                         uint16_t gpio_register);
+static int is_virtual_device(const char *imagefile);
+static int virtual_device_control(usb_device_t *this, uint8_t request,
+                                  uint8_t *data, uint16_t length);
+static int usb_device_control_request(usb_device_t *this, uint8_t request,
+                                      uint16_t value, uint16_t index,
+                                      uint8_t *data, uint16_t length);
+static struct control_batch *control_batch_open(usb_device_t *this);
+static int control_batch_add(struct control_batch *batch, uint8_t request,
+                             uint16_t value, uint16_t index, uint8_t *data,
+                             uint16_t length);
+static int control_batch_submit(struct control_batch *batch,
+                                usb_device_control_cb_t callback,
+                                void *context);
+static void LIBUSB_CALL control_batch_callback(struct libusb_transfer *transfer);
+
+
+#define MAX_CONTROL_DATA (256)
+
+struct control_request {
+  uint8_t request;
+  uint16_t value;
+  uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE + MAX_CONTROL_DATA];
+};
+
+struct control_batch {
+  usb_device_t *usb_device;
+  uint32_t num_requests;
+  struct control_request requests[MAX_BATCH_REQUESTS];
+  struct libusb_transfer *transfers[MAX_BATCH_REQUESTS];
+  uint32_t remaining;
+  int failed;
+  usb_device_control_cb_t callback;
+  void *callback_context;
+};
 
 
 struct usb_device_id {
@@ -63,6 +116,35 @@ struct usb_device_id {
 };
 
 
+/* the firmware images read so far, so that opening several receivers (or
+   the same one again) does not go back to the file every time; an image
+   stays in use until its last upload is done even if the file changed */
+struct firmware_image {
+  char *path;
+  dev_t st_dev;
+  ino_t st_ino;
+  off_t st_size;
+  struct timespec st_mtim;
+  uint8_t *data;
+  size_t size;
+  int refcount;                 /* the cache holds one */
+  struct firmware_image *next;
+};
+
+static pthread_mutex_t firmware_images_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct firmware_image *firmware_images = 0;
+
+static const int FIRMWARE_POLL_INTERVAL = 10;   /* ms */
+static const int FIRMWARE_TIMEOUT = 5000;       /* ms - for re-enumeration */
+
+
+static const char REPLAY_PREFIX[] = "file://";
+static const int REPLAY_PREFIX_LENGTH = sizeof(REPLAY_PREFIX) - 1;
+static const char NET_UDP_PREFIX[] = "udp://";
+static const char NET_TCP_PREFIX[] = "tcp://";
+static const char SHM_PREFIX[] = "shm://";
+
+
 static struct usb_device_id usb_device_ids[] = {
   { 0x04b4, 0x00f3, 1 },     /* Cypress / FX3 Boot-loader */
   { 0x04b4, 0x00f1, 0 }      /* Cypress / FX3 Streamer Example */
@@ -236,12 +318,68 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
                               uint16_t gpio_register)
 {
   usb_device_t *ret_val = 0;
-  libusb_context *ctx = 0;
 
+  if (imagefile && strncmp(imagefile, REPLAY_PREFIX, REPLAY_PREFIX_LENGTH) == 0) {
+    return open_replay_device(imagefile + REPLAY_PREFIX_LENGTH, gpio_register);
+  }
+  if (imagefile && strncmp(imagefile, SHM_PREFIX, sizeof(SHM_PREFIX) - 1) == 0) {
+    return open_shm_device(imagefile, gpio_register);
+  }
+  if (imagefile && is_virtual_device(imagefile)) {
+    return open_net_device(imagefile, gpio_register);
+  }
+
+  libusb_context *ctx = usb_device_open_context();
+  if (ctx == 0) {
+    return ret_val;
+  }
+  ret_val = usb_device_open_shared(ctx, index, imagefile, gpio_register);
+  if (ret_val == 0) {
+    libusb_exit(ctx);
+    return ret_val;
+  }
+  ret_val->owns_context = 1;
+  return ret_val;
+}
+
+
+libusb_context *usb_device_open_context()
+{
+  libusb_context *ctx = 0;
   int ret = libusb_init(&ctx);
   if (ret < 0) {
     log_usb_error(ret, __func__, __FILE__, __LINE__);
-    goto FAIL0;
+    return 0;
+  }
+  return ctx;
+}
+
+
+void usb_device_close_context(libusb_context *context)
+{
+  libusb_exit(context);
+  return;
+}
+
+
+int usb_device_handle_context_events_timeout(libusb_context *context,
+                                             int timeout_ms)
+{
+  struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+  return libusb_handle_events_timeout_completed(context, &timeout, 0);
+}
+
+
+usb_device_t *usb_device_open_shared(libusb_context *ctx, int index,
+                                     const char* imagefile,
+                                     uint16_t gpio_register)
+{
+  usb_device_t *ret_val = 0;
+  int ret;
+
+  if (imagefile && is_virtual_device(imagefile)) {
+    fprintf(stderr, "ERROR - file://, udp://, tcp:// and shm:// devices cannot share a context\n");
+    goto FAIL1;
   }
 
   libusb_device *device;
@@ -251,6 +389,28 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
     goto FAIL1;
   }
 
+  /* a device left running the firmware (by a previous run, or by another
+     instance that was killed) is used as is if the firmware answers;
+     otherwise it goes back to the boot loader for a fresh load */
+  if (!needs_firmware && !firmware_is_running(dev_handle)) {
+    if (imagefile == 0) {
+      log_error("firmware not responding and no image file", __func__, __FILE__, __LINE__);
+      goto FAIL2;
+    }
+    fprintf(stderr, "WARNING - firmware not responding - resetting device\n");
+    const uint8_t bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+    uint8_t dummy[] = { 0 };
+    /* the device drops off the bus, so the request may well fail */
+    libusb_control_transfer(dev_handle, bmRequestType, RESETFX3, 0, 0,
+                            dummy, sizeof(dummy), 1000);
+    libusb_close(dev_handle);
+    dev_handle = wait_for_usb_device(index, ctx, &device, 1);
+    if (dev_handle == 0) {
+      goto FAIL1;
+    }
+    needs_firmware = 1;
+  }
+
   if (needs_firmware) {
     ret = load_image(dev_handle, imagefile);
     if (ret != 0) {
@@ -258,21 +418,12 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
       goto FAIL2;
     }
 
-    /* rescan USB to get a new device handle */
+    /* rescan USB to get a new device handle once the firmware is up */
     libusb_close(dev_handle);
-
-    /* wait unitl firmware is ready */
-    usleep(500 * 1000L);
-
-    needs_firmware = 0;
-    dev_handle = find_usb_device(index, ctx, &device, &needs_firmware);
+    dev_handle = wait_for_usb_device(index, ctx, &device, 0);
     if (dev_handle == 0) {
       goto FAIL1;
     }
-    if (needs_firmware) {
-      log_error("device is still in boot loader mode", __func__, __FILE__, __LINE__);
-      goto FAIL2;
-    }
   }
 
   int speed = libusb_get_device_speed(device);
@@ -313,6 +464,7 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
   this->dev = device;
   this->dev_handle = dev_handle;
   this->context = ctx;
+  this->owns_context = 0;
   this->completed = 0;
   this->nendpoints = nendpoints;
   memset(this->endpoints, 0, sizeof(this->endpoints));
@@ -323,8 +475,16 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
   this->bulk_in_endpoint_address = bulk_in_endpoint_address;
   this->bulk_in_max_packet_size = bulk_in_max_packet_size;
   this->bulk_in_max_burst = bulk_in_max_burst;
-  this->gpio_register = gpio_register;
-  memset(this->fw_registers, 0, sizeof(this->fw_registers));
+  atomic_init(&this->gpio_register, gpio_register);
+  for (int i = 0; i < MAX_FW_REGISTERS; ++i) {
+    atomic_init(&this->fw_registers[i], 0);
+  }
+  this->replay = 0;
+  this->net_receiver = 0;
+  this->shm_reader = 0;
+  pthread_mutex_init(&this->batch_mutex, 0);
+  this->batch = 0;
+  atomic_init(&this->pending_batches, 0);
 
   ret_val = this;
   return ret_val;
@@ -332,29 +492,101 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
 FAIL2:
   libusb_close(dev_handle);
 FAIL1:
-  libusb_exit(0);
-FAIL0:
   return ret_val;
 }
 
 
 void usb_device_close(usb_device_t *this)
 {
+  if (this->batch) {
+    free(this->batch);
+    this->batch = 0;
+  }
+  usb_device_wait_batches(this);
+  pthread_mutex_destroy(&this->batch_mutex);
+  if (this->replay) {
+    replay_close(this->replay);
+    free(this);
+    return;
+  }
+  if (this->net_receiver) {
+    net_receiver_close(this->net_receiver);
+    free(this);
+    return;
+  }
+  if (this->shm_reader) {
+    shm_reader_close(this->shm_reader);
+    free(this);
+    return;
+  }
   libusb_close(this->dev_handle);
+  if (this->owns_context) {
+    libusb_exit(this->context);
+  }
   free(this);
-  libusb_exit(0);
   return;
 }
 
 
 int usb_device_handle_events(usb_device_t *this)
 {
+  if (this->replay) {
+    return replay_handle_events(this->replay, -1);
+  }
+  if (this->net_receiver) {
+    return net_receiver_handle_events(this->net_receiver, -1);
+  }
+  if (this->shm_reader) {
+    return shm_reader_handle_events(this->shm_reader, -1);
+  }
   return libusb_handle_events_completed(this->context, &this->completed);
 }
 
 
+int usb_device_handle_events_timeout(usb_device_t *this, int timeout_ms)
+{
+  if (this->replay) {
+    return replay_handle_events(this->replay, timeout_ms);
+  }
+  if (this->net_receiver) {
+    return net_receiver_handle_events(this->net_receiver, timeout_ms);
+  }
+  if (this->shm_reader) {
+    return shm_reader_handle_events(this->shm_reader, timeout_ms);
+  }
+  struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+  return libusb_handle_events_timeout_completed(this->context, &timeout,
+                                                &this->completed);
+}
+
+
 int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
-                       uint16_t index, uint8_t *data, uint16_t length) {
+                       uint16_t index, uint8_t *data, uint16_t length)
+{
+  TRACE(CONTROL, request, ((uint32_t) value << 16) | index);
+  /* only the thread that began the batch queues into it - the others
+     keep sending their requests right away */
+  int batched = 0;
+  int ret = 0;
+  pthread_mutex_lock(&this->batch_mutex);
+  if (this->batch && pthread_equal(this->batch_owner, pthread_self())) {
+    batched = 1;
+    ret = control_batch_add(this->batch, request, value, index, data, length);
+  }
+  pthread_mutex_unlock(&this->batch_mutex);
+  if (!batched) {
+    ret = usb_device_control_request(this, request, value, index, data,
+                                     length);
+  }
+  TRACE(CONTROL_DONE, request, ret);
+  return ret;
+}
+
+
+static int usb_device_control_request(usb_device_t *this, uint8_t request,
+                                      uint16_t value, uint16_t index,
+                                      uint8_t *data, uint16_t length)
+{
 
   const uint8_t bmWriteRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
   const uint8_t bmReadRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
@@ -362,6 +594,10 @@ int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
 
   uint8_t dummy[] = { 0 };
 
+  if (this->replay || this->net_receiver || this->shm_reader) {
+    return virtual_device_control(this, request, data, length);
+  }
+
   int ret;
   switch (request) {
     case STARTFX3:
@@ -417,41 +653,303 @@ int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
 }
 
 
+int usb_device_submit_transfer(usb_device_t *this,
+                               struct libusb_transfer *transfer)
+{
+  if (this->replay || this->net_receiver || this->shm_reader) {
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+      /* applied now - the completion comes from the event loop */
+      struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+      int ret = virtual_device_control(this, setup->bRequest,
+                                       libusb_control_transfer_get_data(transfer),
+                                       libusb_le16_to_cpu(setup->wLength));
+      if (ret < 0) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+      }
+    }
+    if (this->net_receiver) {
+      return net_receiver_submit_transfer(this->net_receiver, transfer);
+    }
+    if (this->shm_reader) {
+      return shm_reader_submit_transfer(this->shm_reader, transfer);
+    }
+    return replay_submit_transfer(this->replay, transfer);
+  }
+  return libusb_submit_transfer(transfer);
+}
+
+
+int usb_device_cancel_transfer(usb_device_t *this,
+                               struct libusb_transfer *transfer)
+{
+  if (this->replay) {
+    return replay_cancel_transfer(this->replay, transfer);
+  }
+  if (this->net_receiver) {
+    return net_receiver_cancel_transfer(this->net_receiver, transfer);
+  }
+  if (this->shm_reader) {
+    return shm_reader_cancel_transfer(this->shm_reader, transfer);
+  }
+  return libusb_cancel_transfer(transfer);
+}
+
+
+int usb_device_bulk_transfer(usb_device_t *this, uint8_t *data, int length,
+                             int *transferred, unsigned int timeout_ms)
+{
+  if (this->replay) {
+    return replay_bulk_transfer(this->replay, data, length, transferred,
+                                timeout_ms);
+  }
+  if (this->net_receiver) {
+    return net_receiver_bulk_transfer(this->net_receiver, data, length,
+                                      transferred, timeout_ms);
+  }
+  if (this->shm_reader) {
+    return shm_reader_bulk_transfer(this->shm_reader, data, length,
+                                    transferred, timeout_ms);
+  }
+  return libusb_bulk_transfer(this->dev_handle, this->bulk_in_endpoint_address,
+                              data, length, transferred, timeout_ms);
+}
+
+
+replay_t *usb_device_get_replay(usb_device_t *this)
+{
+  return this->replay;
+}
+
+
+net_receiver_t *usb_device_get_net_receiver(usb_device_t *this)
+{
+  return this->net_receiver;
+}
+
+
+shm_reader_t *usb_device_get_shm_reader(usb_device_t *this)
+{
+  return this->shm_reader;
+}
+
+
+int usb_device_control_batch_begin(usb_device_t *this)
+{
+  int ret_val = -1;
+  pthread_mutex_lock(&this->batch_mutex);
+  if (this->batch) {
+    fprintf(stderr, "ERROR - usb_device_control_batch_begin() failed - batch already open\n");
+    goto FAIL0;
+  }
+  this->batch = control_batch_open(this);
+  if (this->batch == 0) {
+    goto FAIL0;
+  }
+  this->batch_owner = pthread_self();
+  ret_val = 0;
+
+FAIL0:
+  pthread_mutex_unlock(&this->batch_mutex);
+  return ret_val;
+}
+
+
+int usb_device_control_batch_commit(usb_device_t *this,
+                                    usb_device_control_cb_t callback,
+                                    void *context)
+{
+  pthread_mutex_lock(&this->batch_mutex);
+  struct control_batch *batch = this->batch;
+  if (batch && !pthread_equal(this->batch_owner, pthread_self())) {
+    batch = 0;
+  }
+  if (batch) {
+    this->batch = 0;
+  }
+  pthread_mutex_unlock(&this->batch_mutex);
+  if (batch == 0) {
+    fprintf(stderr, "ERROR - usb_device_control_batch_commit() failed - no batch open by this thread\n");
+    return -1;
+  }
+  return control_batch_submit(batch, callback, context);
+}
+
+
+int usb_device_control_async(usb_device_t *this, uint8_t request,
+                             uint16_t value, uint16_t index, uint8_t *data,
+                             uint16_t length, usb_device_control_cb_t callback,
+                             void *context)
+{
+  TRACE(CONTROL, request, ((uint32_t) value << 16) | index);
+  struct control_batch *batch = control_batch_open(this);
+  if (batch == 0) {
+    return -1;
+  }
+  if (control_batch_add(batch, request, value, index, data, length) < 0) {
+    free(batch);
+    return -1;
+  }
+  return control_batch_submit(batch, callback, context);
+}
+
+
+void usb_device_wait_batches(usb_device_t *this)
+{
+  /* the batches in flight time out on their own, so this loop ends */
+  while (atomic_load(&this->pending_batches) > 0) {
+    usb_device_handle_events_timeout(this, 100);
+  }
+  return;
+}
+
+
+struct control_all_state {
+  int remaining;
+  int failed;
+  int completed;
+};
+
+static void LIBUSB_CALL control_all_callback(struct libusb_transfer *transfer)
+{
+  struct control_all_state *state = (struct control_all_state *) transfer->user_data;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    log_usb_error(transfer->status, __func__, __FILE__, __LINE__);
+    state->failed++;
+  }
+  if (--state->remaining == 0) {
+    state->completed = 1;
+  }
+  return;
+}
+
+int usb_device_control_all(usb_device_t **devices, int num_devices,
+                           uint8_t request)
+{
+  const uint8_t bmWriteRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+  const unsigned int timeout = 5000;        // timeout (in ms) for each command
+
+  int ret_val = -1;
+
+  if (num_devices <= 0) {
+    return 0;
+  }
+  switch (request) {
+    case STARTFX3:
+    case STOPFX3:
+      break;
+    default:
+      fprintf(stderr, "ERROR - usb_device_control_all() - unsupported request: 0x%02x\n",
+              request);
+      return ret_val;
+  }
+
+  /* one dummy data byte, like usb_device_control() */
+  struct libusb_transfer **transfers = (struct libusb_transfer **) calloc(num_devices, sizeof(struct libusb_transfer *));
+  uint8_t *buffers = (uint8_t *) calloc(num_devices, LIBUSB_CONTROL_SETUP_SIZE + 1);
+  if (transfers == 0 || buffers == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL0;
+  }
+  struct control_all_state state = { 0, 0, 0 };
+  for (int i = 0; i < num_devices; ++i) {
+    transfers[i] = libusb_alloc_transfer(0);
+    if (transfers[i] == 0) {
+      log_error("libusb_alloc_transfer() failed", __func__, __FILE__, __LINE__);
+      goto FAIL1;
+    }
+    uint8_t *buffer = buffers + i * (LIBUSB_CONTROL_SETUP_SIZE + 1);
+    libusb_fill_control_setup(buffer, bmWriteRequestType, request, 0, 0, 1);
+    libusb_fill_control_transfer(transfers[i], devices[i]->dev_handle, buffer,
+                                 control_all_callback, &state, timeout);
+  }
+
+  /* everything is ready - now submit them as close together as we can */
+  int submitted = 0;
+  for (; submitted < num_devices; ++submitted) {
+    state.remaining++;
+    int ret = libusb_submit_transfer(transfers[submitted]);
+    if (ret < 0) {
+      state.remaining--;
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      break;
+    }
+  }
+  /* the transfers time out on their own, so this loop ends */
+  while (state.remaining > 0) {
+    int ret = libusb_handle_events_completed(devices[0]->context,
+                                             &state.completed);
+    if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+    }
+  }
+  if (submitted == num_devices && state.remaining == 0 && state.failed == 0) {
+    ret_val = 0;
+  }
+
+FAIL1:
+  for (int i = 0; i < num_devices; ++i) {
+    if (transfers[i]) {
+      libusb_free_transfer(transfers[i]);
+    }
+  }
+FAIL0:
+  free(buffers);
+  free(transfers);
+  return ret_val;
+}
+
+
 uint16_t usb_device_gpio_get(usb_device_t *this) {
-  return this->gpio_register;
+  return atomic_load(&this->gpio_register);
+}
+
+
+/* lock free: the shadow register is updated atomically, and its value
+   sent until no other thread has changed it in the meantime, so that the
+   last value sent is the last one written */
+static int usb_device_gpio_send(usb_device_t *this) {
+  uint16_t gpio_register = atomic_load(&this->gpio_register);
+  for (;;) {
+    int ret = usb_device_control(this, GPIOFX3, 0, 0,
+                                 (uint8_t *) &gpio_register,
+                                 sizeof(gpio_register));
+    if (ret < 0) {
+      return ret;
+    }
+    uint16_t current = atomic_load(&this->gpio_register);
+    if (current == gpio_register) {
+      return 0;
+    }
+    gpio_register = current;
+  }
 }
 
 
 int usb_device_gpio_set(usb_device_t *this, uint16_t bit_pattern,
                         uint16_t bit_mask) {
-  this->gpio_register = (this->gpio_register & ~bit_mask) | bit_pattern;
-  return usb_device_control(this, GPIOFX3, 0, 0,
-                            (uint8_t *) &this->gpio_register,
-                            sizeof(this->gpio_register));
+  uint16_t gpio_register = atomic_load(&this->gpio_register);
+  while (!atomic_compare_exchange_weak(&this->gpio_register, &gpio_register,
+                                       (gpio_register & ~bit_mask) | bit_pattern))
+    ;
+  return usb_device_gpio_send(this);
 }
 
 
 int usb_device_gpio_on(usb_device_t *this, uint16_t bit_pattern) {
-  this->gpio_register |= bit_pattern;
-  return usb_device_control(this, GPIOFX3, 0, 0,
-                            (uint8_t *) &this->gpio_register,
-                            sizeof(this->gpio_register));
+  atomic_fetch_or(&this->gpio_register, bit_pattern);
+  return usb_device_gpio_send(this);
 }
 
 
 int usb_device_gpio_off(usb_device_t *this, uint16_t bit_pattern) {
-  this->gpio_register &= ~bit_pattern;
-  return usb_device_control(this, GPIOFX3, 0, 0,
-                            (uint8_t *) &this->gpio_register,
-                            sizeof(this->gpio_register));
+  atomic_fetch_and(&this->gpio_register, (uint16_t) ~bit_pattern);
+  return usb_device_gpio_send(this);
 }
 
 
 int usb_device_gpio_toggle(usb_device_t *this, uint16_t bit_pattern) {
-  this->gpio_register ^= bit_pattern;
-  return usb_device_control(this, GPIOFX3, 0, 0,
-                            (uint8_t *) &this->gpio_register,
-                            sizeof(this->gpio_register));
+  atomic_fetch_xor(&this->gpio_register, bit_pattern);
+  return usb_device_gpio_send(this);
 }
 
 
@@ -482,12 +980,13 @@ int usb_device_i2c_read(usb_device_t *this, uint8_t i2c_address,
 }
 
 
-/* firmware registers */
+/* firmware registers - lock free, like the GPIO register */
 uint16_t usb_device_get_fw_register(usb_device_t *this, uint16_t address) {
   if (address >= MAX_FW_REGISTERS) {
     fprintf(stderr, "ERROR - usb_device_get_fw_register() failed - invalid register address: %d\n", address);
+    return 0;
   }
-  return this->fw_registers[address];
+  return atomic_load(&this->fw_registers[address]);
 }
 
 
@@ -495,13 +994,51 @@ int usb_device_set_fw_register(usb_device_t *this, uint16_t address,
                                     uint16_t value) {
   if (address >= MAX_FW_REGISTERS) {
     fprintf(stderr, "ERROR - usb_device_set_fw_register() failed - invalid register address: %d\n", address);
+    return -1;
   }
-  int ret = usb_device_control(this, SETARGFX3, address, value, 0, 0);
+  uint16_t previous = atomic_exchange(&this->fw_registers[address], value);
+  uint16_t sent = value;
+  for (;;) {
+    int ret = usb_device_control(this, SETARGFX3, address, sent, 0, 0);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - usb_device_control(SETARGFX3) failed\n");
+      /* unless somebody else has written it since */
+      atomic_compare_exchange_strong(&this->fw_registers[address], &value,
+                                     previous);
+      return -1;
+    }
+    uint16_t current = atomic_load(&this->fw_registers[address]);
+    if (current == sent) {
+      return 0;
+    }
+    sent = current;
+  }
+}
+
+
+int usb_device_set_fw_register_async(usb_device_t *this, uint16_t address,
+                                     uint16_t value,
+                                     usb_device_control_cb_t callback,
+                                     void *context) {
+  if (address >= MAX_FW_REGISTERS) {
+    fprintf(stderr, "ERROR - usb_device_set_fw_register_async() failed - invalid register address: %d\n", address);
+    return -1;
+  }
+  uint16_t previous = atomic_exchange(&this->fw_registers[address], value);
+  int ret = usb_device_control_async(this, SETARGFX3, address, value, 0, 0,
+                                     callback, context);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(SETARGFX3) failed\n");
+    fprintf(stderr, "ERROR - usb_device_control_async(SETARGFX3) failed\n");
+    atomic_compare_exchange_strong(&this->fw_registers[address], &value,
+                                   previous);
     return -1;
   }
-  this->fw_registers[address] = value;
+  /* written by another thread while this one was being submitted: that
+     one may reach the device first, so it is sent again after this */
+  uint16_t current = atomic_load(&this->fw_registers[address]);
+  if (current != value) {
+    usb_device_control_async(this, SETARGFX3, address, current, 0, 0, 0, 0);
+  }
   return 0;
 }
 
@@ -585,70 +1122,234 @@ FAIL0:
 }
 
 
+static int usb_device_present(int index, libusb_context *ctx,
+                              int needs_firmware)
+{
+  libusb_device **list = 0;
+  ssize_t nusbdevices = libusb_get_device_list(ctx, &list);
+  if (nusbdevices < 0) {
+    log_usb_error(nusbdevices, __func__, __FILE__, __LINE__);
+    return -1;
+  }
+
+  int present = 0;
+  int count = 0;
+  for (ssize_t j = 0; j < nusbdevices; ++j) {
+    struct libusb_device_descriptor desc;
+    libusb_get_device_descriptor(list[j], &desc);
+    for (int i = 0; i < n_usb_device_ids; ++i) {
+      if (desc.idVendor == usb_device_ids[i].vid &&
+          desc.idProduct == usb_device_ids[i].pid) {
+        if (count == index) {
+          present = usb_device_ids[i].needs_firmware == needs_firmware;
+        }
+        count++;
+      }
+    }
+  }
+  libusb_free_device_list(list, 1);
+  return present;
+}
+
+
+/* polls until the device comes back in the mode wanted (boot loader or
+   firmware) after a reset or a firmware load */
+static libusb_device_handle *wait_for_usb_device(int index,
+                             libusb_context *ctx, libusb_device **device,
+                             int needs_firmware)
+{
+  for (int elapsed = 0; elapsed < FIRMWARE_TIMEOUT;
+       elapsed += FIRMWARE_POLL_INTERVAL) {
+    usleep(FIRMWARE_POLL_INTERVAL * 1000L);
+    int ret = usb_device_present(index, ctx, needs_firmware);
+    if (ret < 0) {
+      return 0;
+    }
+    if (ret == 0) {
+      continue;
+    }
+    int found_needs_firmware = 0;
+    libusb_device_handle *dev_handle = find_usb_device(index, ctx, device,
+                                                       &found_needs_firmware);
+    if (dev_handle == 0 || found_needs_firmware == needs_firmware) {
+      return dev_handle;
+    }
+    /* it went away again between the two scans */
+    libusb_close(dev_handle);
+  }
+  fprintf(stderr, "ERROR - usb_device@%d still %s after %d ms\n", index,
+          needs_firmware ? "not in boot loader mode" : "in boot loader mode",
+          FIRMWARE_TIMEOUT);
+  return 0;
+}
+
+
+/* the firmware answers TESTFX3 with the hardware model and firmware
+   version; anything else is either some other firmware or a hung one */
+static int firmware_is_running(libusb_device_handle *dev_handle)
+{
+  const uint8_t bmReadRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+  const unsigned int timeout = 1000;        // timeout (in ms)
+
+  uint8_t data[4];
+  int ret = libusb_control_transfer(dev_handle, bmReadRequestType, TESTFX3,
+                                    0, 0, data, sizeof(data), timeout);
+  if (ret < 0) {
+    log_usb_warning(ret, __func__, __FILE__, __LINE__);
+    return 0;
+  }
+  if (ret != sizeof(data)) {
+    fprintf(stderr, "WARNING - unexpected TESTFX3 response\n");
+    return 0;
+  }
+  return 1;
+}
+
+
 int load_image(libusb_device_handle *dev_handle, const char *imagefile)
 {
-  int ret_val = -1;
+  if (imagefile == 0) {
+    fprintf(stderr, "ERROR - device in boot loader mode and no image file\n");
+    return -1;
+  }
+
+  struct firmware_image *image = firmware_image_get(imagefile);
+  if (image == 0) {
+    fprintf(stderr, "ERROR - firmware_image_get() failed\n");
+    return -1;
+  }
+
+  int ret_val = 0;
+  if (transfer_image(image->data, dev_handle) < 0) {
+    fprintf(stderr, "ERROR - transfer_image() failed\n");
+    ret_val = -1;
+  }
 
-  const int fx_type = FX_TYPE_FX3;
-  const int img_type = IMG_TYPE_IMG;
-  const int stage = 0;
-  verbose = 1;
-  ret_val = ezusb_load_ram(dev_handle, imagefile, fx_type, img_type, stage);
+  firmware_image_put(image);
   return ret_val;
+}
+
+
+/* returns the cached image, read (and validated) again if the file has
+   changed since */
+static struct firmware_image *firmware_image_get(const char *imagefile)
+{
+  struct firmware_image *ret_val = 0;
 
   int fd = open(imagefile, O_RDONLY);
   if (fd < 0) {
     fprintf(stderr, "ERROR - open(%s) failed: %s\n", imagefile, strerror(errno));
     goto FAIL0;
   }
-
-  /* slurp the whole fle into memory */
   struct stat statbuf;
   int ret = fstat(fd, &statbuf);
   if (ret < 0) {
     fprintf(stderr, "ERROR - fstat(%s) failed: %s\n", imagefile, strerror(errno));
     goto FAIL1;
   }
-  size_t image_size = statbuf.st_size;
-  uint8_t *image = (uint8_t *) malloc(image_size);
+
+  struct firmware_image *stale = 0;
+  pthread_mutex_lock(&firmware_images_mutex);
+  struct firmware_image **prev = &firmware_images;
+  for (struct firmware_image *image = firmware_images; image;
+       prev = &image->next, image = image->next) {
+    if (strcmp(image->path, imagefile) != 0) {
+      continue;
+    }
+    if (image->st_dev == statbuf.st_dev && image->st_ino == statbuf.st_ino &&
+        image->st_size == statbuf.st_size &&
+        image->st_mtim.tv_sec == statbuf.st_mtim.tv_sec &&
+        image->st_mtim.tv_nsec == statbuf.st_mtim.tv_nsec) {
+      image->refcount++;
+      pthread_mutex_unlock(&firmware_images_mutex);
+      close(fd);
+      return image;
+    }
+    /* the file has changed - out of the cache */
+    *prev = image->next;
+    stale = image;
+    break;
+  }
+  pthread_mutex_unlock(&firmware_images_mutex);
+  if (stale) {
+    firmware_image_put(stale);
+  }
+
+  /* slurp the whole file into memory */
+  struct firmware_image *image = (struct firmware_image *) malloc(sizeof(struct firmware_image));
   if (image == 0) {
     fprintf(stderr, "ERROR - malloc() failed: %s\n", strerror(errno));
     goto FAIL1;
   }
-  for (size_t nleft = image_size; nleft != 0; ) {
-    ssize_t nr = read(fd, image, nleft);
+  image->path = strdup(imagefile);
+  image->st_dev = statbuf.st_dev;
+  image->st_ino = statbuf.st_ino;
+  image->st_size = statbuf.st_size;
+  image->st_mtim = statbuf.st_mtim;
+  image->size = statbuf.st_size;
+  image->data = (uint8_t *) malloc(image->size);
+  if (image->path == 0 || image->data == 0) {
+    fprintf(stderr, "ERROR - malloc() failed: %s\n", strerror(errno));
+    goto FAIL2;
+  }
+  for (size_t nread = 0; nread < image->size; ) {
+    ssize_t nr = read(fd, image->data + nread, image->size - nread);
     if (nr < 0) {
       fprintf(stderr, "ERROR - read(%s) failed: %s\n", imagefile, strerror(errno));
-      goto FAIL1;
+      goto FAIL2;
+    }
+    if (nr == 0) {
+      fprintf(stderr, "ERROR - read(%s) failed: file truncated\n", imagefile);
+      goto FAIL2;
     }
-    nleft -= nr;
+    nread += nr;
   }
-
   close(fd);
+  fd = -1;
 
-  if (validate_image(image, image_size) < 0) {
+  if (validate_image(image->data, image->size) < 0) {
     fprintf(stderr, "ERROR - validate_image() failed\n");
-    goto FAILA;
-  }
-
-  if (transfer_image(image, dev_handle) < 0) {
-    fprintf(stderr, "ERROR - transfer_image() failed\n");
-    goto FAILA;
+    goto FAIL2;
   }
 
-  ret_val = 0;
+  /* one reference for the cache, one for the caller; if another thread
+     got here first its copy is just as good */
+  image->refcount = 2;
+  pthread_mutex_lock(&firmware_images_mutex);
+  image->next = firmware_images;
+  firmware_images = image;
+  pthread_mutex_unlock(&firmware_images_mutex);
 
-FAILA:
-  free(image);
+  ret_val = image;
   return ret_val;
 
+FAIL2:
+  free(image->data);
+  free(image->path);
+  free(image);
 FAIL1:
-  close(fd);
+  if (fd >= 0) {
+    close(fd);
+  }
 FAIL0:
   return ret_val;
 }
 
 
+static void firmware_image_put(struct firmware_image *image)
+{
+  pthread_mutex_lock(&firmware_images_mutex);
+  int refcount = --image->refcount;
+  pthread_mutex_unlock(&firmware_images_mutex);
+  if (refcount == 0) {
+    free(image->data);
+    free(image->path);
+    free(image);
+  }
+  return;
+}
+
+
 static int validate_image(const uint8_t *image, const size_t size)
 {
   if (size < 10240) {
@@ -707,9 +1408,11 @@ static int transfer_image(const uint8_t *image,
                           libusb_device_handle *dev_handle)
 {
   const uint8_t bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+  const uint8_t bmReadRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
   const uint8_t bRequest = 0xa0;            // vendor command
   const unsigned int timeout = 5000;        // timeout (in ms) for each command
-  const size_t max_write_size = 2 * 1024;   // max write size in bytes
+  enum { max_write_size = 4 * 1024 };       // boot loader max write size in bytes
+  uint8_t readback[max_write_size];
  
   // skip first word with 'CY' magic
   uint32_t *current = (uint32_t *) image + 1;
@@ -735,8 +1438,21 @@ static int transfer_image(const uint8_t *image,
         fprintf(stderr, "ERROR - libusb_control_transfer() returned less bytes than expected - actual=%hu expected=%hu\n", ret, wLength);
         return -1;
       }
+      /* read the chunk back and verify it */
+      ret = libusb_control_transfer(dev_handle, bmReadRequestType, bRequest,
+                                    address & 0xffff, address >> 16,
+                                    readback, wLength, timeout);
+      if (ret < 0) {
+        log_usb_error(ret, __func__, __FILE__, __LINE__);
+        return -1;
+      }
+      if (ret != wLength || memcmp(readback, data, wLength) != 0) {
+        fprintf(stderr, "ERROR - firmware verify error at address 0x%08x\n", address);
+        return -1;
+      }
       data += wLength;
       nleft -= wLength;
+      address += wLength;
     }
     current += loadSz;
   }
@@ -744,8 +1460,6 @@ static int transfer_image(const uint8_t *image,
   uint32_t entryAddr = *current++;
   uint32_t checksum __attribute__((unused)) = *current++;
 
-  sleep(1);
-
   int ret = libusb_control_transfer(dev_handle, bmRequestType, bRequest,
                                     entryAddr & 0xffff, entryAddr >> 16,
                                     0, 0, timeout);
@@ -802,3 +1516,330 @@ static int list_endpoints(struct libusb_endpoint_descriptor endpoints[],
 
   return count;
 }
+
+static usb_device_t *open_replay_device(const char *path,
+                                        uint16_t gpio_register)
+{
+  replay_t *replay = replay_open(path);
+  if (replay == 0) {
+    fprintf(stderr, "ERROR - replay_open() failed\n");
+    return 0;
+  }
+  usb_device_t *ret_val = open_virtual_device(replay, 0, 0, gpio_register);
+  if (ret_val == 0) {
+    replay_close(replay);
+  }
+  return ret_val;
+}
+
+static usb_device_t *open_net_device(const char *url,
+                                     uint16_t gpio_register)
+{
+  net_receiver_t *net_receiver = net_receiver_open(url);
+  if (net_receiver == 0) {
+    fprintf(stderr, "ERROR - net_receiver_open() failed\n");
+    return 0;
+  }
+  usb_device_t *ret_val = open_virtual_device(0, net_receiver, 0, gpio_register);
+  if (ret_val == 0) {
+    net_receiver_close(net_receiver);
+  }
+  return ret_val;
+}
+
+static usb_device_t *open_shm_device(const char *url,
+                                     uint16_t gpio_register)
+{
+  shm_reader_t *shm_reader = shm_reader_open(url);
+  if (shm_reader == 0) {
+    fprintf(stderr, "ERROR - shm_reader_open() failed\n");
+    return 0;
+  }
+  usb_device_t *ret_val = open_virtual_device(0, 0, shm_reader, gpio_register);
+  if (ret_val == 0) {
+    shm_reader_close(shm_reader);
+  }
+  return ret_val;
+}
+
+/* a virtual device with the bulk in endpoint of the RX888 firmware */
+static usb_device_t *open_virtual_device(replay_t *replay,
+                                         net_receiver_t *net_receiver,
+                                         shm_reader_t *shm_reader,
+                                         uint16_t gpio_register)
+{
+  usb_device_t *this = (usb_device_t *) malloc(sizeof(usb_device_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return 0;
+  }
+  this->dev = 0;
+  this->dev_handle = 0;
+  this->context = 0;
+  this->owns_context = 0;
+  this->completed = 0;
+  this->nendpoints = 0;
+  memset(this->endpoints, 0, sizeof(this->endpoints));
+  memset(this->ss_endpoints, 0, sizeof(this->ss_endpoints));
+  this->bulk_in_endpoint_address = LIBUSB_ENDPOINT_IN | 1;
+  this->bulk_in_max_packet_size = 1024;
+  this->bulk_in_max_burst = 16;
+  atomic_init(&this->gpio_register, gpio_register);
+  for (int i = 0; i < MAX_FW_REGISTERS; ++i) {
+    atomic_init(&this->fw_registers[i], 0);
+  }
+  this->replay = replay;
+  this->net_receiver = net_receiver;
+  this->shm_reader = shm_reader;
+  pthread_mutex_init(&this->batch_mutex, 0);
+  this->batch = 0;
+  atomic_init(&this->pending_batches, 0);
+  return this;
+}
+
+static int is_virtual_device(const char *imagefile)
+{
+  return strncmp(imagefile, REPLAY_PREFIX, REPLAY_PREFIX_LENGTH) == 0 ||
+         strncmp(imagefile, NET_UDP_PREFIX, sizeof(NET_UDP_PREFIX) - 1) == 0 ||
+         strncmp(imagefile, NET_TCP_PREFIX, sizeof(NET_TCP_PREFIX) - 1) == 0 ||
+         strncmp(imagefile, SHM_PREFIX, sizeof(SHM_PREFIX) - 1) == 0;
+}
+
+/* there is no radio behind a capture file, a network stream or a shared
+   memory ring: the streaming commands drive the replay or the reader, and
+   everything else is accepted and ignored */
+static int virtual_device_control(usb_device_t *this, uint8_t request,
+                                  uint8_t *data, uint16_t length)
+{
+  switch (request) {
+    case TESTFX3:
+    case I2CRFX3:
+      /* model HW_NORADIO, no firmware version */
+      memset(data, 0, length);
+      break;
+    case STARTFX3:
+      if (this->net_receiver) {
+        net_receiver_start(this->net_receiver);
+      } else if (this->shm_reader) {
+        shm_reader_start(this->shm_reader);
+      } else {
+        replay_start(this->replay);
+      }
+      break;
+    case STOPFX3:
+      if (this->net_receiver) {
+        net_receiver_stop(this->net_receiver);
+      } else if (this->shm_reader) {
+        shm_reader_stop(this->shm_reader);
+      } else {
+        replay_stop(this->replay);
+      }
+      break;
+    case STARTADC:
+      if (length >= sizeof(uint32_t)) {
+        uint32_t sample_rate;
+        memcpy(&sample_rate, data, sizeof(sample_rate));
+        if (this->net_receiver) {
+          net_receiver_set_sample_rate(this->net_receiver, sample_rate);
+        } else if (this->shm_reader) {
+          shm_reader_set_sample_rate(this->shm_reader, sample_rate);
+        } else {
+          replay_set_sample_rate(this->replay, sample_rate);
+        }
+      }
+      break;
+    case GPIOFX3:
+    case I2CWFX3:
+    case RESETFX3:
+    case SETARGFX3:
+    case R82XXINIT:
+    case R82XXTUNE:
+    case R82XXSTDBY:
+      break;
+    default:
+      fprintf(stderr, "ERROR - unknown USB device control request: 0x%02x\n",
+              request);
+      return -1;
+  }
+  return 0;
+}
+
+static struct control_batch *control_batch_open(usb_device_t *this)
+{
+  struct control_batch *batch = (struct control_batch *) malloc(sizeof(struct control_batch));
+  if (batch == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return 0;
+  }
+  batch->usb_device = this;
+  batch->num_requests = 0;
+  memset(batch->transfers, 0, sizeof(batch->transfers));
+  batch->remaining = 0;
+  batch->failed = 0;
+  batch->callback = 0;
+  batch->callback_context = 0;
+  return batch;
+}
+
+/* queue a write request the way usb_device_control_request() would send it */
+static int control_batch_add(struct control_batch *batch, uint8_t request,
+                             uint16_t value, uint16_t index, uint8_t *data,
+                             uint16_t length)
+{
+  const uint8_t bmWriteRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+
+  uint8_t dummy[] = { 0 };
+
+  switch (request) {
+    case STARTFX3:
+    case STOPFX3:
+    case RESETFX3:
+    case R82XXSTDBY:
+      value = 0;
+      index = 0;
+      data = dummy;
+      length = sizeof(dummy);
+      break;
+    case GPIOFX3:
+    case I2CWFX3:
+    case STARTADC:
+    case R82XXINIT:
+    case R82XXTUNE:
+      break;
+    case SETARGFX3:
+      data = dummy;
+      length = sizeof(dummy);
+      break;
+    default:
+      fprintf(stderr, "ERROR - USB device control request 0x%02x cannot be batched\n",
+              request);
+      return -1;
+  }
+  if (length > MAX_CONTROL_DATA) {
+    fprintf(stderr, "ERROR - USB device control request 0x%02x too long for a batch: %u\n",
+            request, length);
+    return -1;
+  }
+
+  /* a later tuner frequency, GPIO state, or value of the same firmware
+     register replaces the one already queued; it goes at the end, so that
+     the requests queued in between are still sent before it */
+  for (uint32_t i = 0; i < batch->num_requests; ++i) {
+    struct control_request *queued = &batch->requests[i];
+    if (queued->request == request &&
+        (request == R82XXTUNE || request == GPIOFX3 ||
+         (request == SETARGFX3 && queued->value == value))) {
+      memmove(&batch->requests[i], &batch->requests[i+1],
+              (batch->num_requests - i - 1) * sizeof(struct control_request));
+      batch->num_requests--;
+      break;
+    }
+  }
+  if (batch->num_requests == MAX_BATCH_REQUESTS) {
+    fprintf(stderr, "ERROR - too many requests in the control batch\n");
+    return -1;
+  }
+  struct control_request *control_request = &batch->requests[batch->num_requests++];
+  control_request->request = request;
+  control_request->value = value;
+  libusb_fill_control_setup(control_request->buffer, bmWriteRequestType,
+                            request, value, index, length);
+  memcpy(control_request->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+  return 0;
+}
+
+/* takes the batch over - it is freed when it completes, or on failure */
+static int control_batch_submit(struct control_batch *batch,
+                                usb_device_control_cb_t callback,
+                                void *context)
+{
+  const unsigned int timeout = 5000;        // timeout (in ms) for each command
+
+  usb_device_t *this = batch->usb_device;
+  batch->callback = callback;
+  batch->callback_context = context;
+
+  if (batch->num_requests == 0) {
+    free(batch);
+    if (callback) {
+      callback(0, context);
+    }
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < batch->num_requests; ++i) {
+    batch->transfers[i] = libusb_alloc_transfer(0);
+    if (batch->transfers[i] == 0) {
+      log_error("libusb_alloc_transfer() failed", __func__, __FILE__, __LINE__);
+      goto FAIL;
+    }
+    libusb_fill_control_transfer(batch->transfers[i], this->dev_handle,
+                                 batch->requests[i].buffer,
+                                 control_batch_callback, batch, timeout);
+  }
+
+  /* the control endpoint runs them one after the other, in order; the
+     remaining count covers every transfer until all are submitted, so
+     that the batch cannot complete under our feet */
+  atomic_fetch_add(&this->pending_batches, 1);
+  batch->remaining = batch->num_requests + 1;
+  uint32_t submitted = 0;
+  for (; submitted < batch->num_requests; ++submitted) {
+    int ret = usb_device_submit_transfer(this, batch->transfers[submitted]);
+    if (ret < 0) {
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      break;
+    }
+  }
+  if (submitted == 0) {
+    atomic_fetch_sub(&this->pending_batches, 1);
+    goto FAIL;
+  }
+  if (submitted < batch->num_requests) {
+    batch->failed = 1;
+  }
+  /* drop the references of the requests not submitted and our own */
+  uint32_t unused = batch->num_requests - submitted + 1;
+  if (__atomic_sub_fetch(&batch->remaining, unused, __ATOMIC_ACQ_REL) == 0) {
+    for (uint32_t i = 0; i < batch->num_requests; ++i) {
+      libusb_free_transfer(batch->transfers[i]);
+    }
+    if (batch->callback) {
+      batch->callback(batch->failed ? -1 : 0, batch->callback_context);
+    }
+    free(batch);
+    atomic_fetch_sub(&this->pending_batches, 1);
+  }
+  return 0;
+
+FAIL:
+  for (uint32_t i = 0; i < batch->num_requests; ++i) {
+    if (batch->transfers[i]) {
+      libusb_free_transfer(batch->transfers[i]);
+    }
+  }
+  free(batch);
+  return -1;
+}
+
+static void LIBUSB_CALL control_batch_callback(struct libusb_transfer *transfer)
+{
+  struct control_batch *batch = (struct control_batch *) transfer->user_data;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    log_usb_error(transfer->status, __func__, __FILE__, __LINE__);
+    batch->failed = 1;
+  }
+  if (__atomic_sub_fetch(&batch->remaining, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  usb_device_t *usb_device = batch->usb_device;
+  for (uint32_t i = 0; i < batch->num_requests; ++i) {
+    libusb_free_transfer(batch->transfers[i]);
+  }
+  if (batch->callback) {
+    batch->callback(batch->failed ? -1 : 0, batch->callback_context);
+  }
+  free(batch);
+  atomic_fetch_sub(&usb_device->pending_batches, 1);
+  return;
+}
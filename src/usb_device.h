@@ -24,6 +24,10 @@
 
 #include <libusb.h>
 
+#include "replay.h"
+#include "net_receiver.h"
+#include "shm_reader.h"
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,16 +62,94 @@ int usb_device_get_device_list(struct usb_device_info **usb_device_infos);
 
 int usb_device_free_device_list(struct usb_device_info *usb_device_infos);
 
+/* the firmware image is only loaded into devices in boot loader mode,
+   or running a firmware that does not answer TESTFX3 (which are reset
+   first); images are kept in memory, and read again only when the file
+   changes. An imagefile of the form "file://<path>" opens a capture file
+   (raw 16 bit samples or a 16 bit mono WAV) as a virtual device instead */
 usb_device_t *usb_device_open(int index, const char* imagefile,
                               uint16_t gpio_register);
 
+/* several devices can share one libusb context, and so one event loop;
+   the context must outlive all of its devices */
+libusb_context *usb_device_open_context();
+
+void usb_device_close_context(libusb_context *context);
+
+int usb_device_handle_context_events_timeout(libusb_context *context,
+                                             int timeout_ms);
+
+usb_device_t *usb_device_open_shared(libusb_context *context, int index,
+                                     const char* imagefile,
+                                     uint16_t gpio_register);
+
 int usb_device_handle_events(usb_device_t *this);
 
+int usb_device_handle_events_timeout(usb_device_t *this, int timeout_ms);
+
 void usb_device_close(usb_device_t *this);
 
+/* the transfer calls of the streaming code go through these, so that
+   the file:// devices can serve them */
+int usb_device_submit_transfer(usb_device_t *this,
+                               struct libusb_transfer *transfer);
+
+int usb_device_cancel_transfer(usb_device_t *this,
+                               struct libusb_transfer *transfer);
+
+int usb_device_bulk_transfer(usb_device_t *this, uint8_t *data, int length,
+                             int *transferred, unsigned int timeout_ms);
+
+/* 0 if this is a real device */
+replay_t *usb_device_get_replay(usb_device_t *this);
+
+net_receiver_t *usb_device_get_net_receiver(usb_device_t *this);
+
+shm_reader_t *usb_device_get_shm_reader(usb_device_t *this);
+
 int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
                        uint16_t index, uint8_t *data, uint16_t length);
 
+/* control batches: between usb_device_control_batch_begin() and
+   usb_device_control_batch_commit() the write requests of
+   usb_device_control() (and so of the GPIO and firmware register
+   functions) are queued instead of sent, and they return 0 right away;
+   a later R82XXTUNE, GPIOFX3, or SETARGFX3 for the same register replaces
+   the one already queued, and is moved to the end. The commit submits them all back to back
+   without waiting, and the callback is called from the event loop when
+   the last one has completed (status 0 or -1). Read requests cannot be
+   batched. A batch belongs to the thread that began it: the requests of
+   the other threads are sent right away, and only that thread commits */
+#define MAX_BATCH_REQUESTS (16)
+
+typedef void (*usb_device_control_cb_t)(int status, void *context);
+
+int usb_device_control_batch_begin(usb_device_t *this);
+
+/* returns -1 (and the callback is not called) if nothing was submitted */
+int usb_device_control_batch_commit(usb_device_t *this,
+                                    usb_device_control_cb_t callback,
+                                    void *context);
+
+/* a batch of one request, independent of the batch open (if any) */
+int usb_device_control_async(usb_device_t *this, uint8_t request,
+                             uint16_t value, uint16_t index, uint8_t *data,
+                             uint16_t length, usb_device_control_cb_t callback,
+                             void *context);
+
+/* handle the events until the callbacks of all the batches committed so
+   far have been called (the batches in flight time out on their own) */
+void usb_device_wait_batches(usb_device_t *this);
+
+/* send a command without data (i.e. STARTFX3) to several devices sharing
+   the same context at once: the control transfers are submitted back to
+   back, and then waited for */
+int usb_device_control_all(usb_device_t **devices, int num_devices,
+                           uint8_t request);
+
+/* the GPIO and firmware register functions can be called from any
+   thread; when two threads change the same register at the same time,
+   the device ends up with the value written last */
 uint16_t usb_device_gpio_get(usb_device_t *this);
 
 int usb_device_gpio_set(usb_device_t *this, uint16_t bit_pattern,
@@ -95,6 +177,13 @@ uint16_t usb_device_get_fw_register(usb_device_t *this, uint16_t address);
 int usb_device_set_fw_register(usb_device_t *this, uint16_t address,
                                uint16_t value);
 
+/* the same without waiting for the device (usb_device_control_async());
+   the register reads back the new value right away */
+int usb_device_set_fw_register_async(usb_device_t *this, uint16_t address,
+                                     uint16_t value,
+                                     usb_device_control_cb_t callback,
+                                     void *context);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,7 +23,13 @@
 #ifndef __USB_DEVICE_INTERNALS_H
 #define __USB_DEVICE_INTERNALS_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "usb_device.h"
+#include "replay.h"
+#include "net_receiver.h"
+#include "shm_reader.h"
 
 
 #ifdef __cplusplus
@@ -34,6 +40,7 @@ typedef struct usb_device {
   libusb_device *dev;
   libusb_device_handle *dev_handle;
   libusb_context *context;
+  int owns_context;             /* 0 if shared with other devices */
   int completed;
   int nendpoints;
 #define MAX_ENDPOINTS (16)
@@ -42,9 +49,18 @@ typedef struct usb_device {
   uint8_t bulk_in_endpoint_address;
   uint16_t bulk_in_max_packet_size;
   uint8_t bulk_in_max_burst;
-  uint16_t gpio_register;
+  /* the last values written, from any thread: each writer sends the
+     register again until the value it sent is still the current one */
+  atomic_ushort gpio_register;
 #define MAX_FW_REGISTERS (16)
-  uint16_t fw_registers[MAX_FW_REGISTERS];
+  atomic_ushort fw_registers[MAX_FW_REGISTERS];
+  replay_t *replay;             /* file:// devices only */
+  net_receiver_t *net_receiver; /* udp:// and tcp:// devices only */
+  shm_reader_t *shm_reader;     /* shm:// devices only */
+  pthread_mutex_t batch_mutex;  /* guards batch and batch_owner only */
+  struct control_batch *batch;  /* between batch begin and commit */
+  pthread_t batch_owner;        /* the thread that began the batch */
+  atomic_int pending_batches;   /* committed and not completed yet */
 } usb_device_t;
 typedef struct usb_device usb_device_t;
 
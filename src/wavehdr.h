@@ -51,6 +51,16 @@ typedef struct
 	char		waveID[4];	/* "WAVE" string */
 } riff_chunk;
 
+typedef struct
+{
+	/* ds64 header - EBU Tech 3306 (RF64) / ITU-R BS.2088 (BW64) */
+	chunk_hdr	hdr;		/* ID == "ds64", or "JUNK" while the file is below 4 GB */
+	uint64_t	riffSize;	/* size of the RF64 block - 8 bytes */
+	uint64_t	dataSize;	/* size of the data chunk */
+	uint64_t	sampleCount;	/* number of frames in the data chunk */
+	uint32_t	tableLength;	/* no further chunk sizes in the table */
+} ds64_chunk;
+
 typedef struct
 {
 	/* FMT header */
@@ -89,6 +99,7 @@ typedef struct
 typedef struct
 {
 	riff_chunk r;
+	ds64_chunk s;
 	fmt_chunk  f;
 	auxi_chunk a;
 	data_chunk d;
@@ -21,27 +21,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-#include <assert.h>
-
-#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
-#else
-#include <windows.h>
-#include <fcntl.h>
-#include <io.h>
-#include <process.h>
-#define _USE_MATH_DEFINES
-#endif
-
-#include <math.h>
 
 #include "wavehdr.h"
 
-static waveFileHeader waveHdr;
-
-static uint32_t	waveDataSize = 0;
-int	waveHdrStarted = 0;
+struct waveWriter
+{
+	waveFileHeader	hdr;
+	int		fd;
+	int		isPipe;		/* stdout or not seekable: header isn't updated */
+	int		flags;
+	int		frameSize;
+	uint64_t	dataSize;
+	uint64_t	headerUpdateBytes;
+	uint64_t	nextHeaderUpdate;
+};
 
 
 static void waveSetCurrTime(Wind_SystemTime *p)
@@ -52,11 +49,7 @@ static void waveSetCurrTime(Wind_SystemTime *p)
 	gettimeofday(&tv, NULL);
 	p->wMilliseconds = tv.tv_usec / 1000;
 
-#ifdef _WIN32
-	t = *gmtime(&tv.tv_sec);
-#else
 	gmtime_r(&tv.tv_sec, &t);
-#endif
 
 	p->wYear = t.tm_year + 1900;	/* 1601 through 30827 */
 	p->wMonth = t.tm_mon + 1;		/* 1..12 */
@@ -69,7 +62,8 @@ static void waveSetCurrTime(Wind_SystemTime *p)
 
 static void waveSetStartTimeInt(time_t tim, double fraction, Wind_SystemTime *p)
 {
-	struct tm t = *gmtime( &tim );
+	struct tm t;
+	gmtime_r( &tim, &t );
 	p->wYear = t.tm_year + 1900;	/* 1601 through 30827 */
 	p->wMonth = t.tm_mon + 1;		/* 1..12 */
 	p->wDayOfWeek = t.tm_wday;		/* 0 .. 6: 0 == Sunday, .., 6 == Saturday */
@@ -82,128 +76,208 @@ static void waveSetStartTimeInt(time_t tim, double fraction, Wind_SystemTime *p)
 		p->wMilliseconds = 999;
 }
 
-void waveSetStartTime(time_t tim, double fraction)
+void waveWriterSetStartTime(waveWriter * w, time_t tim, double fraction)
 {
-	waveSetStartTimeInt(tim, fraction, &waveHdr.a.StartTime );
-	waveHdr.a.StopTime = waveHdr.a.StartTime;		/* to fix */
+	waveSetStartTimeInt(tim, fraction, &w->hdr.a.StartTime );
+	w->hdr.a.StopTime = w->hdr.a.StartTime;		/* to fix */
 }
 
 
-void wavePrepareHeader(unsigned samplerate, unsigned freq, int bitsPerSample, int numChannels)
+static void wavePrepareHeader(waveFileHeader * h, unsigned samplerate, unsigned freq, int bitsPerSample, int numChannels)
 {
 	int	bytesPerSample = bitsPerSample / 8;
 	int bytesPerFrame = bytesPerSample * numChannels;
 
-	memcpy( waveHdr.r.hdr.ID, "RIFF", 4 );
-	waveHdr.r.hdr.size = sizeof(waveFileHeader) - 8;		/* to fix */
-	memcpy( waveHdr.r.waveID, "WAVE", 4 );
-
-	memcpy( waveHdr.f.hdr.ID, "fmt ", 4 );
-	waveHdr.f.hdr.size = 16;
-	waveHdr.f.wFormatTag = 1;					/* PCM */
-	waveHdr.f.nChannels = numChannels;		/* I and Q channels */
-	waveHdr.f.nSamplesPerSec = samplerate;
-	waveHdr.f.nAvgBytesPerSec = samplerate * bytesPerFrame;
-	waveHdr.f.nBlockAlign = waveHdr.f.nChannels;
-	waveHdr.f.nBitsPerSample = bitsPerSample;
-
-	memcpy( waveHdr.a.hdr.ID, "auxi", 4 );
-	waveHdr.a.hdr.size = 2 * sizeof(Wind_SystemTime) + 9 * sizeof(int32_t);  /* = 2 * 16 + 9 * 4 = 68 */
-	waveSetCurrTime( &waveHdr.a.StartTime );
-	waveHdr.a.StopTime = waveHdr.a.StartTime;		/* to fix */
-	waveHdr.a.centerFreq = freq;
-	waveHdr.a.ADsamplerate = samplerate;
-	waveHdr.a.IFFrequency = 0;
-	waveHdr.a.Bandwidth = 0;
-	waveHdr.a.IQOffset = 0;
-	waveHdr.a.Unused2 = 0;
-	waveHdr.a.Unused3 = 0;
-	waveHdr.a.Unused4 = 0;
-	waveHdr.a.Unused5 = 0;
-
-	memcpy( waveHdr.d.hdr.ID, "data", 4 );
-	waveHdr.d.hdr.size = 0;		/* to fix later */
-	waveDataSize = 0;
+	memset( h, 0, sizeof(waveFileHeader) );
+
+	memcpy( h->r.hdr.ID, "RIFF", 4 );
+	h->r.hdr.size = sizeof(waveFileHeader) - 8;		/* to fix */
+	memcpy( h->r.waveID, "WAVE", 4 );
+
+	/* placeholder for the ds64 chunk - readers skip it, until the file becomes RF64 */
+	memcpy( h->s.hdr.ID, "JUNK", 4 );
+	h->s.hdr.size = sizeof(ds64_chunk) - sizeof(chunk_hdr);	/* = 28 */
+
+	memcpy( h->f.hdr.ID, "fmt ", 4 );
+	h->f.hdr.size = 16;
+	h->f.wFormatTag = 1;					/* PCM */
+	h->f.nChannels = numChannels;		/* I and Q channels */
+	h->f.nSamplesPerSec = samplerate;
+	h->f.nAvgBytesPerSec = samplerate * bytesPerFrame;
+	h->f.nBlockAlign = bytesPerFrame;
+	h->f.nBitsPerSample = bitsPerSample;
+
+	memcpy( h->a.hdr.ID, "auxi", 4 );
+	h->a.hdr.size = 2 * sizeof(Wind_SystemTime) + 9 * sizeof(int32_t);  /* = 2 * 16 + 9 * 4 = 68 */
+	waveSetCurrTime( &h->a.StartTime );
+	h->a.StopTime = h->a.StartTime;		/* to fix */
+	h->a.centerFreq = freq;
+	h->a.ADsamplerate = samplerate;
+
+	memcpy( h->d.hdr.ID, "data", 4 );
+	h->d.hdr.size = 0;		/* to fix later */
 }
 
-void waveWriteHeader(unsigned samplerate, unsigned freq, int bitsPerSample, int numChannels, FILE * f)
+/* fill in the sizes for w->dataSize - switching to RF64/BW64 beyond 4 GB */
+static void waveSetSizes(waveWriter * w)
 {
-	if (f != stdout) {
-		assert( !waveHdrStarted );
-		wavePrepareHeader(samplerate, freq, bitsPerSample, numChannels);
-		fwrite(&waveHdr, sizeof(waveFileHeader), 1, f);
-		waveHdrStarted = 1;
+	waveFileHeader * h = &w->hdr;
+	uint64_t riffSize = sizeof(waveFileHeader) - 8 + w->dataSize + (w->dataSize & 1);
+
+	if ( riffSize > UINT32_MAX )
+	{
+		memcpy( h->r.hdr.ID, (w->flags & WAVE_WRITER_BW64) ? "BW64" : "RF64", 4 );
+		h->r.hdr.size = UINT32_MAX;
+		memcpy( h->s.hdr.ID, "ds64", 4 );
+		h->s.riffSize = riffSize;
+		h->s.dataSize = w->dataSize;
+		h->s.sampleCount = w->dataSize / w->frameSize;
+		h->s.tableLength = 0;
+		h->d.hdr.size = UINT32_MAX;
+	}
+	else
+	{
+		h->r.hdr.size = (uint32_t)riffSize;
+		h->d.hdr.size = (uint32_t)w->dataSize;
 	}
 }
 
-int  waveWriteSamples(FILE* f,  void * vpData, size_t numSamples, int needCleanData)
+static int waveWriteAll(int fd, const void * vpData, size_t numBytes)
 {
-	size_t nw;
-	switch (waveHdr.f.nBitsPerSample)
+	const uint8_t * p = (const uint8_t *)vpData;
+	while ( numBytes > 0 )
 	{
-	case 0:
-	default:
-		return 1;
-	case 8:
-		/* no endian conversion needed for single bytes */
-		nw = fwrite(vpData, sizeof(uint8_t), numSamples, f);
-		waveDataSize += sizeof(uint8_t) * numSamples;
-		return (nw == numSamples) ? 0 : 1;
-	case 16:
-		/* TODO: endian conversion needed */
-		nw = fwrite(vpData, sizeof(int16_t), numSamples, f);
-		waveDataSize += sizeof(int16_t) * numSamples;
-		if ( needCleanData )
+		ssize_t nw = write(fd, p, numBytes);
+		if ( nw < 0 )
 		{
-			/* TODO: convert back endianness */
+			if ( errno == EINTR )
+				continue;
+			return 1;
 		}
-		return (nw == numSamples) ? 0 : 1;
+		p += nw;
+		numBytes -= nw;
 	}
+	return 0;
 }
 
-int  waveWriteFrames(FILE* f,  void * vpData, size_t numFrames, int needCleanData)
+waveWriter * waveWriterOpen(const char * filename, unsigned samplerate, unsigned freq, int bitsPerSample, int numChannels, int flags)
 {
-	size_t nw;
-	switch (waveHdr.f.nBitsPerSample)
+	if ( (bitsPerSample != 8 && bitsPerSample != 16) || numChannels <= 0 )
 	{
-	case 0:
-	default:
-		return 1;
-	case 8:
-		/* no endian conversion needed for single bytes */
-		nw = fwrite(vpData, waveHdr.f.nChannels * sizeof(uint8_t), numFrames, f);
-		waveDataSize += waveHdr.f.nChannels * sizeof(uint8_t) * numFrames;
-		return (nw == numFrames) ? 0 : 1;
-	case 16:
-		/* TODO: endian conversion needed */
-		nw = fwrite(vpData, waveHdr.f.nChannels * sizeof(int16_t), numFrames, f);
-		waveDataSize += waveHdr.f.nChannels * sizeof(int16_t) * numFrames;
-		if ( needCleanData )
-		{
-			/* TODO: convert back endianness */
-		}
-		return (nw == numFrames) ? 0 : 1;
+		fprintf(stderr, "ERROR - unsupported wave format: %d bits, %d channels\n", bitsPerSample, numChannels);
+		return 0;
+	}
+
+	waveWriter * w = (waveWriter *)malloc(sizeof(waveWriter));
+	if ( !w )
+	{
+		fprintf(stderr, "ERROR - malloc() failed\n");
+		return 0;
+	}
+
+	if ( !strcmp(filename, "-") )
+		w->fd = STDOUT_FILENO;
+	else
+		w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if ( w->fd < 0 )
+	{
+		fprintf(stderr, "ERROR - open(%s) failed: %s\n", filename, strerror(errno));
+		free(w);
+		return 0;
 	}
+	w->isPipe = ( lseek(w->fd, 0, SEEK_CUR) < 0 );
+	w->flags = flags;
+	w->frameSize = (bitsPerSample / 8) * numChannels;
+	w->dataSize = 0;
+	w->headerUpdateBytes = WAVE_DEFAULT_HEADER_UPDATE_BYTES;
+	w->nextHeaderUpdate = w->headerUpdateBytes;
+
+	wavePrepareHeader(&w->hdr, samplerate, freq, bitsPerSample, numChannels);
+	if ( w->isPipe )
+	{
+		/* sizes unknown - can't be fixed later */
+		w->hdr.r.hdr.size = UINT32_MAX;
+		w->hdr.d.hdr.size = UINT32_MAX;
+	}
+	if ( waveWriteAll(w->fd, &w->hdr, sizeof(waveFileHeader)) )
+	{
+		fprintf(stderr, "ERROR - writing wave header to %s failed: %s\n", filename, strerror(errno));
+		if ( w->fd != STDOUT_FILENO )
+			close(w->fd);
+		free(w);
+		return 0;
+	}
+	return w;
 }
 
+void waveWriterSetHeaderUpdateBytes(waveWriter * w, uint64_t headerUpdateBytes)
+{
+	w->headerUpdateBytes = headerUpdateBytes;
+	w->nextHeaderUpdate = headerUpdateBytes ? w->dataSize + headerUpdateBytes : UINT64_MAX;
+}
 
-int  waveFinalizeHeader(FILE * f)
+int  waveWriterGetFrameSize(const waveWriter * w)
 {
-	if (f != stdout) {
-		assert( waveHdrStarted );
-		waveSetCurrTime( &waveHdr.a.StopTime );
-		waveHdr.d.hdr.size = waveDataSize;
-		waveHdr.r.hdr.size += waveDataSize;
-		/* fprintf(stderr, "waveFinalizeHeader(): datasize = %d\n", waveHdr.dataSize); */
-		waveHdrStarted = 0;
-		if ( fseek(f, 0, SEEK_SET) )
-			return 1;
-		if ( 1 != fwrite(&waveHdr, sizeof(waveFileHeader), 1, f) )
-			return 1;
-		/* fprintf(stderr, "waveFinalizeHeader(): success writing header\n"); */
+	return w->frameSize;
+}
+
+uint64_t waveWriterGetDataSize(const waveWriter * w)
+{
+	return w->dataSize;
+}
+
+int  waveWriterUpdateHeader(waveWriter * w)
+{
+	if ( w->isPipe )
 		return 0;
+	waveSetCurrTime( &w->hdr.a.StopTime );
+	waveSetSizes(w);
+	/* the header is rewritten as a single block: small enough to land in one sector */
+	if ( pwrite(w->fd, &w->hdr, sizeof(waveFileHeader), 0) != (ssize_t)sizeof(waveFileHeader) )
+		return 1;
+	return 0;
+}
+
+int  waveWriterWrite(waveWriter * w, const void * vpData, size_t numBytes)
+{
+	if ( numBytes % w->frameSize )
+		return 1;
+	/* no endian conversion: data is little endian on all supported hosts */
+	if ( waveWriteAll(w->fd, vpData, numBytes) )
+		return 1;
+	w->dataSize += numBytes;
+	if ( w->dataSize >= w->nextHeaderUpdate )
+	{
+		w->nextHeaderUpdate = w->dataSize + w->headerUpdateBytes;
+		return waveWriterUpdateHeader(w);
+	}
+	return 0;
+}
+
+int  waveWriterWriteFrames(waveWriter * w, const void * vpData, size_t numFrames)
+{
+	return waveWriterWrite(w, vpData, numFrames * w->frameSize);
+}
+
+int  waveWriterClose(waveWriter * w)
+{
+	int ret = 0;
+	if ( !w->isPipe )
+	{
+		/* chunks have an even size: pad byte isn't part of the data size */
+		if ( w->dataSize & 1 )
+		{
+			const uint8_t pad = 0;
+			if ( waveWriteAll(w->fd, &pad, 1) )
+				ret = 1;
+		}
+		if ( waveWriterUpdateHeader(w) )
+			ret = 1;
 	}
-	return 1;
+	if ( w->fd != STDOUT_FILENO && close(w->fd) )
+		ret = 1;
+	free(w);
+	return ret;
 }
 
 // vim: tabstop=8:softtabstop=8:shiftwidth=8:noexpandtab
@@ -25,28 +25,51 @@
 extern "C" {
 #endif
 
-extern int	waveHdrStarted;
+typedef struct waveWriter waveWriter;
 
 /*!
- * helper functions to write and finalize wave headers
- *   with compatibility to some SDR programs - showing frequency:
- * raw sample data still have to be written by caller to FILE*.
- * call waveWriteHeader() before writing anything to to file
- * and call waveFinalizeHeader() afterwards,
- * stdout/stderr can't be used, because seek to begin isn't possible.
- * 
+ * per file wave writer - with compatibility to some SDR programs,
+ *   showing frequency in the 'auxi' chunk.
+ * writers are independent of each other: any number of files
+ *   can be written concurrently, each one from its own thread.
+ * the size fields in the header are rewritten in place (with pwrite())
+ *   every 'headerUpdateBytes' of data, so that a capture which is
+ *   interrupted is still a valid file up to the last update.
+ * a 'JUNK' chunk reserves room for a 'ds64' chunk: when the data
+ *   grows beyond 4 GB, the file turns into RF64 (or BW64, with
+ *   WAVE_WRITER_BW64), where the sizes are 64 bit.
+ * filename "-" writes to stdout: the header is then written once,
+ *   with the 'unknown' sizes 0xFFFFFFFF, and never updated.
  */
 
-void waveWriteHeader(unsigned samplerate, unsigned freq, int bitsPerSample, int numChannels, FILE * f);
+#define WAVE_WRITER_BW64	1	/* "BW64" instead of "RF64" beyond 4 GB */
 
-/* waveWriteFrames() writes (numFrames * numChannels) samples
- * waveWriteSamples()
- * both return 0, when no errors occured
+#define WAVE_DEFAULT_HEADER_UPDATE_BYTES	(64 * 1024 * 1024)
+
+/* returns 0 on error */
+waveWriter * waveWriterOpen(const char * filename, unsigned samplerate, unsigned freq, int bitsPerSample, int numChannels, int flags);
+
+void waveWriterSetStartTime(waveWriter * w, time_t t, double fraction);
+
+/* 0 updates the header only at waveWriterClose() */
+void waveWriterSetHeaderUpdateBytes(waveWriter * w, uint64_t headerUpdateBytes);
+
+/* bytes per frame (all channels of one sample) */
+int  waveWriterGetFrameSize(const waveWriter * w);
+
+/* waveWriterWrite() writes whole buffers - numBytes has to be a multiple of the frame size
+ * waveWriterWriteFrames() writes (numFrames * numChannels) samples
+ * samples are written in host byte order: these are little endian on all supported hosts
+ * all return 0, when no errors occured
  */
-int  waveWriteFrames(FILE* f,  void * vpData, size_t numFrames, int needCleanData);
-int  waveWriteSamples(FILE* f,  void * vpData, size_t numSamples, int needCleanData);  /* returns 0, when no errors occured */
-void waveSetStartTime(time_t t, double fraction);
-int  waveFinalizeHeader(FILE * f);      /* returns 0, when no errors occured */
+int  waveWriterWrite(waveWriter * w, const void * vpData, size_t numBytes);
+int  waveWriterWriteFrames(waveWriter * w, const void * vpData, size_t numFrames);
+int  waveWriterUpdateHeader(waveWriter * w);
+
+uint64_t waveWriterGetDataSize(const waveWriter * w);
+
+/* writes the final header and closes the file - returns 0, when no errors occured */
+int  waveWriterClose(waveWriter * w);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,202 @@
+/*
+ * worker_pool.c - fork/join pool of DSP worker threads
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "worker_pool.h"
+#include "event_thread.h"
+
+
+typedef struct worker_pool worker_pool_t;
+
+struct worker {
+  worker_pool_t *pool;
+  pthread_t thread;
+  uint64_t cpu_affinity_mask;
+};
+
+typedef struct worker_pool {
+  uint32_t num_threads;
+  struct worker *workers;
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  /* the current job - protected by mutex, except next_task */
+  uint64_t generation;
+  int stop;
+  worker_pool_task_t task;
+  void *context;
+  uint32_t num_tasks;
+  atomic_uint next_task;
+  uint32_t busy_workers;
+} worker_pool_t;
+
+
+/* internal functions */
+static void *worker_pool_thread(void *arg);
+static void worker_pool_run_tasks(worker_pool_t *this);
+
+
+worker_pool_t *worker_pool_open(uint32_t num_threads,
+                                const uint64_t *cpu_affinity_masks)
+{
+  worker_pool_t *ret_val = 0;
+
+  worker_pool_t *this = (worker_pool_t *) malloc(sizeof(worker_pool_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  this->workers = (struct worker *) calloc(num_threads ? num_threads : 1,
+                                           sizeof(struct worker));
+  if (this->workers == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL1;
+  }
+  pthread_mutex_init(&this->mutex, 0);
+  pthread_cond_init(&this->start_cond, 0);
+  pthread_cond_init(&this->done_cond, 0);
+  this->generation = 0;
+  this->stop = 0;
+  this->task = 0;
+  this->context = 0;
+  this->num_tasks = 0;
+  atomic_init(&this->next_task, 0);
+  this->busy_workers = 0;
+
+  for (this->num_threads = 0; this->num_threads < num_threads; ++this->num_threads) {
+    struct worker *worker = &this->workers[this->num_threads];
+    worker->pool = this;
+    worker->cpu_affinity_mask = cpu_affinity_masks ? cpu_affinity_masks[this->num_threads] : 0;
+    int ret = pthread_create(&worker->thread, 0, worker_pool_thread, worker);
+    if (ret != 0) {
+      fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+      goto FAIL2;
+    }
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL2:
+  worker_pool_close(this);
+  return ret_val;
+FAIL1:
+  free(this);
+FAIL0:
+  return ret_val;
+}
+
+
+void worker_pool_close(worker_pool_t *this)
+{
+  pthread_mutex_lock(&this->mutex);
+  this->stop = 1;
+  pthread_cond_broadcast(&this->start_cond);
+  pthread_mutex_unlock(&this->mutex);
+  for (uint32_t i = 0; i < this->num_threads; ++i) {
+    pthread_join(this->workers[i].thread, 0);
+  }
+  pthread_cond_destroy(&this->done_cond);
+  pthread_cond_destroy(&this->start_cond);
+  pthread_mutex_destroy(&this->mutex);
+  free(this->workers);
+  free(this);
+  return;
+}
+
+
+uint32_t worker_pool_get_concurrency(worker_pool_t *this)
+{
+  return this->num_threads + 1;
+}
+
+
+void worker_pool_run(worker_pool_t *this, worker_pool_task_t task,
+                     void *context, uint32_t num_tasks)
+{
+  pthread_mutex_lock(&this->mutex);
+  this->task = task;
+  this->context = context;
+  this->num_tasks = num_tasks;
+  atomic_store(&this->next_task, 0);
+  this->busy_workers = this->num_threads;
+  this->generation++;
+  pthread_cond_broadcast(&this->start_cond);
+  pthread_mutex_unlock(&this->mutex);
+
+  /* the calling thread helps too */
+  worker_pool_run_tasks(this);
+
+  pthread_mutex_lock(&this->mutex);
+  while (this->busy_workers > 0) {
+    pthread_cond_wait(&this->done_cond, &this->mutex);
+  }
+  pthread_mutex_unlock(&this->mutex);
+  return;
+}
+
+
+/* internal functions */
+static void *worker_pool_thread(void *arg)
+{
+  struct worker *worker = (struct worker *) arg;
+  worker_pool_t *this = worker->pool;
+
+  event_thread_set_scheduling(worker->cpu_affinity_mask, 0);
+
+  uint64_t generation = 0;
+  pthread_mutex_lock(&this->mutex);
+  while (1) {
+    while (this->generation == generation && !this->stop) {
+      pthread_cond_wait(&this->start_cond, &this->mutex);
+    }
+    if (this->stop) {
+      break;
+    }
+    generation = this->generation;
+    pthread_mutex_unlock(&this->mutex);
+
+    worker_pool_run_tasks(this);
+
+    pthread_mutex_lock(&this->mutex);
+    if (--this->busy_workers == 0) {
+      pthread_cond_signal(&this->done_cond);
+    }
+  }
+  pthread_mutex_unlock(&this->mutex);
+  return 0;
+}
+
+
+static void worker_pool_run_tasks(worker_pool_t *this)
+{
+  /* task, context and num_tasks were published under the mutex */
+  uint32_t index;
+  while ((index = atomic_fetch_add(&this->next_task, 1)) < this->num_tasks) {
+    this->task(this->context, index);
+  }
+  return;
+}
@@ -0,0 +1,56 @@
+/*
+ * worker_pool.h - fork/join pool of DSP worker threads
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __WORKER_POOL_H
+#define __WORKER_POOL_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct worker_pool worker_pool_t;
+
+typedef void (*worker_pool_task_t)(void *context, uint32_t index);
+
+/* cpu_affinity_masks (optional) has one mask per thread; 0 = no affinity */
+worker_pool_t *worker_pool_open(uint32_t num_threads,
+                                const uint64_t *cpu_affinity_masks);
+
+void worker_pool_close(worker_pool_t *this);
+
+/* number of tasks that can run at the same time (the worker threads plus
+   the calling thread) */
+uint32_t worker_pool_get_concurrency(worker_pool_t *this);
+
+/* run task(context, 0) ... task(context, num_tasks - 1) on the worker
+   threads and the calling thread, and return when all of them are done;
+   only one thread at a time may call worker_pool_run() */
+void worker_pool_run(worker_pool_t *this, worker_pool_task_t task,
+                     void *context, uint32_t num_tasks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __WORKER_POOL_H */